@@ -116,6 +116,91 @@ typedef int CMP_err;
 /* should be called once, as soon as the application starts */
 CMP_err CMPclient_init(OPTIONAL const char *name, OPTIONAL LOG_cb_t log_fn);
 
+/* logging helpers */
+/* set the verbosity used by LOG() and by the level gate of the functions below */
+void CMPclient_log_set_verbosity(severity level);
+/*
+ * check upfront whether messages of given level would be output at all,
+ * e.g., to avoid computing the arguments of frequent LOG() calls in vain
+ */
+bool CMPclient_log_enabled(severity level);
+
+/*-
+ * @brief start a background thread forwarding log messages to |sink|
+ *
+ * @param |sink| log callback to be called from the background thread,
+ *        defaults to LOG_console
+ * @param |capacity| number of message slots of the lock-free ring buffer,
+ *        rounded up to a power of 2. The default 0 means 1024.
+ * @note Use CMPclient_log_async as log_fn, e.g., for CMPclient_init(),
+ *       LOG_init(), or CMPclient_prepare(). Messages are dropped if the buffer
+ *       is full, which is counted. Message texts longer than 1023 characters
+ *       are truncated.
+ * @return CMP_OK on success, else CMP error code
+ */
+CMP_err CMPclient_log_async_start(OPTIONAL LOG_cb_t sink, size_t capacity);
+/* log callback queueing the message; falls back to synchronous output if not started */
+bool CMPclient_log_async(OPTIONAL const char *func, OPTIONAL const char *file,
+                         int lineno, severity level, const char *msg);
+/* number of messages dropped so far due to full buffer */
+unsigned long CMPclient_log_async_dropped(void);
+/*
+ * output all pending messages, stop the background thread, and reinstall the
+ * sink given to CMPclient_log_async_start() via LOG_init(). Messages logged
+ * concurrently via CMPclient_log_async are then passed to the sink directly.
+ */
+void CMPclient_log_async_stop(void);
+
+/* allocation accounting */
+# define CMPCLIENT_PHASE_OTHER    0
+# define CMPCLIENT_PHASE_PREPARE  1
+# define CMPCLIENT_PHASE_SETUP    2
+# define CMPCLIENT_PHASE_IR       3
+# define CMPCLIENT_PHASE_CR       4
+# define CMPCLIENT_PHASE_P10CR    5
+# define CMPCLIENT_PHASE_KUR      6
+# define CMPCLIENT_PHASE_RR       7
+# define CMPCLIENT_PHASE_GENM     8
+# define CMPCLIENT_PHASE_REINIT   9
+# define CMPCLIENT_PHASE_FINISH  10
+# define CMPCLIENT_PHASE_NUM     11
+
+typedef struct cmpclient_alloc_stats_st {
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long reallocs;
+    size_t bytes_allocated;
+    long bytes_live; /* of blocks allocated in phase, whenever freed */
+    long bytes_peak;
+} CMPCLIENT_ALLOC_STATS;
+
+/*-
+ * @brief install OpenSSL memory functions counting allocations per phase
+ *
+ * @param |arena| carve small blocks from per-thread chunks that are
+ *        released in one go after CMPclient_reinit() once their contents
+ *        have been freed
+ * @note Must be called before any memory is allocated via OpenSSL,
+ *       in particular before CMPclient_init().
+ *       Statistics are kept for the whole process. Allocations are
+ *       attributed to the phase of the most recent library call in the
+ *       allocating thread, e.g., CMPCLIENT_PHASE_KUR, and frees and reallocs,
+ *       including any change in size, to the phase that allocated the block,
+ *       also when done in other phases or by other threads.
+ * @return CMP_OK on success, else CMP error code
+ */
+CMP_err CMPclient_alloc_stats_enable(bool arena);
+bool CMPclient_alloc_stats_enabled(void);
+/*
+ * returns the previous phase; a phase out of range just yields the current one.
+ * Library functions restore the phase of their caller when returning.
+ */
+int CMPclient_alloc_set_phase(int phase);
+const char *CMPclient_alloc_phase_name(int phase);
+void CMPclient_alloc_stats_get(int phase, CMPCLIENT_ALLOC_STATS *stats);
+void CMPclient_alloc_stats_reset(void);
+void CMPclient_alloc_stats_log(severity level);
+
 /* must be called first */
 CMP_err CMPclient_prepare(CMP_CTX **pctx,
                           OPTIONAL OSSL_LIB_CTX *libctx,
@@ -132,9 +217,54 @@ CMP_err CMPclient_prepare(CMP_CTX **pctx,
                           int total_timeout,
                           OPTIONAL X509_STORE *new_cert_truststore,
                           bool implicit_confirm);
+/*
+ * Buffer holding DER or PEM input, e.g., as obtained from a database.
+ * PEM input may contain several certificates.
+ */
+typedef struct cmpclient_mem_st {
+    const unsigned char *data;
+    size_t len;
+} CMPCLIENT_MEM;
+/*
+ * Like CMPclient_prepare(), yet loading all credentials and trust stores
+ * from memory; |certs| holds the own cert, optionally followed by its chain.
+ */
+CMP_err CMPclient_prepare_from_mem(CMP_CTX **pctx,
+                                   OPTIONAL OSSL_LIB_CTX *libctx,
+                                   OPTIONAL const char *propq,
+                                   OPTIONAL LOG_cb_t log_fn,
+                                   OPTIONAL const CMPCLIENT_MEM *cmp_trusted,
+                                   OPTIONAL const char *recipient,
+                                   OPTIONAL const CMPCLIENT_MEM *untrusted,
+                                   OPTIONAL const CMPCLIENT_MEM *key,
+                                   OPTIONAL const char *key_pass,
+                                   OPTIONAL const CMPCLIENT_MEM *certs,
+                                   OPTIONAL const char *secret,
+                                   OPTIONAL const char *secret_ref,
+                                   OPTIONAL const CMPCLIENT_MEM *creds_trusted,
+                                   OPTIONAL const char *digest,
+                                   OPTIONAL const char *mac,
+                                   OPTIONAL OSSL_CMP_transfer_cb_t transfer_fn,
+                                   int total_timeout,
+                                   OPTIONAL const CMPCLIENT_MEM *new_cert_trusted,
+                                   bool implicit_confirm);
+
+/*
+ * To trust responses only if signed by a given server cert, instead of
+ * validating them via cmp_truststore, call OSSL_CMP_CTX_set1_srvCert() next.
+ * This already is the fast path: per message, OpenSSL then checks just the
+ * key usage (unless OSSL_CMP_OPT_IGNORE_KEYUSAGE is set) and the signature,
+ * using the public key decoded once and cached in the cert, and the sender,
+ * without any chain building.
+ */
 
 /* call next if the transfer_fn is NULL and no existing connection is used */
 /* Will return error when used with OpenSSL compiled with OPENSSL_NO_SOCK. */
+/*
+ * server may also have the form "unix:/path/to/socket" for a co-located
+ * server such as an RA, which is then contacted via plain HTTP over that
+ * Unix domain socket using the transport of CMPclient_setup_transport().
+ */
 CMP_err CMPclient_setup_HTTP(CMP_CTX *ctx, const char *server, const char *path,
                              int keep_alive, int timeout, OPTIONAL SSL_CTX *tls,
                              OPTIONAL const char *proxy,
@@ -143,6 +273,234 @@ CMP_err CMPclient_setup_HTTP(CMP_CTX *ctx, const char *server, const char *path,
 CMP_err CMPclient_setup_BIO(CMP_CTX *ctx, BIO *rw, const char *path,
                             int keep_alive, int timeout);
 
+/*
+ * Alternative to CMPclient_setup_HTTP() with the same parameters, where the
+ * library rather than OpenSSL establishes the connections: server names are
+ * resolved via a process-wide cache, and connection attempts to IPv6 and IPv4
+ * addresses are raced (Happy Eyeballs). Plain HTTP via a proxy is left to
+ * OpenSSL. The transport, set as transfer_cb_arg, is freed by CMPclient_finish().
+ */
+CMP_err CMPclient_setup_transport(CMP_CTX *ctx,
+                                  const char *server, const char *path,
+                                  int keep_alive, int timeout,
+                                  OPTIONAL SSL_CTX *tls,
+                                  OPTIONAL const char *proxy,
+                                  OPTIONAL const char *no_proxy);
+typedef struct cmpclient_transport_st CMPCLIENT_TRANSPORT;
+CMPCLIENT_TRANSPORT *CMPclient_transport_new(const char *host,
+                                             const char *port,
+                                             OPTIONAL const char *path,
+                                             OPTIONAL SSL_CTX *tls,
+                                             OPTIONAL const char *proxy,
+                                             OPTIONAL const char *no_proxy);
+/* HTTP via the Unix domain socket at socket_path, without TLS or proxy */
+CMPCLIENT_TRANSPORT *CMPclient_transport_new_unix(const char *socket_path,
+                                                  OPTIONAL const char *path);
+/* closes any kept-alive connection, called by CMPclient_reinit() */
+void CMPclient_transport_close(OPTIONAL CMPCLIENT_TRANSPORT *t);
+void CMPclient_transport_free(OPTIONAL CMPCLIENT_TRANSPORT *t);
+
+/* socket options, all zero gives the defaults */
+typedef struct cmpclient_transport_opts_st {
+    bool nagle; /* do not set TCP_NODELAY, which is set by default */
+    bool fast_open; /* TCP Fast Open, where supported; single address only */
+    int sndbuf; /* SO_SNDBUF in bytes, 0 for system default */
+    int rcvbuf; /* SO_RCVBUF in bytes, 0 for system default */
+    int connect_timeout_ms; /* 0: the message timeout applies */
+} CMPCLIENT_TRANSPORT_OPTS;
+/* applies to any later connection, or resets to defaults if opts is NULL */
+void CMPclient_transport_set_opts(CMPCLIENT_TRANSPORT *t,
+                                  OPTIONAL const CMPCLIENT_TRANSPORT_OPTS *opts);
+/* to be called after CMPclient_setup_transport() or with unix: server */
+CMP_err CMPclient_set_transport_opts(CMP_CTX *ctx,
+                                     OPTIONAL const CMPCLIENT_TRANSPORT_OPTS *opts);
+
+/* times from start of an exchange, the connect time includes name lookup */
+typedef struct cmpclient_exchange_times_st {
+    unsigned long connect_us; /* 0 if connection was kept alive */
+    unsigned long first_byte_us; /* 0 if unknown since OpenSSL connected */
+    unsigned long total_us; /* until the response has been received */
+    bool reused; /* connection kept alive from previous exchange */
+} CMPCLIENT_EXCHANGE_TIMES;
+/* of the last request/response exchange, also logged at info level */
+bool CMPclient_transport_times_get(const CMPCLIENT_TRANSPORT *t,
+                                   CMPCLIENT_EXCHANGE_TIMES *times);
+bool CMPclient_get_exchange_times(const CMP_CTX *ctx,
+                                  CMPCLIENT_EXCHANGE_TIMES *times);
+/* transfer callback expecting a CMPCLIENT_TRANSPORT as transfer_cb_arg */
+OSSL_CMP_MSG *CMPclient_transport_cb(OSSL_CMP_CTX *ctx,
+                                     const OSSL_CMP_MSG *req);
+
+/*
+ * Event-driven engine multiplexing many transactions on the calling thread.
+ * Each job runs fn(arg), typically a CMPclient_enroll() or the like on its own
+ * context set up with CMPclient_setup_transport(), and is switched out while
+ * the transport waits for the network. On completion, done(arg, err) is called.
+ * Each job has its own OpenSSL error queue, which done() still can inspect,
+ * and its own allocation phase; other per-thread state of the library is not
+ * held across waiting. A job must not keep an ERR mark across waiting.
+ * If a job cannot be started, done() is called with an error for it and for
+ * all jobs queued, while jobs already running are continued.
+ * Uses io_uring where available, else (or with CMPCLIENT_ENGINE_EPOLL) epoll.
+ */
+typedef struct cmpclient_engine_st CMPCLIENT_ENGINE;
+typedef CMP_err (*CMPclient_engine_fn)(void *arg);
+typedef void (*CMPclient_engine_done_fn)(void *arg, CMP_err err);
+# define CMPCLIENT_ENGINE_EPOLL 1 /* flag for not trying io_uring */
+CMPCLIENT_ENGINE *CMPclient_engine_new(int max_inflight, int flags);
+const char *CMPclient_engine_backend(const CMPCLIENT_ENGINE *e);
+CMP_err CMPclient_engine_submit(CMPCLIENT_ENGINE *e, CMPclient_engine_fn fn,
+                                OPTIONAL void *arg,
+                                OPTIONAL CMPclient_engine_done_fn done);
+/* runs until all submitted jobs are done, including jobs submitted meanwhile */
+CMP_err CMPclient_engine_run(CMPCLIENT_ENGINE *e);
+unsigned long CMPclient_engine_jobs_done(const CMPCLIENT_ENGINE *e);
+void CMPclient_engine_free(OPTIONAL CMPCLIENT_ENGINE *e);
+/* true if called from within an engine job */
+bool CMPclient_engine_active(void);
+/*
+ * wait until fd is ready for the given poll() events, yielding to other jobs
+ * if called within an engine job, else blocking. timeout_ms <= 0 means none.
+ * With fd < 0 just sleeps for timeout_ms, which then must be > 0.
+ * Returns 1 if ready, 0 on timeout, -1 on error.
+ */
+int CMPclient_engine_wait(int fd, short events, int timeout_ms);
+
+/*
+ * Store-and-forward spool for offline operation: requests of any number of
+ * transactions are queued as files in the out/ subdirectory of dir and
+ * shipped in bulk by CMPclient_spool_forward() whenever connectivity allows,
+ * which stores the responses in the in/ subdirectory, from where they are
+ * picked up by the waiting transactions matching their transactionID.
+ * Files are named <transactionID in hex>.<any suffix>.der.
+ * The spool, which may be shared by many contexts and threads and also by
+ * engine jobs, checks for responses every poll_ms (default if <= 0).
+ */
+typedef struct cmpclient_spool_st CMPCLIENT_SPOOL;
+CMPCLIENT_SPOOL *CMPclient_spool_new(const char *dir, int poll_ms);
+void CMPclient_spool_free(OPTIONAL CMPCLIENT_SPOOL *spool);
+/* to be used instead of CMPclient_setup_HTTP(); timeout 0 means wait forever */
+CMP_err CMPclient_setup_spool(CMP_CTX *ctx, CMPCLIENT_SPOOL *spool,
+                              int timeout);
+/* transfer callback expecting a CMPCLIENT_SPOOL as transfer_cb_arg */
+OSSL_CMP_MSG *CMPclient_spool_cb(OSSL_CMP_CTX *ctx, const OSSL_CMP_MSG *req);
+/*
+ * sends all requests queued in dir to the server ctx has been set up for,
+ * e.g., with CMPclient_setup_transport() and keep_alive, stopping on transfer
+ * error. Optionally yields the number of requests forwarded.
+ */
+CMP_err CMPclient_spool_forward(CMP_CTX *ctx, const char *dir,
+                                OPTIONAL int *num);
+
+/*
+ * Trust store reloaded whenever its source files change, checked every
+ * interval seconds by a background thread (0: only on CMPclient_trust_reload(),
+ * < 0: default). Each (re)load yields a new snapshot X509_STORE, to which
+ * setup_fn, if given, is applied before publishing, e.g., for doing
+ * STORE_set_parameters() and STORE_set1_host_ip() as for the initial load.
+ * Snapshots obtained by CMPclient_trust_get1() may be used as cmp_truststore
+ * and new_cert_truststore of CMPclient_prepare(); contexts holding them are
+ * switched to the latest snapshot at the start of each transaction.
+ * Once a snapshot has been given as new_cert_truststore, later snapshots
+ * ignore any verification time set by setup_fn, as done by CMPclient_prepare(),
+ * since new certs are current anyway; published snapshots are not modified.
+ * Transactions and TLS handshakes in progress are not affected by a reload.
+ * Each snapshot holds a reference to the handle, so CMPclient_trust_free()
+ * may be called while contexts still use snapshots: they keep their current
+ * one, which is no more refreshed, and the handle is released with the last.
+ */
+typedef struct cmpclient_trust_st CMPCLIENT_TRUST;
+typedef bool (*CMPclient_trust_setup_cb_t)(X509_STORE *store,
+                                           OPTIONAL void *arg);
+CMPCLIENT_TRUST *CMPclient_trust_new(const char *files,
+                                     OPTIONAL const char *desc,
+                                     OPTIONAL CMPclient_trust_setup_cb_t setup_fn,
+                                     OPTIONAL void *setup_arg,
+                                     int interval);
+void CMPclient_trust_free(OPTIONAL CMPCLIENT_TRUST *trust);
+/* returns the current snapshot, to be freed by the caller */
+X509_STORE *CMPclient_trust_get1(CMPCLIENT_TRUST *trust);
+/* incremented on each successful (re)load */
+unsigned long CMPclient_trust_generation(const CMPCLIENT_TRUST *trust);
+/*
+ * reloads if the source files have changed or force is set. Returns 1 if a
+ * new snapshot has been published, 0 if unchanged, -1 on error, where
+ * the previous snapshot stays in use.
+ */
+int CMPclient_trust_reload(CMPCLIENT_TRUST *trust, bool force);
+/* switches the trust stores of ctx to the current snapshot if outdated */
+bool CMPclient_trust_refresh(CMP_CTX *ctx);
+# ifndef SECUTILS_NO_TLS
+/*
+ * makes TLS connections set up by this library with tls verify with the
+ * snapshot current when each connection is created, also after reloads.
+ * To be called before tls is used; tls itself is not modified afterwards.
+ * Connections cannot be set up with tls after CMPclient_trust_free().
+ */
+CMP_err CMPclient_trust_attach_TLS(CMPCLIENT_TRUST *trust, SSL_CTX *tls);
+# endif
+
+/* ttl and negative_ttl in seconds; 0 disables caching, < 0 sets default */
+void CMPclient_dns_cache_set_ttl(int ttl, int negative_ttl);
+/*
+ * also clears endpoint stats and limits; safe while exchanges are in flight,
+ * which remain accounted for their servers until finished
+ */
+void CMPclient_dns_cache_clear(void);
+/*
+ * pins the addresses used for host and port instead of resolving host, given
+ * as comma-separated numeric IPv6 or IPv4 addresses tried in this order, until
+ * CMPclient_dns_cache_clear(). addrs NULL unpins them. Returns false on error.
+ */
+bool CMPclient_dns_cache_set(const char *host, const char *port,
+                             OPTIONAL const char *addrs);
+/*
+ * per server or proxy host and port, as used by CMPclient_setup_transport(),
+ * or per Unix domain socket path with port ""
+ */
+typedef struct cmpclient_endpoint_stats_st {
+    unsigned long resolves; /* name lookups actually done */
+    unsigned long resolve_failures;
+    unsigned long cache_hits;
+    unsigned long connects;
+    unsigned long connect_failures;
+    unsigned long resolve_us; /* total time spent on lookups */
+    unsigned long connect_us; /* total time spent on successful connects */
+    int last_family; /* AF_INET6, AF_INET, or AF_UNIX of last connect, or 0 */
+    unsigned long throttled; /* exchanges delayed by admission control */
+    unsigned long throttle_us; /* total time they were delayed */
+    unsigned long backoffs; /* pauses due to server overload or failure */
+} CMPCLIENT_ENDPOINT_STATS;
+bool CMPclient_endpoint_stats_get(const char *host, const char *port,
+                                  CMPCLIENT_ENDPOINT_STATS *stats);
+void CMPclient_endpoint_stats_log(severity level);
+
+/*
+ * Admission control per server, keyed by host and port like the endpoint stats
+ * (not by any proxy), for the transport of CMPclient_setup_transport().
+ * Each exchange takes a token from a bucket holding up to burst tokens,
+ * refilled at rate per second, and waits while max_inflight exchanges with the
+ * server are outstanding, all within the message timeout. All zero: unlimited.
+ * Regardless of limits, after an HTTP 503 or 429 response all exchanges with
+ * the server pause for the given Retry-After time, else, as after other 5xx
+ * responses and timeouts, for a time doubling from 1 up to 60 seconds.
+ * Requests answered by 503 or 429 are retried if the message timeout permits.
+ * Limits are process-wide and are cleared by CMPclient_dns_cache_clear().
+ */
+typedef struct cmpclient_rate_limit_st {
+    double rate; /* exchanges per second, 0 for unlimited */
+    int burst; /* exchanges that may start at once after idling, < 1 means 1 */
+    int max_inflight; /* concurrent exchanges, 0 for unlimited */
+} CMPCLIENT_RATE_LIMIT;
+/* limit NULL removes the limits; returns false on invalid parameters */
+bool CMPclient_rate_limit_set(const char *host, const char *port,
+                              OPTIONAL const CMPCLIENT_RATE_LIMIT *limit);
+/* for the server of the transport, and of ctx set up for it, respectively */
+bool CMPclient_transport_set_rate_limit(const CMPCLIENT_TRANSPORT *t,
+                                        OPTIONAL const CMPCLIENT_RATE_LIMIT *limit);
+CMP_err CMPclient_set_rate_limit(CMP_CTX *ctx,
+                                 OPTIONAL const CMPCLIENT_RATE_LIMIT *limit);
+
 # if OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP
 /* call optionally before requests; name may be UTF8-encoded string */
 /* This calls OSSL_CMP_CTX_reset_geninfo_ITAVs() if name == NULL */
@@ -175,6 +533,29 @@ CMP_err CMPclient_setup_certreq(CMP_CTX *ctx,
                                 OPTIONAL const X509_EXTENSIONS *exts,
                                 OPTIONAL const X509_REQ *csr);
 
+/*
+ * Precompiled part of cert templates common to any number of enrollments,
+ * e.g., of a bulk enrollment with one profile and varying subjects: issuer,
+ * X.509v3 extensions, SANs, and policies, copied once on creation.
+ * It is reference-counted and may be shared by contexts and threads.
+ * CMPclient_setup_certreq_template() installs it in a context, where it is
+ * kept across CMPclient_reinit(), such that subsequent enrollments, e.g., via
+ * CMPclient_imprint() with exts NULL, just need to add subject and key.
+ * Since SANs and policies accumulate, apply it only once per context.
+ */
+typedef struct cmpclient_req_template_st CMPCLIENT_REQ_TEMPLATE;
+CMPCLIENT_REQ_TEMPLATE
+*CMPclient_req_template_new(OPTIONAL const char *issuer,
+                            OPTIONAL const X509_EXTENSIONS *exts,
+                            OPTIONAL const STACK_OF(GENERAL_NAME) *sans,
+                            bool san_nodefault,
+                            OPTIONAL const STACK_OF(POLICYINFO) *policies,
+                            bool policies_critical);
+bool CMPclient_req_template_up_ref(CMPCLIENT_REQ_TEMPLATE *tmpl);
+void CMPclient_req_template_free(OPTIONAL CMPCLIENT_REQ_TEMPLATE *tmpl);
+CMP_err CMPclient_setup_certreq_template(CMP_CTX *ctx,
+                                         const CMPCLIENT_REQ_TEMPLATE *tmpl);
+
 /*-
  * Either the internal CMPclient_enroll() or the specific CMPclient_imprint(),
  * CMPclient_bootstrap(), CMPclient_pkcs10(), or CMPclient_update[_anycert]())
@@ -209,7 +590,8 @@ CMP_err CMPclient_update_anycert(OSSL_CMP_CTX *ctx, CREDENTIALS **new_creds,
 /* reason codes are defined in openssl/x509v3.h */
 CMP_err CMPclient_revoke(CMP_CTX *ctx, const X509 *cert, /* TODO: X509_REQ *csr, */ int reason);
 
-#if OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP
+#if (OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP) \
+    && !defined GENCMP_NO_GENM
 /* get CA certs, discard duplicates, and verify they are non-expired CA certs */
 CMP_err CMPclient_caCerts(CMP_CTX *ctx, STACK_OF(X509) **out);
 /* get certificate request template and related key specifications */
@@ -218,7 +600,8 @@ CMP_err CMPclient_certReqTemplate(CMP_CTX *ctx,
                                   OPTIONAL OSSL_CMP_ATAVS **keySpec);
 # endif
 
-#if OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP
+#if (OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP) \
+    && !defined GENCMP_NO_GENM
 /* get any root CA key update and verify it as far as possible */
 CMP_err CMPclient_rootCaCert(CMP_CTX *ctx,
                              const X509 *oldWithOld, X509 **newWithNew,
@@ -246,17 +629,137 @@ void CMPclient_finish(OPTIONAL CMP_CTX *ctx);
 #  include <secutils/credentials/key.h>
 # endif
 
+/*
+ * When enabled, CSR_load(), STORE_load(), and CERTS_load_cached() keep the
+ * DER encoding of single cert or CSR files in a sidecar file <file>.dercache,
+ * which is used on subsequent loads as long as device, inode, size, mtime, and
+ * ctime of the original file are unchanged. The same checks are applied to certs
+ * taken from the cache as to those loaded from the original file.
+ * Default is disabled.
+ * Keys are never cached since this would store them without encryption.
+ */
+void CMPclient_dercache_enable(bool enable);
+
 /* X509_STORE helpers */
 EVP_PKEY *KEY_load(OPTIONAL const char *file, OPTIONAL const char *pass,
                    OPTIONAL const char *engine, OPTIONAL const char *desc);
 X509_REQ *CSR_load(const char *file, OPTIONAL const char *desc);
+/* like CERTS_load(), using any DER cache */
+STACK_OF(X509) *CERTS_load_cached(const char *files, OPTIONAL const char *desc,
+                                  int type_CA,
+                                  OPTIONAL const X509_VERIFY_PARAM *vpm);
 
+# ifndef GENCMP_NO_CERTSTATUS
 X509_CRL *CRL_load(const char *url, int timeout, OPTIONAL const char *desc);
 STACK_OF(X509_CRL) *CRLs_load(const char *files, int timeout,
                               OPTIONAL const char *desc);
 void CRLs_free(OPTIONAL STACK_OF(X509_CRL) *crls);
+# endif
 X509_STORE *STORE_load(const char *trusted_certs, OPTIONAL const char *desc,
                        OPTIONAL X509_VERIFY_PARAM *vpm);
+# ifndef GENCMP_NO_CERTSTATUS
+/*
+ * To be called after STORE_set_parameters() when checking the status of all
+ * chain certs via OCSP. Then the CertIDs of the chain certs (except the trust
+ * anchor) are grouped by responder and issuer into a single OCSP request each,
+ * with up to max_ids CertIDs, where 0 means no limit. CertIDs of different
+ * issuers share a request only if a trust anchor in the store is explicitly
+ * trusted for OCSP signing when this function is called, since otherwise
+ * the response cannot be authorized for all of them. The responder is taken
+ * from the AIA of each cert if use_aia, else the first of the given responders
+ * is used.
+ * Only if the status of any cert remains undetermined, the chain is checked
+ * with the previous check_revocation callback of the store as before.
+ * timeout is in seconds per request, 0 for none, < 0 for default: 10 seconds.
+ */
+bool CMPclient_ocsp_multi(X509_STORE *store, bool use_aia,
+                          OPTIONAL const char *responders, int timeout,
+                          int max_ids);
+/*
+ * To be called after CMPclient_ocsp_multi(). Keeps the status of chain certs
+ * given by verified OCSP responses, per CertID until the nextUpdate time of
+ * the response, such that further verifications using the store, also by other
+ * threads, do not request it again. Responses without nextUpdate are not kept.
+ * The cache holds up to max_entries; 0 disables it and drops its contents.
+ */
+bool CMPclient_ocsp_cache(X509_STORE *store, int max_entries);
+# endif
+
+/*
+ * DER-encoded certificate compiled into the binary,
+ * e.g., as generated by util/embed_certs.pl. The loaders below do not perform
+ * any file I/O or base64 decoding; the results must be freed by the caller.
+ */
+typedef struct cmpclient_der_cert_st {
+    const unsigned char *der;
+    size_t len;
+} CMPCLIENT_DER_CERT;
+X509 *CERT_load_der(const unsigned char *der, size_t len,
+                    OPTIONAL const char *desc);
+/* |num| may be 0, in which case an empty stack is returned */
+STACK_OF(X509) *CERTS_load_der(OPTIONAL const CMPCLIENT_DER_CERT *certs,
+                               size_t num, OPTIONAL const char *desc);
+/* suitable as cmp_truststore or new_cert_truststore for CMPclient_prepare() */
+X509_STORE *STORE_load_der(OPTIONAL const CMPCLIENT_DER_CERT *certs,
+                           size_t num, OPTIONAL const char *desc,
+                           OPTIONAL X509_VERIFY_PARAM *vpm);
+
+/*
+ * Counterparts of the above file-based loaders taking DER or PEM input
+ * from memory, avoiding temporary files. Keys may be encrypted PEM or
+ * PKCS#8 DER, no password is prompted for. Certs may be given as a sequence
+ * of PEM or DER certs, or as PKCS#7 (e.g., .p7b) in PEM or DER; PKCS#12 input
+ * is not supported. Results must be freed by the caller.
+ */
+EVP_PKEY *KEY_load_from_mem(const unsigned char *data, size_t len,
+                            OPTIONAL const char *pass,
+                            OPTIONAL const char *desc);
+X509_REQ *CSR_load_from_mem(const unsigned char *data, size_t len,
+                            OPTIONAL const char *desc);
+STACK_OF(X509) *CERTS_load_from_mem(const unsigned char *data, size_t len,
+                                    OPTIONAL const char *desc);
+X509_STORE *STORE_load_from_mem(const unsigned char *data, size_t len,
+                                OPTIONAL const char *desc,
+                                OPTIONAL X509_VERIFY_PARAM *vpm);
+# ifndef GENCMP_NO_CERTSTATUS
+X509_CRL *CRL_load_from_mem(const unsigned char *data, size_t len,
+                            OPTIONAL const char *desc);
+# endif
+
+/*
+ * Serialization to memory, e.g., for forwarding results without file I/O.
+ * If *out is NULL, a buffer is allocated, to be freed with OPENSSL_free().
+ * Otherwise it must point to a buffer of *outlen bytes; if this is too small,
+ * CMP_R_INVALID_PARAMETERS is returned with *outlen set to the size needed.
+ * On success *outlen is set to the length of the output.
+ * |format| may be FORMAT_PEM or FORMAT_ASN1 (DER), where DER can hold only
+ * a single object. Keys are written as PKCS#8, encrypted if |pass| is given.
+ * caPubs and extraCerts can be obtained via OSSL_CMP_CTX_get1_caPubs() and
+ * OSSL_CMP_CTX_get1_extraCertsIn() for use with CERTS_save_mem().
+ */
+CMP_err KEY_save_mem(const EVP_PKEY *pkey, file_format_t format,
+                     OPTIONAL const char *pass,
+                     unsigned char **out, size_t *outlen);
+CMP_err CERTS_save_mem(OPTIONAL const STACK_OF(X509) *certs,
+                       file_format_t format,
+                       unsigned char **out, size_t *outlen);
+/*
+ * Cert and chain of |creds|, preceded by the private key if |with_key|.
+ * FORMAT_PKCS12 is supported as well, using |pass| also for integrity.
+ */
+CMP_err CREDENTIALS_save_mem(const CREDENTIALS *creds, file_format_t format,
+                             bool with_key, OPTIONAL const char *pass,
+                             unsigned char **out, size_t *outlen);
+
+/*
+ * Like X509_add_certs() with X509_ADD_FLAG_NO_DUP, appending to |sk| in the
+ * given order all |certs| not already contained, yet in linear time by using
+ * a hash set keyed by cert fingerprint rather than comparing all pairs.
+ * |flags| may contain X509_ADD_FLAG_UP_REF and X509_ADD_FLAG_NO_SS,
+ * X509_ADD_FLAG_PREPEND is not supported.
+ */
+bool CERTS_add_nodup(STACK_OF(X509) *sk, OPTIONAL const STACK_OF(X509) *certs,
+                     int flags);
 # ifdef LOCAL_DEFS
 #  include "genericCMPClient_imports.h"
 # else
@@ -264,7 +767,7 @@ X509_STORE *STORE_load(const char *trusted_certs, OPTIONAL const char *desc,
 # endif
 
 /* SSL_CTX helpers for HTTPS */
-# ifndef SEC_NO_TLS
+# ifndef SECUTILS_NO_TLS
 #  ifdef LOCAL_DEFS
 #   include "genericCMPClient_imports.h"
 #  else
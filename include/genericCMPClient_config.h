@@ -0,0 +1,52 @@
+/**
+* @file static_config.h
+*
+* @brief Static configuration of the generic CMP client
+*
+* @copyright Copyright (c) 2023 Siemens AG
+*
+* @author David von Oheimb <david.von.oheimb@siemens.com>
+*
+* This work is licensed under the terms of the Apache Software License 2.0.
+* See the COPYING file in the top-level directory.
+*
+* SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef GENCMPCLIENT_STATIC_CONFIG_H_
+#define GENCMPCLIENT_STATIC_CONFIG_H_
+
+#undef USE_LIBCMP
+/* #undef USE_LIBCMP */
+
+/* feature switches for minimal-footprint builds, see GENCMP_PROFILE */
+#undef GENCMP_NO_TLS /* no HTTPS */
+/* #undef GENCMP_NO_TLS */
+#undef GENCMP_NO_CERTSTATUS /* no CRL- or OCSP-based cert status checking */
+/* #undef GENCMP_NO_CERTSTATUS */
+#undef GENCMP_NO_GENM /* no genm requests for caCerts, rootCaCert, etc. */
+/* #undef GENCMP_NO_GENM */
+#undef GENCMP_NO_CONFIG /* no config file support in CLI */
+/* #undef GENCMP_NO_CONFIG */
+#undef GENCMP_NO_HTTP /* no persistent transport, just OSSL_CMP_MSG_http_perform */
+/* #undef GENCMP_NO_HTTP */
+#undef GENCMP_NO_ENGINE /* no event-driven engine for concurrent transactions */
+/* #undef GENCMP_NO_ENGINE */
+#undef GENCMP_NO_SPOOL /* no store-and-forward transfer via spool directories */
+/* #undef GENCMP_NO_SPOOL */
+#undef GENCMP_NO_TRUST /* no trust stores reloaded on change of their files */
+/* #undef GENCMP_NO_TRUST */
+#undef GENCMP_NO_ALLOC /* no per-phase allocation accounting and arena */
+/* #undef GENCMP_NO_ALLOC */
+#undef GENCMP_NO_LOG /* no asynchronous logging */
+/* #undef GENCMP_NO_LOG */
+
+/* optional HTTP/2 transport, requires libnghttp2 */
+#undef GENCMP_USE_HTTP2
+/* #undef GENCMP_USE_HTTP2 */
+
+#if defined GENCMP_NO_TLS && !defined SECUTILS_NO_TLS
+# define SECUTILS_NO_TLS 1
+#endif
+
+#endif /* GENCMPCLIENT_STATIC_CONFIG_H_ */
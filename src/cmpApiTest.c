@@ -0,0 +1,1682 @@
+/*-
+ * @file   cmpApiTest.c
+ * @brief  behavior tests of the generic CMP client library API
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "genericCMPClient.h"
+#include "mockCA.h"
+#include "mockOCSP.h"
+
+#include <openssl/pem.h>
+
+/*
+ * Each test case is a function returning whether all its checks passed.
+ * Test cases are independent of each other and may be selected by name,
+ * which is how test/recipes/81-test_cmp_api.t runs them one by one.
+ * Any CMP transactions are served by an in-process mock CA, except for those
+ * via the library's transport, which go to cmpMockServer given by -mock_server.
+ */
+
+#define TEST_DEFAULT_DATADIR "test/recipes/80-test_cmp_http_data/Mock"
+#define TEST_PATH_LEN 512
+
+static const char *opt_datadir = TEST_DEFAULT_DATADIR;
+static long opt_verbosity = LOG_WARNING;
+static const char *opt_mock_server = NULL;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            LOG(FL_ERR, "check failed: %s", #cond); \
+            goto end; \
+        } \
+    } while (0)
+
+static const char *data_file(const char *name)
+{
+    static char path[TEST_PATH_LEN];
+
+    snprintf(path, sizeof(path), "%s/%s", opt_datadir, name);
+    return path;
+}
+
+/* creates a fresh directory, to be removed with remove_dir() */
+static bool make_dir(char *dir, size_t size)
+{
+    const char *tmp = getenv("TMPDIR");
+
+    snprintf(dir, size, "%s/cmpApiTest.XXXXXX", tmp != NULL ? tmp : "/tmp");
+    return mkdtemp(dir) != NULL;
+}
+
+static void remove_dir(const char *dir)
+{
+    char cmd[TEST_PATH_LEN + 16];
+
+    if (*dir == '\0')
+        return;
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+    if (system(cmd) != 0)
+        LOG(FL_WARN, "cannot remove %s", dir);
+}
+
+static const char *dir_file(const char *dir, const char *name)
+{
+    static char path[TEST_PATH_LEN];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return path;
+}
+
+static bool copy_file(const char *from, const char *to)
+{
+    FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+    char buf[4096];
+    size_t n;
+    bool ok = in != NULL && out != NULL;
+
+    while (ok && (n = fread(buf, 1, sizeof(buf), in)) > 0)
+        ok = fwrite(buf, 1, n, out) == n;
+    if (in != NULL)
+        fclose(in);
+    if (out != NULL)
+        ok = fclose(out) == 0 && ok;
+    return ok;
+}
+
+/* the result must be freed with OPENSSL_free() */
+static unsigned char *read_file(const char *path, size_t *len)
+{
+    BIO *in = BIO_new_file(path, "rb"), *mem = BIO_new(BIO_s_mem());
+    unsigned char *res = NULL;
+    char buf[4096];
+    char *data;
+    int n;
+    long size;
+
+    while (in != NULL && mem != NULL && (n = BIO_read(in, buf, sizeof(buf))) > 0)
+        if (BIO_write(mem, buf, n) != n)
+            goto end;
+    if (mem != NULL && (size = BIO_get_mem_data(mem, &data)) > 0
+        && (res = OPENSSL_malloc((size_t)size)) != NULL) {
+        memcpy(res, data, (size_t)size);
+        *len = (size_t)size;
+    }
+
+ end:
+    BIO_free(in);
+    BIO_free(mem);
+    return res;
+}
+
+static bool file_exists(const char *path)
+{
+    return access(path, F_OK) == 0;
+}
+
+static void sleep_us(long us)
+{
+    struct timespec ts;
+
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    (void)nanosleep(&ts, NULL);
+}
+
+/* asynchronous logging */
+#ifndef GENCMP_NO_LOG
+
+static int sink_blocked = 0;
+static unsigned long sink_msgs = 0, sink_warnings = 0;
+
+static bool blocking_sink(OPTIONAL const char *func, OPTIONAL const char *file,
+                          int lineno, severity level, const char *msg)
+{
+    (void)func;
+    (void)file;
+    (void)lineno;
+    (void)msg;
+    while (__atomic_load_n(&sink_blocked, __ATOMIC_ACQUIRE))
+        sleep_us(100);
+    if (level == LOG_WARNING)
+        (void)__atomic_fetch_add(&sink_warnings, 1, __ATOMIC_RELAXED);
+    else
+        (void)__atomic_fetch_add(&sink_msgs, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+# define LOG_TEST_CAPACITY 4
+# define LOG_TEST_MSGS 20
+
+static bool test_log_async_dropped(void)
+{
+    unsigned long dropped;
+    int i;
+    bool ok = false;
+
+    CMPclient_log_set_verbosity(LOG_INFO);
+    __atomic_store_n(&sink_blocked, 1, __ATOMIC_RELEASE);
+    CHECK(CMPclient_log_async_start(blocking_sink, LOG_TEST_CAPACITY) == CMP_OK);
+    for (i = 0; i < LOG_TEST_MSGS; i++)
+        (void)CMPclient_log_async(NULL, NULL, 0, LOG_INFO, "msg");
+    /* above verbosity, so neither queued nor counted as dropped */
+    CHECK(CMPclient_log_async(NULL, NULL, 0, LOG_DEBUG, "debug"));
+    CHECK(!CMPclient_log_enabled(LOG_DEBUG)
+          && CMPclient_log_enabled(LOG_INFO));
+
+    /* at most the buffer and the message in the sink could be taken */
+    dropped = CMPclient_log_async_dropped();
+    CHECK(dropped >= LOG_TEST_MSGS - LOG_TEST_CAPACITY - 1);
+    __atomic_store_n(&sink_blocked, 0, __ATOMIC_RELEASE);
+    CMPclient_log_async_stop();
+    CHECK(sink_msgs + dropped == LOG_TEST_MSGS);
+    CHECK(sink_warnings == 1); /* reporting the number of dropped messages */
+
+    /* after stop, messages go to the sink directly */
+    CHECK(CMPclient_log_async(NULL, NULL, 0, LOG_INFO, "direct"));
+    CHECK(sink_msgs + dropped == LOG_TEST_MSGS + 1);
+    ok = true;
+
+ end:
+    __atomic_store_n(&sink_blocked, 0, __ATOMIC_RELEASE);
+    CMPclient_log_async_stop();
+    CMPclient_log_set_verbosity((severity)opt_verbosity);
+    return ok;
+}
+#endif /* GENCMP_NO_LOG */
+
+/* allocation accounting */
+#ifndef GENCMP_NO_ALLOC
+
+static bool test_alloc_phase_restored(void)
+{
+    OSSL_CMP_CTX *ctx = NULL;
+    bool ok = false;
+
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_OTHER);
+    CHECK(CMPclient_prepare(&ctx, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+                            NULL, NULL, NULL, NULL, 0, NULL, false) == CMP_OK);
+    CHECK(CMPclient_alloc_set_phase(-1) == CMPCLIENT_PHASE_OTHER);
+    /* also on error */
+    CHECK(CMPclient_setup_certreq(NULL, NULL, NULL, NULL, NULL, NULL)
+          != CMP_OK);
+    CHECK(CMPclient_alloc_set_phase(-1) == CMPCLIENT_PHASE_OTHER);
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_GENM);
+    CHECK(CMPclient_reinit(ctx) == CMP_OK);
+    CHECK(CMPclient_alloc_set_phase(-1) == CMPCLIENT_PHASE_GENM);
+    ok = true;
+
+ end:
+    CMPclient_finish(ctx);
+    return ok && CMPclient_alloc_set_phase(CMPCLIENT_PHASE_OTHER)
+        == CMPCLIENT_PHASE_GENM;
+}
+
+/*
+ * frees and reallocs, including any change in size, are charged to the phase
+ * that allocated the block, also when done in other phases
+ */
+static bool test_alloc_free_phase(void)
+{
+    CMPCLIENT_ALLOC_STATS ir, reinit, finish;
+    unsigned char *p = NULL, *q;
+    bool ok = false;
+
+    CHECK(CMPclient_alloc_stats_enabled());
+    CMPclient_alloc_stats_reset();
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_IR);
+    CHECK((p = OPENSSL_malloc(100)) != NULL);
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_REINIT);
+    CHECK((q = OPENSSL_realloc(p, 200)) != NULL);
+    p = q;
+    CMPclient_alloc_stats_get(CMPCLIENT_PHASE_IR, &ir);
+    CHECK(ir.allocs == 1 && ir.reallocs == 1 && ir.bytes_allocated == 200
+          && ir.bytes_live == 200 && ir.bytes_peak == 200);
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_FINISH);
+    CHECK((q = OPENSSL_realloc(p, 50)) != NULL);
+    p = q;
+    CMPclient_alloc_stats_get(CMPCLIENT_PHASE_IR, &ir);
+    CHECK(ir.reallocs == 2 && ir.bytes_live == 50 && ir.bytes_peak == 200);
+    OPENSSL_free(p);
+    p = NULL;
+
+    CMPclient_alloc_stats_get(CMPCLIENT_PHASE_IR, &ir);
+    CMPclient_alloc_stats_get(CMPCLIENT_PHASE_REINIT, &reinit);
+    CMPclient_alloc_stats_get(CMPCLIENT_PHASE_FINISH, &finish);
+    CHECK(ir.allocs == 1 && ir.frees == 1 && ir.reallocs == 2
+          && ir.bytes_allocated == 200 && ir.bytes_live == 0
+          && ir.bytes_peak == 200);
+    CHECK(reinit.allocs == 0 && reinit.frees == 0 && reinit.reallocs == 0
+          && reinit.bytes_allocated == 0 && reinit.bytes_live == 0);
+    CHECK(finish.allocs == 0 && finish.frees == 0 && finish.reallocs == 0
+          && finish.bytes_allocated == 0 && finish.bytes_live == 0);
+    ok = true;
+
+ end:
+    OPENSSL_free(p);
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_OTHER);
+    return ok;
+}
+#endif /* GENCMP_NO_ALLOC */
+
+/* certificate lists */
+
+static bool same_certs(const STACK_OF(X509) *a, const STACK_OF(X509) *b)
+{
+    int i;
+
+    if (sk_X509_num(a) != sk_X509_num(b))
+        return false;
+    for (i = 0; i < sk_X509_num(a); i++)
+        if (X509_cmp(sk_X509_value(a, i), sk_X509_value(b, i)) != 0)
+            return false;
+    return true;
+}
+
+static bool test_certs_add_nodup(void)
+{
+    STACK_OF(X509) *chain = CERTS_load(data_file("signer.crt"), "chain", -1,
+                                       NULL);
+    STACK_OF(X509) *root = CERTS_load(data_file("root.crt"), "root", -1, NULL);
+    STACK_OF(X509) *input = sk_X509_new_null();
+    STACK_OF(X509) *expected = sk_X509_new_null();
+    STACK_OF(X509) *actual = sk_X509_new_null();
+    int i, flags;
+    bool ok = false;
+
+    CHECK(sk_X509_num(chain) == 3 && sk_X509_num(root) == 1);
+    /* duplicates within the input and with the initial contents */
+    CHECK(X509_add_certs(input, chain, X509_ADD_FLAG_UP_REF)
+          && X509_add_certs(input, root, X509_ADD_FLAG_UP_REF)
+          && X509_add_certs(input, chain, X509_ADD_FLAG_UP_REF));
+
+    for (flags = 0; flags <= X509_ADD_FLAG_NO_SS; flags += X509_ADD_FLAG_NO_SS) {
+        sk_X509_pop_free(expected, X509_free);
+        sk_X509_pop_free(actual, X509_free);
+        expected = sk_X509_new_null();
+        actual = sk_X509_new_null();
+        CHECK(expected != NULL && actual != NULL);
+        CHECK(X509_add_cert(expected, sk_X509_value(chain, 1),
+                            X509_ADD_FLAG_UP_REF)
+              && X509_add_cert(actual, sk_X509_value(chain, 1),
+                               X509_ADD_FLAG_UP_REF));
+        CHECK(X509_add_certs(expected, input, X509_ADD_FLAG_UP_REF
+                             | X509_ADD_FLAG_NO_DUP | flags));
+        CHECK(CERTS_add_nodup(actual, input, X509_ADD_FLAG_UP_REF | flags));
+        CHECK(same_certs(expected, actual));
+    }
+    CHECK(sk_X509_num(actual) < sk_X509_num(input));
+    /* the self-signed root must have been left out last time */
+    for (i = 0; i < sk_X509_num(actual); i++)
+        CHECK(X509_cmp(sk_X509_value(actual, i), sk_X509_value(root, 0)) != 0);
+
+    CHECK(CERTS_add_nodup(actual, NULL, 0));
+    CHECK(!CERTS_add_nodup(actual, input, X509_ADD_FLAG_PREPEND));
+    CHECK(!CERTS_add_nodup(NULL, input, 0));
+    ok = true;
+
+ end:
+    sk_X509_pop_free(chain, X509_free);
+    sk_X509_pop_free(root, X509_free);
+    sk_X509_pop_free(input, X509_free);
+    sk_X509_pop_free(expected, X509_free);
+    sk_X509_pop_free(actual, X509_free);
+    return ok;
+}
+
+/* in-memory loading and export */
+
+static bool test_certs_mem_roundtrip(void)
+{
+    STACK_OF(X509) *from_file = CERTS_load(data_file("signer.crt"), "certs",
+                                           -1, NULL);
+    STACK_OF(X509) *certs = NULL, *again = NULL, *single = NULL;
+    X509_STORE *store = NULL;
+    EVP_PKEY *key = NULL, *key_again = NULL;
+    unsigned char *data = NULL, *out = NULL, buf[16];
+    unsigned char *p;
+    size_t len, outlen;
+    bool ok = false;
+
+    CHECK(sk_X509_num(from_file) == 3);
+    CHECK((data = read_file(data_file("signer.crt"), &len)) != NULL);
+    CHECK((certs = CERTS_load_from_mem(data, len, NULL)) != NULL);
+    CHECK(same_certs(certs, from_file));
+    CHECK((store = STORE_load_from_mem(data, len, NULL, NULL)) != NULL);
+    CHECK(sk_X509_OBJECT_num(X509_STORE_get0_objects(store)) == 3);
+    CHECK(CERTS_load_from_mem(data, len / 2, NULL) == NULL); /* truncated */
+
+    /* PEM round trip, with allocation */
+    CHECK(CERTS_save_mem(certs, FORMAT_PEM, &out, &outlen) == CMP_OK);
+    CHECK((again = CERTS_load_from_mem(out, outlen, NULL)) != NULL);
+    CHECK(same_certs(again, certs));
+
+    /* into a caller buffer, first too small */
+    outlen = sizeof(buf);
+    p = buf;
+    CHECK(CERTS_save_mem(certs, FORMAT_PEM, &p, &outlen)
+          == CMP_R_INVALID_PARAMETERS);
+    OPENSSL_free(out);
+    CHECK((out = OPENSSL_malloc(outlen)) != NULL);
+    p = out;
+    CHECK(CERTS_save_mem(certs, FORMAT_PEM, &p, &outlen) == CMP_OK);
+    sk_X509_pop_free(again, X509_free);
+    CHECK((again = CERTS_load_from_mem(out, outlen, NULL)) != NULL);
+    CHECK(same_certs(again, certs));
+    OPENSSL_free(out);
+    out = NULL;
+
+    /* DER holds a single cert only */
+    CHECK(CERTS_save_mem(certs, FORMAT_ASN1, &out, &outlen) != CMP_OK);
+    CHECK((single = sk_X509_new_null()) != NULL
+          && X509_add_cert(single, sk_X509_value(certs, 0),
+                           X509_ADD_FLAG_UP_REF));
+    CHECK(CERTS_save_mem(single, FORMAT_ASN1, &out, &outlen) == CMP_OK);
+    sk_X509_pop_free(again, X509_free);
+    CHECK((again = CERTS_load_from_mem(out, outlen, NULL)) != NULL);
+    CHECK(same_certs(again, single));
+    OPENSSL_free(out);
+    out = NULL;
+
+    /* encrypted key round trip */
+    CHECK((key = KEY_load(data_file("signer.key"), NULL, NULL, "key")) != NULL);
+    CHECK(KEY_save_mem(key, FORMAT_PEM, "12345", &out, &outlen) == CMP_OK);
+    CHECK(KEY_load_from_mem(out, outlen, "wrong", NULL) == NULL);
+    CHECK((key_again = KEY_load_from_mem(out, outlen, "12345", NULL)) != NULL);
+    CHECK(EVP_PKEY_eq(key, key_again) == 1);
+    ok = true;
+
+ end:
+    OPENSSL_free(data);
+    OPENSSL_free(out);
+    EVP_PKEY_free(key);
+    EVP_PKEY_free(key_again);
+    X509_STORE_free(store);
+    sk_X509_pop_free(from_file, X509_free);
+    sk_X509_pop_free(certs, X509_free);
+    sk_X509_pop_free(again, X509_free);
+    sk_X509_pop_free(single, X509_free);
+    return ok;
+}
+
+static bool mem_loads_certs(BIO *mem, bool truncate,
+                            const STACK_OF(X509) *expected)
+{
+    char *data;
+    long len = BIO_get_mem_data(mem, &data);
+    STACK_OF(X509) *certs;
+    bool ok;
+
+    if (len <= 1)
+        return false;
+    certs = CERTS_load_from_mem((unsigned char *)data,
+                                (size_t)len - (truncate ? 1 : 0), NULL);
+    ok = truncate ? certs == NULL : certs != NULL && same_certs(certs, expected);
+    sk_X509_pop_free(certs, X509_free);
+    return ok;
+}
+
+/* multiple certs as a sequence of DER certs, or as PKCS#7 in DER or PEM */
+static bool test_certs_mem_der_pkcs7(void)
+{
+    STACK_OF(X509) *certs = CERTS_load(data_file("signer.crt"), "certs",
+                                       -1, NULL);
+    BIO *der = BIO_new(BIO_s_mem());
+    BIO *p7_der = BIO_new(BIO_s_mem());
+    BIO *p7_pem = BIO_new(BIO_s_mem());
+    PKCS7 *p7 = NULL;
+    int i;
+    bool ok = false;
+
+    CHECK(sk_X509_num(certs) == 3);
+    CHECK(der != NULL && p7_der != NULL && p7_pem != NULL);
+    CHECK((p7 = PKCS7_new()) != NULL
+          && PKCS7_set_type(p7, NID_pkcs7_signed)
+          && PKCS7_content_new(p7, NID_pkcs7_data));
+    for (i = 0; i < sk_X509_num(certs); i++)
+        CHECK(i2d_X509_bio(der, sk_X509_value(certs, i))
+              && PKCS7_add_certificate(p7, sk_X509_value(certs, i)));
+    CHECK(i2d_PKCS7_bio(p7_der, p7) && PEM_write_bio_PKCS7(p7_pem, p7));
+
+    CHECK(mem_loads_certs(der, false, certs));
+    CHECK(mem_loads_certs(der, true, NULL));
+    CHECK(mem_loads_certs(p7_der, false, certs));
+    CHECK(mem_loads_certs(p7_der, true, NULL));
+    CHECK(mem_loads_certs(p7_pem, false, certs));
+    ok = true;
+
+ end:
+    PKCS7_free(p7);
+    BIO_free(der);
+    BIO_free(p7_der);
+    BIO_free(p7_pem);
+    sk_X509_pop_free(certs, X509_free);
+    return ok;
+}
+
+/* DER cache */
+
+/* number of certs loaded, or -1 on failure */
+static int num_loaded(const char *file, int type_CA)
+{
+    STACK_OF(X509) *certs = CERTS_load_cached(file, "test certs", type_CA, NULL);
+    int n = certs == NULL ? -1 : sk_X509_num(certs);
+
+    sk_X509_pop_free(certs, X509_free);
+    return n;
+}
+
+/* CA cert, EE cert, and EE cert with its chain */
+/* changes the PEM label in file, keeping its size */
+static bool garble_pem(const char *file)
+{
+    size_t len;
+    unsigned char *data = read_file(file, &len);
+    char *label;
+    FILE *fp = NULL;
+    bool ok = data != NULL
+        && (label = strstr((char *)data, "CERTIFICATE-----")) != NULL
+        && (label[strlen("CERTIFICAT")] = 'X') != 0
+        && (fp = fopen(file, "r+b")) != NULL
+        && fwrite(data, 1, len, fp) == len;
+
+    if (fp != NULL && fclose(fp) != 0)
+        ok = false;
+    OPENSSL_free(data);
+    return ok;
+}
+
+#define DERCACHE_TEST_TICK_US 20000 /* exceeds the granularity of ctime */
+
+static const char *const dercache_inputs[] = {
+    "root.crt", "signer_only.crt", "signer.crt"
+};
+
+static bool test_dercache_equivalence(void)
+{
+    char dir[TEST_PATH_LEN] = "", file[TEST_PATH_LEN], cache[TEST_PATH_LEN];
+    char victim[TEST_PATH_LEN];
+    struct stat st;
+    struct timespec times[2];
+    FILE *fp;
+    int i, type_CA, expected;
+    bool ok = false;
+
+    CHECK(make_dir(dir, sizeof(dir)));
+    snprintf(file, sizeof(file), "%s", dir_file(dir, "certs.pem"));
+    snprintf(cache, sizeof(cache), "%s.dercache", file);
+    snprintf(victim, sizeof(victim), "%s", dir_file(dir, "victim"));
+    CHECK((fp = fopen(victim, "w")) != NULL && fputs("keep", fp) >= 0
+          && fclose(fp) == 0);
+    /* the name used for writing the cache must not be predictable */
+    CHECK(symlink(victim, dir_file(dir, "certs.pem.dercache.tmp")) == 0);
+
+    for (i = 0; i < (int)(sizeof(dercache_inputs) / sizeof(char *)); i++) {
+        for (type_CA = -1; type_CA <= 1; type_CA++) {
+            CHECK(copy_file(data_file(dercache_inputs[i]), file));
+            (void)remove(cache);
+            CMPclient_dercache_enable(false);
+            expected = num_loaded(file, type_CA);
+            CHECK(!file_exists(cache));
+
+            CMPclient_dercache_enable(true);
+            CHECK(num_loaded(file, -1) > 0); /* fills the cache */
+            CHECK(file_exists(cache));
+            if (num_loaded(file, type_CA) != expected) {
+                LOG(FL_ERR, "%s with type_CA %d loaded differently from cache",
+                    dercache_inputs[i], type_CA);
+                goto end;
+            }
+        }
+    }
+    /* replacing the original file invalidates the cache */
+    CHECK(copy_file(data_file("root.crt"), file));
+    CHECK(num_loaded(file, -1) == 1 && file_exists(cache));
+    CHECK(copy_file(data_file("signer.crt"), file));
+    CHECK(num_loaded(file, -1) == 3);
+
+    /* so does an in-place overwrite of the same size retaining the mtime */
+    CHECK(copy_file(data_file("root.crt"), file));
+    CHECK(num_loaded(file, -1) == 1 && file_exists(cache));
+    CHECK(stat(file, &st) == 0);
+    sleep_us(DERCACHE_TEST_TICK_US);
+    CHECK(garble_pem(file));
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+#ifdef __APPLE__
+    times[1] = st.st_mtimespec;
+#else
+    times[1] = st.st_mtim;
+#endif
+    CHECK(utimensat(AT_FDCWD, file, times, 0) == 0);
+    CHECK(num_loaded(file, -1) == 0); /* rather than 1 from the cache */
+
+    CHECK((fp = fopen(victim, "r")) != NULL);
+    CHECK(fgets(file, sizeof(file), fp) != NULL && strcmp(file, "keep") == 0);
+    fclose(fp);
+    ok = true;
+
+ end:
+    CMPclient_dercache_enable(false);
+    remove_dir(dir);
+    return ok;
+}
+
+/* in-process mock CA, with PBM-based protection */
+
+#define TEST_SECRET "test"
+#define TEST_SECRET_REF "api-test"
+#define TEST_RECIPIENT "/O=openssl_cmp"
+#define TEST_SUBJECT "/CN=api-test"
+
+typedef struct test_mock_st {
+    MOCK_CA_OPTS opts;
+    MOCK_CA *ca;
+    CREDENTIALS *creds;
+    EVP_PKEY *new_key; /* matching the cert returned by the mock CA */
+} TEST_MOCK;
+
+static void mock_free(TEST_MOCK *mock)
+{
+    MOCK_CA_free(mock->ca);
+    CREDENTIALS_free(mock->creds);
+    EVP_PKEY_free(mock->new_key);
+    X509_free(mock->opts.srv_cert);
+    X509_free(mock->opts.rsp_cert);
+    sk_X509_pop_free(mock->opts.rsp_extracerts, X509_free);
+    memset(mock, 0, sizeof(*mock));
+}
+
+/* slots is the number of transactions the mock CA handles in parallel */
+static bool mock_setup(TEST_MOCK *mock, int slots)
+{
+    const char *desc = "mock input";
+
+    memset(mock, 0, sizeof(*mock));
+    mock->opts.srv_secret = TEST_SECRET;
+    mock->opts.no_check_time = true;
+    mock->opts.verbosity = (int)opt_verbosity;
+    if ((mock->opts.srv_cert = CERT_load(data_file("server.crt"), NULL, desc,
+                                         -1, NULL)) == NULL
+        || (mock->opts.rsp_cert = CERT_load(data_file("signer_only.crt"), NULL,
+                                            desc, -1, NULL)) == NULL
+        || (mock->opts.rsp_extracerts =
+            CERTS_load(data_file("signer_issuing.crt"), desc, -1, NULL)) == NULL
+        || (mock->new_key = KEY_load(data_file("signer.key"), NULL, NULL,
+                                     desc)) == NULL
+        || (mock->creds = CREDENTIALS_new(NULL, NULL, NULL, TEST_SECRET,
+                                          TEST_SECRET_REF)) == NULL
+        || (mock->ca = MOCK_CA_new(NULL, NULL, &mock->opts, slots)) == NULL) {
+        mock_free(mock);
+        return false;
+    }
+    return true;
+}
+
+static OSSL_CMP_CTX *mock_ctx(TEST_MOCK *mock)
+{
+    OSSL_CMP_CTX *ctx = NULL;
+
+    if (CMPclient_prepare(&ctx, NULL, NULL, NULL, NULL, TEST_RECIPIENT, NULL,
+                          mock->creds, NULL, NULL, NULL, MOCK_CA_transfer_cb,
+                          0, NULL, false) != CMP_OK)
+        return NULL;
+    if (!OSSL_CMP_CTX_set_log_verbosity(ctx, (int)opt_verbosity)
+        || !OSSL_CMP_CTX_set_transfer_cb_arg(ctx, mock->ca)) {
+        CMPclient_finish(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/* request templates */
+
+static X509_EXTENSIONS *new_exts(const char *name, const char *value)
+{
+    X509_EXTENSIONS *exts = sk_X509_EXTENSION_new_null();
+    X509_EXTENSION *ext = X509V3_EXT_conf(NULL, NULL, name, value);
+
+    if (exts == NULL || ext == NULL || !sk_X509_EXTENSION_push(exts, ext)) {
+        X509_EXTENSION_free(ext);
+        sk_X509_EXTENSION_free(exts);
+        return NULL;
+    }
+    return exts;
+}
+
+static bool has_ext(const OSSL_CRMF_CERTTEMPLATE *tmpl, int nid)
+{
+    return X509v3_get_ext_by_NID(OSSL_CRMF_CERTTEMPLATE_get0_extensions(tmpl),
+                                 nid, -1) >= 0;
+}
+
+static bool test_req_template(void)
+{
+    TEST_MOCK mock = { 0 };
+    X509_EXTENSIONS *exts = new_exts("keyUsage", "critical,digitalSignature");
+    X509_EXTENSIONS *san_exts = new_exts("subjectAltName", "DNS:ext.example");
+    STACK_OF(GENERAL_NAME) *sans = sk_GENERAL_NAME_new_null();
+    GENERAL_NAME *san = a2i_GENERAL_NAME(NULL, NULL, NULL, GEN_DNS,
+                                         "api-test.example", 0);
+    X509_NAME *issuer = UTIL_parse_name("/CN=issuer", MBSTRING_ASC, false);
+    CMPCLIENT_REQ_TEMPLATE *tmpl = NULL;
+    OSSL_CRMF_CERTTEMPLATE *sent = NULL;
+    OSSL_CMP_CTX *ctx = NULL;
+    CREDENTIALS *new_creds = NULL;
+    int i;
+    bool ok = false;
+
+    CHECK(mock_setup(&mock, 1));
+    CHECK(exts != NULL && san_exts != NULL && issuer != NULL);
+    CHECK(sans != NULL && san != NULL && sk_GENERAL_NAME_push(sans, san));
+    san = NULL;
+    CHECK(CMPclient_req_template_new(NULL, san_exts, sans, false, NULL, false)
+          == NULL);
+
+    CHECK((tmpl = CMPclient_req_template_new("/CN=issuer", exts, sans, true,
+                                             NULL, false)) != NULL);
+    /* the template holds copies */
+    sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+    exts = NULL;
+    sk_GENERAL_NAME_pop_free(sans, GENERAL_NAME_free);
+    sans = NULL;
+
+    /* the same template serves several transactions and contexts */
+    for (i = 0; i < 3; i++) {
+        if (i != 1) {
+            CMPclient_finish(ctx);
+            CHECK((ctx = mock_ctx(&mock)) != NULL);
+        }
+        CHECK(CMPclient_setup_certreq_template(ctx, tmpl) == CMP_OK);
+        if (i == 2) { /* contexts keep what they need */
+            CMPclient_req_template_free(tmpl);
+            tmpl = NULL;
+        }
+        CHECK(CMPclient_imprint(ctx, &new_creds, mock.new_key, TEST_SUBJECT,
+                                NULL) == CMP_OK);
+        CREDENTIALS_free(new_creds);
+        new_creds = NULL;
+        CHECK(CMPclient_reinit(ctx) == CMP_OK);
+
+        OSSL_CRMF_CERTTEMPLATE_free(sent);
+        CHECK((sent = MOCK_CA_get1_last_template(mock.ca)) != NULL);
+        CHECK(X509_NAME_cmp(OSSL_CRMF_CERTTEMPLATE_get0_issuer(sent), issuer)
+              == 0);
+        CHECK(has_ext(sent, NID_key_usage));
+        CHECK(has_ext(sent, NID_subject_alt_name));
+    }
+    ok = true;
+
+ end:
+    CMPclient_finish(ctx);
+    CMPclient_req_template_free(tmpl);
+    OSSL_CRMF_CERTTEMPLATE_free(sent);
+    CREDENTIALS_free(new_creds);
+    X509_NAME_free(issuer);
+    GENERAL_NAME_free(san);
+    sk_GENERAL_NAME_pop_free(sans, GENERAL_NAME_free);
+    sk_X509_EXTENSION_pop_free(san_exts, X509_EXTENSION_free);
+    sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+    mock_free(&mock);
+    return ok;
+}
+
+/* transactions via the transport of the library with cmpMockServer */
+#ifndef GENCMP_NO_HTTP
+
+# define SRV_TEST_TIMEOUT 10 /* seconds */
+# define SRV_TEST_MAX_ARGS 8 /* further options of cmpMockServer */
+
+typedef struct test_srv_st {
+    pid_t pid;
+    char server[64]; /* host and port as given in its ACCEPT line */
+    char host[32], port[8]; /* the same, split up */
+    CREDENTIALS *creds;
+    X509 *ref_cert; /* to be revoked, which the server accepts repeatedly */
+} TEST_SRV;
+
+static bool srv_skipped(void)
+{
+    if (opt_mock_server != NULL)
+        return false;
+    LOG(FL_WARN, "skipping test, which needs -mock_server");
+    return true;
+}
+
+static void srv_stop(TEST_SRV *srv)
+{
+    if (srv->pid > 0) {
+        (void)kill(srv->pid, SIGTERM);
+        (void)waitpid(srv->pid, NULL, 0);
+    }
+    CREDENTIALS_free(srv->creds);
+    X509_free(srv->ref_cert);
+    memset(srv, 0, sizeof(*srv));
+}
+
+/* the variable arguments are further options, terminated by NULL */
+static bool srv_start(TEST_SRV *srv, ...)
+{
+    const char *argv[16 + SRV_TEST_MAX_ARGS];
+    char srv_cert[TEST_PATH_LEN], srv_key[TEST_PATH_LEN];
+    char ref_cert[TEST_PATH_LEN], line[128], *colon, *end;
+    const char *arg;
+    va_list args;
+    int fds[2], n = 0, i;
+    FILE *in;
+    bool ok;
+
+    memset(srv, 0, sizeof(*srv));
+    /* the local server is to be reached directly */
+    (void)unsetenv("http_proxy");
+    (void)unsetenv("HTTP_PROXY");
+    if ((srv->creds = CREDENTIALS_new(NULL, NULL, NULL, TEST_SECRET,
+                                      TEST_SECRET_REF)) == NULL
+        || (srv->ref_cert = CERT_load(data_file("signer_only.crt"), NULL,
+                                      "cert to revoke", -1, NULL)) == NULL)
+        return false;
+    snprintf(srv_cert, sizeof(srv_cert), "%s", data_file("server.crt"));
+    snprintf(srv_key, sizeof(srv_key), "%s", data_file("server.key"));
+    snprintf(ref_cert, sizeof(ref_cert), "%s", data_file("signer_only.crt"));
+    argv[n++] = opt_mock_server;
+    argv[n++] = "-srv_secret";
+    argv[n++] = "pass:" TEST_SECRET;
+    argv[n++] = "-srv_cert";
+    argv[n++] = srv_cert;
+    argv[n++] = "-srv_key";
+    argv[n++] = srv_key;
+    argv[n++] = "-ref_cert";
+    argv[n++] = ref_cert;
+    argv[n++] = "-no_check_time";
+    argv[n++] = "-port";
+    argv[n++] = "0";
+    va_start(args, srv);
+    for (i = 0; i < SRV_TEST_MAX_ARGS
+             && (arg = va_arg(args, const char *)) != NULL; i++)
+        argv[n++] = arg;
+    va_end(args);
+    argv[n] = NULL;
+
+    if (pipe(fds) != 0)
+        return false;
+    if ((srv->pid = fork()) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (srv->pid == 0) {
+        (void)dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv(opt_mock_server, (char *const *)argv);
+        _exit(127);
+    }
+    close(fds[1]);
+    if ((in = fdopen(fds[0], "r")) == NULL) {
+        close(fds[0]);
+        return false;
+    }
+    ok = fgets(line, sizeof(line), in) != NULL
+        && strncmp(line, "ACCEPT ", 7) == 0
+        && (end = strstr(line, " PID=")) != NULL;
+    fclose(in);
+    if (!ok) {
+        LOG(FL_ERR, "cannot start mock server '%s'", opt_mock_server);
+        return false;
+    }
+    *end = '\0';
+    snprintf(srv->server, sizeof(srv->server), "%s", line + 7);
+    if ((colon = strrchr(line + 7, ':')) == NULL)
+        return false;
+    *colon = '\0';
+    snprintf(srv->host, sizeof(srv->host), "%s", line + 7);
+    snprintf(srv->port, sizeof(srv->port), "%s", colon + 1);
+    return true;
+}
+
+static OSSL_CMP_CTX *srv_ctx(TEST_SRV *srv)
+{
+    OSSL_CMP_CTX *ctx = NULL;
+
+    if (CMPclient_prepare(&ctx, NULL, NULL, NULL, NULL, TEST_RECIPIENT, NULL,
+                          srv->creds, NULL, NULL, NULL, NULL, 0, NULL, false)
+        != CMP_OK)
+        return NULL;
+    if (!OSSL_CMP_CTX_set_log_verbosity(ctx, (int)opt_verbosity)) {
+        CMPclient_finish(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/* a single rr/rp, keeping any connection */
+static bool srv_revoke(TEST_SRV *srv, OSSL_CMP_CTX *ctx)
+{
+    bool ok = CMPclient_revoke(ctx, srv->ref_cert, CRL_REASON_NONE) == CMP_OK;
+
+    (void)OSSL_CMP_CTX_reinit(ctx); /* unlike CMPclient_reinit() */
+    return ok;
+}
+
+# define DNS_TEST_HOST "cmp.test"
+/* refused, since the mock server listens just on 127.0.0.1 */
+# define DNS_TEST_UNREACHABLE "127.0.0.2"
+
+static bool dns_test_stats(const char *host, TEST_SRV *srv,
+                           unsigned long resolves, unsigned long cache_hits)
+{
+    CMPCLIENT_ENDPOINT_STATS stats;
+
+    if (!CMPclient_endpoint_stats_get(host, srv->port, &stats))
+        return false;
+    if (stats.resolves == resolves && stats.cache_hits == cache_hits
+        && stats.connect_failures == 0)
+        return true;
+    LOG(FL_ERR, "%s: %lu resolves, %lu cache hits, %lu failed connects",
+        host, stats.resolves, stats.cache_hits, stats.connect_failures);
+    return false;
+}
+
+/*
+ * Connecting falls back to the next address of the server if the first one
+ * is unreachable, and resolved addresses are reused until their TTL expires.
+ */
+static bool test_dns_fallback_expiry(void)
+{
+    TEST_SRV srv = { 0 };
+    OSSL_CMP_CTX *ctx = NULL;
+    char addrs[64], server[64];
+    bool ok = false;
+
+    if (srv_skipped())
+        return true;
+    CHECK(srv_start(&srv, NULL));
+    snprintf(addrs, sizeof(addrs), "%s,%s", DNS_TEST_UNREACHABLE, srv.host);
+    CHECK(CMPclient_dns_cache_set(DNS_TEST_HOST, srv.port, addrs));
+    snprintf(server, sizeof(server), "%s:%s", DNS_TEST_HOST, srv.port);
+    CHECK((ctx = srv_ctx(&srv)) != NULL);
+    CHECK(CMPclient_setup_transport(ctx, server, "pkix/", 0 /* no keep_alive */,
+                                    SRV_TEST_TIMEOUT, NULL, NULL, NULL)
+          == CMP_OK);
+    CHECK(srv_revoke(&srv, ctx));
+    CHECK(dns_test_stats(DNS_TEST_HOST, &srv, 0, 1));
+    CMPclient_finish(ctx);
+    ctx = NULL;
+
+    CMPclient_dns_cache_set_ttl(1, 1);
+    snprintf(server, sizeof(server), "localhost:%s", srv.port);
+    CHECK((ctx = srv_ctx(&srv)) != NULL);
+    CHECK(CMPclient_setup_transport(ctx, server, "pkix/", 0 /* no keep_alive */,
+                                    SRV_TEST_TIMEOUT, NULL, NULL, NULL)
+          == CMP_OK);
+    CHECK(srv_revoke(&srv, ctx) && srv_revoke(&srv, ctx));
+    CHECK(dns_test_stats("localhost", &srv, 1, 1));
+    sleep_us(2000000L); /* beyond the TTL, which has a granularity of 1 s */
+    CHECK(srv_revoke(&srv, ctx));
+    CHECK(dns_test_stats("localhost", &srv, 2, 1));
+    ok = true;
+
+ end:
+    CMPclient_finish(ctx);
+    CMPclient_dns_cache_set_ttl(-1, -1);
+    CMPclient_dns_cache_clear();
+    srv_stop(&srv);
+    return ok;
+}
+
+# define RATE_TEST_TXNS 3
+# define RATE_TEST_RATE 2 /* transactions per second */
+
+static long elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long)(now.tv_sec - start->tv_sec) * 1000
+        + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* runs RATE_TEST_TXNS transactions, returning the time taken in ms, or -1 */
+static long rate_test_run(TEST_SRV *srv, OSSL_CMP_CTX *ctx,
+                          CMPCLIENT_ENDPOINT_STATS *stats)
+{
+    struct timespec start;
+    int i;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < RATE_TEST_TXNS; i++)
+        if (!srv_revoke(srv, ctx))
+            return -1;
+    return CMPclient_endpoint_stats_get(srv->host, srv->port, stats)
+        ? elapsed_ms(&start) : -1;
+}
+
+/* exchanges beyond the client-side rate limit are delayed */
+static bool test_rate_limit_throttle(void)
+{
+    TEST_SRV srv = { 0 };
+    CMPCLIENT_RATE_LIMIT limit;
+    CMPCLIENT_ENDPOINT_STATS stats;
+    OSSL_CMP_CTX *ctx = NULL;
+    long ms;
+    bool ok = false;
+
+    if (srv_skipped())
+        return true;
+    CHECK(srv_start(&srv, NULL));
+    CHECK((ctx = srv_ctx(&srv)) != NULL);
+    CHECK(CMPclient_setup_transport(ctx, srv.server, "pkix/",
+                                    1 /* keep_alive */, SRV_TEST_TIMEOUT,
+                                    NULL, NULL, NULL) == CMP_OK);
+    memset(&limit, 0, sizeof(limit));
+    limit.rate = RATE_TEST_RATE;
+    limit.burst = 1;
+    CHECK(CMPclient_set_rate_limit(ctx, &limit) == CMP_OK);
+    CHECK((ms = rate_test_run(&srv, ctx, &stats)) >= 0);
+    /* the bucket is full at first, each further token takes 1 / rate */
+    CHECK(ms >= 900L * (RATE_TEST_TXNS - 1) / RATE_TEST_RATE);
+    CHECK(stats.throttled >= 1 && stats.backoffs == 0);
+    ok = true;
+
+ end:
+    CMPclient_finish(ctx);
+    CMPclient_dns_cache_clear();
+    srv_stop(&srv);
+    return ok;
+}
+
+/*
+ * A server overloaded by more than one request per second answers with 503
+ * and Retry-After: 1, which pauses the exchanges with it, then retried.
+ * Of the transactions run in quick succession, at least two fall into the
+ * same second.
+ */
+static bool test_retry_after_pause(void)
+{
+    TEST_SRV srv = { 0 };
+    CMPCLIENT_ENDPOINT_STATS stats;
+    OSSL_CMP_CTX *ctx = NULL;
+    long ms;
+    bool ok = false;
+
+    if (srv_skipped())
+        return true;
+    CHECK(srv_start(&srv, "-max_rate", "1", NULL));
+    CHECK((ctx = srv_ctx(&srv)) != NULL);
+    CHECK(CMPclient_setup_transport(ctx, srv.server, "pkix/",
+                                    1 /* keep_alive */, SRV_TEST_TIMEOUT,
+                                    NULL, NULL, NULL) == CMP_OK);
+    CHECK((ms = rate_test_run(&srv, ctx, &stats)) >= 0);
+    CHECK(stats.backoffs >= 1 && ms >= 900);
+    ok = true;
+
+ end:
+    CMPclient_finish(ctx);
+    CMPclient_dns_cache_clear();
+    srv_stop(&srv);
+    return ok;
+}
+
+#endif /* GENCMP_NO_HTTP */
+
+/* store-and-forward spool */
+#ifndef GENCMP_NO_SPOOL
+
+# define SPOOL_TEST_TXNS 3
+# define SPOOL_TEST_POLL_MS 5
+# define SPOOL_TEST_TIMEOUT 10 /* seconds */
+
+/* the mock CA as HTTP server, see MOCK_HTTP_start() */
+static unsigned char *mock_respond(void *arg, const unsigned char *der,
+                                   long len, int *rsp_len)
+{
+    OSSL_CMP_MSG *req = d2i_OSSL_CMP_MSG(NULL, &der, len), *rsp = NULL;
+    unsigned char *rsp_der = NULL;
+
+    if (req != NULL && (rsp = MOCK_CA_process(arg, req)) != NULL
+        && (*rsp_len = i2d_OSSL_CMP_MSG(rsp, &rsp_der)) <= 0)
+        rsp_der = NULL;
+    OSSL_CMP_MSG_free(req);
+    OSSL_CMP_MSG_free(rsp);
+    return rsp_der;
+}
+
+typedef struct spool_test_txn_st {
+    OSSL_CMP_CTX *ctx;
+    const EVP_PKEY *new_key;
+    CREDENTIALS *new_creds;
+    CMP_err err;
+    int done; /* accessed atomically */
+} SPOOL_TEST_TXN;
+
+static void *spool_test_txn(void *arg)
+{
+    SPOOL_TEST_TXN *txn = arg;
+
+    txn->err = CMPclient_imprint(txn->ctx, &txn->new_creds, txn->new_key,
+                                 TEST_SUBJECT, NULL);
+    __atomic_store_n(&txn->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* returns the number of messages in the given subdirectory, or -1 */
+static int num_spooled(const char *dir, const char *sub)
+{
+    DIR *d = opendir(dir_file(dir, sub));
+    struct dirent *entry;
+    int n = 0;
+
+    if (d == NULL)
+        return -1;
+    while ((entry = readdir(d)) != NULL)
+        if (entry->d_name[0] != '.')
+            n++;
+    (void)closedir(d);
+    return n;
+}
+
+static bool test_spool_roundtrip(void)
+{
+    TEST_MOCK mock = { 0 };
+    MOCK_HTTP http = { 0 };
+    SPOOL_TEST_TXN txns[SPOOL_TEST_TXNS];
+    pthread_t threads[SPOOL_TEST_TXNS];
+    char dir[TEST_PATH_LEN] = "", server[32];
+    CMPCLIENT_SPOOL *spool = NULL;
+    OSSL_CMP_CTX *fwd = NULL;
+    int started = 0, done = 0, num, i;
+    time_t deadline = time(NULL) + SPOOL_TEST_TIMEOUT;
+    bool ok = false;
+
+    http.fd = -1;
+    memset(txns, 0, sizeof(txns));
+    CHECK(mock_setup(&mock, SPOOL_TEST_TXNS));
+    CHECK(MOCK_HTTP_start(&http, mock_respond, mock.ca, "application/pkixcmp"));
+    snprintf(server, sizeof(server), "127.0.0.1:%d", http.port);
+    CHECK(make_dir(dir, sizeof(dir)));
+    CHECK((spool = CMPclient_spool_new(dir, SPOOL_TEST_POLL_MS)) != NULL);
+
+    /* transactions queue their requests while there is no uplink */
+    for (i = 0; i < SPOOL_TEST_TXNS; i++) {
+        txns[i].new_key = mock.new_key;
+        CHECK((txns[i].ctx = mock_ctx(&mock)) != NULL);
+        CHECK(CMPclient_setup_spool(txns[i].ctx, spool, SPOOL_TEST_TIMEOUT)
+              == CMP_OK);
+    }
+    for (; started < SPOOL_TEST_TXNS; started++)
+        CHECK(pthread_create(&threads[started], NULL, spool_test_txn,
+                             &txns[started]) == 0);
+    while (num_spooled(dir, "out") < SPOOL_TEST_TXNS && time(NULL) < deadline)
+        sleep_us(1000L * SPOOL_TEST_POLL_MS);
+    CHECK(num_spooled(dir, "out") == SPOOL_TEST_TXNS);
+
+    /* a single forwarding run ships all of them */
+    CHECK(CMPclient_prepare(&fwd, NULL, NULL, NULL, NULL, TEST_RECIPIENT,
+                            NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, false)
+          == CMP_OK);
+    CHECK(CMPclient_setup_HTTP(fwd, server, "/", 0 /* no keep_alive */,
+                               SPOOL_TEST_TIMEOUT, NULL, NULL, NULL) == CMP_OK);
+    CHECK(CMPclient_spool_forward(fwd, dir, &num) == CMP_OK);
+    CHECK(num == SPOOL_TEST_TXNS);
+
+    /* the responses resume the transactions, which then send certConf */
+    while (done < SPOOL_TEST_TXNS && time(NULL) < deadline) {
+        sleep_us(1000L * SPOOL_TEST_POLL_MS);
+        CHECK(CMPclient_spool_forward(fwd, dir, &num) == CMP_OK);
+        for (done = 0, i = 0; i < SPOOL_TEST_TXNS; i++)
+            done += __atomic_load_n(&txns[i].done, __ATOMIC_ACQUIRE);
+    }
+    CHECK(done == SPOOL_TEST_TXNS);
+    for (i = 0; i < SPOOL_TEST_TXNS; i++)
+        CHECK(txns[i].err == CMP_OK && txns[i].new_creds != NULL);
+    CHECK(num_spooled(dir, "out") == 0 && num_spooled(dir, "in") == 0);
+    ok = true;
+
+ end:
+    for (i = 0; i < started; i++) /* any still waiting time out */
+        (void)pthread_join(threads[i], NULL);
+    for (i = 0; i < SPOOL_TEST_TXNS; i++) {
+        CMPclient_finish(txns[i].ctx);
+        CREDENTIALS_free(txns[i].new_creds);
+    }
+    CMPclient_finish(fwd);
+    CMPclient_spool_free(spool);
+    MOCK_HTTP_stop(&http);
+    mock_free(&mock);
+    remove_dir(dir);
+    return ok;
+}
+#endif /* GENCMP_NO_SPOOL */
+
+/* engine jobs sharing a thread, which keep their allocation phase */
+#if !defined(GENCMP_NO_ENGINE) && !defined(GENCMP_NO_ALLOC)
+
+# define ENGINE_TEST_JOBS 3
+
+typedef struct engine_test_job_st {
+    int reason; /* of the error raised by the job */
+    int phase; /* allocation phase set by the job */
+    bool isolated; /* as seen by the job */
+    bool done_ok; /* as seen by its done callback */
+} ENGINE_TEST_JOB;
+
+static bool only_error(int reason)
+{
+    return ERR_GET_REASON(ERR_peek_error()) == reason
+        && ERR_GET_REASON(ERR_peek_last_error()) == reason;
+}
+
+static CMP_err engine_test_job(void *arg)
+{
+    ENGINE_TEST_JOB *job = arg;
+    int i;
+
+    job->isolated = ERR_peek_error() == 0;
+    ERR_raise_data(ERR_LIB_CMP, job->reason, "job %d", job->reason);
+    (void)CMPclient_alloc_set_phase(job->phase);
+    for (i = 0; i < 3; i++) {
+        (void)CMPclient_engine_wait(-1, 0, 10 /* ms */);
+        job->isolated = job->isolated && only_error(job->reason)
+            && CMPclient_alloc_set_phase(-1) == job->phase;
+    }
+    return CMP_OK;
+}
+
+static void engine_test_done(void *arg, CMP_err err)
+{
+    ENGINE_TEST_JOB *job = arg;
+
+    job->done_ok = err == CMP_OK && only_error(job->reason);
+}
+
+static bool test_engine_job_state(void)
+{
+    static const int phases[ENGINE_TEST_JOBS] = {
+        CMPCLIENT_PHASE_IR, CMPCLIENT_PHASE_KUR, CMPCLIENT_PHASE_RR
+    };
+    CMPCLIENT_ENGINE *engine = CMPclient_engine_new(ENGINE_TEST_JOBS, 0);
+    ENGINE_TEST_JOB jobs[ENGINE_TEST_JOBS];
+    int i;
+    bool ok = false;
+
+    CHECK(engine != NULL);
+    memset(jobs, 0, sizeof(jobs));
+    for (i = 0; i < ENGINE_TEST_JOBS; i++) {
+        jobs[i].reason = CMP_R_INVALID_ARGS + i;
+        jobs[i].phase = phases[i];
+        CHECK(CMPclient_engine_submit(engine, engine_test_job, &jobs[i],
+                                      engine_test_done) == CMP_OK);
+    }
+    /* errors and phase of the caller are kept */
+    ERR_raise(ERR_LIB_CMP, CMP_R_NULL_ARGUMENT);
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_GENM);
+    CHECK(CMPclient_engine_run(engine) == CMP_OK);
+    CHECK(only_error(CMP_R_NULL_ARGUMENT));
+    CHECK(CMPclient_alloc_set_phase(CMPCLIENT_PHASE_OTHER)
+          == CMPCLIENT_PHASE_GENM);
+    for (i = 0; i < ENGINE_TEST_JOBS; i++) {
+        if (!jobs[i].isolated || !jobs[i].done_ok) {
+            LOG(FL_ERR, "job %d saw state of others", i);
+            goto end;
+        }
+    }
+    ok = true;
+
+ end:
+    CMPclient_engine_free(engine);
+    return ok;
+}
+#endif /* !defined(GENCMP_NO_ENGINE) && !defined(GENCMP_NO_ALLOC) */
+
+/* reloadable trust stores */
+#ifndef GENCMP_NO_TRUST
+
+static int num_objects(X509_STORE *store)
+{
+    return store == NULL ? -1 : sk_X509_OBJECT_num(X509_STORE_get0_objects(store));
+}
+
+static bool test_trust_reload(void)
+{
+    char dir[TEST_PATH_LEN] = "", file[TEST_PATH_LEN];
+    CMPCLIENT_TRUST *trust = NULL;
+    OSSL_CMP_CTX *ctx = NULL;
+    X509_STORE *first = NULL, *current = NULL;
+    FILE *fp;
+    bool ok = false;
+
+    CHECK(make_dir(dir, sizeof(dir)));
+    snprintf(file, sizeof(file), "%s", dir_file(dir, "trusted.pem"));
+    CHECK(copy_file(data_file("root.crt"), file));
+    CHECK((trust = CMPclient_trust_new(file, "test trust", NULL, NULL,
+                                       0 /* no watcher */)) != NULL);
+    CHECK(CMPclient_trust_generation(trust) == 1);
+    CHECK((first = CMPclient_trust_get1(trust)) != NULL);
+    CHECK(num_objects(first) == 1);
+    CHECK(CMPclient_prepare(&ctx, NULL, NULL, NULL, first, NULL, NULL, NULL,
+                            NULL, NULL, NULL, NULL, 0, NULL, false) == CMP_OK);
+    CHECK(OSSL_CMP_CTX_get0_trustedStore(ctx) == first);
+
+    CHECK(CMPclient_trust_reload(trust, false) == 0);
+    CHECK(CMPclient_trust_refresh(ctx));
+    CHECK(OSSL_CMP_CTX_get0_trustedStore(ctx) == first);
+
+    /* changed contents yield a new snapshot, picked up on refresh */
+    CHECK(copy_file(data_file("signer.crt"), file));
+    CHECK(CMPclient_trust_reload(trust, false) == 1);
+    CHECK(CMPclient_trust_generation(trust) == 2);
+    CHECK(OSSL_CMP_CTX_get0_trustedStore(ctx) == first);
+    CHECK(CMPclient_trust_refresh(ctx));
+    CHECK((current = CMPclient_trust_get1(trust)) != NULL);
+    CHECK(OSSL_CMP_CTX_get0_trustedStore(ctx) == current);
+    CHECK(num_objects(current) == 3 && num_objects(first) == 1);
+
+    /* a file being rewritten does not replace the snapshot */
+    CHECK((fp = fopen(file, "w")) != NULL && fclose(fp) == 0);
+    CHECK(CMPclient_trust_reload(trust, false) == -1);
+    CHECK(CMPclient_trust_generation(trust) == 2);
+    CHECK(CMPclient_trust_refresh(ctx));
+    CHECK(OSSL_CMP_CTX_get0_trustedStore(ctx) == current);
+
+    /* snapshots stay usable after the handle has been freed */
+    CHECK(copy_file(data_file("root.crt"), file));
+    CHECK(CMPclient_trust_reload(trust, false) == 1);
+    CMPclient_trust_free(trust);
+    trust = NULL;
+    CHECK(CMPclient_trust_refresh(ctx));
+    CHECK(OSSL_CMP_CTX_get0_trustedStore(ctx) == current);
+    X509_STORE_free(current);
+    current = NULL;
+    X509_STORE_free(first);
+    first = NULL;
+    CHECK(CMPclient_trust_refresh(ctx));
+    CHECK(num_objects(OSSL_CMP_CTX_get0_trustedStore(ctx)) == 3);
+    ok = true;
+
+ end:
+    CMPclient_finish(ctx);
+    X509_STORE_free(first);
+    X509_STORE_free(current);
+    CMPclient_trust_free(trust);
+    remove_dir(dir);
+    return ok;
+}
+
+/* a verification time before the certs are valid, ignored for new certs */
+static bool trust_set_past_time(X509_STORE *store, void *arg)
+{
+    (void)arg;
+    X509_VERIFY_PARAM_set_time(X509_STORE_get0_param(store), (time_t)1);
+    return true;
+}
+
+static bool past_time_set(X509_STORE *store)
+{
+    return (X509_VERIFY_PARAM_get_flags(X509_STORE_get0_param(store))
+            & X509_V_FLAG_USE_CHECK_TIME) != 0;
+}
+
+/* certConf of a new cert, as done by OpenSSL within a transaction */
+static bool new_cert_accepted(OSSL_CMP_CTX *ctx, X509 *cert)
+{
+    const char *text = NULL;
+
+    return OSSL_CMP_certConf_cb(ctx, cert, 0, &text) == 0;
+}
+
+static bool test_trust_refresh_new_cert(void)
+{
+    char dir[TEST_PATH_LEN] = "", file[TEST_PATH_LEN];
+    CMPCLIENT_TRUST *trust = NULL;
+    OSSL_CMP_CTX *ctx = NULL;
+    STACK_OF(X509) *certs = NULL;
+    X509_STORE *first = NULL, *in_use = NULL, *held = NULL;
+    bool ok = false;
+
+    CHECK(make_dir(dir, sizeof(dir)));
+    snprintf(file, sizeof(file), "%s", dir_file(dir, "trusted.pem"));
+    CHECK(copy_file(data_file("root.crt"), file));
+    CHECK((certs = CERTS_load(data_file("signer.crt"), "certs", -1,
+                              NULL)) != NULL);
+    CHECK((trust = CMPclient_trust_new(file, "test trust",
+                                       trust_set_past_time, NULL,
+                                       0 /* no watcher */)) != NULL);
+    CHECK((first = CMPclient_trust_get1(trust)) != NULL);
+    CHECK(past_time_set(first));
+
+    /* the context gets a snapshot without verification time */
+    CHECK(CMPclient_prepare(&ctx, NULL, NULL, NULL, NULL, NULL, certs, NULL,
+                            NULL, NULL, NULL, NULL, 0, first,
+                            false) == CMP_OK);
+    CHECK((in_use = OSSL_CMP_CTX_get_certConf_cb_arg(ctx)) != NULL);
+    CHECK(in_use != first && !past_time_set(in_use));
+    CHECK(past_time_set(first)); /* published snapshots are not modified */
+    CHECK(CMPclient_trust_generation(trust) == 2);
+    CHECK(new_cert_accepted(ctx, sk_X509_value(certs, 0)));
+
+    /* reloaded while a transaction in progress holds the snapshot */
+    CHECK(X509_STORE_up_ref(in_use));
+    held = in_use;
+    CHECK(copy_file(data_file("signer.crt"), file));
+    CHECK(CMPclient_trust_reload(trust, false) == 1);
+    CHECK(OSSL_CMP_CTX_get_certConf_cb_arg(ctx) == in_use);
+    CHECK(new_cert_accepted(ctx, sk_X509_value(certs, 0)));
+    CHECK(CMPclient_trust_refresh(ctx));
+    CHECK(OSSL_CMP_CTX_get_certConf_cb_arg(ctx) != in_use);
+    CHECK(num_objects(OSSL_CMP_CTX_get_certConf_cb_arg(ctx)) == 3);
+    CHECK(!past_time_set(OSSL_CMP_CTX_get_certConf_cb_arg(ctx)));
+    CHECK(new_cert_accepted(ctx, sk_X509_value(certs, 0)));
+    CHECK(num_objects(in_use) == 1 && !past_time_set(in_use));
+    ok = true;
+
+ end:
+    CMPclient_finish(ctx);
+    X509_STORE_free(held);
+    X509_STORE_free(first);
+    CMPclient_trust_free(trust);
+    sk_X509_pop_free(certs, X509_free);
+    remove_dir(dir);
+    return ok;
+}
+#endif /* GENCMP_NO_TRUST */
+
+/*
+ * OCSP status of a chain root -> 2 intermediate CAs -> leaf, checked by
+ * CMPclient_ocsp_multi() via the in-process responder of MOCK_OCSP_new(),
+ * which signs with a trusted responder cert or with the key of the issuing CA.
+ */
+#if !defined(GENCMP_NO_CERTSTATUS) && !defined(OPENSSL_NO_OCSP)
+
+static MOCK_OCSP *ocsp_new(int max_ids, int revoked, bool trusted_rsp)
+{
+    return MOCK_OCSP_new("OCSP test", max_ids, revoked, trusted_rsp);
+}
+
+/* returns the verification error, or X509_V_OK */
+static int ocsp_verify(MOCK_OCSP *to, int *depth)
+{
+    X509_STORE_CTX *csc = X509_STORE_CTX_new();
+    int err = X509_V_ERR_UNSPECIFIED;
+
+    if (csc != NULL
+        && X509_STORE_CTX_init(csc, to->store, to->chain[0], to->untrusted)) {
+        (void)X509_verify_cert(csc);
+        err = X509_STORE_CTX_get_error(csc);
+        *depth = X509_STORE_CTX_get_error_depth(csc);
+    }
+    X509_STORE_CTX_free(csc);
+    return err;
+}
+
+static int ocsp_requests(MOCK_OCSP *to)
+{
+    return __atomic_load_n(&to->requests, __ATOMIC_ACQUIRE);
+}
+
+static int ocsp_last_ids(MOCK_OCSP *to)
+{
+    return __atomic_load_n(&to->last_ids, __ATOMIC_ACQUIRE);
+}
+
+static bool test_ocsp_multi(void)
+{
+    MOCK_OCSP *to = NULL;
+    int depth;
+    bool ok = false;
+
+    /* the CertIDs of all certs except the root go into a single request */
+    CHECK((to = ocsp_new(0 /* no limit */, -1 /* none revoked */,
+                         true)) != NULL);
+    CHECK(ocsp_verify(to, &depth) == X509_V_OK);
+    CHECK(ocsp_requests(to) == 1 && ocsp_last_ids(to) == 3);
+
+    /* limiting the CertIDs per request splits the group */
+    CHECK(CMPclient_ocsp_multi(to->store, true, NULL, -1, 2));
+    CHECK(ocsp_verify(to, &depth) == X509_V_OK);
+    CHECK(ocsp_requests(to) == 3 && ocsp_last_ids(to) == 1);
+    CHECK(CMPclient_ocsp_multi(to->store, true, NULL, -1, 1));
+    CHECK(ocsp_verify(to, &depth) == X509_V_OK);
+    CHECK(ocsp_requests(to) == 6);
+    MOCK_OCSP_free(to);
+    to = NULL;
+
+    /* the SingleResponses are distributed to the certs they belong to */
+    CHECK((to = ocsp_new(0, 1 /* sub CA */, true)) != NULL);
+    CHECK(ocsp_verify(to, &depth) == X509_V_ERR_CERT_REVOKED && depth == 1);
+    CHECK(ocsp_requests(to) == 1);
+    ok = true;
+
+ end:
+    MOCK_OCSP_free(to);
+    return ok;
+}
+
+static bool test_ocsp_ca_signed(void)
+{
+    MOCK_OCSP *to = NULL;
+    int depth;
+    bool ok = false;
+
+    /* without a trusted responder, each issuer gets its own request */
+    CHECK((to = ocsp_new(0 /* no limit */, -1 /* none revoked */,
+                         false)) != NULL);
+    CHECK(ocsp_verify(to, &depth) == X509_V_OK);
+    CHECK(ocsp_requests(to) == 3 && ocsp_last_ids(to) == 1);
+    CHECK(CMPclient_ocsp_cache(to->store, 16));
+    CHECK(ocsp_verify(to, &depth) == X509_V_OK);
+    CHECK(ocsp_verify(to, &depth) == X509_V_OK);
+    CHECK(ocsp_requests(to) == 6);
+    MOCK_OCSP_free(to);
+    to = NULL;
+
+    CHECK((to = ocsp_new(0, 1 /* sub CA */, false)) != NULL);
+    CHECK(ocsp_verify(to, &depth) == X509_V_ERR_CERT_REVOKED && depth == 1);
+    CHECK(ocsp_requests(to) == 3);
+    ok = true;
+
+ end:
+    MOCK_OCSP_free(to);
+    return ok;
+}
+
+static bool test_ocsp_cache(void)
+{
+    MOCK_OCSP *to = NULL;
+    int depth;
+    bool ok = false;
+
+    CHECK((to = ocsp_new(0 /* no limit */, -1 /* none revoked */,
+                         true)) != NULL);
+    CHECK(CMPclient_ocsp_cache(to->store, 16));
+    CHECK(ocsp_verify(to, &depth) == X509_V_OK);
+    CHECK(ocsp_requests(to) == 1 && ocsp_last_ids(to) == 3);
+    /* the status of all chain certs is known until nextUpdate */
+    CHECK(ocsp_verify(to, &depth) == X509_V_OK);
+    CHECK(ocsp_requests(to) == 1);
+
+    /* the cache survives reconfiguration, but can be dropped */
+    CHECK(CMPclient_ocsp_multi(to->store, true, NULL, -1, 0));
+    CHECK(ocsp_verify(to, &depth) == X509_V_OK);
+    CHECK(ocsp_requests(to) == 1);
+    CHECK(CMPclient_ocsp_cache(to->store, 0));
+    CHECK(ocsp_verify(to, &depth) == X509_V_OK);
+    CHECK(ocsp_requests(to) == 2);
+
+    /* responses without nextUpdate are not kept */
+    __atomic_store_n(&to->no_next_update, 1, __ATOMIC_RELEASE);
+    CHECK(CMPclient_ocsp_cache(to->store, 16));
+    CHECK(ocsp_verify(to, &depth) == X509_V_OK);
+    CHECK(ocsp_verify(to, &depth) == X509_V_OK);
+    CHECK(ocsp_requests(to) == 4 && ocsp_last_ids(to) == 3);
+
+    /* the size limit is respected */
+    __atomic_store_n(&to->no_next_update, 0, __ATOMIC_RELEASE);
+    CHECK(CMPclient_ocsp_cache(to->store, 0) && CMPclient_ocsp_cache(to->store, 2));
+    CHECK(ocsp_verify(to, &depth) == X509_V_OK);
+    CHECK(ocsp_verify(to, &depth) == X509_V_OK);
+    CHECK(ocsp_requests(to) == 6 && ocsp_last_ids(to) == 1);
+    ok = true;
+
+ end:
+    MOCK_OCSP_free(to);
+    return ok;
+}
+#endif /* !defined(GENCMP_NO_CERTSTATUS) && !defined(OPENSSL_NO_OCSP) */
+
+typedef bool (*test_fn_t)(void);
+
+typedef struct test_st {
+    const char *name;
+    test_fn_t run;
+} TEST;
+
+static const TEST tests[] = {
+#ifndef GENCMP_NO_LOG
+    { "log_async_dropped", test_log_async_dropped },
+#endif
+#ifndef GENCMP_NO_ALLOC
+    { "alloc_phase_restored", test_alloc_phase_restored },
+    { "alloc_free_phase", test_alloc_free_phase },
+#endif
+    { "dercache_equivalence", test_dercache_equivalence },
+    { "certs_add_nodup", test_certs_add_nodup },
+    { "certs_mem_roundtrip", test_certs_mem_roundtrip },
+    { "certs_mem_der_pkcs7", test_certs_mem_der_pkcs7 },
+    { "req_template", test_req_template },
+#ifndef GENCMP_NO_HTTP
+    { "dns_fallback_expiry", test_dns_fallback_expiry },
+    { "rate_limit_throttle", test_rate_limit_throttle },
+    { "retry_after_pause", test_retry_after_pause },
+#endif
+#ifndef GENCMP_NO_SPOOL
+    { "spool_roundtrip", test_spool_roundtrip },
+#endif
+#if !defined(GENCMP_NO_ENGINE) && !defined(GENCMP_NO_ALLOC)
+    { "engine_job_state", test_engine_job_state },
+#endif
+#ifndef GENCMP_NO_TRUST
+    { "trust_reload", test_trust_reload },
+    { "trust_refresh_new_cert", test_trust_refresh_new_cert },
+#endif
+#if !defined(GENCMP_NO_CERTSTATUS) && !defined(OPENSSL_NO_OCSP)
+    { "ocsp_multi", test_ocsp_multi },
+    { "ocsp_ca_signed", test_ocsp_ca_signed },
+    { "ocsp_cache", test_ocsp_cache },
+#endif
+};
+
+#define NUM_TESTS ((int)(sizeof(tests) / sizeof(tests[0])))
+
+static void print_help(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] [test name...]\n"
+            "Options:\n"
+            "  -datadir <dir>     test input files, default: %s\n"
+            "  -verbosity <level> log level, default: %d\n"
+            "  -mock_server <file> cmpMockServer executable for transport tests\n"
+            "  -list              list available tests\n",
+            prog, TEST_DEFAULT_DATADIR, LOG_WARNING);
+}
+
+/* returns the index of the first test name, or 0 on error */
+static int parse_args(int argc, char *argv[], bool *list)
+{
+    int i;
+
+    for (i = 1; i < argc && *argv[i] == '-'; i++) {
+        const char *arg = argv[i];
+
+        if (*arg == '-' && arg[1] == '-')
+            arg++;
+        if (strcmp(arg, "-list") == 0) {
+            *list = true;
+            continue;
+        }
+        if (strcmp(arg, "-help") == 0 || i + 1 >= argc)
+            return 0;
+        if (strcmp(arg, "-datadir") == 0)
+            opt_datadir = argv[++i];
+        else if (strcmp(arg, "-verbosity") == 0)
+            opt_verbosity = UTIL_atoint(argv[++i]);
+        else if (strcmp(arg, "-mock_server") == 0)
+            opt_mock_server = argv[++i];
+        else
+            return 0;
+    }
+    return opt_verbosity >= LOG_EMERG && opt_verbosity <= LOG_TRACE ? i : 0;
+}
+
+static const TEST *find_test(const char *name)
+{
+    int i;
+
+    for (i = 0; i < NUM_TESTS; i++)
+        if (strcmp(tests[i].name, name) == 0)
+            return &tests[i];
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    bool list = false;
+    int first, i, failed = 0;
+
+    if ((first = parse_args(argc, argv, &list)) == 0) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (list) {
+        for (i = 0; i < NUM_TESTS; i++)
+            printf("%s\n", tests[i].name);
+        return EXIT_SUCCESS;
+    }
+#ifndef GENCMP_NO_ALLOC
+    /* before any allocation via OpenSSL; also exercises the hooks in all tests */
+    if (CMPclient_alloc_stats_enable(false) != CMP_OK)
+        return EXIT_FAILURE;
+#endif
+    if (CMPclient_init("cmpApiTest", NULL) != CMP_OK)
+        return EXIT_FAILURE;
+    CMPclient_log_set_verbosity((severity)opt_verbosity);
+
+    for (i = first == argc ? 0 : first; i < (first == argc ? NUM_TESTS : argc);
+         i++) {
+        const TEST *test = first == argc ? &tests[i] : find_test(argv[i]);
+        const char *name = first == argc ? tests[i].name : argv[i];
+        bool ok = test != NULL && (*test->run)();
+
+        if (test == NULL)
+            LOG(FL_ERR, "Unknown test '%s'", name);
+        printf("%s - %s\n", ok ? "ok" : "not ok", name);
+        if (!ok) {
+            OSSL_CMP_CTX_print_errors(NULL);
+            failed++;
+        }
+        ERR_clear_error(); /* of any failures provoked by passed tests */
+    }
+    CMPclient_finish(NULL);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,2030 @@
+/*-
+ * @file   cmpBench.c
+ * @brief  micro and macro benchmarks of the generic CMP client API
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <openssl/conf.h>
+#include <openssl/x509v3.h>
+
+#include "genericCMPClient.h"
+#include "mockCA.h"
+#include "mockOCSP.h"
+
+/*
+ * All CMP transactions are served by an in-process mock CA via a transfer
+ * callback, such that results do not depend on network or server load.
+ * Each benchmark is run for a number of warm-up iterations not measured,
+ * followed by the given number of measured iterations. The median is the
+ * figure compared against any baseline, since it is least sensitive to noise.
+ */
+
+#define BENCH_DEFAULT_ITERATIONS 100
+#define BENCH_DEFAULT_WARMUP 5
+#define BENCH_DEFAULT_TOLERANCE 10 /* percent */
+#define BENCH_DEFAULT_DATADIR "test/recipes/80-test_cmp_http_data/Mock"
+#define BENCH_SUBJECT "/C=AU/ST=Some-State/O=Internet Widgits Pty Ltd/CN=leaf"
+#define BENCH_RECIPIENT "/O=openssl_cmp"
+#define BENCH_SECRET "test"
+#define BENCH_SECRET_REF "bench"
+#define BENCH_PATH_LEN 512
+#define BENCH_CONNS 64 /* concurrent transactions for rtt_*_64 */
+#define BENCH_DEFAULT_KEYSPECS \
+    "EC:prime256v1,EC:secp384r1,EC:secp521r1,RSA:2048,RSA:3072"
+#define BENCH_DEFAULT_DIGESTS "sha256,sha384,sha512"
+#define BENCH_DEFAULT_MACS "hmac-sha1,hmacWithSHA256"
+
+static const char *opt_datadir = BENCH_DEFAULT_DATADIR;
+static const char *opt_filter = NULL;
+static const char *opt_out = NULL;
+static const char *opt_baseline = NULL;
+static long opt_iterations = BENCH_DEFAULT_ITERATIONS;
+static long opt_warmup = BENCH_DEFAULT_WARMUP;
+static long opt_tolerance = BENCH_DEFAULT_TOLERANCE;
+static long opt_alloc_stats = 0;
+static long opt_verbosity = LOG_WARNING;
+static const char *opt_mock_server = NULL;
+static const char *opt_keyspecs = BENCH_DEFAULT_KEYSPECS;
+static const char *opt_digests = BENCH_DEFAULT_DIGESTS;
+static const char *opt_macs = BENCH_DEFAULT_MACS;
+
+typedef struct bench_env_st {
+    MOCK_CA_OPTS mock_opts;
+    MOCK_CA *mock;
+    CREDENTIALS *creds; /* PBM-based */
+    EVP_PKEY *new_key;
+    X509 *ref_cert;
+    X509_STORE *chain_trust;
+    STACK_OF(X509) *chain_untrusted;
+    X509 *enrolled; /* result of an initial enrollment */
+    OSSL_CMP_CTX *ctx; /* for those benchmarks that reuse a context */
+    char cache_dir[BENCH_PATH_LEN]; /* scratch copy of inputs for DER cache */
+    STACK_OF(X509) *synth_certs; /* each of them contained twice */
+    char *mem_inputs[4]; /* contents of prepare_files */
+    pid_t server_pid; /* of cmpMockServer, or 0 */
+    char server[BENCH_PATH_LEN]; /* its address as given in its ACCEPT line */
+    OSSL_CMP_CTX *ctxs[BENCH_CONNS]; /* for concurrent transactions */
+    CMPCLIENT_ENGINE *engine;
+    CMPCLIENT_SPOOL *spool;
+    char spool_dir[BENCH_PATH_LEN];
+    int server_max_rate; /* for the next mock server started, 0 for none */
+    CMPCLIENT_TRUST *trust;
+    CONF *reqexts_conf;
+    struct mock_ocsp_st *ocsp;
+    MOCK_CA *signing_mock; /* signing its responses with srv_cert */
+    OSSL_CMP_MSG *rsp; /* captured signature-protected response */
+} BENCH_ENV;
+
+typedef bool (*bench_fn_t)(BENCH_ENV *env);
+
+typedef struct bench_st {
+    const char *name;
+    const char *kind; /* "micro" or "macro" */
+    bench_fn_t setup; /* may be NULL */
+    bench_fn_t run; /* one iteration */
+    bench_fn_t teardown; /* may be NULL */
+} BENCH;
+
+typedef struct bench_result_st {
+    const char *name;
+    const char *kind;
+    long iterations;
+    double min_us, median_us, mean_us, p95_us, max_us;
+    double cpu_us; /* mean user + system time of the process */
+    unsigned long connects; /* to the mock server, including warm-up */
+    CMPCLIENT_ALLOC_STATS alloc[CMPCLIENT_PHASE_NUM];
+} BENCH_RESULT;
+
+static const char *dir_file(const char *dir, const char *name)
+{
+    static char path[BENCH_PATH_LEN];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return path;
+}
+
+static const char *data_file(const char *name)
+{
+    return dir_file(opt_datadir, name);
+}
+
+static bool load_env(BENCH_ENV *env)
+{
+    MOCK_CA_OPTS *opts = &env->mock_opts;
+    const char *desc = "benchmark input";
+
+    memset(env, 0, sizeof(*env));
+    opts->srv_secret = BENCH_SECRET;
+    opts->no_check_time = true;
+    opts->no_cache_extracerts = true;
+    opts->verbosity = (int)opt_verbosity;
+    if ((opts->srv_cert = CERT_load(data_file("server.crt"), NULL, desc,
+                                    -1 /* no type check */, NULL)) == NULL
+        || (opts->srv_key = KEY_load(data_file("server.key"), NULL,
+                                     NULL /* engine */, desc)) == NULL
+        || (opts->srv_trusted = STORE_load(data_file("signer_root.crt"),
+                                           desc, NULL)) == NULL
+        || (opts->rsp_cert = CERT_load(data_file("signer_only.crt"), NULL,
+                                       desc, -1, NULL)) == NULL
+        || (opts->rsp_extracerts = CERTS_load(data_file("signer_issuing.crt"),
+                                              desc, -1, NULL)) == NULL
+        || (opts->rsp_capubs = CERTS_load(data_file("server.crt"),
+                                          desc, -1, NULL)) == NULL)
+        return false;
+    if (!X509_up_ref(opts->rsp_cert))
+        return false;
+    opts->ref_cert = env->ref_cert = opts->rsp_cert;
+    if ((env->mock = MOCK_CA_new(NULL, NULL, opts, 1)) == NULL)
+        return false;
+
+    /* the mock CA always returns the same cert, so the key must match it */
+    if ((env->new_key = KEY_load(data_file("signer.key"), NULL,
+                                 NULL, desc)) == NULL
+        || (env->creds = CREDENTIALS_new(NULL, NULL, NULL, BENCH_SECRET,
+                                         BENCH_SECRET_REF)) == NULL)
+        return false;
+
+    if ((env->chain_trust = STORE_load(data_file("signer_root.crt"),
+                                       desc, NULL)) == NULL
+        || (env->chain_untrusted = CERTS_load(data_file("signer_issuing.crt"),
+                                              desc, -1, NULL)) == NULL)
+        return false;
+    return true;
+}
+
+static void free_env(BENCH_ENV *env)
+{
+    MOCK_CA_OPTS *opts = &env->mock_opts;
+
+    CMPclient_finish(env->ctx);
+    X509_free(env->enrolled);
+    sk_X509_pop_free(env->chain_untrusted, X509_free);
+    X509_STORE_free(env->chain_trust);
+    CREDENTIALS_free(env->creds);
+    EVP_PKEY_free(env->new_key);
+    X509_free(env->ref_cert);
+    MOCK_CA_free(env->mock);
+    X509_free(opts->srv_cert);
+    EVP_PKEY_free(opts->srv_key);
+    X509_STORE_free(opts->srv_trusted);
+    X509_free(opts->rsp_cert);
+    sk_X509_pop_free(opts->rsp_extracerts, X509_free);
+    sk_X509_pop_free(opts->rsp_capubs, X509_free);
+}
+
+static OSSL_CMP_CTX *new_ctx(BENCH_ENV *env)
+{
+    OSSL_CMP_CTX *ctx = NULL;
+
+    if (CMPclient_prepare(&ctx, NULL /* libctx */, NULL /* propq */,
+                          NULL /* log_fn */, NULL /* cmp_truststore */,
+                          BENCH_RECIPIENT, NULL /* untrusted */, env->creds,
+                          NULL /* creds_truststore */, NULL /* digest */,
+                          NULL /* mac */, MOCK_CA_transfer_cb,
+                          0 /* total_timeout */, NULL /* new_cert_truststore */,
+                          false /* implicit_confirm */) != CMP_OK)
+        return NULL;
+    if (!OSSL_CMP_CTX_set_log_verbosity(ctx, (int)opt_verbosity)
+        || !OSSL_CMP_CTX_set_transfer_cb_arg(ctx, env->mock)) {
+        CMPclient_finish(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static bool setup_ctx(BENCH_ENV *env)
+{
+    return (env->ctx = new_ctx(env)) != NULL;
+}
+
+static bool teardown_ctx(BENCH_ENV *env)
+{
+    CMPclient_finish(env->ctx);
+    env->ctx = NULL;
+    return true;
+}
+
+static bool run_prepare(BENCH_ENV *env)
+{
+    OSSL_CMP_CTX *ctx = new_ctx(env);
+
+    CMPclient_finish(ctx);
+    return ctx != NULL;
+}
+
+/* signature-based credentials, compare loading from files and from memory */
+static const char *const prepare_files[] = {
+    "signer.key", "signer_only.crt", "signer_issuing.crt", "signer_root.crt"
+};
+#define PREPARE_FILES_NUM (sizeof(prepare_files) / sizeof(prepare_files[0]))
+
+static bool prepare_creds(BENCH_ENV *env, EVP_PKEY *key, STACK_OF(X509) *certs,
+                          STACK_OF(X509) *untrusted, X509_STORE *trusted)
+{
+    CREDENTIALS *creds = NULL;
+    OSSL_CMP_CTX *ctx = NULL;
+    bool ok = key != NULL && certs != NULL && untrusted != NULL
+        && trusted != NULL
+        && (creds = CREDENTIALS_new(key, sk_X509_value(certs, 0), NULL,
+                                    NULL, NULL)) != NULL
+        && CMPclient_prepare(&ctx, NULL, NULL, NULL, trusted, NULL, untrusted,
+                             creds, trusted, NULL, NULL, MOCK_CA_transfer_cb,
+                             0, NULL, false) == CMP_OK;
+
+    (void)env;
+    CMPclient_finish(ctx);
+    CREDENTIALS_free(creds);
+    return ok;
+}
+
+static bool run_prepare_from_files(BENCH_ENV *env)
+{
+    const char *desc = "benchmark input";
+    EVP_PKEY *key = KEY_load(data_file(prepare_files[0]), NULL, NULL, desc);
+    STACK_OF(X509) *certs = CERTS_load(data_file(prepare_files[1]),
+                                       desc, -1, NULL);
+    STACK_OF(X509) *untrusted = CERTS_load(data_file(prepare_files[2]),
+                                           desc, -1, NULL);
+    X509_STORE *trusted = STORE_load(data_file(prepare_files[3]), desc, NULL);
+    bool ok = prepare_creds(env, key, certs, untrusted, trusted);
+
+    X509_STORE_free(trusted);
+    sk_X509_pop_free(untrusted, X509_free);
+    sk_X509_pop_free(certs, X509_free);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+static char *read_file(const char *file);
+
+static bool setup_prepare_from_mem(BENCH_ENV *env)
+{
+    size_t i;
+
+    for (i = 0; i < PREPARE_FILES_NUM; i++)
+        if ((env->mem_inputs[i] = read_file(data_file(prepare_files[i])))
+            == NULL)
+            return false;
+    return true;
+}
+
+static bool run_prepare_from_mem(BENCH_ENV *env)
+{
+    CMPCLIENT_MEM mem[PREPARE_FILES_NUM];
+    OSSL_CMP_CTX *ctx = NULL;
+    size_t i;
+    bool ok;
+
+    for (i = 0; i < PREPARE_FILES_NUM; i++) {
+        mem[i].data = (const unsigned char *)env->mem_inputs[i];
+        mem[i].len = strlen(env->mem_inputs[i]);
+    }
+    ok = CMPclient_prepare_from_mem(&ctx, NULL, NULL, NULL, &mem[3], NULL,
+                                    &mem[2], &mem[0], NULL, &mem[1],
+                                    NULL, NULL, &mem[3], NULL, NULL,
+                                    MOCK_CA_transfer_cb, 0, NULL,
+                                    false) == CMP_OK;
+    CMPclient_finish(ctx);
+    return ok;
+}
+
+static bool teardown_prepare_from_mem(BENCH_ENV *env)
+{
+    size_t i;
+
+    for (i = 0; i < PREPARE_FILES_NUM; i++) {
+        OPENSSL_free(env->mem_inputs[i]);
+        env->mem_inputs[i] = NULL;
+    }
+    return true;
+}
+
+static bool run_setup_HTTP(BENCH_ENV *env)
+{
+    return CMPclient_setup_HTTP(env->ctx, "127.0.0.1:1700", "pkix/",
+                                1 /* keep_alive */, 0 /* timeout */,
+                                NULL /* tls */, NULL /* proxy */,
+                                NULL /* no_proxy */) == CMP_OK;
+}
+
+static bool run_imprint(BENCH_ENV *env)
+{
+    CREDENTIALS *new_creds = NULL;
+    CMP_err err = CMPclient_imprint(env->ctx, &new_creds, env->new_key,
+                                    BENCH_SUBJECT, NULL /* exts */);
+
+    CREDENTIALS_free(new_creds);
+    return err == CMP_OK && CMPclient_reinit(env->ctx) == CMP_OK;
+}
+
+/*
+ * Enrollments with the same extensions and issuer but varying subjects,
+ * where the extensions are given in a config section as with -reqexts.
+ * The imprint_reqexts variant parses them for each enrollment like the CLI,
+ * while imprint_template uses a request template precompiled once.
+ */
+#define REQEXTS_SECTION "reqexts"
+#define REQEXTS_ISSUER "/CN=issuer"
+#define REQEXTS_SUBJECTS 16
+
+static const char reqexts_conf_text[] =
+    "[" REQEXTS_SECTION "]\n"
+    "basicConstraints = critical, CA:FALSE\n"
+    "keyUsage = critical, digitalSignature, keyEncipherment\n"
+    "extendedKeyUsage = clientAuth, serverAuth\n"
+    "subjectAltName = DNS:device.example.com, IP:192.168.0.1\n"
+    "certificatePolicies = 1.3.6.1.4.1.4329.38.4.1.1\n";
+
+static int reqexts_subject_num = 0;
+
+static const char *next_subject(void)
+{
+    static char subject[sizeof(BENCH_SUBJECT) + 8];
+
+    snprintf(subject, sizeof(subject), "%s-%d", BENCH_SUBJECT,
+             reqexts_subject_num++ % REQEXTS_SUBJECTS);
+    return subject;
+}
+
+static bool setup_reqexts(BENCH_ENV *env)
+{
+    BIO *bio = BIO_new_mem_buf(reqexts_conf_text, -1);
+
+    if (bio == NULL || (env->reqexts_conf = NCONF_new(NULL)) == NULL
+        || NCONF_load_bio(env->reqexts_conf, bio, NULL) <= 0) {
+        BIO_free(bio);
+        return false;
+    }
+    BIO_free(bio);
+    return setup_ctx(env);
+}
+
+static bool teardown_reqexts(BENCH_ENV *env)
+{
+    NCONF_free(env->reqexts_conf);
+    env->reqexts_conf = NULL;
+    return teardown_ctx(env);
+}
+
+static X509_EXTENSIONS *load_reqexts(BENCH_ENV *env)
+{
+    X509_EXTENSIONS *exts = sk_X509_EXTENSION_new_null();
+    X509V3_CTX ext_ctx;
+
+    if (exts == NULL)
+        return NULL;
+    X509V3_set_ctx(&ext_ctx, NULL, NULL, NULL, NULL, 0);
+    X509V3_set_nconf(&ext_ctx, env->reqexts_conf);
+    if (!X509V3_EXT_add_nconf_sk(env->reqexts_conf, &ext_ctx, REQEXTS_SECTION,
+                                 &exts)) {
+        sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+        return NULL;
+    }
+    return exts;
+}
+
+static bool run_imprint_reqexts(BENCH_ENV *env)
+{
+    CREDENTIALS *new_creds = NULL;
+    X509_EXTENSIONS *exts = load_reqexts(env);
+    X509_NAME *issuer = UTIL_parse_name(REQEXTS_ISSUER, MBSTRING_ASC, false);
+    CMP_err err = CMP_R_INVALID_PARAMETERS;
+
+    if (exts != NULL && issuer != NULL
+        && OSSL_CMP_CTX_set1_issuer(env->ctx, issuer))
+        err = CMPclient_imprint(env->ctx, &new_creds, env->new_key,
+                                next_subject(), exts);
+    X509_NAME_free(issuer);
+    sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+    CREDENTIALS_free(new_creds);
+    return err == CMP_OK && CMPclient_reinit(env->ctx) == CMP_OK;
+}
+
+static bool setup_imprint_template(BENCH_ENV *env)
+{
+    CMPCLIENT_REQ_TEMPLATE *tmpl = NULL;
+    X509_EXTENSIONS *exts;
+    bool ok;
+
+    if (!setup_reqexts(env) || (exts = load_reqexts(env)) == NULL)
+        return false;
+    tmpl = CMPclient_req_template_new(REQEXTS_ISSUER, exts, NULL /* sans */,
+                                      false, NULL /* policies */, false);
+    ok = tmpl != NULL
+        && CMPclient_setup_certreq_template(env->ctx, tmpl) == CMP_OK;
+    CMPclient_req_template_free(tmpl);
+    sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+    return ok;
+}
+
+static bool run_imprint_template(BENCH_ENV *env)
+{
+    CREDENTIALS *new_creds = NULL;
+    CMP_err err = CMPclient_imprint(env->ctx, &new_creds, env->new_key,
+                                    next_subject(), NULL /* exts */);
+
+    CREDENTIALS_free(new_creds);
+    return err == CMP_OK && CMPclient_reinit(env->ctx) == CMP_OK;
+}
+
+static bool run_update(BENCH_ENV *env)
+{
+    CREDENTIALS *new_creds = NULL;
+    CMP_err err = CMPclient_update_anycert(env->ctx, &new_creds,
+                                           env->ref_cert, env->new_key);
+
+    CREDENTIALS_free(new_creds);
+    return err == CMP_OK && CMPclient_reinit(env->ctx) == CMP_OK;
+}
+
+static bool run_revoke(BENCH_ENV *env)
+{
+    return CMPclient_revoke(env->ctx, env->ref_cert, CRL_REASON_NONE) == CMP_OK
+        && CMPclient_reinit(env->ctx) == CMP_OK;
+}
+
+#if (OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP) \
+    && !defined GENCMP_NO_GENM
+static bool run_caCerts(BENCH_ENV *env)
+{
+    STACK_OF(X509) *certs = NULL;
+    CMP_err err = CMPclient_caCerts(env->ctx, &certs);
+
+    sk_X509_pop_free(certs, X509_free);
+    return err == CMP_OK && CMPclient_reinit(env->ctx) == CMP_OK;
+}
+#endif
+
+static const char *const big_files[] = {
+    "big_root.crt", "big_issuing.crt", "big_trusted.crt", "big_server.crt"
+};
+#define BIG_FILES_NUM (sizeof(big_files) / sizeof(big_files[0]))
+
+static bool load_big(const char *dir)
+{
+    size_t i;
+
+    for (i = 0; i < BIG_FILES_NUM; i++) {
+        X509_STORE *store = STORE_load(dir_file(dir, big_files[i]),
+                                       "big certs", NULL);
+
+        if (store == NULL)
+            return false;
+        X509_STORE_free(store);
+    }
+    return true;
+}
+
+static bool run_STORE_load_big(BENCH_ENV *env)
+{
+    (void)env;
+    return load_big(opt_datadir);
+}
+
+/* the DER cache files are created during warm-up, outside the data dir */
+static bool setup_dercache(BENCH_ENV *env)
+{
+    char src[BENCH_PATH_LEN];
+    size_t i;
+    bool ok = true;
+
+    snprintf(env->cache_dir, sizeof(env->cache_dir), "%s",
+             dir_file(getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp",
+                      "cmpBench_XXXXXX"));
+    if (mkdtemp(env->cache_dir) == NULL) {
+        env->cache_dir[0] = '\0';
+        return false;
+    }
+    for (i = 0; ok && i < BIG_FILES_NUM; i++) {
+        BIO *in, *out;
+        char buf[4096];
+        int n;
+
+        snprintf(src, sizeof(src), "%s", data_file(big_files[i]));
+        in = BIO_new_file(src, "rb");
+        out = BIO_new_file(dir_file(env->cache_dir, big_files[i]), "wb");
+        ok = in != NULL && out != NULL;
+        while (ok && (n = BIO_read(in, buf, (int)sizeof(buf))) > 0)
+            ok = BIO_write(out, buf, n) == n;
+        BIO_free(in);
+        BIO_free(out);
+    }
+    CMPclient_dercache_enable(true);
+    return ok;
+}
+
+static bool run_STORE_load_big_dercache(BENCH_ENV *env)
+{
+    return load_big(env->cache_dir);
+}
+
+static bool teardown_dercache(BENCH_ENV *env)
+{
+    char cache[BENCH_PATH_LEN];
+    size_t i;
+
+    CMPclient_dercache_enable(false);
+    if (env->cache_dir[0] == '\0')
+        return true;
+    for (i = 0; i < BIG_FILES_NUM; i++) {
+        snprintf(cache, sizeof(cache), "%s.dercache",
+                 dir_file(env->cache_dir, big_files[i]));
+        (void)remove(cache);
+        (void)remove(dir_file(env->cache_dir, big_files[i]));
+    }
+    (void)remove(env->cache_dir);
+    env->cache_dir[0] = '\0';
+    return true;
+}
+
+static bool setup_build_chain(BENCH_ENV *env)
+{
+    CREDENTIALS *new_creds = NULL;
+
+    if (!setup_ctx(env))
+        return false;
+    if (CMPclient_imprint(env->ctx, &new_creds, env->new_key,
+                          BENCH_SUBJECT, NULL) != CMP_OK)
+        return false;
+    env->enrolled = CREDENTIALS_get_cert(new_creds);
+    if (env->enrolled != NULL && !X509_up_ref(env->enrolled))
+        env->enrolled = NULL;
+    CREDENTIALS_free(new_creds);
+    return env->enrolled != NULL;
+}
+
+static bool run_build_chain(BENCH_ENV *env)
+{
+    STACK_OF(X509) *chain = X509_build_chain(env->enrolled,
+                                             env->chain_untrusted,
+                                             env->chain_trust,
+                                             0 /* with_self_signed */,
+                                             NULL, NULL);
+    bool ok = sk_X509_num(chain) > 1;
+
+    sk_X509_pop_free(chain, X509_free);
+    return ok;
+}
+
+static bool teardown_build_chain(BENCH_ENV *env)
+{
+    X509_free(env->enrolled);
+    env->enrolled = NULL;
+    return teardown_ctx(env);
+}
+
+/*
+ * Validation of a signature-protected response as done for the first
+ * response of each transaction, with the server cert set via
+ * OSSL_CMP_CTX_set1_srvCert() or found and validated via a CMP trust
+ * store holding it among further trusted certs, as typical for CA bundles.
+ * The response is an rp captured once from a mock CA signing its responses.
+ */
+static OSSL_CMP_MSG *captured_rsp = NULL;
+
+static OSSL_CMP_MSG *capture_transfer_cb(OSSL_CMP_CTX *ctx,
+                                         const OSSL_CMP_MSG *req)
+{
+    OSSL_CMP_MSG *rsp = MOCK_CA_transfer_cb(ctx, req);
+
+    if (rsp != NULL && captured_rsp == NULL)
+        captured_rsp = OSSL_CMP_MSG_dup(rsp);
+    return rsp;
+}
+
+static bool teardown_validate_rsp(BENCH_ENV *env)
+{
+    (void)teardown_ctx(env);
+    MOCK_CA_free(env->signing_mock);
+    env->signing_mock = NULL;
+    OSSL_CMP_MSG_free(env->rsp);
+    env->rsp = NULL;
+    return true;
+}
+
+static bool setup_validate_rsp(BENCH_ENV *env, bool pinned)
+{
+    MOCK_CA_OPTS opts = env->mock_opts;
+    X509_STORE *ts = NULL;
+    bool ok = false;
+
+    opts.srv_secret = NULL;
+    opts.accept_unprotected = true;
+    if ((env->signing_mock = MOCK_CA_new(NULL, NULL, &opts, 1)) == NULL
+        || (!pinned
+            && ((ts = STORE_load(data_file("big_trusted.crt"),
+                                 "bench trust store", NULL)) == NULL
+                || !X509_STORE_add_cert(ts, opts.srv_cert)
+                /* like the mock CA, ignore that the test cert has expired */
+                || !X509_VERIFY_PARAM_set_flags(X509_STORE_get0_param(ts),
+                                                X509_V_FLAG_NO_CHECK_TIME)))
+        || CMPclient_prepare(&env->ctx, NULL, NULL, NULL, ts, BENCH_RECIPIENT,
+                             NULL, NULL /* creds */, NULL, NULL, NULL,
+                             capture_transfer_cb, 0, NULL, false) != CMP_OK
+        || !OSSL_CMP_CTX_set_log_verbosity(env->ctx, (int)opt_verbosity)
+        || !OSSL_CMP_CTX_set_transfer_cb_arg(env->ctx, env->signing_mock)
+        || !OSSL_CMP_CTX_set_option(env->ctx, OSSL_CMP_OPT_UNPROTECTED_SEND, 1)
+        || (pinned && !OSSL_CMP_CTX_set1_srvCert(env->ctx, opts.srv_cert)))
+        goto end;
+    captured_rsp = NULL;
+    ok = CMPclient_revoke(env->ctx, env->ref_cert, CRL_REASON_NONE) == CMP_OK
+        && (env->rsp = captured_rsp) != NULL;
+
+ end:
+    X509_STORE_free(ts);
+    if (!ok)
+        (void)teardown_validate_rsp(env);
+    return ok;
+}
+
+static bool setup_validate_rsp_pinned(BENCH_ENV *env)
+{
+    return setup_validate_rsp(env, true);
+}
+
+static bool setup_validate_rsp_trusted(BENCH_ENV *env)
+{
+    return setup_validate_rsp(env, false);
+}
+
+static bool run_validate_rsp(BENCH_ENV *env)
+{
+    /* forgets the server cert validated for the previous transaction */
+    return OSSL_CMP_CTX_reinit(env->ctx)
+        && OSSL_CMP_validate_msg(env->ctx, env->rsp);
+}
+
+/*
+ * Synthetic lists of distinct certs, each of them contained twice,
+ * as may result from merging extraCerts and caPubs of many responses.
+ * The certs are DER-decoded such that they look like received ones.
+ */
+static X509 *synth_cert(EVP_PKEY *key, long serial)
+{
+    X509 *cert = X509_new(), *res = NULL;
+    X509_NAME *name = X509_NAME_new();
+    char cn[32];
+    unsigned char *der = NULL;
+    const unsigned char *p;
+    int len;
+
+    snprintf(cn, sizeof(cn), "synthetic %ld", serial);
+    if (cert != NULL && name != NULL
+        && X509_set_version(cert, 2)
+        && ASN1_INTEGER_set(X509_get_serialNumber(cert), serial)
+        && X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                      (const unsigned char *)cn, -1, -1, 0)
+        && X509_set_subject_name(cert, name)
+        && X509_set_issuer_name(cert, name)
+        && X509_gmtime_adj(X509_getm_notBefore(cert), 0) != NULL
+        && X509_gmtime_adj(X509_getm_notAfter(cert), 86400) != NULL
+        && X509_set_pubkey(cert, key)
+        && X509_sign(cert, key, EVP_sha256()) > 0
+        && (len = i2d_X509(cert, &der)) > 0) {
+        p = der;
+        res = d2i_X509(NULL, &p, len);
+    }
+    OPENSSL_free(der);
+    X509_NAME_free(name);
+    X509_free(cert);
+    return res;
+}
+
+static bool setup_dedup(BENCH_ENV *env, int num)
+{
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY *key = NULL;
+    int i;
+    bool ok = false;
+
+    if (pctx == NULL || EVP_PKEY_keygen_init(pctx) <= 0
+        || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx,
+                                                  NID_X9_62_prime256v1) <= 0
+        || EVP_PKEY_keygen(pctx, &key) <= 0
+        || (env->synth_certs = sk_X509_new_reserve(NULL, 2 * num)) == NULL)
+        goto end;
+    for (i = 0; i < num; i++) {
+        X509 *cert = synth_cert(key, i + 1);
+
+        if (cert == NULL)
+            goto end;
+        (void)sk_X509_push(env->synth_certs, cert);
+    }
+    /* add duplicates in reverse order, such that they are spread out */
+    for (i = num - 1; i >= 0; i--) {
+        X509 *cert = sk_X509_value(env->synth_certs, i);
+
+        if (!X509_up_ref(cert))
+            goto end;
+        (void)sk_X509_push(env->synth_certs, cert);
+    }
+    ok = true;
+
+ end:
+    EVP_PKEY_free(key);
+    EVP_PKEY_CTX_free(pctx);
+    return ok;
+}
+
+static bool setup_dedup_1k(BENCH_ENV *env)
+{
+    return setup_dedup(env, 1000);
+}
+
+static bool setup_dedup_10k(BENCH_ENV *env)
+{
+    return setup_dedup(env, 10000);
+}
+
+static bool check_dedup(BENCH_ENV *env, STACK_OF(X509) *res)
+{
+    bool ok = 2 * sk_X509_num(res) == sk_X509_num(env->synth_certs);
+
+    sk_X509_pop_free(res, X509_free);
+    return ok;
+}
+
+static bool run_dedup(BENCH_ENV *env)
+{
+    STACK_OF(X509) *res = sk_X509_new_null();
+
+    if (res != NULL
+        && !CERTS_add_nodup(res, env->synth_certs, X509_ADD_FLAG_UP_REF)) {
+        sk_X509_pop_free(res, X509_free);
+        return false;
+    }
+    return check_dedup(env, res);
+}
+
+/* the pairwise comparison previously used, for reference */
+static bool run_dedup_pairwise(BENCH_ENV *env)
+{
+    STACK_OF(X509) *res = sk_X509_new_null();
+
+    if (res != NULL
+        && !X509_add_certs(res, env->synth_certs,
+                           X509_ADD_FLAG_UP_REF | X509_ADD_FLAG_NO_DUP)) {
+        sk_X509_pop_free(res, X509_free);
+        return false;
+    }
+    return check_dedup(env, res);
+}
+
+static bool teardown_dedup(BENCH_ENV *env)
+{
+    sk_X509_pop_free(env->synth_certs, X509_free);
+    env->synth_certs = NULL;
+    return true;
+}
+
+/*
+ * Contexts holding a reloadable trust store switching to its current snapshot
+ * at the start of each transaction, by TRUST_THREADS threads with a context
+ * each, without and with a full reload of the store running concurrently,
+ * which should slow down the switching only by competing for the CPU.
+ */
+#define TRUST_THREADS 32
+#define TRUST_REFRESHES_PER_THREAD 2000
+
+static bool setup_trust(BENCH_ENV *env)
+{
+    int i;
+
+    if ((env->trust = CMPclient_trust_new(data_file("big_trusted.crt"),
+                                          "bench trust", NULL, NULL,
+                                          0 /* no watcher */)) == NULL)
+        return false;
+    for (i = 0; i < TRUST_THREADS; i++) {
+        X509_STORE *store;
+
+        if ((env->ctxs[i] = new_ctx(env)) == NULL
+            || (store = CMPclient_trust_get1(env->trust)) == NULL)
+            return false;
+        if (!OSSL_CMP_CTX_set0_trustedStore(env->ctxs[i], store)) {
+            X509_STORE_free(store);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool teardown_trust(BENCH_ENV *env)
+{
+    int i;
+
+    for (i = 0; i < TRUST_THREADS; i++) {
+        CMPclient_finish(env->ctxs[i]);
+        env->ctxs[i] = NULL;
+    }
+    CMPclient_trust_free(env->trust);
+    env->trust = NULL;
+    return true;
+}
+
+static void *trust_refresh_worker(void *arg)
+{
+    OSSL_CMP_CTX *ctx = arg;
+    int i;
+
+    for (i = 0; i < TRUST_REFRESHES_PER_THREAD; i++)
+        if (!CMPclient_trust_refresh(ctx))
+            return NULL;
+    return arg;
+}
+
+static void *trust_reload_worker(void *arg)
+{
+    return CMPclient_trust_reload(arg, true /* force */) == 1 ? arg : NULL;
+}
+
+static bool run_trust_refresh(BENCH_ENV *env, bool reload)
+{
+    pthread_t threads[TRUST_THREADS + 1];
+    int i, started;
+    bool ok;
+
+    started = 0;
+    if (reload && pthread_create(&threads[started++], NULL,
+                                 trust_reload_worker, env->trust) != 0)
+        return false;
+    for (i = 0; i < TRUST_THREADS; i++, started++)
+        if (pthread_create(&threads[started], NULL, trust_refresh_worker,
+                           env->ctxs[i]) != 0)
+            break;
+    ok = i == TRUST_THREADS;
+    for (i = 0; i < started; i++) {
+        void *res = NULL;
+
+        if (pthread_join(threads[i], &res) != 0 || res == NULL)
+            ok = false;
+    }
+    /* all contexts must have ended up with the latest snapshot */
+    for (i = 0; ok && i < TRUST_THREADS; i++) {
+        X509_STORE *store = CMPclient_trust_get1(env->trust);
+
+        ok = CMPclient_trust_refresh(env->ctxs[i])
+            && store == OSSL_CMP_CTX_get0_trustedStore(env->ctxs[i]);
+        X509_STORE_free(store);
+    }
+    return ok;
+}
+
+static bool run_trust_refresh_32t(BENCH_ENV *env)
+{
+    return run_trust_refresh(env, false);
+}
+
+static bool run_trust_refresh_32t_reload(BENCH_ENV *env)
+{
+    return run_trust_refresh(env, true);
+}
+
+/*
+ * OCSP status checks of a chain root -> 2 intermediate CAs -> leaf
+ * with -check_all semantics, answered by an in-process responder thread
+ * on loopback for all three certs. The responder signs with a cert issued
+ * by the root, which is explicitly trusted for OCSP signing, as needed for
+ * merging CertIDs of different issuers into a request.
+ * ocsp_chain_grouped sends one request holding all CertIDs, while
+ * ocsp_chain_per_cert limits requests to one CertID, as without grouping.
+ * The number of requests made is reported as connects.
+ */
+#if !defined(GENCMP_NO_CERTSTATUS) && !defined(OPENSSL_NO_OCSP)
+static bool teardown_ocsp_chain(BENCH_ENV *env)
+{
+    MOCK_OCSP_free(env->ocsp);
+    env->ocsp = NULL;
+    return true;
+}
+
+static bool setup_ocsp_chain(BENCH_ENV *env, int max_ids)
+{
+    env->ocsp = MOCK_OCSP_new("OCSP bench", max_ids, -1 /* none revoked */,
+                              true /* trusted responder */);
+    return env->ocsp != NULL;
+}
+
+static bool setup_ocsp_chain_grouped(BENCH_ENV *env)
+{
+    return setup_ocsp_chain(env, 0 /* no limit */);
+}
+
+static bool setup_ocsp_chain_per_cert(BENCH_ENV *env)
+{
+    return setup_ocsp_chain(env, 1);
+}
+
+static bool run_ocsp_chain(BENCH_ENV *env)
+{
+    X509_STORE_CTX *csc = X509_STORE_CTX_new();
+    bool ok = csc != NULL
+        && X509_STORE_CTX_init(csc, env->ocsp->store, env->ocsp->chain[0],
+                               env->ocsp->untrusted)
+        && X509_verify_cert(csc) > 0;
+
+    X509_STORE_CTX_free(csc);
+    return ok;
+}
+#endif /* !defined(GENCMP_NO_CERTSTATUS) && !defined(OPENSSL_NO_OCSP) */
+
+/*
+ * Round trips via the local mock server, started as a separate process,
+ * comparing loopback TCP with a Unix domain socket as used for co-located RAs.
+ * The *_connect variants open a new connection for each transaction,
+ * while the others keep it alive. Each transaction is a single rr/rp.
+ */
+static bool start_mock_server(BENCH_ENV *env, bool use_unix, int threads)
+{
+    char srv_cert[BENCH_PATH_LEN], srv_key[BENCH_PATH_LEN];
+    char ref_cert[BENCH_PATH_LEN], sock[BENCH_PATH_LEN], line[BENCH_PATH_LEN];
+    char threads_arg[16], rate_arg[16], *end;
+    const char *argv[24];
+    int fds[2];
+    FILE *in;
+    pid_t pid;
+    bool ok;
+
+    snprintf(srv_cert, sizeof(srv_cert), "%s", data_file("server.crt"));
+    snprintf(srv_key, sizeof(srv_key), "%s", data_file("server.key"));
+    snprintf(ref_cert, sizeof(ref_cert), "%s", data_file("signer_only.crt"));
+    snprintf(sock, sizeof(sock), "/tmp/cmpBench-%d.sock", (int)getpid());
+    snprintf(threads_arg, sizeof(threads_arg), "%d", threads);
+    snprintf(rate_arg, sizeof(rate_arg), "%d", env->server_max_rate);
+    if (pipe(fds) != 0)
+        return false;
+    if ((pid = fork()) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        int n = 0;
+
+        argv[n++] = opt_mock_server;
+        argv[n++] = "-srv_secret";
+        argv[n++] = "pass:" BENCH_SECRET;
+        argv[n++] = "-srv_cert";
+        argv[n++] = srv_cert;
+        argv[n++] = "-srv_key";
+        argv[n++] = srv_key;
+        argv[n++] = "-ref_cert";
+        argv[n++] = ref_cert;
+        argv[n++] = "-rsp_cert";
+        argv[n++] = ref_cert;
+        argv[n++] = "-no_check_time";
+        argv[n++] = "-threads";
+        argv[n++] = threads_arg;
+        argv[n++] = use_unix ? "-unix" : "-port";
+        argv[n++] = use_unix ? sock : "0";
+        if (env->server_max_rate > 0) {
+            argv[n++] = "-max_rate";
+            argv[n++] = rate_arg;
+        }
+        argv[n] = NULL;
+        (void)dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv(opt_mock_server, (char *const *)argv);
+        _exit(127);
+    }
+    close(fds[1]);
+    env->server_pid = pid;
+    if ((in = fdopen(fds[0], "r")) == NULL) {
+        close(fds[0]);
+        return false;
+    }
+    ok = fgets(line, sizeof(line), in) != NULL
+        && strncmp(line, "ACCEPT ", 7) == 0
+        && (end = strstr(line, " PID=")) != NULL;
+    fclose(in);
+    if (!ok) {
+        LOG(FL_ERR, "Cannot start mock server '%s'", opt_mock_server);
+        return false;
+    }
+    *end = '\0';
+    snprintf(env->server, sizeof(env->server), "%s", line + 7);
+    return (env->ctx = new_ctx(env)) != NULL
+        && CMPclient_setup_transport(env->ctx, env->server, "pkix/",
+                                     1 /* keep_alive */, 0 /* timeout */,
+                                     NULL /* tls */, NULL /* proxy */,
+                                     NULL /* no_proxy */) == CMP_OK;
+}
+
+static bool setup_rtt_tcp(BENCH_ENV *env)
+{
+    return start_mock_server(env, false, 1);
+}
+
+static bool setup_rtt_unix(BENCH_ENV *env)
+{
+    return start_mock_server(env, true, 1);
+}
+
+/* without TCP_NODELAY, showing the delay caused by Nagle's algorithm */
+static bool setup_rtt_tcp_nagle(BENCH_ENV *env)
+{
+    CMPCLIENT_TRANSPORT_OPTS opts;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.nagle = true;
+    return start_mock_server(env, false, 1)
+        && CMPclient_set_transport_opts(env->ctx, &opts) == CMP_OK;
+}
+
+static bool teardown_rtt(BENCH_ENV *env)
+{
+    (void)teardown_ctx(env);
+    if (env->server_pid > 0) {
+        (void)kill(env->server_pid, SIGTERM);
+        (void)waitpid(env->server_pid, NULL, 0);
+    }
+    env->server_pid = 0;
+    if (strncmp(env->server, "unix:", 5) == 0)
+        (void)unlink(env->server + 5);
+    env->server[0] = '\0';
+    return true;
+}
+
+static bool run_rtt(BENCH_ENV *env)
+{
+    return CMPclient_revoke(env->ctx, env->ref_cert, CRL_REASON_NONE) == CMP_OK
+        && OSSL_CMP_CTX_reinit(env->ctx); /* keeps the connection */
+}
+
+static bool run_rtt_connect(BENCH_ENV *env)
+{
+    return run_revoke(env); /* CMPclient_reinit() closes the connection */
+}
+
+/*
+ * BENCH_CONNS rr transactions at a time with a server thread for each,
+ * either multiplexed by the engine on a single thread or with a thread each.
+ * The number of connections kept alive is the same in both cases.
+ */
+static X509 *rr_ref_cert; /* shared by all concurrent transactions */
+
+static bool setup_rtt_64(BENCH_ENV *env, int flags)
+{
+    int i;
+
+    rr_ref_cert = env->ref_cert;
+    if (!start_mock_server(env, false, BENCH_CONNS))
+        return false;
+    for (i = 0; i < BENCH_CONNS; i++)
+        if ((env->ctxs[i] = new_ctx(env)) == NULL
+            || CMPclient_setup_transport(env->ctxs[i], env->server, "pkix/",
+                                         1 /* keep_alive */, 0 /* timeout */,
+                                         NULL /* tls */, NULL /* proxy */,
+                                         NULL /* no_proxy */) != CMP_OK)
+            return false;
+    if (flags < 0)
+        return true;
+    if ((env->engine = CMPclient_engine_new(BENCH_CONNS, flags)) == NULL)
+        return false;
+    LOG(FL_INFO, "Engine backend: %s", CMPclient_engine_backend(env->engine));
+    return true;
+}
+
+static bool setup_rtt_engine_64(BENCH_ENV *env)
+{
+    return setup_rtt_64(env, 0);
+}
+
+static bool setup_rtt_epoll_64(BENCH_ENV *env)
+{
+    return setup_rtt_64(env, CMPCLIENT_ENGINE_EPOLL);
+}
+
+static bool setup_rtt_threads_64(BENCH_ENV *env)
+{
+    return setup_rtt_64(env, -1);
+}
+
+static bool teardown_rtt_64(BENCH_ENV *env)
+{
+    int i;
+
+    for (i = 0; i < BENCH_CONNS; i++) {
+        CMPclient_finish(env->ctxs[i]);
+        env->ctxs[i] = NULL;
+    }
+    CMPclient_engine_free(env->engine);
+    env->engine = NULL;
+    return teardown_rtt(env);
+}
+
+static CMP_err rr_job(void *arg)
+{
+    OSSL_CMP_CTX *ctx = arg;
+    CMP_err err = CMPclient_revoke(ctx, rr_ref_cert, CRL_REASON_NONE);
+
+    if (err == CMP_OK && !OSSL_CMP_CTX_reinit(ctx))
+        err = CMP_R_INVALID_CONTEXT;
+    return err;
+}
+
+static void *rr_worker(void *arg)
+{
+    return rr_job(arg) == CMP_OK ? arg : NULL;
+}
+
+static int rr_failed;
+
+static void rr_done(void *arg, CMP_err err)
+{
+    (void)arg;
+    if (err != CMP_OK)
+        rr_failed++;
+}
+
+static bool run_rtt_engine_64(BENCH_ENV *env)
+{
+    unsigned long done = CMPclient_engine_jobs_done(env->engine);
+    int i;
+
+    rr_failed = 0;
+    for (i = 0; i < BENCH_CONNS; i++)
+        if (CMPclient_engine_submit(env->engine, rr_job, env->ctxs[i],
+                                    rr_done) != CMP_OK)
+            return false;
+    return CMPclient_engine_run(env->engine) == CMP_OK && rr_failed == 0
+        && CMPclient_engine_jobs_done(env->engine) == done + BENCH_CONNS;
+}
+
+/*
+ * BENCH_CONNS rr transactions queued to a spool by engine jobs, and a further
+ * job forwarding whatever has been queued in batches of one connection each
+ */
+#define SPOOL_POLL_MS 5
+
+static bool setup_spool_64(BENCH_ENV *env)
+{
+    int i;
+
+    rr_ref_cert = env->ref_cert;
+    snprintf(env->spool_dir, sizeof(env->spool_dir), "/tmp/cmpBench-spool-%d",
+             (int)getpid());
+    if (!start_mock_server(env, false, 1)
+        || (env->spool = CMPclient_spool_new(env->spool_dir,
+                                             SPOOL_POLL_MS)) == NULL)
+        return false;
+    for (i = 0; i < BENCH_CONNS; i++)
+        if ((env->ctxs[i] = new_ctx(env)) == NULL
+            || CMPclient_setup_spool(env->ctxs[i], env->spool,
+                                     0 /* timeout */) != CMP_OK)
+            return false;
+    return (env->engine = CMPclient_engine_new(BENCH_CONNS + 1, 0)) != NULL;
+}
+
+static bool teardown_spool_64(BENCH_ENV *env)
+{
+    char dir[BENCH_PATH_LEN + 4];
+
+    (void)teardown_rtt_64(env);
+    CMPclient_spool_free(env->spool);
+    env->spool = NULL;
+    if (env->spool_dir[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s/in", env->spool_dir);
+        (void)rmdir(dir);
+        snprintf(dir, sizeof(dir), "%s/out", env->spool_dir);
+        (void)rmdir(dir);
+        (void)rmdir(env->spool_dir);
+        env->spool_dir[0] = '\0';
+    }
+    return true;
+}
+
+static int spool_forwarded;
+
+static CMP_err spool_forward_job(void *arg)
+{
+    BENCH_ENV *env = arg;
+    CMP_err err = CMP_OK;
+    int num;
+
+    while (err == CMP_OK && spool_forwarded < BENCH_CONNS) {
+        (void)CMPclient_engine_wait(-1, 0, SPOOL_POLL_MS);
+        err = CMPclient_spool_forward(env->ctx, env->spool_dir, &num);
+        spool_forwarded += num;
+    }
+    return err;
+}
+
+static bool run_spool_64(BENCH_ENV *env)
+{
+    int i;
+
+    rr_failed = 0;
+    spool_forwarded = 0;
+    for (i = 0; i < BENCH_CONNS; i++)
+        if (CMPclient_engine_submit(env->engine, rr_job, env->ctxs[i],
+                                    rr_done) != CMP_OK)
+            return false;
+    return CMPclient_engine_submit(env->engine, spool_forward_job, env,
+                                   rr_done) == CMP_OK
+        && CMPclient_engine_run(env->engine) == CMP_OK && rr_failed == 0;
+}
+
+/*
+ * As rtt_engine_64, but against a mock server answering requests beyond
+ * BENCH_SERVER_RATE per second with 503 and Retry-After, without and with
+ * a client-side rate limit of 90% of that
+ */
+#define BENCH_SERVER_RATE 500
+#define BENCH_BURST 16
+
+static bool setup_overload_64(BENCH_ENV *env, double rate)
+{
+    CMPCLIENT_RATE_LIMIT limit;
+    bool ok;
+
+    env->server_max_rate = BENCH_SERVER_RATE;
+    ok = setup_rtt_64(env, 0);
+    env->server_max_rate = 0;
+    memset(&limit, 0, sizeof(limit));
+    limit.rate = rate;
+    limit.burst = BENCH_BURST;
+    /* applies to all contexts since they are for the same server */
+    return ok && CMPclient_set_rate_limit(env->ctxs[0], rate > 0 ? &limit
+                                          : NULL) == CMP_OK;
+}
+
+static bool setup_overload_64_unlimited(BENCH_ENV *env)
+{
+    return setup_overload_64(env, 0);
+}
+
+static bool setup_overload_64_limited(BENCH_ENV *env)
+{
+    return setup_overload_64(env, BENCH_SERVER_RATE * 0.9);
+}
+
+static bool run_rtt_threads_64(BENCH_ENV *env)
+{
+    pthread_t threads[BENCH_CONNS];
+    int i, started;
+    bool ok;
+
+    for (started = 0; started < BENCH_CONNS; started++)
+        if (pthread_create(&threads[started], NULL, rr_worker,
+                           env->ctxs[started]) != 0)
+            break;
+    ok = started == BENCH_CONNS;
+    for (i = 0; i < started; i++) {
+        void *res = NULL;
+
+        if (pthread_join(threads[i], &res) != 0 || res == NULL)
+            ok = false;
+    }
+    return ok;
+}
+
+static const BENCH benches[] = {
+    { "prepare_finish", "micro", NULL, run_prepare, NULL },
+    { "prepare_from_files", "micro", NULL, run_prepare_from_files, NULL },
+    { "prepare_from_mem", "micro", setup_prepare_from_mem,
+      run_prepare_from_mem, teardown_prepare_from_mem },
+    { "setup_HTTP", "micro", setup_ctx, run_setup_HTTP, teardown_ctx },
+    { "imprint", "macro", setup_ctx, run_imprint, teardown_ctx },
+    { "imprint_reqexts", "macro", setup_reqexts, run_imprint_reqexts,
+      teardown_reqexts },
+    { "imprint_template", "macro", setup_imprint_template,
+      run_imprint_template, teardown_reqexts },
+    { "update", "macro", setup_ctx, run_update, teardown_ctx },
+    { "revoke", "macro", setup_ctx, run_revoke, teardown_ctx },
+#if (OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP) \
+    && !defined GENCMP_NO_GENM
+    { "caCerts", "macro", setup_ctx, run_caCerts, teardown_ctx },
+#endif
+    { "validate_rsp_pinned", "micro", setup_validate_rsp_pinned,
+      run_validate_rsp, teardown_validate_rsp },
+    { "validate_rsp_trusted", "micro", setup_validate_rsp_trusted,
+      run_validate_rsp, teardown_validate_rsp },
+    { "STORE_load_big", "micro", NULL, run_STORE_load_big, NULL },
+    { "STORE_load_big_dercache", "micro", setup_dercache,
+      run_STORE_load_big_dercache, teardown_dercache },
+    { "build_chain", "micro", setup_build_chain, run_build_chain,
+      teardown_build_chain },
+    { "dedup_1k", "micro", setup_dedup_1k, run_dedup, teardown_dedup },
+    { "dedup_1k_pairwise", "micro", setup_dedup_1k, run_dedup_pairwise,
+      teardown_dedup },
+    { "dedup_10k", "micro", setup_dedup_10k, run_dedup, teardown_dedup },
+    /* no 10k pairwise variant since it would take seconds per iteration */
+    { "trust_refresh_32t", "micro", setup_trust, run_trust_refresh_32t,
+      teardown_trust },
+    { "trust_refresh_32t_reload", "micro", setup_trust,
+      run_trust_refresh_32t_reload, teardown_trust },
+#if !defined(GENCMP_NO_CERTSTATUS) && !defined(OPENSSL_NO_OCSP)
+    { "ocsp_chain_grouped", "macro", setup_ocsp_chain_grouped, run_ocsp_chain,
+      teardown_ocsp_chain },
+    { "ocsp_chain_per_cert", "macro", setup_ocsp_chain_per_cert,
+      run_ocsp_chain, teardown_ocsp_chain },
+#endif
+    /* these need -mock_server */
+    { "rtt_tcp", "macro", setup_rtt_tcp, run_rtt, teardown_rtt },
+    { "rtt_unix", "macro", setup_rtt_unix, run_rtt, teardown_rtt },
+    { "rtt_tcp_nagle", "macro", setup_rtt_tcp_nagle, run_rtt, teardown_rtt },
+    { "rtt_tcp_connect", "macro", setup_rtt_tcp, run_rtt_connect,
+      teardown_rtt },
+    { "rtt_unix_connect", "macro", setup_rtt_unix, run_rtt_connect,
+      teardown_rtt },
+    { "rtt_engine_64", "macro", setup_rtt_engine_64, run_rtt_engine_64,
+      teardown_rtt_64 },
+    { "rtt_epoll_64", "macro", setup_rtt_epoll_64, run_rtt_engine_64,
+      teardown_rtt_64 },
+    { "rtt_threads_64", "macro", setup_rtt_threads_64, run_rtt_threads_64,
+      teardown_rtt_64 },
+    { "spool_64", "macro", setup_spool_64, run_spool_64, teardown_spool_64 },
+    { "overload_64", "macro", setup_overload_64_unlimited, run_rtt_engine_64,
+      teardown_rtt_64 },
+    { "overload_64_limited", "macro", setup_overload_64_limited,
+      run_rtt_engine_64, teardown_rtt_64 },
+};
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+static double cpu_time_us(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+    return (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6
+        + (double)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+/* number of connections made to the mock server, if any */
+static unsigned long server_connects(const BENCH_ENV *env)
+{
+    CMPCLIENT_ENDPOINT_STATS stats;
+    char host[BENCH_PATH_LEN], *port;
+
+#if !defined(GENCMP_NO_CERTSTATUS) && !defined(OPENSSL_NO_OCSP)
+    if (env->ocsp != NULL)
+        return (unsigned long)__atomic_load_n(&env->ocsp->requests,
+                                              __ATOMIC_ACQUIRE);
+#endif
+    if (strncmp(env->server, "unix:", 5) == 0)
+        return CMPclient_endpoint_stats_get(env->server + 5, "", &stats)
+            ? stats.connects : 0;
+    snprintf(host, sizeof(host), "%s", env->server);
+    if ((port = strrchr(host, ':')) == NULL)
+        return 0;
+    *port++ = '\0';
+    return CMPclient_endpoint_stats_get(host, port, &stats)
+        ? stats.connects : 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static bool run_bench(BENCH_ENV *env, const BENCH *b, BENCH_RESULT *res)
+{
+    double *samples, sum = 0, cpu_start;
+    long i;
+    int phase;
+    bool ok = false;
+
+    memset(res, 0, sizeof(*res));
+    res->name = b->name;
+    res->kind = b->kind;
+    res->iterations = opt_iterations;
+    if ((samples = OPENSSL_malloc((size_t)opt_iterations
+                                  * sizeof(*samples))) == NULL)
+        return false;
+    if (b->setup != NULL && !(*b->setup)(env)) {
+        LOG(FL_ERR, "Setup of benchmark '%s' failed", b->name);
+        goto end;
+    }
+    for (i = 0; i < opt_warmup; i++)
+        if (!(*b->run)(env))
+            goto failed;
+
+    CMPclient_alloc_stats_reset();
+    cpu_start = cpu_time_us();
+    for (i = 0; i < opt_iterations; i++) {
+        double start;
+
+        /* API functions switch phases themselves, anything else is 'other' */
+        (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_OTHER);
+        start = now_us();
+        if (!(*b->run)(env))
+            goto failed;
+        samples[i] = now_us() - start;
+        sum += samples[i];
+    }
+    res->cpu_us = (cpu_time_us() - cpu_start) / (double)opt_iterations;
+    res->connects = server_connects(env);
+    for (phase = 0; phase < CMPCLIENT_PHASE_NUM; phase++)
+        CMPclient_alloc_stats_get(phase, &res->alloc[phase]);
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_OTHER);
+
+    qsort(samples, (size_t)opt_iterations, sizeof(*samples), cmp_double);
+    res->min_us = samples[0];
+    res->max_us = samples[opt_iterations - 1];
+    res->median_us = samples[opt_iterations / 2];
+    res->p95_us = samples[(opt_iterations * 95) / 100];
+    res->mean_us = sum / (double)opt_iterations;
+    ok = true;
+    goto end;
+
+ failed:
+    LOG(FL_ERR, "Benchmark '%s' failed in iteration %ld", b->name, i);
+ end:
+    if (b->teardown != NULL)
+        (void)(*b->teardown)(env);
+    OPENSSL_free(samples);
+    return ok;
+}
+
+static void print_json(FILE *out, const BENCH_RESULT *results, int num)
+{
+    int i, phase;
+
+    fprintf(out, "{\n  \"suite\": \"cmpBench\",\n");
+    fprintf(out, "  \"openssl\": \"%s\",\n", OpenSSL_version(OPENSSL_VERSION));
+    fprintf(out, "  \"iterations\": %ld,\n  \"warmup\": %ld,\n",
+            opt_iterations, opt_warmup);
+    fprintf(out, "  \"results\": [");
+    for (i = 0; i < num; i++) {
+        const BENCH_RESULT *r = &results[i];
+        const char *sep = "";
+
+        fprintf(out, "%s\n    { \"name\": \"%s\", \"kind\": \"%s\","
+                " \"iterations\": %ld,\n", i > 0 ? "," : "",
+                r->name, r->kind, r->iterations);
+        fprintf(out, "      \"min_us\": %.2f, \"median_us\": %.2f,"
+                " \"mean_us\": %.2f, \"p95_us\": %.2f, \"max_us\": %.2f,"
+                " \"cpu_us\": %.2f",
+                r->min_us, r->median_us, r->mean_us, r->p95_us, r->max_us,
+                r->cpu_us);
+        if (r->connects > 0)
+            fprintf(out, ", \"connects\": %lu", r->connects);
+        if (CMPclient_alloc_stats_enabled()) {
+            fprintf(out, ",\n      \"alloc_per_op\": {");
+            for (phase = 0; phase < CMPCLIENT_PHASE_NUM; phase++) {
+                const CMPCLIENT_ALLOC_STATS *st = &r->alloc[phase];
+
+                if (st->allocs == 0)
+                    continue;
+                fprintf(out, "%s \"%s\": { \"allocs\": %lu, \"bytes\": %lu,"
+                        " \"peak\": %ld }", sep,
+                        CMPclient_alloc_phase_name(phase),
+                        st->allocs / (unsigned long)r->iterations,
+                        (unsigned long)st->bytes_allocated
+                        / (unsigned long)r->iterations, st->bytes_peak);
+                sep = ",";
+            }
+            fprintf(out, " }");
+        }
+        fprintf(out, " }");
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+/* minimal scan of JSON as produced by print_json() */
+static bool baseline_median(const char *json, const char *name, double *median)
+{
+    char key[128];
+    const char *p, *next;
+
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+    if ((p = strstr(json, key)) == NULL)
+        return false;
+    next = strstr(p + 1, "\"name\":");
+    if ((p = strstr(p, "\"median_us\":")) == NULL
+        || (next != NULL && p > next))
+        return false;
+    *median = strtod(p + strlen("\"median_us\":"), NULL);
+    return *median > 0;
+}
+
+static char *read_file(const char *file)
+{
+    BIO *bio = BIO_new_file(file, "r");
+    BIO *mem = BIO_new(BIO_s_mem());
+    char buf[4096], *res = NULL;
+    int len;
+
+    if (bio == NULL || mem == NULL)
+        goto end;
+    while ((len = BIO_read(bio, buf, sizeof(buf))) > 0)
+        if (BIO_write(mem, buf, len) != len)
+            goto end;
+    if (BIO_write(mem, "", 1) != 1)
+        goto end;
+    len = (int)BIO_get_mem_data(mem, &res);
+    res = OPENSSL_strndup(res, (size_t)len);
+ end:
+    BIO_free(bio);
+    BIO_free(mem);
+    return res;
+}
+
+/* returns the number of regressions, or -1 on error */
+static int compare_baseline(const BENCH_RESULT *results, int num)
+{
+    char *json = read_file(opt_baseline);
+    int i, regressions = 0;
+
+    if (json == NULL) {
+        LOG(FL_ERR, "Cannot read baseline file '%s'", opt_baseline);
+        return -1;
+    }
+    for (i = 0; i < num; i++) {
+        double base, change;
+
+        if (!baseline_median(json, results[i].name, &base)) {
+            LOG(FL_WARN, "%-16s no baseline", results[i].name);
+            continue;
+        }
+        change = (results[i].median_us - base) * 100.0 / base;
+        if (change > (double)opt_tolerance) {
+            LOG(FL_ERR, "%-16s median %.2f us vs. %.2f us: %+.1f%% REGRESSION",
+                results[i].name, results[i].median_us, base, change);
+            regressions++;
+        } else {
+            LOG(FL_INFO, "%-16s median %.2f us vs. %.2f us: %+.1f%%",
+                results[i].name, results[i].median_us, base, change);
+        }
+    }
+    OPENSSL_free(json);
+    return regressions;
+}
+
+/*
+ * Algorithm cost matrix: for each key spec as with -newkeytype, and each
+ * signature-based (with digest) or PBM-based (with MAC) protection, an ir with
+ * implicit confirmation is done via CMPclient_imprint() against a mock CA
+ * using the same key type and algorithm for protecting its responses.
+ * The time up to the request reaching the transfer callback is split into
+ * POPO signing and message protection by repeating the enrollment with
+ * POPO raVerified and additionally without protection, each difference of
+ * medians giving the cost of the part left out. Response verification is the
+ * time from the response being returned by the mock CA to the end of the
+ * enrollment. Keys are generated with KEY_new() like for -newkeytype.
+ */
+#define MATRIX_KEYGEN_ITERATIONS 10
+#define MATRIX_MAX_ROWS 128
+#define MATRIX_SUBJECT "/CN=matrix device"
+
+typedef struct matrix_row_st {
+    char keyspec[32];
+    char protection[48];
+    double keygen_us;
+    double popo_us, protect_us, verify_us, total_us;
+    int req_bytes, rsp_bytes;
+} MATRIX_ROW;
+
+enum matrix_variant { MATRIX_FULL, MATRIX_RAVERIFIED, MATRIX_UNPROTECTED };
+
+static double matrix_req_at, matrix_rsp_at; /* set by matrix_transfer_cb */
+static int matrix_req_bytes, matrix_rsp_bytes;
+
+static OSSL_CMP_MSG *matrix_transfer_cb(OSSL_CMP_CTX *ctx,
+                                        const OSSL_CMP_MSG *req)
+{
+    OSSL_CMP_MSG *rsp;
+
+    matrix_req_at = now_us();
+    rsp = MOCK_CA_transfer_cb(ctx, req);
+    matrix_req_bytes = i2d_OSSL_CMP_MSG(req, NULL);
+    matrix_rsp_bytes = rsp == NULL ? 0 : i2d_OSSL_CMP_MSG(rsp, NULL);
+    matrix_rsp_at = now_us();
+    return rsp;
+}
+
+/* self-signed, as far as needed for the mock CA and the pinned srvcert */
+static X509 *matrix_cert(EVP_PKEY *key, const char *cn, const char *digest)
+{
+    X509 *cert = X509_new();
+    X509_NAME *name = X509_NAME_new();
+    const EVP_MD *md = digest == NULL ? EVP_sha256()
+        : EVP_get_digestbyname(digest);
+
+    if (cert == NULL || name == NULL || md == NULL
+        || !X509_set_version(cert, 2)
+        || !ASN1_INTEGER_set(X509_get_serialNumber(cert), 1)
+        || !X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                       (const unsigned char *)cn, -1, -1, 0)
+        || !X509_set_subject_name(cert, name)
+        || !X509_set_issuer_name(cert, name)
+        || X509_gmtime_adj(X509_getm_notBefore(cert), 0) == NULL
+        || X509_gmtime_adj(X509_getm_notAfter(cert), 86400) == NULL
+        || !X509_set_pubkey(cert, key)
+        || X509_sign(cert, key, md) <= 0) {
+        X509_free(cert);
+        cert = NULL;
+    }
+    X509_NAME_free(name);
+    return cert;
+}
+
+static double median_of(double *samples, long num)
+{
+    qsort(samples, (size_t)num, sizeof(*samples), cmp_double);
+    return samples[num / 2];
+}
+
+/* fills in the times for the given variant; returns false on error */
+static bool matrix_run(OSSL_CMP_CTX *ctx, EVP_PKEY *key,
+                       enum matrix_variant variant, MATRIX_ROW *row,
+                       double *req_us)
+{
+    double *verify = OPENSSL_malloc((size_t)opt_iterations * sizeof(double));
+    double *total = OPENSSL_malloc((size_t)opt_iterations * sizeof(double));
+    long i;
+    bool ok = verify != NULL && total != NULL
+        && OSSL_CMP_CTX_set_option(ctx, OSSL_CMP_OPT_POPO_METHOD,
+                                   variant == MATRIX_FULL
+                                   ? OSSL_CRMF_POPO_SIGNATURE
+                                   : OSSL_CRMF_POPO_RAVERIFIED)
+        && OSSL_CMP_CTX_set_option(ctx, OSSL_CMP_OPT_UNPROTECTED_SEND,
+                                   variant == MATRIX_UNPROTECTED);
+
+    for (i = -opt_warmup; ok && i < opt_iterations; i++) {
+        CREDENTIALS *new_creds = NULL;
+        double start = now_us(), end;
+
+        ok = CMPclient_imprint(ctx, &new_creds, key, MATRIX_SUBJECT,
+                               NULL /* exts */) == CMP_OK;
+        end = now_us();
+        CREDENTIALS_free(new_creds);
+        ok = CMPclient_reinit(ctx) == CMP_OK && ok;
+        if (i >= 0) {
+            req_us[i] = matrix_req_at - start;
+            verify[i] = end - matrix_rsp_at;
+            total[i] = end - start - (matrix_rsp_at - matrix_req_at);
+        }
+    }
+    if (ok && variant == MATRIX_FULL) {
+        row->verify_us = median_of(verify, opt_iterations);
+        row->total_us = median_of(total, opt_iterations);
+        row->req_bytes = matrix_req_bytes;
+        row->rsp_bytes = matrix_rsp_bytes;
+    }
+    OPENSSL_free(verify);
+    OPENSSL_free(total);
+    return ok;
+}
+
+/* digest is NULL for PBM-based protection using mac */
+static bool matrix_row(EVP_PKEY *key, const char *digest, const char *mac,
+                       MATRIX_ROW *row)
+{
+    MOCK_CA_OPTS opts;
+    MOCK_CA *mock = NULL;
+    EVP_PKEY *srv_key = NULL;
+    X509 *srv_cert = NULL, *cert = matrix_cert(key, "matrix device", digest);
+    X509_STORE *srv_trusted = X509_STORE_new();
+    CREDENTIALS *creds = NULL;
+    OSSL_CMP_CTX *ctx = NULL;
+    double *req[3] = { NULL, NULL, NULL }, med[3];
+    int v;
+    bool ok = false;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.srv_secret = digest == NULL ? BENCH_SECRET : NULL;
+    opts.digest = digest;
+    opts.mac = mac;
+    opts.rsp_cert = cert; /* must match the enrolled key */
+    opts.srv_trusted = srv_trusted;
+    opts.accept_unprotected = true;
+    opts.accept_raverified = true;
+    opts.grant_implicit_confirm = true;
+    opts.no_check_time = true;
+    /* unprotected requests of the last variant are expected */
+    opts.verbosity = opt_verbosity > LOG_WARNING ? (int)opt_verbosity : LOG_ERR;
+    if (cert == NULL || srv_trusted == NULL)
+        goto end;
+    if (digest != NULL) {
+        /* the CA uses the same algorithms; its cert is pinned */
+        if ((srv_key = KEY_new(row->keyspec)) == NULL
+            || (srv_cert = matrix_cert(srv_key, "matrix CA", digest)) == NULL
+            || !X509_STORE_add_cert(srv_trusted, cert))
+            goto end;
+        opts.srv_key = srv_key;
+        creds = CREDENTIALS_new(key, cert, NULL, NULL, NULL);
+    } else {
+        /* with PBM, the CA cert just provides the sender name */
+        if ((srv_cert = matrix_cert(key, "matrix CA", NULL)) == NULL)
+            goto end;
+        creds = CREDENTIALS_new(NULL, NULL, NULL, BENCH_SECRET,
+                                BENCH_SECRET_REF);
+    }
+    opts.srv_cert = srv_cert;
+    if (creds == NULL
+        || (mock = MOCK_CA_new(NULL, NULL, &opts, 1)) == NULL
+        || CMPclient_prepare(&ctx, NULL, NULL, NULL, NULL, "/CN=matrix CA",
+                             NULL, creds, NULL, digest, mac,
+                             matrix_transfer_cb, 0, NULL,
+                             true /* implicit_confirm */) != CMP_OK
+        || !OSSL_CMP_CTX_set_log_verbosity(ctx, (int)opt_verbosity)
+        || !OSSL_CMP_CTX_set_transfer_cb_arg(ctx, mock)
+        || (digest != NULL && !OSSL_CMP_CTX_set1_srvCert(ctx, srv_cert)))
+        goto end;
+
+    for (v = MATRIX_FULL; v <= MATRIX_UNPROTECTED; v++) {
+        if ((req[v] = OPENSSL_malloc((size_t)opt_iterations
+                                     * sizeof(double))) == NULL
+            || !matrix_run(ctx, key, (enum matrix_variant)v, row, req[v]))
+            goto end;
+        med[v] = median_of(req[v], opt_iterations);
+    }
+    row->popo_us = med[MATRIX_FULL] > med[MATRIX_RAVERIFIED]
+        ? med[MATRIX_FULL] - med[MATRIX_RAVERIFIED] : 0;
+    row->protect_us = med[MATRIX_RAVERIFIED] > med[MATRIX_UNPROTECTED]
+        ? med[MATRIX_RAVERIFIED] - med[MATRIX_UNPROTECTED] : 0;
+    ok = true;
+
+ end:
+    if (!ok)
+        LOG(FL_ERR, "Cost matrix failed for %s with %s",
+            row->keyspec, row->protection);
+    for (v = MATRIX_FULL; v <= MATRIX_UNPROTECTED; v++)
+        OPENSSL_free(req[v]);
+    CMPclient_finish(ctx);
+    MOCK_CA_free(mock);
+    CREDENTIALS_free(creds);
+    X509_STORE_free(srv_trusted);
+    X509_free(srv_cert);
+    X509_free(cert);
+    KEY_free(srv_key);
+    return ok;
+}
+
+static double matrix_keygen(const char *keyspec, EVP_PKEY **key)
+{
+    double samples[MATRIX_KEYGEN_ITERATIONS];
+    int i;
+
+    for (i = 0; i < MATRIX_KEYGEN_ITERATIONS; i++) {
+        double start = now_us();
+
+        KEY_free(*key);
+        if ((*key = KEY_new(keyspec)) == NULL)
+            return -1;
+        samples[i] = now_us() - start;
+    }
+    return median_of(samples, MATRIX_KEYGEN_ITERATIONS);
+}
+
+static int cmp_row_total(const void *a, const void *b)
+{
+    return cmp_double(&((const MATRIX_ROW *)a)->total_us,
+                      &((const MATRIX_ROW *)b)->total_us);
+}
+
+static void print_matrix(FILE *out, MATRIX_ROW *rows, int num)
+{
+    int i;
+
+    qsort(rows, (size_t)num, sizeof(*rows), cmp_row_total);
+    fprintf(out, "# cmpBench cost matrix, %s, medians of %ld iterations,"
+            " sorted by total client time\n",
+            OpenSSL_version(OPENSSL_VERSION), opt_iterations);
+    fprintf(out, "%-16s %-22s %10s %9s %10s %9s %9s %9s %9s\n",
+            "key spec", "protection", "keygen_us", "popo_us", "protect_us",
+            "verify_us", "total_us", "req_bytes", "rsp_bytes");
+    for (i = 0; i < num; i++)
+        fprintf(out, "%-16s %-22s %10.1f %9.1f %10.1f %9.1f %9.1f %9d %9d\n",
+                rows[i].keyspec, rows[i].protection, rows[i].keygen_us,
+                rows[i].popo_us, rows[i].protect_us, rows[i].verify_us,
+                rows[i].total_us, rows[i].req_bytes, rows[i].rsp_bytes);
+}
+
+/* returns the number of rows, or -1 on error */
+static int run_matrix(MATRIX_ROW *rows)
+{
+    const char *const lists[2] = { opt_digests, opt_macs };
+    char *keyspecs = OPENSSL_strdup(opt_keyspecs), *keyspec, *next_keyspec;
+    int num = 0, failed = 0, l;
+
+    if (keyspecs == NULL)
+        return -1;
+    for (keyspec = keyspecs; keyspec != NULL && *keyspec != '\0';
+         keyspec = next_keyspec) {
+        EVP_PKEY *key = NULL;
+        double keygen_us;
+
+        next_keyspec = UTIL_next_item(keyspec);
+        LOG(FL_INFO, "Cost matrix for key spec %s", keyspec);
+        if ((keygen_us = matrix_keygen(keyspec, &key)) < 0) {
+            LOG(FL_ERR, "Cannot generate key of spec %s", keyspec);
+            failed++;
+            continue;
+        }
+        for (l = 0; l < 2; l++) {
+            char *algs = OPENSSL_strdup(lists[l]), *alg, *next_alg;
+
+            for (alg = algs; alg != NULL && *alg != '\0'; alg = next_alg) {
+                MATRIX_ROW *row = &rows[num];
+
+                next_alg = UTIL_next_item(alg);
+                if (num == MATRIX_MAX_ROWS) {
+                    LOG(FL_WARN, "Cost matrix limited to %d rows",
+                        MATRIX_MAX_ROWS);
+                    break;
+                }
+                memset(row, 0, sizeof(*row));
+                snprintf(row->keyspec, sizeof(row->keyspec), "%s", keyspec);
+                snprintf(row->protection, sizeof(row->protection), "%s:%s",
+                         l == 0 ? "sig" : "pbm", alg);
+                row->keygen_us = keygen_us;
+                if (matrix_row(key, l == 0 ? alg : NULL,
+                               l == 0 ? NULL : alg, row))
+                    num++;
+                else
+                    failed++;
+            }
+            OPENSSL_free(algs);
+        }
+        KEY_free(key);
+    }
+    OPENSSL_free(keyspecs);
+    return failed == 0 ? num : -1;
+}
+
+static void print_help(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -datadir <dir>     test credentials, default: %s\n"
+            "  -filter <text>     run only benchmarks with names containing text\n"
+            "  -iterations <n>    measured iterations per benchmark, default: %d\n"
+            "  -warmup <n>        unmeasured iterations before, default: %d\n"
+            "  -out <file>        write JSON results to file, default: stdout\n"
+            "  -baseline <file>   compare medians with earlier JSON results\n"
+            "  -tolerance <pct>   allowed slowdown vs. baseline, default: %d\n"
+            "  -alloc_stats <n>   1: include allocations per operation, 2: also arena\n"
+            "  -verbosity <n>     log level, default: %d\n"
+            "  -mock_server <file> cmpMockServer executable for rtt_* benchmarks\n"
+            "  -list              list available benchmarks\n"
+            "  -matrix            write algorithm cost table instead of benchmarks\n"
+            "  -keyspecs <list>   key specs for -matrix, default: %s\n"
+            "  -digests <list>    digests for signature-based protection, default: %s\n"
+            "  -macs <list>       MACs for PBM-based protection, default: %s\n",
+            prog, BENCH_DEFAULT_DATADIR, BENCH_DEFAULT_ITERATIONS,
+            BENCH_DEFAULT_WARMUP, BENCH_DEFAULT_TOLERANCE, LOG_WARNING,
+            BENCH_DEFAULT_KEYSPECS, BENCH_DEFAULT_DIGESTS, BENCH_DEFAULT_MACS);
+}
+
+static bool parse_args(int argc, char *argv[], bool *list, bool *matrix)
+{
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        if (*arg == '-' && arg[1] == '-')
+            arg++;
+        if (strcmp(arg, "-list") == 0) {
+            *list = true;
+            continue;
+        }
+        if (strcmp(arg, "-matrix") == 0) {
+            *matrix = true;
+            continue;
+        }
+        if (strcmp(arg, "-help") == 0 || i + 1 >= argc)
+            return false;
+        if (strcmp(arg, "-datadir") == 0)
+            opt_datadir = argv[++i];
+        else if (strcmp(arg, "-filter") == 0)
+            opt_filter = argv[++i];
+        else if (strcmp(arg, "-out") == 0)
+            opt_out = argv[++i];
+        else if (strcmp(arg, "-baseline") == 0)
+            opt_baseline = argv[++i];
+        else if (strcmp(arg, "-iterations") == 0)
+            opt_iterations = UTIL_atoint(argv[++i]);
+        else if (strcmp(arg, "-warmup") == 0)
+            opt_warmup = UTIL_atoint(argv[++i]);
+        else if (strcmp(arg, "-tolerance") == 0)
+            opt_tolerance = UTIL_atoint(argv[++i]);
+        else if (strcmp(arg, "-alloc_stats") == 0)
+            opt_alloc_stats = UTIL_atoint(argv[++i]);
+        else if (strcmp(arg, "-verbosity") == 0)
+            opt_verbosity = UTIL_atoint(argv[++i]);
+        else if (strcmp(arg, "-mock_server") == 0)
+            opt_mock_server = argv[++i];
+        else if (strcmp(arg, "-keyspecs") == 0)
+            opt_keyspecs = argv[++i];
+        else if (strcmp(arg, "-digests") == 0)
+            opt_digests = argv[++i];
+        else if (strcmp(arg, "-macs") == 0)
+            opt_macs = argv[++i];
+        else
+            return false;
+    }
+    return opt_iterations > 0 && opt_warmup >= 0 && opt_tolerance >= 0
+        && opt_verbosity >= LOG_EMERG && opt_verbosity <= LOG_TRACE;
+}
+
+int main(int argc, char *argv[])
+{
+    BENCH_ENV env;
+    BENCH_RESULT results[sizeof(benches) / sizeof(benches[0])];
+    int i, num = 0, failed = 0, rc = EXIT_FAILURE;
+    bool list = false, matrix = false;
+    FILE *out = stdout;
+
+    if (!parse_args(argc, argv, &list, &matrix)) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (list) {
+        for (i = 0; i < (int)(sizeof(benches) / sizeof(benches[0])); i++)
+            printf("%-16s %s\n", benches[i].name, benches[i].kind);
+        return EXIT_SUCCESS;
+    }
+    /* must be done before OpenSSL allocates any memory */
+    if (opt_alloc_stats > 0
+        && CMPclient_alloc_stats_enable(opt_alloc_stats > 1) != CMP_OK) {
+        fprintf(stderr, "cannot enable allocation statistics\n");
+        return EXIT_FAILURE;
+    }
+    if (CMPclient_init("cmpBench", NULL) != CMP_OK)
+        return EXIT_FAILURE;
+    CMPclient_log_set_verbosity((severity)opt_verbosity);
+
+    if (!load_env(&env)) {
+        LOG(FL_ERR, "Cannot load benchmark inputs from '%s'", opt_datadir);
+        goto end;
+    }
+    if (matrix) {
+        MATRIX_ROW *rows = OPENSSL_malloc(MATRIX_MAX_ROWS * sizeof(*rows));
+
+        if (rows != NULL && (num = run_matrix(rows)) >= 0) {
+            if (opt_out != NULL && (out = fopen(opt_out, "w")) == NULL) {
+                LOG(FL_ERR, "Cannot open '%s' for writing", opt_out);
+            } else {
+                print_matrix(out, rows, num);
+                if (out != stdout)
+                    fclose(out);
+                rc = EXIT_SUCCESS;
+            }
+        }
+        OPENSSL_free(rows);
+        goto end;
+    }
+    for (i = 0; i < (int)(sizeof(benches) / sizeof(benches[0])); i++) {
+        if (opt_filter != NULL && strstr(benches[i].name, opt_filter) == NULL)
+            continue;
+        if (opt_mock_server == NULL && strncmp(benches[i].name, "rtt_", 4) == 0) {
+            LOG(FL_INFO, "Skipping benchmark '%s' without -mock_server",
+                benches[i].name);
+            continue;
+        }
+        LOG(FL_INFO, "Running benchmark '%s'", benches[i].name);
+        if (run_bench(&env, &benches[i], &results[num]))
+            num++;
+        else
+            failed++;
+    }
+
+    if (opt_out != NULL && (out = fopen(opt_out, "w")) == NULL) {
+        LOG(FL_ERR, "Cannot open '%s' for writing", opt_out);
+        goto end;
+    }
+    print_json(out, results, num);
+    if (out != stdout)
+        fclose(out);
+    if (failed == 0
+        && (opt_baseline == NULL || compare_baseline(results, num) == 0))
+        rc = EXIT_SUCCESS;
+
+ end:
+    free_env(&env);
+    CMPclient_finish(NULL);
+    return rc;
+}
@@ -19,14 +19,26 @@
 
 #include <openssl/ssl.h>
 
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
 #include <secutils/config/config.h>
 #include <secutils/credentials/cert.h>
 #include <secutils/credentials/verify.h>
-#include <secutils/certstatus/crl_mgmt.h> /* for CRLMGMT_load_crl_cb */
+#ifndef GENCMP_NO_CERTSTATUS
+# include <secutils/certstatus/crl_mgmt.h> /* for CRLMGMT_load_crl_cb */
+#endif
 
 #ifdef LOCAL_DEFS
 # include "genericCMPClient_use.h"
 #endif
+#ifdef GENCMP_EMBEDDED_CERTS
+# include "embedded_certs.h" /* generated by util/embed_certs.pl */
+#endif
 
 /*
  * Use cases are split between CMP use cases and others,
@@ -47,25 +59,42 @@ enum use_case { no_use_case,
 #define CONFIG_DEFAULT "config/demo.cnf"
 #define CONFIG_TEST "test_config.cnf" /* from OpenSSL test suite */
 
+#ifndef GENCMP_NO_CONFIG
 char *opt_config = CONFIG_DEFAULT; /* OpenSSL-style configuration file */
 CONF *config = NULL; /* OpenSSL configuration structure */
 char *opt_section = "EJBCA"; /* name(s) of config file section(s) to use */
-#define DEFAULT_SECTION "default"
-#define SECTION_NAME_MAX 40
+# define DEFAULT_SECTION "default"
+# define SECTION_NAME_MAX 40
 char demo_sections[2 * (SECTION_NAME_MAX + 1)]; /* used for pattern "%s,%s" */
+#endif
 long opt_verbosity;
+long opt_log_async;
+long opt_alloc_stats;
+bool opt_dercache;
 
 /* message transfer */
 const char *opt_server;
 const char *opt_proxy;
 const char *opt_no_proxy;
 const char *opt_path;
+#ifndef GENCMP_NO_CERTSTATUS
 const char *opt_cdp_proxy;
 const char *opt_crl_cache_dir;
+#endif
 
 long opt_keep_alive;
 long opt_msg_timeout;
 long opt_total_timeout;
+bool opt_fast_connect;
+bool opt_nagle;
+bool opt_tcp_fastopen;
+long opt_sndbuf;
+long opt_rcvbuf;
+long opt_connect_timeout_ms;
+long opt_rate_limit;
+const char *opt_spool;
+bool opt_spool_forward;
+static CMPCLIENT_SPOOL *spool = NULL;
 
 /* server authentication */
 const char *opt_trusted;
@@ -122,10 +151,18 @@ const char *opt_newkey;
 const char *opt_newkeypass;
 const char *opt_subject;
 long opt_days;
+#ifndef GENCMP_NO_CONFIG
 const char *opt_reqexts;
+#else /* extension sections can only be taken from a config file */
+# define opt_reqexts ((const char *)NULL)
+#endif
 char *opt_sans;
 bool opt_san_nodefault;
+#ifndef GENCMP_NO_CONFIG
 const char *opt_policies;
+#else
+# define opt_policies ((const char *)NULL)
+#endif
 char *opt_policy_oids;
 bool opt_policy_oids_critical;
 long opt_popo;
@@ -157,6 +194,11 @@ const char *opt_tls_extra;
 const char *opt_tls_trusted;
 const char *opt_tls_host;
 
+/* bulk validation */
+const char *opt_batch;
+long opt_batch_threads;
+const char *opt_batch_out;
+
 /* client-side debugging */
 static char *opt_reqin = NULL;
 static bool opt_reqin_new_tid = 0;
@@ -164,6 +206,7 @@ static char *opt_reqout = NULL;
 static char *opt_rspin = NULL;
 static char *opt_rspout = NULL;
 
+#ifndef GENCMP_NO_CERTSTATUS
 /* TODO further extend verification options and align with OpenSSL:apps/cmp.c */
 bool opt_check_all;
 bool opt_check_any;
@@ -176,21 +219,51 @@ bool opt_use_aia;
 const char *opt_ocsp;
 long opt_ocsp_timeout;
 bool opt_ocsp_last;
+bool opt_ocsp_multi;
 bool opt_stapling;
+#else /* cert status checking disabled; the constants keep the code paths */
+# define opt_check_all false
+# define opt_check_any false
+# define opt_crls ((const char *)NULL)
+# define opt_use_cdp false
+# define opt_cdps ((const char *)NULL)
+# define opt_crls_timeout (-1L)
+# define opt_crl_maxdownload_size ((size_t)0)
+# define opt_use_aia false
+# define opt_ocsp ((const char *)NULL)
+# define opt_ocsp_timeout (-1L)
+# define opt_ocsp_last false
+# define opt_ocsp_multi false
+# define opt_stapling false
+#endif
 
 X509_VERIFY_PARAM *vpm = NULL;
+#ifndef GENCMP_NO_CERTSTATUS
 CRLMGMT_DATA *cmdata = NULL;
 STACK_OF(X509_CRL) *crls = NULL;
+#else
+# define crls ((STACK_OF(X509_CRL) *)NULL)
+#endif
 
 opt_t cmp_opts[] = {
     { "help", OPT_BOOL, {.num = -1}, { NULL },
       "Display this summary"},
+#ifndef GENCMP_NO_CONFIG
     { "config", OPT_TXT, {.txt = NULL}, { NULL },
       "Configuration file to use. \"\" means none. Default 'config/demo.cnf'"},
     { "section", OPT_TXT, {.txt = NULL}, { NULL },
       "Section(s) in config file to use. \"\" means 'default'. Default 'EJBCA'"},
+#endif
     { "verbosity", OPT_NUM, {.num = LOG_INFO}, {(const char **) &opt_verbosity},
       "Logging level; 3=ERR, 4=WARN, 6=INFO, 7=DEBUG, 8=TRACE. Default 6 = INFO"},
+    { "log_async", OPT_NUM, {.num = -1}, {(const char **) &opt_log_async},
+      "Log via background thread using buffer of given number of messages (0 = 1024)"},
+    OPT_MORE("Default -1 means synchronous logging"),
+    { "alloc_stats", OPT_NUM, {.num = 0}, {(const char **) &opt_alloc_stats},
+      "Report OpenSSL allocations per CMP phase on exit; 2 = use arena allocator"},
+    OPT_MORE("Default 0 = none. Takes effect only if given on the command line"),
+    { "dercache", OPT_BOOL, {.bit = false}, { (const char **) &opt_dercache },
+      "Cache DER encoding of cert and CSR input files in <file>.dercache"},
 
     OPT_HEADER("Generic message"),
     { "cmd", OPT_TXT, {.txt = NULL}, { &opt_cmd },
@@ -232,16 +305,20 @@ opt_t cmp_opts[] = {
     OPT_MORE("For kur, default is subject of -csr arg, else subject of -oldcert"),
     { "days", OPT_NUM, {.num = 0}, { (const char **) &opt_days },
       "Requested validity time of new cert in number of days"},
+#ifndef GENCMP_NO_CONFIG
     { "reqexts", OPT_TXT, {.txt = NULL}, { &opt_reqexts },
       "Name of config file section defining certificate request extensions"},
     OPT_MORE("Augments or replaces any extensions contained CSR given with -csr"),
+#endif
     { "sans", OPT_TXT, {.txt = NULL}, { (const char **) &opt_sans },
       "Subject Alt Names (IPADDR/DNS/URI) to add as (critical) cert req extension"},
     { "san_nodefault", OPT_BOOL, {.bit = false},
       { (const char **) &opt_san_nodefault},
       "Do not take default SANs from reference certificate (see -oldcert)"},
+#ifndef GENCMP_NO_CONFIG
     { "policies", OPT_TXT, {.txt = NULL}, { &opt_policies},
       "Name of config file section defining policies request extension"},
+#endif
     { "policy_oids", OPT_TXT, {.txt = NULL}, {(const char **) &opt_policy_oids},
       "Policy OID(s) to add as certificate policies request extension"},
     { "policy_oids_critical", OPT_BOOL, {.bit = false},
@@ -316,14 +393,45 @@ opt_t cmp_opts[] = {
       "Timeout per CMP message round trip (or 0 for none). Default 120 seconds"},
     { "total_timeout", OPT_NUM, {.num = 0}, {(const char **)&opt_total_timeout},
       "Overall time an enrollment incl. polling may take. Default: 0 = infinite"},
+    { "fast_connect", OPT_BOOL, {.bit = false},
+      { (const char **) &opt_fast_connect },
+      "Connect by the library with DNS cache and racing IPv6 and IPv4 attempts"},
+    { "nagle", OPT_BOOL, {.bit = false}, { (const char **) &opt_nagle },
+      "Do not set TCP_NODELAY on connections made by the library"},
+    { "tcp_fastopen", OPT_BOOL, {.bit = false},
+      { (const char **) &opt_tcp_fastopen },
+      "Use TCP Fast Open where supported, saving a round trip on reconnects"},
+    { "sndbuf", OPT_NUM, {.num = 0}, { (const char **) &opt_sndbuf },
+      "Socket send buffer size in bytes. Default 0 = system default"},
+    { "rcvbuf", OPT_NUM, {.num = 0}, { (const char **) &opt_rcvbuf },
+      "Socket receive buffer size in bytes. Default 0 = system default"},
+    { "connect_timeout_ms", OPT_NUM, {.num = 0},
+      { (const char **) &opt_connect_timeout_ms },
+      "Timeout for establishing a connection. Default 0: -msg_timeout applies"},
+    OPT_MORE("Except for -nagle, these socket options imply -fast_connect"),
+    { "rate_limit", OPT_NUM, {.num = 0}, { (const char **) &opt_rate_limit },
+      "Max requests per second to the server. Default 0 = unlimited"},
+    OPT_MORE("Useful with -spool_forward; implies -fast_connect"),
+    { "spool", OPT_TXT, {.txt = NULL}, { &opt_spool },
+      "Queue requests in given directory and await responses dropped there,"},
+    OPT_MORE("rather than contacting -server"),
+    { "spool_forward", OPT_BOOL, {.bit = false},
+      { (const char **) &opt_spool_forward },
+      "Forward requests queued in -spool directory to -server, then exit"},
 
     OPT_HEADER("Server authentication"),
     { "trusted", OPT_TXT, {.txt = NULL}, { &opt_trusted },
       "Certificates to use as trust anchors when validating signed CMP responses"},
+#ifdef GENCMP_EMBEDDED_CERTS
+    OPT_MORE("'embedded:trusted' means the certs compiled into this binary"),
+#endif
     { "untrusted", OPT_TXT, {.txt = NULL}, { &opt_untrusted },
       "Intermediate CA certs for chain construction for CMP/TLS/enrolled certs"},
     { "srvcert", OPT_TXT, {.txt = NULL}, { &opt_srvcert },
       "Server cert to pin and trust directly when validating signed CMP responses"},
+#ifdef GENCMP_EMBEDDED_CERTS
+    OPT_MORE("'embedded:srvcert' means the cert compiled into this binary"),
+#endif
     { "expect_sender", OPT_TXT, {.txt = NULL}, { &opt_expect_sender },
       "DN of expected sender of responses. Defaults to subject of -srvcert, if any"},
     { "ignore_keyusage", OPT_BOOL, {.bit = false},
@@ -413,6 +521,14 @@ opt_t cmp_opts[] = {
     { "tls_host", OPT_TXT, {.txt = NULL}, { &opt_tls_host },
       "Address (rather than -server) to be checked during TLS hostname validation"},
 
+    OPT_HEADER("Bulk validation"),
+    { "batch", OPT_TXT, {.txt = NULL}, { &opt_batch },
+      "Directory or list of cert files to check in bulk with the 'validate' use case"},
+    { "batch_threads", OPT_NUM, {.num = 0}, { (const char **) &opt_batch_threads },
+      "Number of worker threads for -batch. Default 0 = number of CPUs"},
+    { "batch_out", OPT_TXT, {.txt = NULL}, { &opt_batch_out },
+      "File to write one JSON result line per cert to. Default: stdout"},
+
     OPT_HEADER("Debugging"),
     {"reqin", OPT_TXT, {.txt = NULL}, { (const char **) &opt_reqin},
      "Take sequence of CMP requests to send to server from file(s)"},
@@ -426,6 +542,7 @@ opt_t cmp_opts[] = {
     {"rspout", OPT_TXT, {.txt = NULL}, { (const char **) &opt_rspout},
      "Save sequence of CMP responses to file(s)"},
 
+#ifndef GENCMP_NO_CERTSTATUS
     OPT_HEADER("CMP and TLS certificate status checking"),
     /* TODO extend verification options and align with OpenSSL:apps/cmp.c */
     { "check_all", OPT_BOOL, {.bit = false}, { (const char **) &opt_check_all},
@@ -455,8 +572,11 @@ opt_t cmp_opts[] = {
       "Timeout for getting OCSP responses, or 0 for none, -1 for default: 10 seconds"},
     { "ocsp_last", OPT_BOOL, {.bit = false}, { (const char **) &opt_ocsp_last },
       "Do OCSP-based status checks last (else before using CRLs downloaded from CDPs)"},
+    { "ocsp_multi", OPT_BOOL, {.bit = false}, { (const char **) &opt_ocsp_multi },
+      "With -check_all, get OCSP status of chain certs with one request per responder"},
     { "stapling", OPT_BOOL, {.bit = false}, { (const char **) &opt_stapling },
       "Enable OCSP stapling for TLS; is tried before any other cert status checks"},
+#endif
 
     OPT_V_OPTIONS, /* excludes "crl_check" and "crl_check_all" */
 
@@ -520,6 +640,16 @@ static int set_gennames(OSSL_CMP_CTX *ctx, char *names, const char *desc)
     return 1;
 }
 
+#ifndef GENCMP_NO_CERTSTATUS
+/* to be called after STORE_set_parameters() and STORE_set_crl_callback() */
+static bool set_ocsp_multi(X509_STORE *store)
+{
+    return !opt_ocsp_multi
+        || CMPclient_ocsp_multi(store, opt_use_aia, opt_ocsp,
+                                (int)opt_ocsp_timeout, 0 /* no limit */);
+}
+#endif
+
 static SSL_CTX *setup_TLS(STACK_OF(X509) *untrusted_certs)
 {
 #ifdef SECUTILS_NO_TLS
@@ -545,8 +675,11 @@ static SSL_CTX *setup_TLS(STACK_OF(X509) *untrusted_certs)
                                   opt_use_cdp, opt_cdps, (int)opt_crls_timeout,
                                   opt_use_aia, opt_ocsp, (int)opt_ocsp_timeout))
             goto err;
-        if (!STORE_set_crl_callback(tls_trust, CRLMGMT_load_crl_cb, cmdata))
+#ifndef GENCMP_NO_CERTSTATUS
+        if (!STORE_set_crl_callback(tls_trust, CRLMGMT_load_crl_cb, cmdata)
+            || (!opt_stapling && !set_ocsp_multi(tls_trust)))
             goto err;
+#endif
     } else {
         LOG_warn("-tls_used given without -tls_trusted; will not authenticate the TLS server");
     }
@@ -607,13 +740,44 @@ static SSL_CTX *setup_TLS(STACK_OF(X509) *untrusted_certs)
 #endif
 }
 
+/* like STORE_load(), also accepting "embedded:trusted" and "embedded:srvcert" */
+static X509_STORE *load_truststore(const char *files, const char *desc,
+                                   OPTIONAL X509_VERIFY_PARAM *vpm_)
+{
+#ifdef GENCMP_EMBEDDED_CERTS
+    if (strcmp(files, "embedded:trusted") == 0)
+        return STORE_load_der(embedded_trusted, embedded_trusted_num,
+                              desc, vpm_);
+    if (strcmp(files, "embedded:srvcert") == 0)
+        return STORE_load_der(embedded_srvcert, embedded_srvcert_num,
+                              desc, vpm_);
+#endif
+    return STORE_load(files, desc, vpm_);
+}
+
+/* like CERT_load(), also accepting "embedded:srvcert" */
+static X509 *load_srvcert(const char *file, const char *desc)
+{
+#ifdef GENCMP_EMBEDDED_CERTS
+    if (strcmp(file, "embedded:srvcert") == 0) {
+        if (embedded_srvcert_num != 1) {
+            LOG(FL_ERR, "Need exactly one embedded cert for %s", desc);
+            return NULL;
+        }
+        return CERT_load_der(embedded_srvcert[0].der, embedded_srvcert[0].len,
+                             desc);
+    }
+#endif
+    return CERT_load(file, NULL /* pass */, desc, -1 /* no type check */, vpm);
+}
+
 static X509_STORE *setup_CMP_truststore(const char *trusted_cert_files)
 {
     if (trusted_cert_files == NULL)
         return NULL;
     X509_STORE *cmp_truststore =
-        STORE_load(trusted_cert_files, "trusted certs for CMP level",
-                   NULL /* no vpm: prevent strict checking */);
+        load_truststore(trusted_cert_files, "trusted certs for CMP level",
+                        NULL /* no vpm: prevent strict checking */);
 
     if (cmp_truststore == NULL)
         goto err;
@@ -621,7 +785,10 @@ static X509_STORE *setup_CMP_truststore(const char *trusted_cert_files)
                               opt_check_all, false /* stapling */, crls,
                               opt_use_cdp, opt_cdps, (int)opt_crls_timeout,
                               opt_use_aia, opt_ocsp, (int)opt_ocsp_timeout) ||
+#ifndef GENCMP_NO_CERTSTATUS
         !STORE_set_crl_callback(cmp_truststore, CRLMGMT_load_crl_cb, cmdata) ||
+        !set_ocsp_multi(cmp_truststore) ||
+#endif
         /* clear any expected host/ip/email address; use opt_expect_sender: */
         !STORE_set1_host_ip(cmp_truststore, NULL, NULL)) {
         STORE_free(cmp_truststore);
@@ -635,10 +802,12 @@ static X509_STORE *setup_CMP_truststore(const char *trusted_cert_files)
 static X509_EXTENSIONS *setup_X509_extensions(CMP_CTX *ctx)
 {
     X509_EXTENSIONS *exts = sk_X509_EXTENSION_new_null();
-    X509V3_CTX ext_ctx;
 
     if (exts == NULL)
         return NULL;
+#ifndef GENCMP_NO_CONFIG
+    X509V3_CTX ext_ctx;
+
     if (opt_reqexts != NULL || opt_policies != NULL) {
         X509V3_set_ctx(&ext_ctx, NULL, NULL, NULL, NULL, 0);
         X509V3_set_nconf(&ext_ctx, config);
@@ -657,6 +826,7 @@ static X509_EXTENSIONS *setup_X509_extensions(CMP_CTX *ctx)
             goto err;
         }
     }
+#endif
 
     if (opt_policies != NULL && opt_policy_oids != NULL) {
         LOG_err("Cannot have policies both via -policies and via -policy_oids");
@@ -998,8 +1168,8 @@ static int setup_ctx(CMP_CTX *ctx)
         return err;
     if (opt_extracerts != NULL) {
         STACK_OF(X509) *certs =
-            CERTS_load(opt_extracerts, "extra certificates for CMP",
-                       -1 /* allow EE and CA */, vpm);
+            CERTS_load_cached(opt_extracerts, "extra certificates for CMP",
+                              -1 /* allow EE and CA */, vpm);
 
         if (certs == NULL) {
             LOG(FL_ERR, "Unable to load '%s' extra certificates for CMP",
@@ -1090,8 +1260,8 @@ static CMP_err prepare_CMP_client(CMP_CTX **pctx, enum use_case use_case,
         LOG(FL_TRACE, "Using '%s' as trust store for validating new cert",
             new_cert_trusted);
         new_cert_truststore =
-            STORE_load(new_cert_trusted,
-                       "trusted certs for validating new cert", vpm);
+            load_truststore(new_cert_trusted,
+                            "trusted certs for validating new cert", vpm);
         if (new_cert_truststore == NULL)
             goto err;
         /* use separate flag for checking any cert, for new certificate store */
@@ -1102,9 +1272,11 @@ static CMP_err prepare_CMP_client(CMP_CTX **pctx, enum use_case use_case,
                                   false, NULL, -1,
                                   false, NULL, -1))
             goto err;
+#ifndef GENCMP_NO_CERTSTATUS
         if (!STORE_set_crl_callback(new_cert_truststore, CRLMGMT_load_crl_cb,
                                     cmdata))
             goto err;
+#endif
     }
     /* cannot set these vpm options before above STORE_set_parameters(...) */
     if (opt_check_any)
@@ -1169,7 +1341,7 @@ static CMP_err prepare_CMP_client(CMP_CTX **pctx, enum use_case use_case,
     }
     cmp_truststore = setup_CMP_truststore(opt_trusted);
     untrusted_certs = opt_untrusted == NULL ? NULL :
-        CERTS_load(opt_untrusted, "untrusted certs", 1 /* CA */, vpm);
+        CERTS_load_cached(opt_untrusted, "untrusted certs", 1 /* CA */, vpm);
     if ((cmp_truststore == NULL && opt_trusted != NULL)
             || (untrusted_certs == NULL && opt_untrusted != NULL))
         goto err;
@@ -1203,9 +1375,8 @@ static CMP_err prepare_CMP_client(CMP_CTX **pctx, enum use_case use_case,
         goto err;
 
     if (opt_srvcert != NULL) {
-        X509 *srvcert = CERT_load(opt_srvcert, NULL /* pass */,
-                                  "directly trusted CMP server certificate",
-                                  -1 /* no type check */, vpm);
+        X509 *srvcert = load_srvcert(opt_srvcert,
+                                     "directly trusted CMP server certificate");
 
         if (srvcert == NULL || !OSSL_CMP_CTX_set1_srvCert(*pctx, srvcert))
             err = -8;
@@ -1245,6 +1416,22 @@ static int setup_transfer(CMP_CTX *ctx)
         goto err;
     }
 
+    if (opt_spool != NULL && !opt_spool_forward) {
+        if (opt_reqin != NULL || opt_reqout != NULL
+            || opt_rspin != NULL || opt_rspout != NULL) {
+            LOG_err("-spool cannot be combined with -reqin, -reqout, -rspin, or -rspout");
+            err = -74;
+            goto err;
+        }
+        if (opt_server != NULL)
+            LOG_warn("ignoring -server option since -spool is given");
+        if ((spool = CMPclient_spool_new(opt_spool, 0)) == NULL) {
+            err = -75;
+            goto err;
+        }
+        err = CMPclient_setup_spool(ctx, spool, (int)opt_msg_timeout);
+        goto err;
+    }
     if (opt_server == NULL) {
         if (opt_rspin == NULL) {
             LOG_err("missing -server or -rspin option");
@@ -1282,9 +1469,47 @@ static int setup_transfer(CMP_CTX *ctx)
         goto err;
     }
 
-    err = CMPclient_setup_HTTP(ctx, opt_server, opt_path,
-                               (int)opt_keep_alive, (int)opt_msg_timeout,
-                               tls, opt_proxy, opt_no_proxy);
+    if (opt_sndbuf < 0 || opt_sndbuf > INT_MAX
+        || opt_rcvbuf < 0 || opt_rcvbuf > INT_MAX
+        || opt_connect_timeout_ms < 0 || opt_connect_timeout_ms > INT_MAX
+        || opt_rate_limit < 0) {
+        LOG_err("Negative or out-of-range socket option or rate limit value");
+        err = -17;
+        goto err;
+    }
+    CMPCLIENT_TRANSPORT_OPTS transport_opts;
+    transport_opts.nagle = opt_nagle;
+    transport_opts.fast_open = opt_tcp_fastopen;
+    transport_opts.sndbuf = (int)opt_sndbuf;
+    transport_opts.rcvbuf = (int)opt_rcvbuf;
+    transport_opts.connect_timeout_ms = (int)opt_connect_timeout_ms;
+    if (opt_tcp_fastopen || opt_sndbuf != 0 || opt_rcvbuf != 0
+        || opt_connect_timeout_ms != 0 || opt_rate_limit != 0)
+        opt_fast_connect = true;
+    CMPCLIENT_RATE_LIMIT rate_limit;
+    memset(&rate_limit, 0, sizeof(rate_limit));
+    rate_limit.rate = (double)opt_rate_limit;
+
+    if (opt_fast_connect && opt_server != NULL) {
+        err = CMPclient_setup_transport(ctx, opt_server, opt_path,
+                                        (int)opt_keep_alive,
+                                        (int)opt_msg_timeout,
+                                        tls, opt_proxy, opt_no_proxy);
+        if (err == CMP_OK)
+            err = CMPclient_set_transport_opts(ctx, &transport_opts);
+        if (err == CMP_OK && opt_rate_limit != 0)
+            err = CMPclient_set_rate_limit(ctx, &rate_limit);
+    } else {
+        err = CMPclient_setup_HTTP(ctx, opt_server, opt_path,
+                                   (int)opt_keep_alive, (int)opt_msg_timeout,
+                                   tls, opt_proxy, opt_no_proxy);
+        if (err == CMP_OK && opt_server != NULL
+            && strncmp(opt_server, "unix:", 5) == 0) {
+            err = CMPclient_set_transport_opts(ctx, &transport_opts);
+            if (err == CMP_OK && opt_rate_limit != 0)
+                err = CMPclient_set_rate_limit(ctx, &rate_limit);
+        }
+    }
 
 #ifndef SECUTILS_NO_TLS
     TLS_free(tls);
@@ -1345,14 +1570,381 @@ static size_t get_cert_filename(const X509 *cert, const char *prefix,
     return len;
 }
 
-static bool validate_cert(void)
+/*
+ * Bulk validation for the 'validate' use case with -batch: worker threads take
+ * the next target from a shared list and verify it against one shared store,
+ * writing a JSON line per cert. CRLs fetched are shared via an in-memory
+ * cache, such that each CRL is downloaded only once until its nextUpdate.
+ * Likewise, the OCSP status of chain certs is cached until the nextUpdate of
+ * the response.
+ */
+#define BATCH_MAX_THREADS 256
+#define BATCH_OCSP_CACHE_MAX 65536 /* entries */
+
+typedef struct batch_st {
+    char **files;
+    int num;
+    int size;
+    int next; /* index of next file to validate, accessed atomically */
+    X509_STORE *store;
+    STACK_OF(X509) *untrusted;
+    FILE *out;
+    pthread_mutex_t out_lock;
+    int valid, invalid, errors; /* accessed atomically */
+} BATCH;
+
+static bool batch_add(BATCH *b, const char *file)
+{
+    char *copy;
+
+    if (b->num == b->size) {
+        int size = b->size == 0 ? 1024 : 2 * b->size;
+        char **files = OPENSSL_realloc(b->files, (size_t)size * sizeof(*files));
+
+        if (files == NULL)
+            return false;
+        b->files = files;
+        b->size = size;
+    }
+    if ((copy = OPENSSL_strdup(file)) == NULL)
+        return false;
+    b->files[b->num++] = copy;
+    return true;
+}
+
+/* takes all regular files in the given directory, else the list of files */
+static bool batch_collect(BATCH *b, const char *spec)
+{
+    char path[PATH_MAX];
+    struct dirent *ent;
+    struct stat st;
+    DIR *dir;
+    bool ok = true;
+
+    if (stat(spec, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        char *list = OPENSSL_strdup(spec), *file = list, *next;
+
+        if (list == NULL)
+            return false;
+        for (; ok && file != NULL && *file != '\0'; file = next) {
+            next = UTIL_next_item(file);
+            ok = batch_add(b, file);
+        }
+        OPENSSL_free(list);
+        return ok;
+    }
+
+    if ((dir = opendir(spec)) == NULL) {
+        LOG(FL_ERR, "Cannot open directory '%s'", spec);
+        return false;
+    }
+    while (ok && (ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", spec, ent->d_name)
+            >= (int)sizeof(path)
+            || stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        ok = batch_add(b, path);
+    }
+    (void)closedir(dir);
+    return ok;
+}
+
+static void batch_free(BATCH *b)
+{
+    int i;
+
+    for (i = 0; i < b->num; i++)
+        OPENSSL_free(b->files[i]);
+    OPENSSL_free(b->files);
+}
+
+static void print_json_str(FILE *out, const char *str)
+{
+    (void)putc('"', out);
+    for (; *str != '\0'; str++) {
+        unsigned char c = (unsigned char)*str;
+
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            (void)putc(c, out);
+    }
+    (void)putc('"', out);
+}
+
+static long elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long)(now.tv_sec - start->tv_sec) * 1000000
+        + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+#ifndef GENCMP_NO_CERTSTATUS
+# define BATCH_CRL_RETRY 30 /* seconds a failed download is not retried */
+
+typedef struct batch_crl_st {
+    char *url;
+    X509_CRL *crl; /* NULL if not (yet) available */
+    time_t expires; /* nextUpdate of crl, 0 if none */
+    bool loading; /* by some thread, which others using the URL wait for */
+    time_t failed; /* of the last failed download */
+    pthread_cond_t loaded;
+    struct batch_crl_st *next;
+} BATCH_CRL;
+
+static BATCH_CRL *batch_crls = NULL;
+static pthread_mutex_t batch_crl_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* to be called with batch_crl_lock held */
+static BATCH_CRL *batch_crl_get(const char *url)
+{
+    BATCH_CRL *c;
+
+    for (c = batch_crls; c != NULL; c = c->next)
+        if (strcmp(c->url, url) == 0)
+            return c;
+    if ((c = OPENSSL_zalloc(sizeof(*c))) == NULL)
+        return NULL;
+    if ((c->url = OPENSSL_strdup(url)) == NULL
+        || pthread_cond_init(&c->loaded, NULL) != 0) {
+        OPENSSL_free(c->url);
+        OPENSSL_free(c);
+        return NULL;
+    }
+    c->next = batch_crls;
+    batch_crls = c;
+    return c;
+}
+
+/* an outdated CRL is kept BATCH_CRL_RETRY seconds, not to fetch it per cert */
+static time_t batch_crl_expires(const X509_CRL *crl)
 {
+    const ASN1_TIME *next = X509_CRL_get0_nextUpdate(crl);
+    time_t now = time(NULL), expires;
+    int days, secs;
+
+    if (next == NULL || !ASN1_TIME_diff(&days, &secs, NULL, next))
+        return 0;
+    expires = now + (time_t)days * 86400 + secs;
+    return expires > now ? expires : now + BATCH_CRL_RETRY;
+}
+
+/*
+ * like CRLMGMT_load_crl_cb(), but keeping the CRLs downloaded for any
+ * further certs until their nextUpdate, then fetching them again.
+ * Each URL is fetched by one thread at a time, without holding the lock,
+ * such that lookups of other URLs proceed meanwhile.
+ * Failures are kept for BATCH_CRL_RETRY seconds, not to wait for an
+ * unreachable CDP once per cert.
+ */
+static X509_CRL *batch_crl_cb(OPTIONAL void *arg, OPTIONAL const char *url,
+                              int timeout, const X509 *cert,
+                              OPTIONAL const char *desc)
+{
+    X509_CRL *crl = NULL;
+    BATCH_CRL *c;
+
+    if (url == NULL)
+        return CRLMGMT_load_crl_cb(arg, url, timeout, cert, desc);
+    (void)pthread_mutex_lock(&batch_crl_lock);
+    if ((c = batch_crl_get(url)) == NULL) {
+        (void)pthread_mutex_unlock(&batch_crl_lock);
+        return CRLMGMT_load_crl_cb(arg, url, timeout, cert, desc);
+    }
+    while (c->loading)
+        (void)pthread_cond_wait(&c->loaded, &batch_crl_lock);
+    if (c->crl != NULL && c->expires != 0 && c->expires <= time(NULL)) {
+        X509_CRL_free(c->crl); /* callers may still hold references */
+        c->crl = NULL;
+        c->failed = 0;
+    }
+    if (c->crl != NULL || time(NULL) < c->failed + BATCH_CRL_RETRY) {
+        if (c->crl != NULL && X509_CRL_up_ref(c->crl))
+            crl = c->crl;
+        (void)pthread_mutex_unlock(&batch_crl_lock);
+        return crl;
+    }
+    c->loading = true;
+    (void)pthread_mutex_unlock(&batch_crl_lock);
+
+    crl = CRLMGMT_load_crl_cb(arg, url, timeout, cert, desc);
+
+    (void)pthread_mutex_lock(&batch_crl_lock);
+    if (crl != NULL && X509_CRL_up_ref(crl)) {
+        c->crl = crl;
+        c->expires = batch_crl_expires(crl);
+    } else {
+        c->failed = time(NULL);
+    }
+    c->loading = false;
+    (void)pthread_cond_broadcast(&c->loaded);
+    (void)pthread_mutex_unlock(&batch_crl_lock);
+    return crl;
+}
+
+static void batch_crls_free(void)
+{
+    BATCH_CRL *c;
+
+    while ((c = batch_crls) != NULL) {
+        batch_crls = c->next;
+        X509_CRL_free(c->crl);
+        (void)pthread_cond_destroy(&c->loaded);
+        OPENSSL_free(c->url);
+        OPENSSL_free(c);
+    }
+}
+#endif
+
+static void batch_validate_one(BATCH *b, const char *file)
+{
+    struct timespec start;
     X509 *target;
-    X509_STORE *store;
+    X509_STORE_CTX *csc = NULL;
+    const char *result = "error";
+    int err = X509_V_ERR_UNSPECIFIED, depth = -1;
+    char subject[256] = "";
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((target = CERT_load(file, opt_keypass, "target cert",
+                            -1 /* no type check */, vpm)) != NULL) {
+        (void)X509_NAME_oneline(X509_get_subject_name(target), subject,
+                                (int)sizeof(subject));
+        if ((csc = X509_STORE_CTX_new()) != NULL
+            && X509_STORE_CTX_init(csc, b->store, target, b->untrusted)) {
+            int rv = X509_verify_cert(csc);
+
+            err = X509_STORE_CTX_get_error(csc);
+            depth = X509_STORE_CTX_get_error_depth(csc);
+            if (rv > 0)
+                result = "valid";
+            else if (rv == 0)
+                result = "invalid";
+        }
+    }
+    X509_STORE_CTX_free(csc);
+    X509_free(target);
+    ERR_clear_error(); /* reasons are reported per cert */
+
+    (void)__atomic_add_fetch(*result == 'v' ? &b->valid
+                             : *result == 'i' ? &b->invalid : &b->errors,
+                             1, __ATOMIC_RELAXED);
+    (void)pthread_mutex_lock(&b->out_lock);
+    fputs("{\"cert\":", b->out);
+    print_json_str(b->out, file);
+    fprintf(b->out, ",\"result\":\"%s\",\"error\":%d,\"reason\":", result,
+            err);
+    print_json_str(b->out, target == NULL ? "cannot load cert"
+                   : X509_verify_cert_error_string(err));
+    fprintf(b->out, ",\"depth\":%d,\"subject\":", depth);
+    print_json_str(b->out, subject);
+    fprintf(b->out, ",\"us\":%ld}\n", elapsed_us(&start));
+    (void)pthread_mutex_unlock(&b->out_lock);
+}
+
+static void *batch_worker(void *arg)
+{
+    BATCH *b = arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->num)
+        batch_validate_one(b, b->files[i]);
+    return NULL;
+}
+
+static bool validate_batch(X509_STORE *store, STACK_OF(X509) *untrusted)
+{
+    pthread_t threads[BATCH_MAX_THREADS];
+    struct timespec start;
+    BATCH b;
+    long nthreads = opt_batch_threads;
+    double secs, rate;
+    int started = 0, i;
+    bool ok = false;
+
+    memset(&b, 0, sizeof(b));
+    b.store = store;
+    b.untrusted = untrusted;
+    b.out = stdout;
+    (void)pthread_mutex_init(&b.out_lock, NULL);
+    if (!batch_collect(&b, opt_batch)) {
+        LOG(FL_ERR, "Cannot collect cert files to validate from '%s'",
+            opt_batch);
+        goto err;
+    }
+    if (b.num == 0) {
+        LOG(FL_ERR, "No cert files to validate found in '%s'", opt_batch);
+        goto err;
+    }
+    if (opt_batch_out != NULL && (b.out = fopen(opt_batch_out, "w")) == NULL) {
+        LOG(FL_ERR, "Cannot open -batch_out file '%s'", opt_batch_out);
+        goto err;
+    }
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > BATCH_MAX_THREADS)
+        nthreads = BATCH_MAX_THREADS;
+    if (nthreads > b.num)
+        nthreads = b.num;
+    if (nthreads < 1)
+        nthreads = 1;
+    LOG(FL_INFO, "Validating %d certificates using %ld threads",
+        b.num, nthreads);
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    for (; started < nthreads; started++)
+        if (pthread_create(&threads[started], NULL, batch_worker, &b) != 0)
+            break;
+    if (started == 0)
+        (void)batch_worker(&b);
+    for (i = 0; i < started; i++)
+        (void)pthread_join(threads[i], NULL);
+    secs = (double)elapsed_us(&start) / 1e6;
+    rate = secs > 0 ? b.num / secs : 0.0;
+
+    fprintf(b.out, "{\"summary\":{\"certs\":%d,\"valid\":%d,\"invalid\":%d,"
+            "\"errors\":%d,\"threads\":%d,\"seconds\":%.3f,"
+            "\"certs_per_second\":%.1f}}\n", b.num, b.valid, b.invalid,
+            b.errors, started > 0 ? started : 1, secs, rate);
+    LOG(FL_INFO, "Validated %d certificates in %.3f s (%.1f per second): "
+        "%d valid, %d invalid, %d errors", b.num, secs, rate,
+        b.valid, b.invalid, b.errors);
+    ok = b.valid == b.num;
+
+ err:
+    if (b.out != stdout && b.out != NULL && fclose(b.out) != 0) {
+        LOG(FL_ERR, "Cannot write -batch_out file '%s'", opt_batch_out);
+        ok = false;
+    }
+#ifndef GENCMP_NO_CERTSTATUS
+    batch_crls_free();
+#endif
+    (void)pthread_mutex_destroy(&b.out_lock);
+    batch_free(&b);
+    return ok;
+}
+
+static bool validate_cert(void)
+{
+    X509 *target = NULL;
+    X509_STORE *store = NULL;
     STACK_OF(X509) *untrusted = NULL;
     bool ret = false;
 
-    if (opt_tls_cert != NULL) {
+    if (opt_batch != NULL) {
+        opt_trusted = opt_own_trusted != NULL ? opt_own_trusted
+            : opt_tls_trusted;
+        if (opt_trusted == NULL) {
+            LOG_err("Missing -own_trusted or -tls_trusted option for -batch");
+            return false;
+        }
+    } else if (opt_tls_cert != NULL) {
         if (opt_tls_trusted == NULL) {
             LOG_err("Missing -tls_trusted option for target certificate given by -tls_cert");
             return false;
@@ -1373,25 +1965,30 @@ static bool validate_cert(void)
 
     LOG(FL_INFO, "Validating certificate, optionally including revocation status ");
 #define STR_OR_NONE(s) (s != NULL ? s : "(none)")
-    LOG(FL_INFO, "Target certificate: %s", STR_OR_NONE(opt_cert));
+    LOG(FL_INFO, "Target certificate: %s",
+        STR_OR_NONE(opt_batch != NULL ? opt_batch : opt_cert));
     LOG(FL_INFO, "Trusted certs: %s", STR_OR_NONE(opt_trusted));
     LOG(FL_INFO, "Untrusted certs: %s", STR_OR_NONE(opt_untrusted));
 
-    target = CERT_load(opt_cert, opt_keypass, "target cert",
-                       -1 /* no type check */, vpm);
-    if (target == NULL)
-        return false;
-    LOG(FL_DEBUG, "Target certificate read successfully:");
-    LOG_cert_CDP(FL_DEBUG, target);
+    if (opt_batch == NULL) {
+        target = CERT_load(opt_cert, opt_keypass, "target cert",
+                           -1 /* no type check */, vpm);
+        if (target == NULL)
+            return false;
+        if (CMPclient_log_enabled(LOG_DEBUG)) {
+            LOG(FL_DEBUG, "Target certificate read successfully:");
+            LOG_cert_CDP(FL_DEBUG, target);
+        }
+    }
 
     /* TODO combine with part of prepare_CMP_client() */
-    store = STORE_load(opt_trusted,
-                       "trusted certs for validating certificate", vpm);
+    store = load_truststore(opt_trusted,
+                            "trusted certs for validating certificate", vpm);
     if (store == NULL)
         goto err;
     if (opt_untrusted != NULL &&
-        (untrusted = CERTS_load(opt_untrusted, "untrusted certs",
-                                1 /* CA */, vpm)) == NULL)
+        (untrusted = CERTS_load_cached(opt_untrusted, "untrusted certs",
+                                       1 /* CA */, vpm)) == NULL)
         goto err;
 
     if (!STORE_set_parameters(store, vpm,
@@ -1400,9 +1997,22 @@ static bool validate_cert(void)
                               opt_use_aia, opt_ocsp, (int)opt_ocsp_timeout))
         goto err;
 
-    if (!STORE_set_crl_callback(store, CRLMGMT_load_crl_cb, cmdata))
+#ifndef GENCMP_NO_CERTSTATUS
+    if (opt_batch != NULL && opt_check_all && !opt_ocsp_last
+        && (opt_use_aia || opt_ocsp != NULL))
+        opt_ocsp_multi = true; /* needed for caching the status of CA certs */
+    if (!STORE_set_crl_callback(store, opt_batch != NULL ? batch_crl_cb
+                                : CRLMGMT_load_crl_cb, cmdata)
+        || !set_ocsp_multi(store)
+        || (opt_batch != NULL && opt_ocsp_multi
+            && !CMPclient_ocsp_cache(store, BATCH_OCSP_CACHE_MAX)))
         goto err;
+#endif
 
+    if (opt_batch != NULL) {
+        ret = validate_batch(store, untrusted);
+        goto err;
+    }
     ret = CREDENTIALS_verify_cert(NULL /* uta_ctx */, target, untrusted, store)
         > 0;
     if (ret)
@@ -1673,6 +2283,10 @@ static CMP_err check_options(enum use_case use_case)
         LOG_err("-ocsp_last is given without -ocsp or -use_aia enabling OCSP-based cert status checking");
         return -38;
     }
+    if (opt_ocsp_multi && (!ocsp_check || !opt_check_all || opt_ocsp_last)) {
+        LOG_err("-ocsp_multi requires -check_all and -ocsp or -use_aia, and excludes -ocsp_last");
+        return -39;
+    }
     if (opt_stapling && !opt_tls_used) {
         LOG_warn("-stapling option is given without -tls_used");
     }
@@ -1894,7 +2508,8 @@ CMP_err save_certs(STACK_OF(X509) *certs, const char *field, const char *desc,
     char desc_certs[80];
 
     snprintf(desc_certs, sizeof(desc_certs), "%s certs", desc);
-    LOG(FL_TRACE, "Extracted %s from %s", desc_certs, field);
+    if (CMPclient_log_enabled(LOG_TRACE))
+        LOG(FL_TRACE, "Extracted %s from %s", desc_certs, field);
 
     if (file != NULL) {
         if (CERTS_save(certs, file, desc_certs) < 0) {
@@ -2020,7 +2635,8 @@ static int print_itavs(const STACK_OF(OSSL_CMP_ITAV) *itavs)
     return ret;
 }
 
-#if OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP
+#if (OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP) \
+    && !defined GENCMP_NO_GENM
 static int save_template(const char *file, const OSSL_CRMF_CERTTEMPLATE *tmpl)
 {
     BIO *bio = BIO_new_file(file, "wb");
@@ -2059,8 +2675,12 @@ static CMP_err do_genm(CMP_CTX *ctx, X509 *oldcert)
 {
     CMP_err err;
 
+#ifdef GENCMP_NO_CERTSTATUS
+    (void)oldcert; /* used only for -infotype crlStatusList */
+#endif
     switch (infotype) {
-#if OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP
+#if (OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP) \
+    && !defined GENCMP_NO_GENM
     case NID_id_it_caCerts:
         if (opt_cacertsout == NULL) {
             LOG(FL_ERR, "Missing -cacertsout option for -infotype caCerts");
@@ -2083,7 +2703,8 @@ static CMP_err do_genm(CMP_CTX *ctx, X509 *oldcert)
         CERTS_free(cacerts);
         return err;
 #endif
-#if OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP
+#if (OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP) \
+    && !defined GENCMP_NO_GENM
     case NID_id_it_rootCaCert:
         if (opt_newwithnew == NULL) {
             LOG(FL_ERR, "Missing -newwithnew option for -infotype rootCaCert");
@@ -2129,6 +2750,7 @@ static CMP_err do_genm(CMP_CTX *ctx, X509 *oldcert)
             return err;
         }
 
+#ifndef GENCMP_NO_CERTSTATUS /* CRL_load() is not available otherwise */
     case NID_id_it_crlStatusList:
         if (opt_oldcrl == NULL && opt_oldcert == NULL) {
             LOG(FL_ERR, "Missing -oldcrl and no -oldcert given for -infotype crlStatusList");
@@ -2167,6 +2789,7 @@ static CMP_err do_genm(CMP_CTX *ctx, X509 *oldcert)
             X509_CRL_free(crl);
             return err;
         }
+#endif
 
     case NID_id_it_certReqTemplate:
         if (opt_template == NULL) {
@@ -2378,6 +3001,7 @@ static int CMPclient(enum use_case use_case, OPTIONAL LOG_cb_t log_fn)
 
  err:
     CMPclient_finish(ctx); /* this also frees ctx */
+    CMPclient_spool_free(spool);
     KEY_free(new_pkey);
     EXTENSIONS_free(exts);
     CREDENTIALS_free(new_creds);
@@ -2439,10 +3063,34 @@ static bool set_verbosity(long level)
         return false;
     }
     opt_verbosity = level;
-    LOG_set_verbosity((severity)level);
+    CMPclient_log_set_verbosity((severity)level);
     return true;
 }
 
+/* ships the requests queued in the -spool directory */
+static int forward_spool(void)
+{
+    CMP_CTX *ctx = OSSL_CMP_CTX_new(NULL, NULL);
+    int err;
+
+    if (ctx == NULL) {
+        LOG_err("Out of memory");
+        return -76;
+    }
+    if (opt_server == NULL) {
+        LOG_err("-spool_forward requires -server");
+        err = -77;
+        goto err;
+    }
+    if ((err = setup_transfer(ctx)) != CMP_OK)
+        goto err;
+    err = CMPclient_spool_forward(ctx, opt_spool, NULL /* num */);
+
+ err:
+    CMPclient_finish(ctx);
+    return err;
+}
+
 int main(int argc, char *argv[])
 {
     int i;
@@ -2450,6 +3098,19 @@ int main(int argc, char *argv[])
     const char *name = "cmpClient";
     LOG_cb_t log_fn = LOG_console;
 
+    /* must be handled before OpenSSL allocates any memory */
+    for (i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-alloc_stats") == 0
+            || strcmp(argv[i], "--alloc_stats") == 0) {
+            long mode = UTIL_atoint(argv[i + 1]);
+
+            if (mode > 0 && CMPclient_alloc_stats_enable(mode > 1) != CMP_OK) {
+                fprintf(stderr, "cannot enable allocation statistics\n");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
     if (CMPclient_init(name, log_fn) != CMP_OK)
         goto end;
 
@@ -2487,16 +3148,20 @@ int main(int argc, char *argv[])
                 rc = print_help(prog);
                 goto end;
             } else if (i + 1 < argc) {
+#ifndef GENCMP_NO_CONFIG
                 if (strcmp(argv[i] + 1, "config") == 0)
                     opt_config = argv[++i];
                 else if (strcmp(argv[i] + 1, "section") == 0)
                     opt_section = argv[++i];
-                else if (strcmp(argv[i] + 1, "verbosity") == 0
+                else
+#endif
+                if (strcmp(argv[i] + 1, "verbosity") == 0
                          && !set_verbosity(UTIL_atoint(argv[++i])))
                     goto end; /* INT_MIN on parse error */
             }
         }
     }
+#ifndef GENCMP_NO_CONFIG
     if (opt_config[0] == '\0')
         opt_config = NULL;
     if (opt_section[0] == '\0')
@@ -2515,18 +3180,23 @@ int main(int argc, char *argv[])
         if (config == NULL)
             goto end;
     }
+#endif
     vpm = X509_VERIFY_PARAM_new();
     if (vpm == 0) {
         LOG_err("Out of memory");
         goto end;
     }
+#ifndef GENCMP_NO_CERTSTATUS
     cmdata = CRLMGMT_DATA_new();
     if (cmdata == 0) {
         LOG_err("Out of memory");
         goto end;
     }
+#endif
+#ifndef GENCMP_NO_CONFIG
     if (config != NULL && !CONF_update_vpm(config, opt_section, vpm))
         goto end;
+#endif
     argv++;
     if (use_case != no_use_case)
         argv++; /* skip first option since use_case is given */
@@ -2540,12 +3210,31 @@ int main(int argc, char *argv[])
         goto end;
     if (!set_verbosity(opt_verbosity))
         goto end;
+    if (opt_log_async >= 0) {
+        if (CMPclient_log_async_start(log_fn, (size_t)opt_log_async) != CMP_OK)
+            goto end;
+        log_fn = CMPclient_log_async;
+        LOG_init(log_fn);
+    }
+    CMPclient_dercache_enable(opt_dercache);
 
+#ifndef GENCMP_NO_CERTSTATUS
     CRLMGMT_DATA_set_proxy_url(cmdata, opt_cdp_proxy);
     CRLMGMT_DATA_set_crl_max_download_size(cmdata, opt_crl_maxdownload_size);
     CRLMGMT_DATA_set_crl_cache_dir(cmdata, opt_crl_cache_dir);
     CRLMGMT_DATA_set_note(cmdata, use_case == validate ? "validation" :
                           "tls or cmp connection or new certificate");
+#endif
+
+    if (opt_spool_forward) {
+        if (opt_spool == NULL) {
+            LOG_err("-spool_forward requires -spool");
+            goto end;
+        }
+        if (forward_spool() == CMP_OK)
+            rc = EXIT_SUCCESS;
+        goto end;
+    }
 
     /* handle here to start correct demo use case */
     if (opt_cmd != NULL) {
@@ -2574,23 +3263,35 @@ int main(int argc, char *argv[])
         goto end;
     }
 
+#ifndef GENCMP_NO_CERTSTATUS
     if (opt_crls != NULL) {
         crls = CRLs_load(opt_crls, (int)opt_crls_timeout, "pre-determined CRLs");
         if (crls == NULL)
             goto end;
     }
+#endif
     if (use_case == validate ? validate_cert()
                              : CMPclient(use_case, log_fn) == CMP_OK)
         rc = EXIT_SUCCESS;
+#ifndef GENCMP_NO_CERTSTATUS
     CRLs_free(crls);
+#endif
 
  end:
+    CMPclient_alloc_stats_log(LOG_INFO);
+    if (opt_fast_connect)
+        CMPclient_endpoint_stats_log(LOG_INFO);
+    CMPclient_log_async_stop();
     if (rc != EXIT_SUCCESS)
         OSSL_CMP_CTX_print_errors(NULL);
+#ifndef GENCMP_NO_CERTSTATUS
     CRLMGMT_DATA_free(cmdata);
+#endif
     X509_VERIFY_PARAM_free(vpm);
+#ifndef GENCMP_NO_CONFIG
     /* TODO fix potential memory leaks; find out why this potentially crashes: */
     NCONF_free(config);
+#endif
 
     return rc;
 }
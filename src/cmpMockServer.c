@@ -0,0 +1,689 @@
+/*-
+ * @file   cmpMockServer.c
+ * @brief  CMP mock CA server on localhost via HTTP(S), for tests and load tests
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <genericCMPClient.h>
+#include "mockCA.h"
+
+#include <openssl/ssl.h>
+
+#include <secutils/config/config.h>
+#include <secutils/credentials/cert.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * The server understands the [cmp] section of the server.cnf files used with
+ * the mock server of the OpenSSL 'cmp' app, such that it can take its place
+ * in the CLI-based tests. Beyond that, it offers HTTPS, response delays,
+ * and multiple worker threads serving connections in parallel.
+ * Only the line announcing the port is written to stdout; logging goes to
+ * stderr such that a parent process need not drain the output pipe.
+ */
+
+#define MOCK_SRV_HOST "127.0.0.1"
+#define MOCK_SRV_PATH "pkix" /* the only path accepted besides "" */
+#define MOCK_SRV_MAX_LINE 1024
+#define MOCK_SRV_MAX_BODY (16 * 1024 * 1024)
+#define MOCK_SRV_IDLE_TIMEOUT 30 /* seconds */
+#define MOCK_SRV_DEFAULT_THREADS 4
+#define MOCK_SRV_RETRY_AFTER 1 /* seconds, for requests beyond -max_rate */
+#define MOCK_SRV_MAX_THREADS 256
+
+static char *opt_config = "";
+static char *opt_section = "cmp";
+static long opt_verbosity = LOG_WARNING;
+
+static long opt_port;
+static const char *opt_host;
+static const char *opt_unix;
+static long opt_threads;
+static long opt_max_msgs;
+static long opt_max_rate;
+static const char *opt_tls_cert;
+static const char *opt_tls_key;
+static const char *opt_tls_keypass;
+
+static const char *opt_srv_secret;
+static const char *opt_srv_cert;
+static const char *opt_srv_key;
+static const char *opt_srv_keypass;
+static const char *opt_srv_trusted;
+static const char *opt_srv_untrusted;
+static const char *opt_ref_cert;
+static const char *opt_rsp_cert;
+static const char *opt_rsp_extracerts;
+static const char *opt_rsp_capubs;
+static long opt_poll_count;
+static long opt_check_after;
+static long opt_delay_ms;
+static bool opt_accept_unprotected;
+static bool opt_accept_raverified;
+static bool opt_grant_implicit_confirm;
+static bool opt_send_unprotected_errors;
+static bool opt_no_check_time;
+static bool opt_no_cache_extracerts;
+
+static opt_t srv_opts[] = {
+    { "help", OPT_BOOL, {.num = -1}, { NULL },
+      "Display this summary"},
+    { "config", OPT_TXT, {.txt = NULL}, { NULL },
+      "Configuration file to use. \"\" means none, which is the default"},
+    { "section", OPT_TXT, {.txt = NULL}, { NULL },
+      "Section(s) in config file to use. Default 'cmp'"},
+    { "verbosity", OPT_NUM, {.num = LOG_WARNING}, {(const char **) &opt_verbosity},
+      "Logging level; 3=ERR, 4=WARN, 6=INFO, 7=DEBUG, 8=TRACE. Default 4 = WARN"},
+
+    OPT_HEADER("Connection"),
+    { "host", OPT_TXT, {.txt = MOCK_SRV_HOST}, { &opt_host },
+      "IP address to listen on. Default " MOCK_SRV_HOST},
+    { "port", OPT_NUM, {.num = 0}, {(const char **) &opt_port },
+      "Port to listen on. Default 0 means any free port, which is printed"},
+    { "unix", OPT_TXT, {.txt = NULL}, { &opt_unix },
+      "Listen on Unix domain socket at given path instead of -host and -port"},
+    { "threads", OPT_NUM, {.num = MOCK_SRV_DEFAULT_THREADS},
+      {(const char **) &opt_threads },
+      "Number of worker threads serving connections in parallel. Default 4"},
+    { "max_msgs", OPT_NUM, {.num = 0}, {(const char **) &opt_max_msgs },
+      "Terminate after answering given number of requests. Default 0 = infinite"},
+    { "max_rate", OPT_NUM, {.num = 0}, {(const char **) &opt_max_rate },
+      "Answer requests beyond given number per second with 503. Default 0 = none"},
+    { "tls_cert", OPT_TXT, {.txt = NULL}, { &opt_tls_cert },
+      "Server's TLS certificate; if given, HTTPS is used instead of HTTP"},
+    { "tls_key", OPT_TXT, {.txt = NULL}, { &opt_tls_key },
+      "Private key for the server's TLS certificate"},
+    { "tls_keypass", OPT_TXT, {.txt = NULL}, { &opt_tls_keypass },
+      "Pass phrase source for -tls_key"},
+
+    OPT_HEADER("Mock CA"),
+    { "srv_secret", OPT_TXT, {.txt = NULL}, { &opt_srv_secret },
+      "Password source for PBM-based protection of responses"},
+    { "srv_cert", OPT_TXT, {.txt = NULL}, { &opt_srv_cert },
+      "Certificate of the server for signature-based protection of responses"},
+    { "srv_key", OPT_TXT, {.txt = NULL}, { &opt_srv_key },
+      "Private key of the server for signature-based protection"},
+    { "srv_keypass", OPT_TXT, {.txt = NULL}, { &opt_srv_keypass },
+      "Pass phrase source for -srv_key"},
+    { "srv_trusted", OPT_TXT, {.txt = NULL}, { &opt_srv_trusted },
+      "Trusted certificates for verifying signature-protected requests"},
+    { "srv_untrusted", OPT_TXT, {.txt = NULL}, { &opt_srv_untrusted },
+      "Intermediate certificates for verifying signature-protected requests"},
+    { "ref_cert", OPT_TXT, {.txt = NULL}, { &opt_ref_cert },
+      "Certificate to be expected for rr and any oldCertID in kur messages"},
+    { "rsp_cert", OPT_TXT, {.txt = NULL}, { &opt_rsp_cert },
+      "Certificate to be returned as mock enrollment result"},
+    { "rsp_extracerts", OPT_TXT, {.txt = NULL}, { &opt_rsp_extracerts },
+      "Extra certificates to be included in mock certification responses"},
+    { "rsp_capubs", OPT_TXT, {.txt = NULL}, { &opt_rsp_capubs },
+      "CA certificates to be included in mock ip response"},
+    { "poll_count", OPT_NUM, {.num = 0}, {(const char **) &opt_poll_count },
+      "Number of times the client must poll before receiving a certificate"},
+    { "check_after", OPT_NUM, {.num = 1}, {(const char **) &opt_check_after },
+      "The checkAfter value (number of seconds to wait) to include in poll response"},
+    { "delay_ms", OPT_NUM, {.num = 0}, {(const char **) &opt_delay_ms },
+      "Milliseconds to delay each response, for simulating slow servers"},
+    { "accept_unprotected", OPT_BOOL, {.bit = false},
+      { (const char **) &opt_accept_unprotected },
+      "Accept missing or invalid protection of requests"},
+    { "accept_raverified", OPT_BOOL, {.bit = false},
+      { (const char **) &opt_accept_raverified },
+      "Accept RAVERIFIED as proof-of-possession (POPO)"},
+    { "grant_implicit_confirm", OPT_BOOL, {.bit = false},
+      { (const char **) &opt_grant_implicit_confirm },
+      "Grant implicit confirmation of newly enrolled certificate"},
+    { "send_unprotected_errors", OPT_BOOL, {.bit = false},
+      { (const char **) &opt_send_unprotected_errors },
+      "Send error messages without protection"},
+    { "no_check_time", OPT_BOOL, {.bit = false},
+      { (const char **) &opt_no_check_time },
+      "Ignore current time when verifying certificates"},
+    { "no_cache_extracerts", OPT_BOOL, {.bit = false},
+      { (const char **) &opt_no_cache_extracerts },
+      "Do not keep certificates received in the extraCerts of requests"},
+
+    OPT_END
+};
+
+typedef struct mock_srv_st {
+    MOCK_CA *ca;
+    SSL_CTX *tls;
+    int fd; /* listening socket */
+    unsigned long msgs; /* number of requests answered, updated atomically */
+    pthread_mutex_t rate_lock; /* for -max_rate */
+    time_t rate_second;
+    long rate_count; /* of requests in rate_second */
+} MOCK_SRV;
+
+/* keep stdout free for the ACCEPT line */
+static bool log_stderr(OPTIONAL const char *func, OPTIONAL const char *file,
+                       int lineno, severity level, const char *msg)
+{
+    static const char *const levels[] = {
+        "EMERG", "ALERT", "CRIT", "ERROR", "WARN", "NOTE", "INFO", "DEBUG",
+        "TRACE"
+    };
+
+    (void)file;
+    (void)lineno;
+    fprintf(stderr, "cmpMockServer: %s%s%s: %s\n",
+            func != NULL ? func : "", func != NULL ? "(): " : "",
+            (unsigned)level < sizeof(levels) / sizeof(levels[0])
+            ? levels[level] : "?", msg);
+    return true;
+}
+
+static int print_help(const char *prog)
+{
+    BIO *bio_stdout = BIO_new_fp(stdout, BIO_NOCLOSE);
+
+    BIO_printf(bio_stdout, "Usage:\n%s options\n\n"
+               "Available options are:\n", prog);
+    OPT_help(srv_opts, bio_stdout);
+    BIO_free(bio_stdout);
+    return EXIT_SUCCESS;
+}
+
+static bool load_mock_opts(MOCK_CA_OPTS *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->poll_count = (int)opt_poll_count;
+    opts->check_after = (int)opt_check_after;
+    opts->delay_ms = (int)opt_delay_ms;
+    opts->accept_unprotected = opt_accept_unprotected;
+    opts->accept_raverified = opt_accept_raverified;
+    opts->grant_implicit_confirm = opt_grant_implicit_confirm;
+    opts->send_unprotected_errors = opt_send_unprotected_errors;
+    opts->no_check_time = opt_no_check_time;
+    opts->no_cache_extracerts = opt_no_cache_extracerts;
+    opts->verbosity = (int)opt_verbosity;
+    opts->log_cb = log_stderr;
+
+    if (opt_srv_secret != NULL
+        && (opts->srv_secret = FILES_get_pass(opt_srv_secret,
+                                              "PBM-based protection")) == NULL)
+        return false;
+    if (opt_srv_cert != NULL
+        && (opts->srv_cert = CERT_load(opt_srv_cert, opt_srv_keypass,
+                                       "server cert", -1, NULL)) == NULL)
+        return false;
+    if (opt_srv_key != NULL
+        && (opts->srv_key = KEY_load(opt_srv_key, opt_srv_keypass, NULL,
+                                     "server key")) == NULL)
+        return false;
+    if (opt_srv_trusted != NULL
+        && (opts->srv_trusted = STORE_load(opt_srv_trusted,
+                                           "trusted certs for requests",
+                                           NULL)) == NULL)
+        return false;
+    if (opt_srv_untrusted != NULL
+        && (opts->srv_untrusted = CERTS_load(opt_srv_untrusted,
+                                             "untrusted certs for requests",
+                                             -1, NULL)) == NULL)
+        return false;
+    if (opt_ref_cert != NULL
+        && (opts->ref_cert = CERT_load(opt_ref_cert, NULL, "reference cert",
+                                       -1, NULL)) == NULL)
+        return false;
+    if (opt_rsp_cert != NULL
+        && (opts->rsp_cert = CERT_load(opt_rsp_cert, NULL, "cert to return",
+                                       -1, NULL)) == NULL)
+        return false;
+    if (opt_rsp_extracerts != NULL
+        && (opts->rsp_extracerts = CERTS_load(opt_rsp_extracerts,
+                                              "extra certs to return",
+                                              -1, NULL)) == NULL)
+        return false;
+    if (opt_rsp_capubs != NULL
+        && (opts->rsp_capubs = CERTS_load(opt_rsp_capubs,
+                                          "CA certs to return", -1, NULL)) == NULL)
+        return false;
+    return true;
+}
+
+static void free_mock_opts(MOCK_CA_OPTS *opts)
+{
+    if (opts->srv_secret != NULL)
+        OPENSSL_clear_free((char *)opts->srv_secret, strlen(opts->srv_secret));
+    X509_free(opts->srv_cert);
+    EVP_PKEY_free(opts->srv_key);
+    X509_STORE_free(opts->srv_trusted);
+    CERTS_free(opts->srv_untrusted);
+    X509_free(opts->ref_cert);
+    X509_free(opts->rsp_cert);
+    CERTS_free(opts->rsp_extracerts);
+    CERTS_free(opts->rsp_capubs);
+}
+
+static bool send_status(BIO *bio, const char *version, const char *status)
+{
+    return BIO_printf(bio, "HTTP/%s %s\r\nContent-Length: 0\r\n"
+                      "Connection: close\r\n\r\n", version, status) > 0
+        && BIO_flush(bio) > 0;
+}
+
+/* simulates an overloaded server */
+static bool send_busy(BIO *bio, const char *version, bool keep_alive)
+{
+    return BIO_printf(bio, "HTTP/%s 503 Service Unavailable\r\n"
+                      "Retry-After: %d\r\nContent-Length: 0\r\n%s\r\n",
+                      version, MOCK_SRV_RETRY_AFTER,
+                      keep_alive ? "Connection: keep-alive\r\n" : "") > 0
+        && BIO_flush(bio) > 0;
+}
+
+static bool send_rsp(BIO *bio, const char *version, bool keep_alive,
+                     const OSSL_CMP_MSG *rsp)
+{
+    unsigned char *der = NULL;
+    int len = i2d_OSSL_CMP_MSG(rsp, &der);
+    bool ok = len > 0
+        && BIO_printf(bio, "HTTP/%s 200 OK\r\n"
+                      "Content-Type: application/pkixcmp\r\n"
+                      "Content-Length: %d\r\n%s\r\n", version, len,
+                      keep_alive ? "Connection: keep-alive\r\n" : "") > 0
+        && BIO_write(bio, der, len) == len
+        && BIO_flush(bio) > 0;
+
+    OPENSSL_free(der);
+    return ok;
+}
+
+/* returns the length of the line without any trailing CRLF, or -1 */
+static int read_line(BIO *bio, char *buf, int size)
+{
+    int len = BIO_gets(bio, buf, size);
+
+    if (len <= 0 || buf[len - 1] != '\n')
+        return -1; /* EOF, error, or line too long */
+    while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+        buf[--len] = '\0';
+    return len;
+}
+
+/* after answering a request */
+static void count_msg(MOCK_SRV *srv)
+{
+    if (opt_max_msgs > 0
+        && __atomic_add_fetch(&srv->msgs, 1, __ATOMIC_RELAXED)
+        >= (unsigned long)opt_max_msgs) {
+        LOG(FL_INFO, "Exiting after %ld messages", opt_max_msgs);
+        exit(EXIT_SUCCESS);
+    }
+}
+
+/* true if the request exceeds -max_rate within the current second */
+static bool over_rate(MOCK_SRV *srv)
+{
+    time_t now;
+    bool over;
+
+    if (opt_max_rate <= 0)
+        return false;
+    now = time(NULL);
+    (void)pthread_mutex_lock(&srv->rate_lock);
+    if (now != srv->rate_second) {
+        srv->rate_second = now;
+        srv->rate_count = 0;
+    }
+    over = ++srv->rate_count > opt_max_rate;
+    (void)pthread_mutex_unlock(&srv->rate_lock);
+    if (over)
+        LOG(FL_DEBUG, "Rejecting request beyond %ld per second", opt_max_rate);
+    return over;
+}
+
+/*
+ * Handle one HTTP request on the connection.
+ * Returns 1 if the connection may be kept alive, 0 if to be closed.
+ */
+static int serve_request(MOCK_SRV *srv, BIO *bio)
+{
+    char line[MOCK_SRV_MAX_LINE], path[MOCK_SRV_MAX_LINE];
+    char version[4] = "1.0", *start, *end;
+    unsigned char *body = NULL;
+    const unsigned char *p;
+    long content_len = -1;
+    bool keep_alive = false;
+    OSSL_CMP_MSG *req = NULL, *rsp = NULL;
+    int res = 0;
+
+    if (read_line(bio, line, sizeof(line)) <= 0)
+        return 0;
+    if (strncmp(line, "POST ", 5) != 0) {
+        LOG(FL_WARN, "Unsupported HTTP request '%s'", line);
+        (void)send_status(bio, version, "405 Method Not Allowed");
+        return 0;
+    }
+    start = line + 5;
+    if ((end = strstr(start, " HTTP/1.")) == NULL || strlen(end) != 9) {
+        LOG(FL_WARN, "Malformed HTTP request line '%s'", line);
+        (void)send_status(bio, version, "400 Bad Request");
+        return 0;
+    }
+    *end = '\0';
+    version[2] = end[8];
+    keep_alive = version[2] == '1'; /* HTTP/1.1 default */
+    while (*start == '/')
+        start++;
+    strcpy(path, start); /* fits since both buffers have the same size */
+    end = path + strlen(path); /* repeated '/'s are fine acc. to RFC 3986 */
+    while (end > path && end[-1] == '/')
+        *--end = '\0';
+
+    for (;;) {
+        int len = read_line(bio, line, sizeof(line));
+
+        if (len < 0)
+            return 0;
+        if (len == 0)
+            break;
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+            content_len = strtol(line + 15, NULL, 10);
+        else if (strncasecmp(line, "Connection:", 11) == 0)
+            keep_alive = strstr(line + 11, "keep-alive") != NULL
+                || strstr(line + 11, "Keep-Alive") != NULL;
+    }
+
+    if (strcmp(path, "") != 0 && strcmp(path, MOCK_SRV_PATH) != 0) {
+        LOG(FL_WARN, "Expecting empty path or '%s/' but got '%s'",
+            MOCK_SRV_PATH, path);
+        (void)send_status(bio, version, "404 Not Found");
+        return 0;
+    }
+    if (content_len <= 0 || content_len > MOCK_SRV_MAX_BODY) {
+        LOG(FL_WARN, "Missing or invalid Content-Length: %ld", content_len);
+        (void)send_status(bio, version, "411 Length Required");
+        return 0;
+    }
+    if ((body = OPENSSL_malloc((size_t)content_len)) == NULL
+        || BIO_read(bio, body, (int)content_len) != (int)content_len)
+        goto end;
+    p = body;
+    if ((req = d2i_OSSL_CMP_MSG(NULL, &p, content_len)) == NULL) {
+        LOG_warn("Cannot parse CMP request");
+        (void)send_status(bio, version, "400 Bad Request");
+        goto end;
+    }
+
+    if (over_rate(srv)) {
+        if (send_busy(bio, version, keep_alive))
+            res = keep_alive;
+        goto end;
+    }
+    if ((rsp = MOCK_CA_process(srv->ca, req)) == NULL) {
+        LOG_warn("Cannot produce CMP response");
+        goto end;
+    }
+    if (send_rsp(bio, version, keep_alive, rsp))
+        res = keep_alive;
+    count_msg(srv);
+
+ end:
+    ERR_clear_error();
+    OSSL_CMP_MSG_free(req);
+    OSSL_CMP_MSG_free(rsp);
+    OPENSSL_free(body);
+    return res;
+}
+
+static void serve_connection(MOCK_SRV *srv, int fd)
+{
+    struct timeval tv;
+    BIO *bio, *sock;
+
+    tv.tv_sec = MOCK_SRV_IDLE_TIMEOUT;
+    tv.tv_usec = 0;
+    (void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if ((sock = BIO_new_socket(fd, BIO_CLOSE)) == NULL) {
+        close(fd);
+        return;
+    }
+    if (srv->tls != NULL) {
+        BIO *ssl = BIO_new_ssl(srv->tls, 0 /* server */);
+
+        if (ssl == NULL) {
+            BIO_free_all(sock);
+            return;
+        }
+        sock = BIO_push(ssl, sock);
+    }
+    if ((bio = BIO_new(BIO_f_buffer())) == NULL) {
+        BIO_free_all(sock);
+        return;
+    }
+    bio = BIO_push(bio, sock);
+    while (serve_request(srv, bio))
+        ;
+    BIO_free_all(bio);
+    ERR_clear_error();
+}
+
+static void *worker(void *arg)
+{
+    MOCK_SRV *srv = arg;
+
+    for (;;) {
+        int fd = accept(srv->fd, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            LOG(FL_ERR, "accept() failed: %s", strerror(errno));
+            break;
+        }
+        serve_connection(srv, fd);
+    }
+    return NULL;
+}
+
+/* returns the listening socket and sets *port to the port actually used */
+static int listen_on(const char *host, int *port)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd, on = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)*port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        LOG(FL_ERR, "Invalid IPv4 address '%s'", host);
+        return -1;
+    }
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    (void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(fd, SOMAXCONN) != 0
+        || getsockname(fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        LOG(FL_ERR, "Cannot listen on %s:%d: %s", host, *port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/* returns the listening socket, replacing any stale socket file at path */
+static int listen_on_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LOG(FL_ERR, "Socket path too long: '%s'", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    (void)unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(fd, SOMAXCONN) != 0) {
+        LOG(FL_ERR, "Cannot listen on unix:%s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    MOCK_SRV srv;
+    MOCK_CA_OPTS mock_opts;
+    CONF *config = NULL;
+    CREDENTIALS *tls_creds = NULL;
+    X509_VERIFY_PARAM *vpm = NULL;
+    pthread_t *threads = NULL;
+    const char *prog = argv[0];
+    int i, n_threads, port, rv, rc = EXIT_FAILURE;
+
+    memset(&srv, 0, sizeof(srv));
+    memset(&mock_opts, 0, sizeof(mock_opts));
+    srv.fd = -1;
+    (void)pthread_mutex_init(&srv.rate_lock, NULL);
+    if (CMPclient_init("cmpMockServer", log_stderr) != CMP_OK)
+        goto end;
+    if (!OPT_init(srv_opts))
+        goto end;
+    /* handle -help, -config, and -section upfront to take effect for other opts */
+    for (i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            if (argv[i][1] == '-')
+                argv[i]++;
+            if (strcmp(argv[i] + 1, "help") == 0) {
+                rc = print_help(prog);
+                goto end;
+            } else if (i + 1 < argc) {
+                if (strcmp(argv[i] + 1, "config") == 0)
+                    opt_config = argv[++i];
+                else if (strcmp(argv[i] + 1, "section") == 0)
+                    opt_section = argv[++i];
+            }
+        }
+    }
+    if (opt_config[0] != '\0') {
+        LOG(FL_INFO, "Using section(s) '%s' of configuration file '%s'",
+            opt_section, opt_config);
+        if ((config = CONF_load_options(NULL, opt_config, opt_section,
+                                        srv_opts)) == NULL)
+            goto end;
+    }
+    if ((vpm = X509_VERIFY_PARAM_new()) == NULL)
+        goto end;
+    rv = OPT_read(srv_opts, argv + 1, vpm);
+    if (rv == -1) {
+        rc = print_help(prog);
+        goto end;
+    }
+    if (rv <= 0)
+        goto end;
+    if (opt_verbosity < LOG_EMERG || opt_verbosity > LOG_TRACE) {
+        LOG(FL_ERR, "Logging verbosity level %ld out of range (0 .. 8)",
+            opt_verbosity);
+        goto end;
+    }
+    CMPclient_log_set_verbosity((severity)opt_verbosity);
+    if (opt_threads < 1 || opt_threads > MOCK_SRV_MAX_THREADS) {
+        LOG(FL_ERR, "Number of threads %ld out of range (1 .. %d)",
+            opt_threads, MOCK_SRV_MAX_THREADS);
+        goto end;
+    }
+    if (opt_port < 0 || opt_port > 65535 || opt_poll_count < 0
+        || opt_check_after < 0 || opt_delay_ms < 0 || opt_max_msgs < 0) {
+        LOG_err("Negative or out-of-range numerical option value");
+        goto end;
+    }
+
+    if (!load_mock_opts(&mock_opts)
+        || (srv.ca = MOCK_CA_new(NULL, NULL, &mock_opts,
+                                 (int)opt_threads)) == NULL)
+        goto end;
+    if (opt_tls_cert != NULL || opt_tls_key != NULL) {
+#ifdef SECUTILS_NO_TLS
+        LOG_err("TLS is not supported by this build");
+        goto end;
+#else
+        if ((tls_creds = CREDENTIALS_load(opt_tls_cert, opt_tls_key,
+                                          opt_tls_keypass,
+                                          "credentials for TLS server")) == NULL
+            || (srv.tls = TLS_CTX_new(NULL, 0 /* server */, NULL, NULL,
+                                      tls_creds, NULL, -1, NULL)) == NULL) {
+            LOG_err("Unable to set up TLS server context");
+            goto end;
+        }
+#endif
+    }
+
+    (void)signal(SIGPIPE, SIG_IGN); /* peers may close at any time */
+    port = (int)opt_port;
+    if (opt_unix != NULL) {
+        if ((srv.fd = listen_on_unix(opt_unix)) < 0)
+            goto end;
+        printf("ACCEPT unix:%s PID=%d\n", opt_unix, (int)getpid());
+    } else {
+        if ((srv.fd = listen_on(opt_host, &port)) < 0)
+            goto end;
+        /* the format of this line is expected by test/recipes/80-test_cmp_http.t */
+        printf("ACCEPT %s:%d PID=%d\n", opt_host, port, (int)getpid());
+    }
+    fflush(stdout);
+
+    if ((threads = OPENSSL_zalloc((size_t)opt_threads * sizeof(*threads))) == NULL)
+        goto end;
+    for (i = 0; i < opt_threads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &srv) != 0) {
+            LOG(FL_ERR, "Cannot start worker thread %d", i);
+            break;
+        }
+    }
+    n_threads = i;
+    if (n_threads == opt_threads)
+        rc = EXIT_SUCCESS;
+    for (i = 0; i < n_threads; i++)
+        (void)pthread_join(threads[i], NULL); /* returns only on error */
+    if (n_threads > 0)
+        rc = EXIT_FAILURE;
+
+ end:
+    if (srv.fd >= 0) {
+        close(srv.fd);
+        if (opt_unix != NULL)
+            (void)unlink(opt_unix);
+    }
+    OPENSSL_free(threads);
+    (void)pthread_mutex_destroy(&srv.rate_lock);
+    MOCK_CA_free(srv.ca);
+    free_mock_opts(&mock_opts);
+#ifndef SECUTILS_NO_TLS
+    TLS_CTX_free(srv.tls);
+#endif
+    CREDENTIALS_free(tls_creds);
+    X509_VERIFY_PARAM_free(vpm);
+    NCONF_free(config);
+    CMPclient_finish(NULL);
+    return rc;
+}
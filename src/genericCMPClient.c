@@ -13,11 +13,19 @@
  *  SPDX-License-Identifier: Apache-2.0
  */
 
-#include "genericCMPClient.h"
+#include "genericCMPClient_local.h"
 
 #include <openssl/cmperr.h>
+#include <openssl/pkcs12.h>
 #include <openssl/ssl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+# include <unistd.h> /* for geteuid() */
+#endif
 
 #if OPENSSL_VERSION_NUMBER < 0x10100006L
 typedef
@@ -66,7 +74,7 @@ CMP_err CMPclient_init(OPTIONAL const char *name, OPTIONAL LOG_cb_t log_fn)
         name = CMPCLIENT_MODULE_NAME;
     LOG_set_name(name);
     LOG_init((LOG_cb_t)log_fn); /* assumes that severity in SecUtils is same as in CMPforOpenSSL */
-    LOG_set_verbosity(LOG_INFO);
+    CMPclient_log_set_verbosity(LOG_INFO);
 
     UTIL_setup_openssl(OPENSSL_VERSION_NUMBER, name);
 #if OPENSSL_VERSION_NUMBER < OPENSSL_V_3_0_0
@@ -99,13 +107,98 @@ CMP_err CMPclient_init(OPTIONAL const char *name, OPTIONAL LOG_cb_t log_fn)
     return CMP_OK;
 }
 
-static X509_NAME *parse_DN(const char *str, const char *desc)
+/*
+ * Per-thread cache of the most recently parsed DNs, which in bulk enrollment
+ * typically include the same recipient and issuer over and over again.
+ * Lookups yield copies, such that no reference into the cache is kept around,
+ * also not by jobs that share a thread when running on a CMPCLIENT_ENGINE.
+ */
+#define DN_CACHE_SIZE 8
+
+typedef struct dn_cache_st {
+    char *str[DN_CACHE_SIZE];
+    X509_NAME *name[DN_CACHE_SIZE];
+    int next; /* entry to be replaced next */
+} DN_CACHE;
+
+static pthread_once_t dn_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t dn_cache_key;
+static bool dn_cache_ok = false;
+
+/* called on thread exit */
+static void dn_cache_free(void *arg)
 {
-    X509_NAME *name = UTIL_parse_name(str, MBSTRING_ASC, false);
+    DN_CACHE *cache = arg;
+    int i;
 
-    if (name == NULL)
+    for (i = 0; i < DN_CACHE_SIZE; i++) {
+        OPENSSL_free(cache->str[i]);
+        X509_NAME_free(cache->name[i]);
+    }
+    OPENSSL_free(cache);
+}
+
+/* the key destructor is not called for the main thread, so do this at exit */
+static void dn_cache_free_at_exit(void)
+{
+    DN_CACHE *cache = pthread_getspecific(dn_cache_key);
+
+    if (cache != NULL) {
+        (void)pthread_setspecific(dn_cache_key, NULL);
+        dn_cache_free(cache);
+    }
+}
+
+static void dn_cache_init(void)
+{
+    dn_cache_ok = pthread_key_create(&dn_cache_key, dn_cache_free) == 0
+        && atexit(dn_cache_free_at_exit) == 0;
+}
+
+static DN_CACHE *get_dn_cache(void)
+{
+    DN_CACHE *cache;
+
+    (void)pthread_once(&dn_cache_once, dn_cache_init);
+    if (!dn_cache_ok)
+        return NULL;
+    if ((cache = pthread_getspecific(dn_cache_key)) == NULL
+        && (cache = OPENSSL_zalloc(sizeof(*cache))) != NULL
+        && pthread_setspecific(dn_cache_key, cache) != 0) {
+        OPENSSL_free(cache);
+        cache = NULL;
+    }
+    return cache;
+}
+
+/* returns a newly allocated name, which the caller must free */
+static X509_NAME *get1_DN(const char *str, const char *desc)
+{
+    DN_CACHE *cache = get_dn_cache();
+    X509_NAME *name;
+    char *copy;
+    int i;
+
+    for (i = 0; cache != NULL && i < DN_CACHE_SIZE; i++)
+        if (cache->str[i] != NULL && strcmp(cache->str[i], str) == 0)
+            return X509_NAME_dup(cache->name[i]);
+
+    if ((name = UTIL_parse_name(str, MBSTRING_ASC, false)) == NULL) {
         LOG(FL_ERR, "Unable to parse %s DN '%s'", desc, str);
-    return name;
+        return NULL;
+    }
+    if (cache == NULL || (copy = OPENSSL_strdup(str)) == NULL) {
+        LOG(FL_ERR, "Out of memory caching %s DN", desc);
+        X509_NAME_free(name);
+        return NULL;
+    }
+    i = cache->next;
+    cache->next = (i + 1) % DN_CACHE_SIZE;
+    OPENSSL_free(cache->str[i]);
+    X509_NAME_free(cache->name[i]);
+    cache->str[i] = copy;
+    cache->name[i] = name;
+    return X509_NAME_dup(name);
 }
 
 CMP_err CMPclient_prepare(OSSL_CMP_CTX **pctx,
@@ -123,12 +216,19 @@ CMP_err CMPclient_prepare(OSSL_CMP_CTX **pctx,
                           OPTIONAL X509_STORE *new_cert_truststore,
                           bool implicit_confirm)
 {
+    ALLOC_PHASE_SCOPE;
     OSSL_CMP_CTX *ctx = NULL;
+    int level = LOG_TRACE;
 
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_PREPARE);
     if (pctx == NULL) {
         return CMP_R_NULL_ARGUMENT;
     }
+    /* let OpenSSL skip formatting its messages that would be discarded */
+    while (level > LOG_EMERG && !CMPclient_log_enabled((severity)level))
+        level--;
     if ((ctx = OSSL_CMP_CTX_new(libctx, propq)) == NULL ||
+        !OSSL_CMP_CTX_set_log_verbosity(ctx, level) ||
         !OSSL_CMP_CTX_set_log_cb(ctx, log_fn != NULL ?
                                  (OSSL_CMP_log_cb_t)log_fn :
                                  /* difference is in 'int' vs. 'bool' and additional TRACE value */
@@ -172,9 +272,10 @@ CMP_err CMPclient_prepare(OSSL_CMP_CTX **pctx,
     }
 
     /* need recipient for unprotected and PBM-protected messages */
-    X509_NAME *rcp = NULL;
+    const X509_NAME *rcp = NULL;
+    X509_NAME *own_rcp = NULL;
     if (recipient != NULL) {
-        rcp = parse_DN(recipient, "recipient");
+        rcp = own_rcp = get1_DN(recipient, "recipient");
         if (rcp == NULL) {
             OSSL_CMP_CTX_free(ctx);
             return CMP_R_INVALID_PARAMETERS;
@@ -183,23 +284,24 @@ CMP_err CMPclient_prepare(OSSL_CMP_CTX **pctx,
         if (sk_X509_num(untrusted) > 0) {
             X509 *first = sk_X509_value(untrusted, 0);
 
-            rcp = X509_NAME_dup((X509_get_subject_name(first)));
+            own_rcp = X509_NAME_dup((X509_get_subject_name(first)));
         } else {
             LOG(FL_WARN, "No explicit recipient, no cert, and no untrusted certs given; resorting to NULL DN");
-            rcp = X509_NAME_new();
+            own_rcp = X509_NAME_new();
         }
-        if (rcp == NULL) {
+        if (own_rcp == NULL) {
             LOG(FL_ERR,
                 "Internal error like out of memory obtaining recipient DN",
                 recipient);
             OSSL_CMP_CTX_free(ctx);
             return CMP_R_RECIPIENT;
         }
+        rcp = own_rcp;
     }
     if (rcp != NULL) { /* else CMPforOpenSSL uses cert issuer */
         bool rv = OSSL_CMP_CTX_set1_recipient(ctx, rcp);
 
-        X509_NAME_free(rcp);
+        X509_NAME_free(own_rcp);
         if (!rv)
             goto err;
     }
@@ -243,14 +345,16 @@ CMP_err CMPclient_prepare(OSSL_CMP_CTX **pctx,
     }
     if (new_cert_truststore != NULL) {
         /* ignore any -attime option here, since new certs are current anyway */
-        X509_VERIFY_PARAM *out_vpm = X509_STORE_get0_param(new_cert_truststore);
-
-        X509_VERIFY_PARAM_clear_flags(out_vpm, X509_V_FLAG_USE_CHECK_TIME);
+        X509_STORE *out_ts =
+            CMPclient_trust_get1_new_cert_store(new_cert_truststore);
 
+        if (out_ts == NULL)
+            goto err;
         if (!OSSL_CMP_CTX_set_certConf_cb(ctx, OSSL_CMP_certConf_cb) ||
-            !OSSL_CMP_CTX_set_certConf_cb_arg(ctx, new_cert_truststore) ||
-            !X509_STORE_up_ref(new_cert_truststore))
+            !OSSL_CMP_CTX_set_certConf_cb_arg(ctx, out_ts)) {
+            X509_STORE_free(out_ts);
             goto err;
+        }
     }
 
     *pctx = ctx;
@@ -261,9 +365,97 @@ CMP_err CMPclient_prepare(OSSL_CMP_CTX **pctx,
     return CMPOSSL_error();
 }
 
+CMP_err CMPclient_prepare_from_mem(CMP_CTX **pctx,
+                                   OSSL_LIB_CTX *libctx, const char *propq,
+                                   OPTIONAL LOG_cb_t log_fn,
+                                   OPTIONAL const CMPCLIENT_MEM *cmp_trusted,
+                                   OPTIONAL const char *recipient,
+                                   OPTIONAL const CMPCLIENT_MEM *untrusted,
+                                   OPTIONAL const CMPCLIENT_MEM *key,
+                                   OPTIONAL const char *key_pass,
+                                   OPTIONAL const CMPCLIENT_MEM *certs,
+                                   OPTIONAL const char *secret,
+                                   OPTIONAL const char *secret_ref,
+                                   OPTIONAL const CMPCLIENT_MEM *creds_trusted,
+                                   OPTIONAL const char *digest,
+                                   OPTIONAL const char *mac,
+                                   OPTIONAL OSSL_CMP_transfer_cb_t transfer_fn,
+                                   int total_timeout,
+                                   OPTIONAL const CMPCLIENT_MEM *new_cert_trusted,
+                                   bool implicit_confirm)
+{
+    ALLOC_PHASE_SCOPE;
+    X509_STORE *cmp_ts = NULL, *creds_ts = NULL, *new_cert_ts = NULL;
+    STACK_OF(X509) *untrusted_certs = NULL, *own_certs = NULL;
+    EVP_PKEY *pkey = NULL;
+    CREDENTIALS *creds = NULL;
+    CMP_err err = CMP_R_LOAD_CERTS;
+
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_PREPARE);
+    if ((cmp_trusted != NULL
+         && (cmp_ts = STORE_load_from_mem(cmp_trusted->data, cmp_trusted->len,
+                                          "trusted certs for CMP level",
+                                          NULL)) == NULL)
+        || (untrusted != NULL
+            && (untrusted_certs =
+                CERTS_load_from_mem(untrusted->data, untrusted->len,
+                                    "untrusted certs")) == NULL)
+        || (certs != NULL
+            && (own_certs = CERTS_load_from_mem(certs->data, certs->len,
+                                                "own cert and chain")) == NULL)
+        || (creds_trusted != NULL
+            && (creds_ts =
+                STORE_load_from_mem(creds_trusted->data, creds_trusted->len,
+                                    "trusted certs for own chain",
+                                    NULL)) == NULL)
+        || (new_cert_trusted != NULL
+            && (new_cert_ts =
+                STORE_load_from_mem(new_cert_trusted->data,
+                                    new_cert_trusted->len,
+                                    "trusted certs for new cert",
+                                    NULL)) == NULL))
+        goto end;
+    if (key != NULL
+        && (pkey = KEY_load_from_mem(key->data, key->len, key_pass,
+                                     "own private key")) == NULL) {
+        err = CMP_R_LOAD_CREDS;
+        goto end;
+    }
+
+    if (pkey != NULL || own_certs != NULL || secret != NULL
+        || secret_ref != NULL) {
+        X509 *cert = sk_X509_shift(own_certs);
+
+        creds = CREDENTIALS_new(pkey, cert, own_certs, secret, secret_ref);
+        X509_free(cert);
+        if (creds == NULL) {
+            err = CMP_R_LOAD_CREDS;
+            goto end;
+        }
+    }
+    err = CMPclient_prepare(pctx, libctx, propq, log_fn, cmp_ts, recipient,
+                            untrusted_certs, creds, creds_ts, digest, mac,
+                            transfer_fn, total_timeout, new_cert_ts,
+                            implicit_confirm);
+
+ end:
+    /* CMPclient_prepare() has taken its own references as far as needed */
+    X509_STORE_free(cmp_ts);
+    sk_X509_pop_free(untrusted_certs, X509_free);
+    EVP_PKEY_free(pkey);
+    sk_X509_pop_free(own_certs, X509_free);
+    CREDENTIALS_free(creds);
+    X509_STORE_free(creds_ts);
+    X509_STORE_free(new_cert_ts);
+    return err;
+}
+
 CMP_err CMPclient_setup_BIO(CMP_CTX *ctx, BIO *rw, const char *path,
                             int keep_alive, int timeout)
 {
+    ALLOC_PHASE_SCOPE;
+
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_SETUP);
     if (ctx == NULL) {
         return CMP_R_INVALID_CONTEXT;
     }
@@ -352,6 +544,11 @@ static BIO *app_http_tls_cb(BIO *bio, void *arg, int connect, int detail)
             BIO_free(sbio);
             return NULL;
         }
+        if (!CMPclient_trust_apply_TLS(ssl)) {
+            SSL_free(ssl);
+            BIO_free(sbio);
+            return NULL;
+        }
 
         SSL_set_tlsext_host_name(ssl, info->server); /* not critical to do */
         SSL_set_connect_state(ssl);
@@ -402,6 +599,77 @@ static int is_localhost(const char *host)
 }
 #endif
 
+/* the transport is set as both transfer_cb_arg and http_cb_arg */
+static CMPCLIENT_TRANSPORT *get0_transport(const OSSL_CMP_CTX *ctx)
+{
+    void *arg = OSSL_CMP_CTX_get_transfer_cb_arg(ctx);
+
+    return arg != NULL && arg == OSSL_CMP_CTX_get_http_cb_arg(ctx) ? arg : NULL;
+}
+
+/* when setting up anew, e.g., for a different server */
+static void free_transport(OSSL_CMP_CTX *ctx)
+{
+    CMPCLIENT_TRANSPORT *t = get0_transport(ctx);
+
+    if (t == NULL)
+        return;
+    (void)OSSL_CMP_CTX_set_http_cb_arg(ctx, NULL);
+    (void)OSSL_CMP_CTX_set_transfer_cb_arg(ctx, NULL);
+    (void)OSSL_CMP_CTX_set_transfer_cb(ctx, NULL);
+    CMPclient_transport_free(t);
+}
+
+/* on success, t is freed along with ctx by CMPclient_finish() */
+static CMP_err set0_transport(OSSL_CMP_CTX *ctx, CMPCLIENT_TRANSPORT *t)
+{
+#ifndef SECUTILS_NO_TLS
+    /* TLS is handled by the transport, which holds its own ref to tls */
+    APP_HTTP_TLS_INFO_free(OSSL_CMP_CTX_get_http_cb_arg(ctx));
+#endif
+    if (!OSSL_CMP_CTX_set_http_cb(ctx, NULL)
+        || !OSSL_CMP_CTX_set_http_cb_arg(ctx, t)
+        || !OSSL_CMP_CTX_set_transfer_cb(ctx, CMPclient_transport_cb)
+        || !OSSL_CMP_CTX_set_transfer_cb_arg(ctx, t)) {
+        (void)OSSL_CMP_CTX_set_http_cb_arg(ctx, NULL);
+        (void)OSSL_CMP_CTX_set_transfer_cb_arg(ctx, NULL);
+        CMPclient_transport_free(t);
+        return CMPOSSL_error();
+    }
+    return CMP_OK;
+}
+
+#define UNIX_PREFIX "unix:"
+#define UNIX_PREFIX_LEN (sizeof(UNIX_PREFIX) - 1)
+
+/* server of the form unix:/path/to/socket, e.g., of a co-located RA */
+static CMP_err setup_unix(OSSL_CMP_CTX *ctx, const char *socket_path,
+                          const char *path, int keep_alive, int timeout,
+                          OPTIONAL SSL_CTX *tls, OPTIONAL const char *proxy)
+{
+    CMPCLIENT_TRANSPORT *t;
+    CMP_err err;
+
+    if (tls != NULL) {
+        LOG(FL_ERR, "TLS is not supported via Unix domain socket");
+        return CMP_R_INVALID_PARAMETERS;
+    }
+    if (proxy != NULL && proxy[0] != '\0')
+        LOG(FL_WARN, "ignoring proxy for Unix domain socket");
+    if (path == NULL)
+        path = "";
+    err = CMPclient_setup_BIO(ctx, NULL, path, keep_alive, timeout);
+    if (err != CMP_OK)
+        return err;
+    if ((t = CMPclient_transport_new_unix(socket_path, path)) == NULL)
+        return CMP_R_INVALID_PARAMETERS;
+    err = set0_transport(ctx, t);
+    if (err == CMP_OK)
+        LOG(FL_INFO, "will contact %s%s at HTTP path \"%s%s\"",
+            UNIX_PREFIX, socket_path, path[0] == '/' ? "" : "/", path);
+    return err;
+}
+
 /* Will return error when used with OpenSSL compiled with OPENSSL_NO_SOCK. */
 CMP_err CMPclient_setup_HTTP(OSSL_CMP_CTX *ctx,
                              const char *server, const char *path,
@@ -409,8 +677,10 @@ CMP_err CMPclient_setup_HTTP(OSSL_CMP_CTX *ctx,
                              OPTIONAL const char *proxy,
                              OPTIONAL const char *no_proxy)
 {
+    ALLOC_PHASE_SCOPE;
     CMP_err err = CMP_R_INVALID_PARAMETERS;
 
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_SETUP);
     if (ctx == NULL) {
         LOG(FL_ERR, "No ctx parameter given");
         return CMP_R_INVALID_CONTEXT;
@@ -421,6 +691,10 @@ CMP_err CMPclient_setup_HTTP(OSSL_CMP_CTX *ctx,
         return err;
     }
 #endif
+    free_transport(ctx);
+    if (server != NULL && strncmp(server, UNIX_PREFIX, UNIX_PREFIX_LEN) == 0)
+        return setup_unix(ctx, server + UNIX_PREFIX_LEN, path,
+                          keep_alive, timeout, tls, proxy);
     char *host = NULL, *server_port = NULL, *parsed_path = NULL;
     if (server == NULL)
         goto set_path;
@@ -515,6 +789,115 @@ CMP_err CMPclient_setup_HTTP(OSSL_CMP_CTX *ctx,
     return err;
 }
 
+CMP_err CMPclient_setup_transport(OSSL_CMP_CTX *ctx,
+                                  const char *server, const char *path,
+                                  int keep_alive, int timeout,
+                                  OPTIONAL SSL_CTX *tls,
+                                  OPTIONAL const char *proxy,
+                                  OPTIONAL const char *no_proxy)
+{
+    ALLOC_PHASE_SCOPE;
+    char *host = NULL, *port = NULL, *parsed_path = NULL;
+    CMPCLIENT_TRANSPORT *t = NULL;
+    CMP_err err;
+
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_SETUP);
+    if (server == NULL) {
+        LOG(FL_ERR, "No server parameter given");
+        return CMP_R_INVALID_PARAMETERS;
+    }
+    err = CMPclient_setup_HTTP(ctx, server, path, keep_alive, timeout,
+                               tls, proxy, no_proxy);
+    if (err != CMP_OK
+        || strncmp(server, UNIX_PREFIX, UNIX_PREFIX_LEN) == 0) /* done */
+        return err;
+    if (!OSSL_HTTP_parse_url(server, NULL, NULL, &host, &port, NULL,
+                             &parsed_path, NULL, NULL))
+        return CMPOSSL_error();
+    t = CMPclient_transport_new(host, port, path != NULL ? path : parsed_path,
+                                tls, proxy, no_proxy);
+    OPENSSL_free(host);
+    OPENSSL_free(port);
+    OPENSSL_free(parsed_path);
+    if (t == NULL)
+        return CMP_R_INVALID_PARAMETERS;
+
+    return set0_transport(ctx, t);
+}
+
+/* the spool is owned by the caller, so not freed along with ctx */
+CMP_err CMPclient_setup_spool(OSSL_CMP_CTX *ctx, CMPCLIENT_SPOOL *spool,
+                              int timeout)
+{
+    ALLOC_PHASE_SCOPE;
+
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_SETUP);
+    if (ctx == NULL) {
+        LOG(FL_ERR, "No ctx parameter given");
+        return CMP_R_INVALID_CONTEXT;
+    }
+    if (spool == NULL) {
+        LOG(FL_ERR, "No spool parameter given");
+        return CMP_R_INVALID_PARAMETERS;
+    }
+    free_transport(ctx);
+#ifndef SECUTILS_NO_TLS
+    APP_HTTP_TLS_INFO_free(OSSL_CMP_CTX_get_http_cb_arg(ctx));
+#endif
+    if (!OSSL_CMP_CTX_set_http_cb_arg(ctx, NULL)
+        || (timeout >= 0 && !OSSL_CMP_CTX_set_option(ctx,
+                                                     OSSL_CMP_OPT_MSG_TIMEOUT,
+                                                     timeout))
+        || !OSSL_CMP_CTX_set_transfer_cb(ctx, CMPclient_spool_cb)
+        || !OSSL_CMP_CTX_set_transfer_cb_arg(ctx, spool))
+        return CMPOSSL_error();
+    LOG_info("will queue requests in spool rather than contacting server");
+    return CMP_OK;
+}
+
+CMP_err CMPclient_set_transport_opts(CMP_CTX *ctx,
+                                     OPTIONAL const CMPCLIENT_TRANSPORT_OPTS *opts)
+{
+    CMPCLIENT_TRANSPORT *t;
+
+    if (ctx == NULL) {
+        LOG(FL_ERR, "No ctx parameter given");
+        return CMP_R_INVALID_CONTEXT;
+    }
+    if ((t = get0_transport(ctx)) == NULL) {
+        LOG(FL_ERR, "transport options require CMPclient_setup_transport()");
+        return CMP_R_INVALID_PARAMETERS;
+    }
+    CMPclient_transport_set_opts(t, opts);
+    return CMP_OK;
+}
+
+CMP_err CMPclient_set_rate_limit(CMP_CTX *ctx,
+                                 OPTIONAL const CMPCLIENT_RATE_LIMIT *limit)
+{
+    ALLOC_PHASE_SCOPE;
+    CMPCLIENT_TRANSPORT *t;
+
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_SETUP);
+    if (ctx == NULL) {
+        LOG(FL_ERR, "No ctx parameter given");
+        return CMP_R_INVALID_CONTEXT;
+    }
+    if ((t = get0_transport(ctx)) == NULL) {
+        LOG(FL_ERR, "rate limits require CMPclient_setup_transport()");
+        return CMP_R_INVALID_PARAMETERS;
+    }
+    return CMPclient_transport_set_rate_limit(t, limit)
+        ? CMP_OK : CMP_R_INVALID_PARAMETERS;
+}
+
+bool CMPclient_get_exchange_times(const CMP_CTX *ctx,
+                                  CMPCLIENT_EXCHANGE_TIMES *times)
+{
+    return ctx != NULL
+        && CMPclient_transport_times_get(get0_transport(ctx), times);
+}
+
 #if OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP
 static int ossl_cmp_sk_ASN1_UTF8STRING_push_str(STACK_OF(ASN1_UTF8STRING) *sk,
                                                 const char *text, int len)
@@ -540,6 +923,9 @@ static int ossl_cmp_sk_ASN1_UTF8STRING_push_str(STACK_OF(ASN1_UTF8STRING) *sk,
 
 CMP_err CMPclient_add_certProfile(CMP_CTX *ctx, OPTIONAL const char *name)
 {
+    ALLOC_PHASE_SCOPE;
+
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_SETUP);
     if (ctx == NULL) {
         LOG(FL_ERR, "No ctx parameter given");
         return CMP_R_INVALID_CONTEXT;
@@ -579,6 +965,9 @@ CMP_err CMPclient_setup_certreq(OSSL_CMP_CTX *ctx,
                                 OPTIONAL const X509_EXTENSIONS *exts,
                                 OPTIONAL const X509_REQ *csr)
 {
+    ALLOC_PHASE_SCOPE;
+
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_SETUP);
     if (ctx == NULL) {
         LOG(FL_ERR, "No ctx parameter given");
         return CMP_R_INVALID_CONTEXT;
@@ -622,6 +1011,132 @@ CMP_err CMPclient_setup_certreq(OSSL_CMP_CTX *ctx,
     return CMPOSSL_error();
 }
 
+struct cmpclient_req_template_st {
+    int references;
+    X509_NAME *issuer;
+    X509_EXTENSIONS *exts;
+    STACK_OF(GENERAL_NAME) *sans;
+    bool san_nodefault;
+    STACK_OF(POLICYINFO) *policies;
+    bool policies_critical;
+};
+
+static POLICYINFO *policyinfo_dup(const POLICYINFO *pinfo)
+{
+    return ASN1_item_dup(ASN1_ITEM_rptr(POLICYINFO), (void *)pinfo);
+}
+
+CMPCLIENT_REQ_TEMPLATE
+*CMPclient_req_template_new(OPTIONAL const char *issuer,
+                            OPTIONAL const X509_EXTENSIONS *exts,
+                            OPTIONAL const STACK_OF(GENERAL_NAME) *sans,
+                            bool san_nodefault,
+                            OPTIONAL const STACK_OF(POLICYINFO) *policies,
+                            bool policies_critical)
+{
+    ALLOC_PHASE_SCOPE;
+    CMPCLIENT_REQ_TEMPLATE *tmpl;
+
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_SETUP);
+    if (sk_GENERAL_NAME_num(sans) > 0
+        && X509v3_get_ext_by_NID(exts, NID_subject_alt_name, -1) >= 0) {
+        LOG(FL_ERR, "Cannot have Subject Alternative Names both via exts and via sans");
+        return NULL;
+    }
+    if ((tmpl = OPENSSL_zalloc(sizeof(*tmpl))) == NULL)
+        return NULL;
+    tmpl->references = 1;
+    tmpl->san_nodefault = san_nodefault;
+    tmpl->policies_critical = policies_critical;
+    if (issuer != NULL
+        && (tmpl->issuer = get1_DN(issuer, "issuer")) == NULL)
+        goto err;
+    if (exts != NULL
+        && (tmpl->exts = sk_X509_EXTENSION_deep_copy(exts, X509_EXTENSION_dup,
+                                                     X509_EXTENSION_free))
+        == NULL)
+        goto err;
+    if (sans != NULL
+        && (tmpl->sans = sk_GENERAL_NAME_deep_copy(sans, GENERAL_NAME_dup,
+                                                   GENERAL_NAME_free)) == NULL)
+        goto err;
+    if (policies != NULL
+        && (tmpl->policies = sk_POLICYINFO_deep_copy(policies, policyinfo_dup,
+                                                     POLICYINFO_free)) == NULL)
+        goto err;
+    return tmpl;
+
+ err:
+    CMPclient_req_template_free(tmpl);
+    return NULL;
+}
+
+bool CMPclient_req_template_up_ref(CMPCLIENT_REQ_TEMPLATE *tmpl)
+{
+    if (tmpl == NULL)
+        return false;
+    (void)__atomic_add_fetch(&tmpl->references, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void CMPclient_req_template_free(OPTIONAL CMPCLIENT_REQ_TEMPLATE *tmpl)
+{
+    if (tmpl == NULL
+        || __atomic_sub_fetch(&tmpl->references, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    X509_NAME_free(tmpl->issuer);
+    sk_X509_EXTENSION_pop_free(tmpl->exts, X509_EXTENSION_free);
+    sk_GENERAL_NAME_pop_free(tmpl->sans, GENERAL_NAME_free);
+    sk_POLICYINFO_pop_free(tmpl->policies, POLICYINFO_free);
+    OPENSSL_free(tmpl);
+}
+
+CMP_err CMPclient_setup_certreq_template(OSSL_CMP_CTX *ctx,
+                                         const CMPCLIENT_REQ_TEMPLATE *tmpl)
+{
+    ALLOC_PHASE_SCOPE;
+    int i;
+
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_SETUP);
+    if (ctx == NULL) {
+        LOG(FL_ERR, "No ctx parameter given");
+        return CMP_R_INVALID_CONTEXT;
+    }
+    if (tmpl == NULL) {
+        LOG(FL_ERR, "No tmpl parameter given");
+        return CMP_R_NULL_ARGUMENT;
+    }
+
+    if ((tmpl->issuer != NULL
+         && !OSSL_CMP_CTX_set1_issuer(ctx, tmpl->issuer))
+        || !OSSL_CMP_CTX_set_option(ctx, OSSL_CMP_OPT_SUBJECTALTNAME_NODEFAULT,
+                                    tmpl->san_nodefault)
+        || !OSSL_CMP_CTX_set_option(ctx, OSSL_CMP_OPT_POLICIES_CRITICAL,
+                                    tmpl->policies_critical))
+        goto err;
+    for (i = 0; i < sk_GENERAL_NAME_num(tmpl->sans); i++)
+        if (!OSSL_CMP_CTX_push1_subjectAltName(ctx,
+                                               sk_GENERAL_NAME_value(tmpl->sans,
+                                                                     i)))
+            goto err;
+    for (i = 0; i < sk_POLICYINFO_num(tmpl->policies); i++) {
+        POLICYINFO *pinfo = policyinfo_dup(sk_POLICYINFO_value(tmpl->policies,
+                                                               i));
+
+        if (pinfo == NULL || !OSSL_CMP_CTX_push0_policy(ctx, pinfo)) {
+            POLICYINFO_free(pinfo);
+            goto err;
+        }
+    }
+    return tmpl->exts == NULL ? CMP_OK
+        : CMPclient_setup_certreq(ctx, NULL /* new_key */, NULL /* old_cert */,
+                                  NULL /* subject */, tmpl->exts,
+                                  NULL /* csr */);
+
+ err:
+    return CMPOSSL_error();
+}
+
 #if OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP /* TODO remove decls when exported by OpenSSL */
 static int ossl_x509_add_cert_new_(STACK_OF(X509) **p_sk, X509 *cert, int flags)
 {
@@ -722,10 +1237,10 @@ STACK_OF(X509) *ossl_cmp_build_cert_chain(OSSL_LIB_CTX *libctx,
     chain = X509_STORE_CTX_get0_chain(csc);
 
     /* result list to store the up_ref'ed not self-signed certificates */
-    if (!ossl_x509_add_certs_new(&res, chain,
-                                 X509_ADD_FLAG_UP_REF | X509_ADD_FLAG_NO_DUP
-                                 | X509_ADD_FLAG_NO_SS)) {
-        sk_X509_free(res);
+    if ((res = sk_X509_new_null()) == NULL
+        || !CERTS_add_nodup(res, chain,
+                            X509_ADD_FLAG_UP_REF | X509_ADD_FLAG_NO_SS)) {
+        sk_X509_pop_free(res, X509_free);
         res = NULL;
     }
 
@@ -738,8 +1253,15 @@ STACK_OF(X509) *ossl_cmp_build_cert_chain(OSSL_LIB_CTX *libctx,
 #endif
 #endif /* end TODO remove decls when exported by OpenSSL */
 
+/* picks up any reloaded trust stores */
+static bool begin_transaction(OSSL_CMP_CTX *ctx)
+{
+    return CMPclient_trust_refresh(ctx);
+}
+
 CMP_err CMPclient_enroll(OSSL_CMP_CTX *ctx, CREDENTIALS **new_creds, int cmd)
 {
+    ALLOC_PHASE_SCOPE;
     X509 *newcert = NULL;
 
     if (ctx == NULL) {
@@ -754,18 +1276,24 @@ CMP_err CMPclient_enroll(OSSL_CMP_CTX *ctx, CREDENTIALS **new_creds, int cmd)
         LOG(FL_ERR, "No new_creds parameter given");
         return CMP_R_NULL_ARGUMENT;
     }
+    if (!begin_transaction(ctx))
+        goto err;
 
     switch (cmd) {
     case CMP_IR:
+        (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_IR);
         newcert = OSSL_CMP_exec_IR_ses(ctx);
         break;
     case CMP_CR:
+        (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_CR);
         newcert = OSSL_CMP_exec_CR_ses(ctx);
         break;
     case CMP_P10CR:
+        (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_P10CR);
         newcert = OSSL_CMP_exec_P10CR_ses(ctx);
         break;
     case CMP_KUR:
+        (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_KUR);
         newcert = OSSL_CMP_exec_KUR_ses(ctx);
         break;
     default:
@@ -832,14 +1360,14 @@ CMP_err CMPclient_imprint(OSSL_CMP_CTX *ctx, CREDENTIALS **new_creds,
         return CMP_R_NULL_ARGUMENT;
     }
 #endif
-    if (subject != NULL && (subj = parse_DN(subject, "subject")) == NULL)
+    if (subject != NULL && (subj = get1_DN(subject, "subject")) == NULL)
         return CMP_R_INVALID_PARAMETERS;
     CMP_err err = CMPclient_setup_certreq(ctx, new_key, NULL /* old_cert */,
                                           subj, exts, NULL /* csr */);
+    X509_NAME_free(subj);
     if (err == CMP_OK) {
         err = CMPclient_enroll(ctx, new_creds, CMP_IR);
     }
-    X509_NAME_free(subj);
     return err;
 }
 
@@ -860,14 +1388,14 @@ CMP_err CMPclient_bootstrap(OSSL_CMP_CTX *ctx, CREDENTIALS **new_creds,
         return CMP_R_NULL_ARGUMENT;
     }
 #endif
-    if (subject != NULL && (subj = parse_DN(subject, "subject")) == NULL)
+    if (subject != NULL && (subj = get1_DN(subject, "subject")) == NULL)
         return CMP_R_INVALID_PARAMETERS;
     CMP_err err = CMPclient_setup_certreq(ctx, new_key, NULL /* old_cert */,
                                           subj, exts, NULL /* csr */);
+    X509_NAME_free(subj);
     if (err == CMP_OK) {
         err = CMPclient_enroll(ctx, new_creds, CMP_CR);
     }
-    X509_NAME_free(subj);
     return err;
 }
 
@@ -910,6 +1438,9 @@ CMP_err CMPclient_update(OSSL_CMP_CTX *ctx, CREDENTIALS **new_creds,
 
 CMP_err CMPclient_revoke(OSSL_CMP_CTX *ctx, const X509 *cert, /* TODO: X509_REQ *csr, */ int reason)
 {
+    ALLOC_PHASE_SCOPE;
+
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_RR);
     if (ctx == NULL) {
         LOG(FL_ERR, "No ctx parameter given");
         return CMP_R_INVALID_CONTEXT;
@@ -937,6 +1468,7 @@ CMP_err CMPclient_revoke(OSSL_CMP_CTX *ctx, const X509 *cert, /* TODO: X509_REQ
 
     if ((reason >= CRL_REASON_UNSPECIFIED &&
          !OSSL_CMP_CTX_set_option(ctx, OSSL_CMP_OPT_REVOCATION_REASON, reason))
+        || !begin_transaction(ctx)
         || !OSSL_CMP_exec_RR_ses(ctx)) {
         goto err;
     }
@@ -947,14 +1479,17 @@ CMP_err CMPclient_revoke(OSSL_CMP_CTX *ctx, const X509 *cert, /* TODO: X509_REQ
     return CMPOSSL_error();
 }
 
-#if OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP
+#if (OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP) \
+    && !defined GENCMP_NO_GENM
 static OSSL_CMP_ITAV *get_genm_itav(CMP_CTX *ctx,
                                     OSSL_CMP_ITAV *req, /* gets consumed */
                                     int expected, const char *desc)
 {
+    ALLOC_PHASE_SCOPE;
     STACK_OF(OSSL_CMP_ITAV) *itavs = NULL;
     int i, n;
 
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_GENM);
     if (ctx == NULL) {
         LOG(FL_ERR, "No ctx parameter given");
         goto err;
@@ -967,6 +1502,8 @@ static OSSL_CMP_ITAV *get_genm_itav(CMP_CTX *ctx,
     if (!OSSL_CMP_CTX_push0_genm_ITAV(ctx, req))
         goto err;
     req = NULL;
+    if (!begin_transaction(ctx))
+        goto err;
     itavs = OSSL_CMP_exec_GENM_ses(ctx);
     if (itavs == NULL) {
         if (OSSL_CMP_CTX_get_status(ctx) != OSSL_CMP_PKISTATUS_request)
@@ -1024,7 +1561,8 @@ static const X509_VERIFY_PARAM *get0_trustedStore_vpm(const CMP_CTX *ctx)
 }
 #endif
 
-#if OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP
+#if (OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP) \
+    && !defined GENCMP_NO_GENM
 CMP_err CMPclient_caCerts(CMP_CTX *ctx, STACK_OF(X509) **out)
 {
     OSSL_CMP_ITAV *req, *itav;
@@ -1057,8 +1595,7 @@ CMP_err CMPclient_caCerts(CMP_CTX *ctx, STACK_OF(X509) **out)
         goto end;
     }
     *out = sk_X509_new_reserve(NULL, sk_X509_num(certs));
-    if (!X509_add_certs(*out, certs,
-                        X509_ADD_FLAG_UP_REF | X509_ADD_FLAG_NO_DUP)) {
+    if (!CERTS_add_nodup(*out, certs, X509_ADD_FLAG_UP_REF)) {
         LOG_err("Failure storing caCerts received in genp");
         sk_X509_pop_free(*out, X509_free);
         *out = NULL;
@@ -1101,7 +1638,8 @@ CMP_err CMPclient_certReqTemplate(CMP_CTX *ctx,
 }
 #endif
 
-#if OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP
+#if (OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP) \
+    && !defined GENCMP_NO_GENM
 static int selfsigned_verify_cb(int ok, X509_STORE_CTX *store_ctx)
 {
     if (ok == 0 && store_ctx != NULL
@@ -1326,18 +1864,29 @@ char *CMPclient_snprint_PKIStatus(const OSSL_CMP_CTX *ctx, char *buf,
 
 CMP_err CMPclient_reinit(OSSL_CMP_CTX *ctx)
 {
+    ALLOC_PHASE_SCOPE;
+    CMP_err err;
+
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_REINIT);
     OSSL_CMP_CTX_print_errors(ctx /* may be NULL */);
     if (ctx == NULL) {
         LOG(FL_ERR, "No ctx parameter given");
         return CMP_R_INVALID_CONTEXT;
     }
-    return OSSL_CMP_CTX_reinit(ctx) ? CMP_OK : CMPOSSL_error();
+    err = OSSL_CMP_CTX_reinit(ctx) ? CMP_OK : CMPOSSL_error();
+    CMPclient_transport_close(get0_transport(ctx));
+    CMPclient_alloc_transaction_end();
+    return err;
 }
 
 void CMPclient_finish(OPTIONAL OSSL_CMP_CTX *ctx)
 {
+    ALLOC_PHASE_SCOPE;
+
+    (void)CMPclient_alloc_set_phase(CMPCLIENT_PHASE_FINISH);
     OSSL_CMP_CTX_print_errors(ctx /* may be NULL */);
     if (ctx != NULL) {
+        CMPCLIENT_TRANSPORT *t = get0_transport(ctx);
 #ifndef SECUTILS_NO_TLS
         BIO *rw = OSSL_CMP_CTX_get_transfer_cb_arg(ctx);
         APP_HTTP_TLS_INFO *info = OSSL_CMP_CTX_get_http_cb_arg(ctx);
@@ -1345,6 +1894,7 @@ void CMPclient_finish(OPTIONAL OSSL_CMP_CTX *ctx)
 #endif
         X509_STORE_free(OSSL_CMP_CTX_get_certConf_cb_arg(ctx));
         OSSL_CMP_CTX_free(ctx);
+        CMPclient_transport_free(t);
 #ifndef SECUTILS_NO_TLS
         if (rw == NULL)
             APP_HTTP_TLS_INFO_free(info);
@@ -1366,27 +1916,810 @@ EVP_PKEY *KEY_load(OPTIONAL const char *file, OPTIONAL const char *pass,
                                   pass, engine, desc);
 }
 
-inline
+/*
+ * Optional sidecar cache <file>.dercache holding the DER encoding of the
+ * contents of a cert or CSR file, which saves reading the original file,
+ * format detection, and PEM decoding.
+ * It starts with a text line giving the device, inode, size, mtime, and ctime
+ * of the original file. The cache is used only if all of them still match.
+ * Replacing the file changes its inode, and writing to it changes its ctime,
+ * which unlike the mtime cannot be set back from user space, e.g., by cp -p
+ * or touch -r. Thus also a same-size overwrite retaining the mtime invalidates
+ * the cache, without the cost of hashing the contents.
+ * Any checks on the certs loaded are done also when taking them from the cache.
+ */
+#define DERCACHE_SUFFIX ".dercache"
+#define DERCACHE_TMP_SUFFIX ".XXXXXX" /* for mkstemp() */
+#define DERCACHE_MAGIC "GENCMP-DERCACHE-3"
+#define DERCACHE_HDR_MAX (sizeof(DERCACHE_MAGIC) + 7 * 21 + 2)
+
+static bool dercache_enabled = false;
+
+void CMPclient_dercache_enable(bool enable)
+{
+    dercache_enabled = enable;
+}
+
+/* reads the whole file; the result must be freed with OPENSSL_free() */
+static unsigned char *read_file(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    unsigned char *buf = NULL;
+    long size;
+
+    if (fp == NULL)
+        return NULL;
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0
+            || fseek(fp, 0, SEEK_SET) != 0
+            || (buf = OPENSSL_malloc(size == 0 ? 1 : (size_t)size)) == NULL
+            || fread(buf, 1, (size_t)size, fp) != (size_t)size) {
+        OPENSSL_free(buf);
+        buf = NULL;
+    } else {
+        *len = (size_t)size;
+    }
+    fclose(fp);
+    return buf;
+}
+
+static char *dercache_path(const char *file)
+{
+    size_t len = strlen(file) + sizeof(DERCACHE_SUFFIX DERCACHE_TMP_SUFFIX);
+    char *path = OPENSSL_malloc(len);
+
+    if (path != NULL)
+        snprintf(path, len, "%s%s", file, DERCACHE_SUFFIX);
+    return path;
+}
+
+/*
+ * Determines the header line the cache for |file| must start with.
+ * Returns false if caching does not apply, e.g., for a list of sources or URI.
+ */
+static bool dercache_header(const char *file, char *hdr, size_t hdr_size)
+{
+    struct stat st;
+
+    if (!dercache_enabled || file == NULL || strpbrk(file, ", \t\n") != NULL
+            || strstr(file, "://") != NULL
+            || stat(file, &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+    snprintf(hdr, hdr_size, "%s %lu %lu %lu %ld.%09ld %ld.%09ld\n",
+             DERCACHE_MAGIC, (unsigned long)st.st_dev, (unsigned long)st.st_ino,
+             (unsigned long)st.st_size,
+             (long)st.st_mtime, STAT_MTIME_NS(st),
+             (long)st.st_ctime, STAT_CTIME_NS(st));
+    return true;
+}
+
+/* returns the cached DER data for |file| if up to date, else NULL */
+static unsigned char *dercache_read(const char *file, const char *hdr,
+                                    size_t *offset, size_t *len)
+{
+    char *path = dercache_path(file);
+    unsigned char *data = NULL;
+    size_t hdr_len = strlen(hdr);
+#ifndef _WIN32
+    struct stat st;
+
+    /* the cache must be as trustworthy as the file it replaces */
+    if (path == NULL || stat(path, &st) != 0 || st.st_uid != geteuid()
+            || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+        goto end;
+#endif
+    if (path == NULL || (data = read_file(path, len)) == NULL)
+        goto end;
+    if (*len <= hdr_len || memcmp(data, hdr, hdr_len) != 0) {
+        if (LOG_ENABLED(LOG_DEBUG))
+            LOG(FL_DEBUG, "ignoring outdated %s", path);
+        OPENSSL_free(data);
+        data = NULL;
+        goto end;
+    }
+    *offset = hdr_len;
+    *len -= hdr_len;
+
+ end:
+    OPENSSL_free(path);
+    return data;
+}
+
+/*
+ * best effort; any failure just means the cache is not used next time.
+ * The new cache is written to a fresh file of unpredictable name created
+ * exclusively, not following any symlink planted there, and then renamed.
+ */
+static void dercache_write(const char *file, const char *hdr, BIO *der)
+{
+#ifndef _WIN32
+    char *path = dercache_path(file);
+    char *tmp = NULL;
+    const char *p;
+    long len = BIO_get_mem_data(der, &p);
+    size_t tmp_len;
+    FILE *fp;
+    int fd;
+    bool ok;
+
+    if (path == NULL || len <= 0)
+        goto end;
+    tmp_len = strlen(path) + sizeof(DERCACHE_TMP_SUFFIX);
+    if ((tmp = OPENSSL_malloc(tmp_len)) == NULL)
+        goto end;
+    snprintf(tmp, tmp_len, "%s%s", path, DERCACHE_TMP_SUFFIX);
+    if ((fd = mkstemp(tmp)) < 0) /* O_CREAT | O_EXCL, mode 0600 */
+        goto end;
+    if ((fp = fdopen(fd, "wb")) == NULL) {
+        (void)close(fd);
+        (void)remove(tmp);
+        goto end;
+    }
+    ok = fputs(hdr, fp) >= 0 && fwrite(p, 1, (size_t)len, fp) == (size_t)len;
+    ok = fclose(fp) == 0 && ok;
+    if (ok && rename(tmp, path) == 0) {
+        if (LOG_ENABLED(LOG_DEBUG))
+            LOG(FL_DEBUG, "wrote %s", path);
+    } else {
+        (void)remove(tmp);
+    }
+
+ end:
+    OPENSSL_free(tmp);
+    OPENSSL_free(path);
+#else
+    (void)file;
+    (void)hdr;
+    (void)der; /* no mkstemp() */
+#endif
+}
+
+static STACK_OF(X509) *dercache_load_certs(const char *files, const char *hdr,
+                                           OPTIONAL const char *desc,
+                                           int type_CA,
+                                           OPTIONAL const X509_VERIFY_PARAM *vpm)
+{
+    STACK_OF(X509) *certs;
+    unsigned char *data;
+    size_t offset, len;
+    BIO *der;
+    int i;
+
+    if ((data = dercache_read(files, hdr, &offset, &len)) != NULL) {
+        const unsigned char *p = data + offset, *end = p + len;
+
+        certs = sk_X509_new_null();
+        while (certs != NULL && p < end) {
+            X509 *cert = d2i_X509(NULL, &p, (long)(end - p));
+
+            if (cert == NULL || !sk_X509_push(certs, cert)) {
+                X509_free(cert);
+                sk_X509_pop_free(certs, X509_free);
+                certs = NULL;
+            }
+        }
+        OPENSSL_free(data);
+        if (certs != NULL) {
+            /* same checks as done by CERTS_load() on the original file */
+            if (!CERT_check_all(files, certs, type_CA, vpm)) {
+                sk_X509_pop_free(certs, X509_free);
+                return NULL;
+            }
+            return certs;
+        }
+        LOG(FL_WARN, "ignoring corrupt DER cache for %s", files);
+    }
+
+    /* cache miss: any checks are done when loading the original file */
+    if ((certs = CERTS_load(files, desc, type_CA, vpm)) == NULL)
+        return NULL;
+    if ((der = BIO_new(BIO_s_mem())) != NULL) {
+        for (i = 0; i < sk_X509_num(certs); i++)
+            if (i2d_X509_bio(der, sk_X509_value(certs, i)) <= 0)
+                break;
+        if (i == sk_X509_num(certs))
+            dercache_write(files, hdr, der);
+        BIO_free(der);
+    }
+    return certs;
+}
+
+STACK_OF(X509) *CERTS_load_cached(const char *files, OPTIONAL const char *desc,
+                                  int type_CA,
+                                  OPTIONAL const X509_VERIFY_PARAM *vpm)
+{
+    char hdr[DERCACHE_HDR_MAX];
+
+    if (!dercache_header(files, hdr, sizeof(hdr)))
+        return CERTS_load(files, desc, type_CA, vpm);
+    return dercache_load_certs(files, hdr, desc, type_CA, vpm);
+}
+
 X509_REQ *CSR_load(const char *file, OPTIONAL const char *desc)
 {
-    return FILES_load_csr_autofmt(file, FILES_get_format(file), desc);
+    char hdr[DERCACHE_HDR_MAX];
+    X509_REQ *csr;
+    unsigned char *data;
+    size_t offset, len;
+    BIO *der;
+
+    if (!dercache_header(file, hdr, sizeof(hdr)))
+        return FILES_load_csr_autofmt(file, FILES_get_format(file), desc);
+
+    if ((data = dercache_read(file, hdr, &offset, &len)) != NULL) {
+        const unsigned char *p = data + offset;
+
+        csr = d2i_X509_REQ(NULL, &p, (long)len);
+        OPENSSL_free(data);
+        if (csr != NULL)
+            return csr;
+        LOG(FL_WARN, "ignoring corrupt DER cache for %s", file);
+    }
+
+    if ((csr = FILES_load_csr_autofmt(file, FILES_get_format(file),
+                                      desc)) == NULL)
+        return NULL;
+    if ((der = BIO_new(BIO_s_mem())) != NULL) {
+        if (i2d_X509_REQ_bio(der, csr) > 0)
+            dercache_write(file, hdr, der);
+        BIO_free(der);
+    }
+    return csr;
 }
 
 /* X509_STORE helpers */
 
-inline
+static X509_STORE *store_from_certs(const STACK_OF(X509) *certs,
+                                    OPTIONAL const X509_VERIFY_PARAM *vpm)
+{
+    X509_STORE *store = STORE_create(NULL, NULL /* cert */, certs);
+
+    if (store != NULL && vpm != NULL && !X509_STORE_set1_param(store, vpm)) {
+        STORE_free(store);
+        store = NULL;
+    }
+    return store;
+}
+
 X509_STORE *STORE_load(const char *trusted_certs, OPTIONAL const char *desc,
                        OPTIONAL X509_VERIFY_PARAM *vpm)
 {
-    return STORE_load_check(trusted_certs, desc, vpm, NULL);
+    char hdr[DERCACHE_HDR_MAX];
+    STACK_OF(X509) *certs;
+    X509_STORE *store;
+
+    if (!dercache_header(trusted_certs, hdr, sizeof(hdr)))
+        return STORE_load_check(trusted_certs, desc, vpm, NULL);
+
+    if ((certs = dercache_load_certs(trusted_certs, hdr, desc, 1 /* CA */,
+                                     vpm)) == NULL)
+        return NULL;
+    store = store_from_certs(certs, vpm);
+    sk_X509_pop_free(certs, X509_free);
+    return store;
+}
+
+X509 *CERT_load_der(const unsigned char *der, size_t len,
+                    OPTIONAL const char *desc)
+{
+    const unsigned char *p = der;
+    X509 *cert;
+
+    if (desc == NULL)
+        desc = "embedded certificate";
+    if (der == NULL || len == 0 || len > (size_t)LONG_MAX) {
+        LOG(FL_ERR, "invalid DER input for %s", desc);
+        return NULL;
+    }
+    cert = d2i_X509(NULL, &p, (long)len);
+    if (cert == NULL || p != der + len) {
+        LOG(FL_ERR, "cannot decode %s", desc);
+        X509_free(cert);
+        return NULL;
+    }
+    return cert;
+}
+
+STACK_OF(X509) *CERTS_load_der(OPTIONAL const CMPCLIENT_DER_CERT *certs,
+                               size_t num, OPTIONAL const char *desc)
+{
+    STACK_OF(X509) *res;
+    size_t i;
+
+    if ((certs == NULL && num != 0) || num > INT_MAX) {
+        LOG(FL_ERR, "invalid input for %s",
+            desc != NULL ? desc : "embedded certificates");
+        return NULL;
+    }
+    if ((res = sk_X509_new_reserve(NULL, (int)num)) == NULL)
+        goto oom;
+    for (i = 0; i < num; i++) {
+        X509 *cert = CERT_load_der(certs[i].der, certs[i].len, desc);
+
+        if (cert == NULL) {
+            sk_X509_pop_free(res, X509_free);
+            return NULL;
+        }
+        (void)sk_X509_push(res, cert); /* cannot fail due to reservation */
+    }
+    return res;
+
+ oom:
+    LOG_err("Out of memory");
+    return NULL;
+}
+
+X509_STORE *STORE_load_der(OPTIONAL const CMPCLIENT_DER_CERT *certs,
+                           size_t num, OPTIONAL const char *desc,
+                           OPTIONAL X509_VERIFY_PARAM *vpm)
+{
+    STACK_OF(X509) *trusted = CERTS_load_der(certs, num, desc);
+    X509_STORE *store = NULL;
+
+    if (trusted == NULL)
+        return NULL;
+    if ((store = store_from_certs(trusted, vpm)) == NULL)
+        LOG(FL_ERR, "cannot create trust store from %s",
+            desc != NULL ? desc : "embedded certificates");
+    sk_X509_pop_free(trusted, X509_free);
+    return store;
+}
+
+/*
+ * Loading from memory: input starting with an ASN.1 SEQUENCE tag is taken
+ * as DER, anything else as PEM. Keys are never prompted for a password.
+ * PKCS#12 input is not supported.
+ */
+static bool mem_is_der(const unsigned char *data, size_t len)
+{
+    return len > 0 && data[0] == 0x30;
+}
+
+static BIO *mem_bio(const unsigned char *data, size_t len, const char *desc)
+{
+    BIO *bio;
+
+    if (data == NULL || len == 0 || len > INT_MAX) {
+        LOG(FL_ERR, "invalid input for %s", desc);
+        return NULL;
+    }
+    if ((bio = BIO_new_mem_buf(data, (int)len)) == NULL)
+        LOG_err("Out of memory");
+    return bio;
+}
+
+static int mem_pass_cb(char *buf, int size, int rwflag, void *pass)
+{
+    size_t len;
+
+    (void)rwflag;
+    if (pass == NULL || size <= 0)
+        return -1;
+    len = strlen(pass);
+    if (len > (size_t)size)
+        len = (size_t)size;
+    memcpy(buf, pass, len);
+    return (int)len;
+}
+
+EVP_PKEY *KEY_load_from_mem(const unsigned char *data, size_t len,
+                            OPTIONAL const char *pass,
+                            OPTIONAL const char *desc)
+{
+    BIO *bio;
+    EVP_PKEY *pkey = NULL;
+
+    if (desc == NULL)
+        desc = "private key";
+    if ((bio = mem_bio(data, len, desc)) == NULL)
+        return NULL;
+    if (!mem_is_der(data, len)) {
+        pkey = PEM_read_bio_PrivateKey(bio, NULL, mem_pass_cb, (void *)pass);
+    } else {
+        pkey = d2i_PrivateKey_bio(bio, NULL);
+        if (pkey == NULL && pass != NULL) { /* try encrypted PKCS#8 */
+            (void)BIO_reset(bio);
+            pkey = d2i_PKCS8PrivateKey_bio(bio, NULL, mem_pass_cb,
+                                           (void *)pass);
+        }
+    }
+    BIO_free(bio);
+    if (pkey == NULL)
+        LOG(FL_ERR, "cannot decode %s", desc);
+    return pkey;
+}
+
+X509_REQ *CSR_load_from_mem(const unsigned char *data, size_t len,
+                            OPTIONAL const char *desc)
+{
+    BIO *bio;
+    X509_REQ *csr;
+
+    if (desc == NULL)
+        desc = "CSR";
+    if ((bio = mem_bio(data, len, desc)) == NULL)
+        return NULL;
+    csr = mem_is_der(data, len) ? d2i_X509_REQ_bio(bio, NULL)
+        : PEM_read_bio_X509_REQ(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    if (csr == NULL)
+        LOG(FL_ERR, "cannot decode %s", desc);
+    return csr;
+}
+
+/* adds the certs of a PKCS#7 SignedData structure, e.g., a certs-only one */
+static bool certs_add_pkcs7(STACK_OF(X509) *certs, const PKCS7 *p7)
+{
+    STACK_OF(X509) *p7_certs = NULL;
+
+    if (PKCS7_type_is_signed(p7) && p7->d.sign != NULL)
+        p7_certs = p7->d.sign->cert;
+    return sk_X509_num(p7_certs) > 0
+        && X509_add_certs(certs, p7_certs, X509_ADD_FLAG_UP_REF);
 }
 
+STACK_OF(X509) *CERTS_load_from_mem(const unsigned char *data, size_t len,
+                                    OPTIONAL const char *desc)
+{
+    STACK_OF(X509) *certs;
+    PKCS7 *p7 = NULL;
+    BIO *bio;
+    X509 *cert;
+
+    if (desc == NULL)
+        desc = "certificates";
+    if ((bio = mem_bio(data, len, desc)) == NULL)
+        return NULL;
+    if ((certs = sk_X509_new_null()) == NULL) {
+        LOG_err("Out of memory");
+        BIO_free(bio);
+        return NULL;
+    }
+
+    if (mem_is_der(data, len)) {
+        const unsigned char *p = data, *end = data + len;
+
+        /* a sequence of DER-encoded certs, else PKCS#7 */
+        while (p < end
+               && (cert = d2i_X509(NULL, &p, (long)(end - p))) != NULL) {
+            if (!sk_X509_push(certs, cert)) {
+                X509_free(cert);
+                goto err;
+            }
+        }
+        if (sk_X509_num(certs) == 0
+            && ((p7 = d2i_PKCS7(NULL, &p, (long)len)) == NULL
+                || !certs_add_pkcs7(certs, p7)))
+            goto err;
+        if (p != end)
+            goto err;
+    } else {
+        while ((cert = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL) {
+            if (!sk_X509_push(certs, cert)) {
+                X509_free(cert);
+                goto err;
+            }
+        }
+        /* reaching the end of the input is signaled as no start line */
+        if (ERR_GET_REASON(ERR_peek_last_error()) != PEM_R_NO_START_LINE)
+            goto err;
+        if (sk_X509_num(certs) == 0) { /* PEM_read_bio_X509() skips PKCS7 */
+            ERR_clear_error();
+            (void)BIO_reset(bio);
+            if ((p7 = PEM_read_bio_PKCS7(bio, NULL, NULL, NULL)) == NULL
+                || !certs_add_pkcs7(certs, p7))
+                goto err;
+        }
+    }
+    ERR_clear_error();
+    PKCS7_free(p7);
+    BIO_free(bio);
+    return certs;
+
+ err:
+    LOG(FL_ERR, "cannot decode %s", desc);
+    sk_X509_pop_free(certs, X509_free);
+    PKCS7_free(p7);
+    BIO_free(bio);
+    return NULL;
+}
+
+X509_STORE *STORE_load_from_mem(const unsigned char *data, size_t len,
+                                OPTIONAL const char *desc,
+                                OPTIONAL X509_VERIFY_PARAM *vpm)
+{
+    STACK_OF(X509) *trusted;
+    X509_STORE *store;
+
+    if (desc == NULL)
+        desc = "trusted certificates";
+    if ((trusted = CERTS_load_from_mem(data, len, desc)) == NULL)
+        return NULL;
+    if ((store = store_from_certs(trusted, vpm)) == NULL)
+        LOG(FL_ERR, "cannot create trust store from %s", desc);
+    sk_X509_pop_free(trusted, X509_free);
+    return store;
+}
+
+/*
+ * Serialization to memory, as counterpart of the file-based saving functions.
+ * The contents of |bio| are handed out either in a newly allocated buffer,
+ * or in the caller-provided one if large enough.
+ */
+static CMP_err bio_to_mem(BIO *bio, unsigned char **out, size_t *outlen,
+                          const char *desc)
+{
+    char *data = NULL;
+    long len = BIO_get_mem_data(bio, &data);
+
+    if (len <= 0) {
+        LOG(FL_ERR, "cannot encode %s", desc);
+        return CMP_R_STORE_CREDS;
+    }
+    if (*out == NULL) {
+        if ((*out = OPENSSL_malloc((size_t)len)) == NULL) {
+            LOG_err("Out of memory");
+            return CMP_R_STORE_CREDS;
+        }
+    } else if (*outlen < (size_t)len) {
+        LOG(FL_ERR, "output buffer too small for %s", desc);
+        *outlen = (size_t)len;
+        return CMP_R_INVALID_PARAMETERS;
+    }
+    memcpy(*out, data, (size_t)len);
+    *outlen = (size_t)len;
+    return CMP_OK;
+}
+
+static bool check_out_args(unsigned char **out, size_t *outlen)
+{
+    if (out == NULL || outlen == NULL) {
+        LOG(FL_ERR, "missing output buffer argument");
+        return false;
+    }
+    return true;
+}
+
+static bool key_to_bio(BIO *bio, const EVP_PKEY *pkey, file_format_t format,
+                       OPTIONAL const char *pass)
+{
+    const EVP_CIPHER *enc = pass != NULL ? EVP_aes_256_cbc() : NULL;
+    int passlen = pass != NULL ? (int)strlen(pass) : 0;
+
+    if (format == FORMAT_PEM)
+        return PEM_write_bio_PKCS8PrivateKey(bio, (EVP_PKEY *)pkey, enc,
+                                             (char *)pass, passlen,
+                                             NULL, NULL) != 0;
+    return i2d_PKCS8PrivateKey_bio(bio, (EVP_PKEY *)pkey, enc,
+                                   (char *)pass, passlen, NULL, NULL) != 0;
+}
+
+static bool certs_to_bio(BIO *bio, OPTIONAL const X509 *cert,
+                         OPTIONAL const STACK_OF(X509) *certs,
+                         file_format_t format)
+{
+    int i, n = certs == NULL ? 0 : sk_X509_num(certs);
+
+    if (format == FORMAT_ASN1) {
+        if ((cert != NULL ? 1 : 0) + n != 1) {
+            LOG(FL_ERR, "DER format can hold exactly one certificate");
+            return false;
+        }
+        return i2d_X509_bio(bio, cert != NULL ? (X509 *)cert
+                            : sk_X509_value(certs, 0)) != 0;
+    }
+    if (cert != NULL && !PEM_write_bio_X509(bio, (X509 *)cert))
+        return false;
+    for (i = 0; i < n; i++)
+        if (!PEM_write_bio_X509(bio, sk_X509_value(certs, i)))
+            return false;
+    return true;
+}
+
+CMP_err KEY_save_mem(const EVP_PKEY *pkey, file_format_t format,
+                     OPTIONAL const char *pass,
+                     unsigned char **out, size_t *outlen)
+{
+    BIO *bio;
+    CMP_err err = CMP_R_STORE_CREDS;
+
+    if (pkey == NULL || !check_out_args(out, outlen)
+        || (format != FORMAT_PEM && format != FORMAT_ASN1)) {
+        LOG(FL_ERR, "invalid argument");
+        return CMP_R_INVALID_PARAMETERS;
+    }
+    if ((bio = BIO_new(BIO_s_mem())) == NULL)
+        LOG_err("Out of memory");
+    else if (!key_to_bio(bio, pkey, format, pass))
+        LOG(FL_ERR, "cannot encode private key");
+    else
+        err = bio_to_mem(bio, out, outlen, "private key");
+    BIO_free(bio);
+    return err;
+}
+
+CMP_err CERTS_save_mem(OPTIONAL const STACK_OF(X509) *certs,
+                       file_format_t format,
+                       unsigned char **out, size_t *outlen)
+{
+    BIO *bio;
+    CMP_err err = CMP_R_STORE_CREDS;
+
+    if (!check_out_args(out, outlen)
+        || (format != FORMAT_PEM && format != FORMAT_ASN1)) {
+        LOG(FL_ERR, "invalid argument");
+        return CMP_R_INVALID_PARAMETERS;
+    }
+    if ((bio = BIO_new(BIO_s_mem())) == NULL)
+        LOG_err("Out of memory");
+    else if (certs_to_bio(bio, NULL, certs, format))
+        err = bio_to_mem(bio, out, outlen, "certificates");
+    BIO_free(bio);
+    return err;
+}
+
+CMP_err CREDENTIALS_save_mem(const CREDENTIALS *creds, file_format_t format,
+                             bool with_key, OPTIONAL const char *pass,
+                             unsigned char **out, size_t *outlen)
+{
+    EVP_PKEY *pkey = with_key ? CREDENTIALS_get_pkey(creds) : NULL;
+    X509 *cert = CREDENTIALS_get_cert(creds);
+    STACK_OF(X509) *chain = CREDENTIALS_get_chain(creds);
+    PKCS12 *p12 = NULL;
+    BIO *bio = NULL;
+    bool ok;
+    CMP_err err = CMP_R_STORE_CREDS;
+
+    if (creds == NULL || !check_out_args(out, outlen)
+        || (with_key && pkey == NULL)
+        || (format == FORMAT_ASN1 && (with_key || sk_X509_num(chain) > 0))) {
+        LOG(FL_ERR, "invalid argument; DER format can hold only a single cert");
+        return CMP_R_INVALID_PARAMETERS;
+    }
+    if ((bio = BIO_new(BIO_s_mem())) == NULL) {
+        LOG_err("Out of memory");
+        goto end;
+    }
+    switch (format) {
+    case FORMAT_PEM:
+        ok = (pkey == NULL || key_to_bio(bio, pkey, format, pass))
+            && certs_to_bio(bio, cert, chain, format);
+        break;
+    case FORMAT_ASN1:
+        ok = certs_to_bio(bio, cert, NULL, format);
+        break;
+    case FORMAT_PKCS12:
+        p12 = PKCS12_create(pass, NULL /* name */, pkey, cert, chain,
+                            0, 0, 0, 0, 0); /* default algorithms */
+        ok = p12 != NULL && i2d_PKCS12_bio(bio, p12) != 0;
+        break;
+    default:
+        LOG(FL_ERR, "unsupported format");
+        err = CMP_R_INVALID_PARAMETERS;
+        goto end;
+    }
+    if (ok)
+        err = bio_to_mem(bio, out, outlen, "credentials");
+    else
+        LOG(FL_ERR, "cannot encode credentials");
+
+ end:
+    PKCS12_free(p12);
+    BIO_free(bio);
+    return err;
+}
+
+/* open addressing with linear probing; a NULL cert marks a free slot */
+typedef struct cert_set_entry_st {
+    unsigned char md[SHA_DIGEST_LENGTH];
+    const X509 *cert;
+} CERT_SET_ENTRY;
+
+/* returns 1 if |cert| has been added, 0 if already contained, -1 on error */
+static int cert_set_add(CERT_SET_ENTRY *set, size_t mask, const X509 *cert)
+{
+    unsigned char md[SHA_DIGEST_LENGTH];
+    unsigned int len = 0;
+    size_t i;
+
+    /* for SHA-1 this usually just copies the fingerprint cached in |cert| */
+    if (!X509_digest(cert, EVP_sha1(), md, &len) || len != sizeof(md))
+        return -1;
+    i = ((size_t)md[0] | (size_t)md[1] << 8 | (size_t)md[2] << 16
+         | (size_t)md[3] << 24) & mask;
+    for (; set[i].cert != NULL; i = (i + 1) & mask) {
+        if (memcmp(set[i].md, md, sizeof(md)) == 0
+            && X509_cmp(set[i].cert, cert) == 0)
+            return 0;
+    }
+    memcpy(set[i].md, md, sizeof(md));
+    set[i].cert = cert;
+    return 1;
+}
+
+bool CERTS_add_nodup(STACK_OF(X509) *sk, OPTIONAL const STACK_OF(X509) *certs,
+                     int flags)
+{
+    int n = sk_X509_num(sk), m = sk_X509_num(certs), i;
+    size_t size = 16;
+    CERT_SET_ENTRY *set = NULL;
+    bool ok = false;
+
+    if (sk == NULL || (flags & X509_ADD_FLAG_PREPEND) != 0) {
+        LOG(FL_ERR, "invalid argument");
+        return false;
+    }
+    if (m <= 0)
+        return true;
+    if (m > INT_MAX - n) {
+        LOG(FL_ERR, "too many certificates");
+        return false;
+    }
+    while (size < 2 * ((size_t)n + (size_t)m)) /* load factor at most 1/2 */
+        size <<= 1;
+    if ((set = OPENSSL_zalloc(size * sizeof(*set))) == NULL
+        || !sk_X509_reserve(sk, n + m)) {
+        LOG_err("Out of memory");
+        goto end;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (cert_set_add(set, size - 1, sk_X509_value(sk, i)) < 0)
+            goto digest_err;
+    }
+    for (i = 0; i < m; i++) {
+        X509 *cert = sk_X509_value(certs, i);
+        int res;
+
+        if ((flags & X509_ADD_FLAG_NO_SS) != 0) {
+            res = X509_self_signed(cert, 0);
+            if (res < 0)
+                goto end;
+            if (res > 0)
+                continue;
+        }
+        if ((res = cert_set_add(set, size - 1, cert)) < 0)
+            goto digest_err;
+        if (res == 0)
+            continue;
+        if ((flags & X509_ADD_FLAG_UP_REF) != 0 && !X509_up_ref(cert))
+            goto end;
+        (void)sk_X509_push(sk, cert); /* cannot fail due to reservation */
+    }
+    ok = true;
+    goto end;
+
+ digest_err:
+    LOG(FL_ERR, "cannot compute certificate fingerprint");
+ end:
+    OPENSSL_free(set);
+    return ok;
+}
+
+#ifndef GENCMP_NO_CERTSTATUS
 inline
 X509_CRL *CRL_load(const char *url, int timeout, OPTIONAL const char *desc)
 {
     return FILES_load_crl_autofmt(url, FORMAT_ASN1, timeout, desc);
 }
 
+X509_CRL *CRL_load_from_mem(const unsigned char *data, size_t len,
+                            OPTIONAL const char *desc)
+{
+    BIO *bio;
+    X509_CRL *crl;
+
+    if (desc == NULL)
+        desc = "CRL";
+    if ((bio = mem_bio(data, len, desc)) == NULL)
+        return NULL;
+    crl = mem_is_der(data, len) ? d2i_X509_CRL_bio(bio, NULL)
+        : PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    if (crl == NULL)
+        LOG(FL_ERR, "cannot decode %s", desc);
+    return crl;
+}
+
 inline
 STACK_OF(X509_CRL) *CRLs_load(const char *files, int timeout,
                               OPTIONAL const char *desc)
@@ -1399,6 +2732,7 @@ void CRLs_free(OPTIONAL STACK_OF(X509_CRL) *crls)
 {
     sk_X509_CRL_pop_free(crls, X509_CRL_free);
 }
+#endif
 
 #ifndef SECUTILS_NO_TLS
 /* SSL_CTX helpers for HTTPS */
@@ -0,0 +1,401 @@
+/*-
+ * @file   genericCMPClient_alloc.c
+ * @brief  optional allocation accounting and arena allocation for OpenSSL
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "genericCMPClient_local.h"
+
+#include <openssl/crypto.h>
+#include <pthread.h>
+#include <string.h>
+
+static const char *const phase_names[CMPCLIENT_PHASE_NUM] = {
+    "other", "prepare", "setup", "ir", "cr", "p10cr", "kur", "rr", "genm",
+    "reinit", "finish"
+};
+
+const char *CMPclient_alloc_phase_name(int phase)
+{
+    return phase >= 0 && phase < CMPCLIENT_PHASE_NUM
+        ? phase_names[phase] : "(unknown)";
+}
+
+#ifndef GENCMP_NO_ALLOC
+
+/*
+ * Each block handed out carries a header holding its size, the phase it was
+ * allocated in, and the arena chunk it belongs to, if any, such that frees and
+ * reallocs can be charged to the phase that allocated the block.
+ * The statistics are global and updated atomically, since blocks are often
+ * freed by other threads than the one allocating them, e.g., OpenSSL objects
+ * shared via the engine or retired trust store snapshots.
+ *
+ * In arena mode, small blocks are carved from per-thread chunks by bumping a
+ * pointer. A chunk counts its live blocks plus one reference held by its owner
+ * thread while it is being carved from. CMPclient_reinit() retires the current
+ * chunk, which drops the owner reference, such that the chunk is released
+ * in one go as soon as all objects of the finished transaction are freed.
+ * Objects that outlive the transaction, like enrolled certificates,
+ * simply keep their chunk alive.
+ */
+
+#define ALLOC_ALIGN 16
+#define ALLOC_HDR_SIZE 16 /* keeps the ALLOC_ALIGN alignment of blocks */
+#define ALLOC_PHASE_BITS 4 /* enough for CMPCLIENT_PHASE_NUM */
+#define ALLOC_PHASE_MASK (((size_t)1 << ALLOC_PHASE_BITS) - 1)
+#define ALLOC_MAX_SIZE (~(size_t)0 >> ALLOC_PHASE_BITS)
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_MAX_BLOCK (ARENA_CHUNK_SIZE / 8)
+
+typedef struct arena_chunk_st {
+    size_t refs; /* live blocks + 1 while being carved from */
+    size_t used;
+    /* followed by the data area, aligned to ALLOC_ALIGN */
+} ARENA_CHUNK;
+#define ARENA_CHUNK_HDR_SIZE \
+    ((sizeof(ARENA_CHUNK) + ALLOC_ALIGN - 1) & ~(size_t)(ALLOC_ALIGN - 1))
+
+typedef struct alloc_hdr_st {
+    size_t info; /* size << ALLOC_PHASE_BITS | allocating phase */
+    ARENA_CHUNK *chunk; /* NULL if obtained directly from malloc() */
+} ALLOC_HDR;
+
+#define HDR_SIZE(hdr) ((hdr)->info >> ALLOC_PHASE_BITS)
+#define HDR_PHASE(hdr) ((int)((hdr)->info & ALLOC_PHASE_MASK))
+
+static int alloc_enabled = 0;
+static int alloc_arena = 0;
+static pthread_key_t arena_key;
+
+static __thread int alloc_phase = CMPCLIENT_PHASE_OTHER;
+static CMPCLIENT_ALLOC_STATS alloc_stats[CMPCLIENT_PHASE_NUM];
+static __thread ARENA_CHUNK *arena_current = NULL;
+
+static void arena_chunk_unref(ARENA_CHUNK *chunk)
+{
+    if (__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(chunk);
+}
+
+static void arena_retire(void)
+{
+    ARENA_CHUNK *chunk = arena_current;
+
+    if (chunk != NULL) {
+        arena_current = NULL;
+        arena_chunk_unref(chunk);
+    }
+}
+
+/* called on thread exit */
+static void arena_thread_cleanup(void *chunk)
+{
+    if (chunk != NULL)
+        arena_chunk_unref(chunk);
+}
+
+static ALLOC_HDR *arena_alloc(size_t total)
+{
+    ARENA_CHUNK *chunk = arena_current;
+    ALLOC_HDR *hdr;
+
+    total = (total + ALLOC_ALIGN - 1) & ~(size_t)(ALLOC_ALIGN - 1);
+    if (chunk == NULL
+        || chunk->used + total > ARENA_CHUNK_SIZE - ARENA_CHUNK_HDR_SIZE) {
+        arena_retire();
+        if ((chunk = malloc(ARENA_CHUNK_SIZE)) == NULL)
+            return NULL;
+        chunk->refs = 1;
+        chunk->used = 0;
+        arena_current = chunk;
+        (void)pthread_setspecific(arena_key, chunk);
+    }
+    hdr = (ALLOC_HDR *)((unsigned char *)chunk + ARENA_CHUNK_HDR_SIZE
+                        + chunk->used);
+    chunk->used += total;
+    (void)__atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+    hdr->chunk = chunk;
+    return hdr;
+}
+
+/* adds num bytes allocated to st, updating the peak of the live ones */
+static void account_live(CMPCLIENT_ALLOC_STATS *st, size_t num)
+{
+    long live, peak;
+
+    (void)__atomic_add_fetch(&st->bytes_allocated, num, __ATOMIC_RELAXED);
+    live = __atomic_add_fetch(&st->bytes_live, (long)num, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&st->bytes_peak, __ATOMIC_RELAXED);
+    while (live > peak
+           && !__atomic_compare_exchange_n(&st->bytes_peak, &peak, live, true,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* records the size and the current phase in hdr */
+static void account_alloc(ALLOC_HDR *hdr, size_t num)
+{
+    CMPCLIENT_ALLOC_STATS *st = &alloc_stats[alloc_phase];
+
+    hdr->info = num << ALLOC_PHASE_BITS | (size_t)alloc_phase;
+    (void)__atomic_add_fetch(&st->allocs, 1, __ATOMIC_RELAXED);
+    account_live(st, num);
+}
+
+/* charges the free to the phase that allocated the block */
+static void account_free(const ALLOC_HDR *hdr)
+{
+    CMPCLIENT_ALLOC_STATS *st = &alloc_stats[HDR_PHASE(hdr)];
+
+    (void)__atomic_add_fetch(&st->frees, 1, __ATOMIC_RELAXED);
+    (void)__atomic_sub_fetch(&st->bytes_live, (long)HDR_SIZE(hdr),
+                             __ATOMIC_RELAXED);
+}
+
+/*
+ * records the new size in hdr, which still holds the old size and phase,
+ * and charges the change in size to the phase that allocated the block
+ */
+static void account_realloc(ALLOC_HDR *hdr, size_t num)
+{
+    int phase = HDR_PHASE(hdr);
+    size_t old = HDR_SIZE(hdr);
+    CMPCLIENT_ALLOC_STATS *st = &alloc_stats[phase];
+
+    hdr->info = num << ALLOC_PHASE_BITS | (size_t)phase;
+    (void)__atomic_add_fetch(&st->reallocs, 1, __ATOMIC_RELAXED);
+    if (num > old)
+        account_live(st, num - old);
+    else
+        (void)__atomic_sub_fetch(&st->bytes_live, (long)(old - num),
+                                 __ATOMIC_RELAXED);
+}
+
+/* takes a consistent enough snapshot of the counters of the given phase */
+static void stats_load(int phase, CMPCLIENT_ALLOC_STATS *stats)
+{
+    CMPCLIENT_ALLOC_STATS *st = &alloc_stats[phase];
+
+    stats->allocs = __atomic_load_n(&st->allocs, __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&st->frees, __ATOMIC_RELAXED);
+    stats->reallocs = __atomic_load_n(&st->reallocs, __ATOMIC_RELAXED);
+    stats->bytes_allocated = __atomic_load_n(&st->bytes_allocated,
+                                             __ATOMIC_RELAXED);
+    stats->bytes_live = __atomic_load_n(&st->bytes_live, __ATOMIC_RELAXED);
+    stats->bytes_peak = __atomic_load_n(&st->bytes_peak, __ATOMIC_RELAXED);
+}
+
+static ALLOC_HDR *block_alloc(size_t num)
+{
+    ALLOC_HDR *hdr;
+
+    if (alloc_arena && num <= ARENA_MAX_BLOCK)
+        return arena_alloc(ALLOC_HDR_SIZE + num);
+    if ((hdr = malloc(ALLOC_HDR_SIZE + num)) != NULL)
+        hdr->chunk = NULL;
+    return hdr;
+}
+
+static void block_free(ALLOC_HDR *hdr)
+{
+    if (hdr->chunk != NULL)
+        arena_chunk_unref(hdr->chunk);
+    else
+        free(hdr);
+}
+
+static void *alloc_malloc(size_t num, ossl_unused const char *file,
+                          ossl_unused int line)
+{
+    ALLOC_HDR *hdr;
+
+    if (num == 0 || num > ALLOC_MAX_SIZE || (hdr = block_alloc(num)) == NULL)
+        return NULL;
+    account_alloc(hdr, num);
+    return (unsigned char *)hdr + ALLOC_HDR_SIZE;
+}
+
+static void alloc_free(void *addr, ossl_unused const char *file,
+                       ossl_unused int line)
+{
+    ALLOC_HDR *hdr;
+
+    if (addr == NULL)
+        return;
+    hdr = (ALLOC_HDR *)((unsigned char *)addr - ALLOC_HDR_SIZE);
+    account_free(hdr);
+    block_free(hdr);
+}
+
+static void *alloc_realloc(void *addr, size_t num, const char *file, int line)
+{
+    ALLOC_HDR *hdr, *old;
+
+    if (addr == NULL)
+        return alloc_malloc(num, file, line);
+    if (num == 0) {
+        alloc_free(addr, file, line);
+        return NULL;
+    }
+    if (num > ALLOC_MAX_SIZE)
+        return NULL;
+    old = (ALLOC_HDR *)((unsigned char *)addr - ALLOC_HDR_SIZE);
+    if (old->chunk == NULL && !(alloc_arena && num <= ARENA_MAX_BLOCK)) {
+        if ((hdr = realloc(old, ALLOC_HDR_SIZE + num)) == NULL)
+            return NULL;
+    } else {
+        /* arena blocks cannot grow in place */
+        if ((hdr = block_alloc(num)) == NULL)
+            return NULL;
+        hdr->info = old->info;
+        memcpy((unsigned char *)hdr + ALLOC_HDR_SIZE, addr,
+               HDR_SIZE(old) < num ? HDR_SIZE(old) : num);
+        block_free(old);
+    }
+    account_realloc(hdr, num);
+    return (unsigned char *)hdr + ALLOC_HDR_SIZE;
+}
+
+CMP_err CMPclient_alloc_stats_enable(bool arena)
+{
+    if (alloc_enabled)
+        return CMP_OK;
+    if (arena && pthread_key_create(&arena_key, arena_thread_cleanup) != 0)
+        return ERR_R_INIT_FAIL;
+    if (!CRYPTO_set_mem_functions(alloc_malloc, alloc_realloc, alloc_free)) {
+        /* OpenSSL has already allocated memory, so it is too late */
+        if (arena)
+            (void)pthread_key_delete(arena_key);
+        return ERR_R_INIT_FAIL;
+    }
+    alloc_arena = arena;
+    alloc_enabled = 1;
+    return CMP_OK;
+}
+
+bool CMPclient_alloc_stats_enabled(void)
+{
+    return alloc_enabled;
+}
+
+int CMPclient_alloc_set_phase(int phase)
+{
+    int prev = alloc_phase;
+
+    if (phase >= 0 && phase < CMPCLIENT_PHASE_NUM)
+        alloc_phase = phase;
+    return prev;
+}
+
+void CMPclient_alloc_stats_get(int phase, CMPCLIENT_ALLOC_STATS *stats)
+{
+    if (stats == NULL)
+        return;
+    if (phase >= 0 && phase < CMPCLIENT_PHASE_NUM)
+        stats_load(phase, stats);
+    else
+        memset(stats, 0, sizeof(*stats));
+}
+
+/* blocks allocated before and freed afterwards make bytes_live negative */
+void CMPclient_alloc_stats_reset(void)
+{
+    int phase;
+
+    for (phase = 0; phase < CMPCLIENT_PHASE_NUM; phase++) {
+        CMPCLIENT_ALLOC_STATS *st = &alloc_stats[phase];
+
+        __atomic_store_n(&st->allocs, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->frees, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->reallocs, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->bytes_allocated, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->bytes_live, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->bytes_peak, 0, __ATOMIC_RELAXED);
+    }
+}
+
+void CMPclient_alloc_phase_restore(const int *phase)
+{
+    alloc_phase = *phase;
+}
+
+void CMPclient_alloc_transaction_end(void)
+{
+    if (alloc_arena) {
+        arena_retire();
+        (void)pthread_setspecific(arena_key, NULL);
+    }
+}
+
+void CMPclient_alloc_stats_log(severity level)
+{
+    int phase;
+
+    if (!alloc_enabled || !CMPclient_log_enabled(level))
+        return;
+    LOG(LOG_FUNC_FILE_LINE, level, "Allocation statistics per phase%s:",
+        alloc_arena ? " (arena mode)" : "");
+    for (phase = 0; phase < CMPCLIENT_PHASE_NUM; phase++) {
+        CMPCLIENT_ALLOC_STATS st;
+
+        stats_load(phase, &st);
+        if (st.allocs == 0 && st.frees == 0)
+            continue;
+        LOG(LOG_FUNC_FILE_LINE, level,
+            "%-7s allocs=%lu frees=%lu reallocs=%lu bytes=%lu peak=%ld",
+            phase_names[phase], st.allocs, st.frees, st.reallocs,
+            (unsigned long)st.bytes_allocated, st.bytes_peak);
+    }
+}
+
+#else /* GENCMP_NO_ALLOC */
+
+CMP_err CMPclient_alloc_stats_enable(bool arena)
+{
+    (void)arena;
+    LOG(FL_ERR, "Allocation accounting is not supported by this build");
+    return CMP_R_INVALID_PARAMETERS;
+}
+
+bool CMPclient_alloc_stats_enabled(void)
+{
+    return false;
+}
+
+int CMPclient_alloc_set_phase(int phase)
+{
+    (void)phase;
+    return CMPCLIENT_PHASE_OTHER;
+}
+
+void CMPclient_alloc_stats_get(int phase, CMPCLIENT_ALLOC_STATS *stats)
+{
+    (void)phase;
+    if (stats != NULL)
+        memset(stats, 0, sizeof(*stats));
+}
+
+void CMPclient_alloc_stats_reset(void)
+{
+}
+
+void CMPclient_alloc_transaction_end(void)
+{
+}
+
+void CMPclient_alloc_stats_log(severity level)
+{
+    (void)level;
+}
+
+#endif
@@ -0,0 +1,801 @@
+/*-
+ * @file   genericCMPClient_engine.c
+ * @brief  event-driven engine running many CMP transactions on one thread
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "genericCMPClient_local.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * The CMP client API is blocking: OSSL_CMP_exec_*_ses() call the transfer
+ * callback, which returns only when the response has arrived. In order to
+ * keep many transactions in flight without a thread each, the engine runs
+ * each submitted job, typically one transaction, in a user-space context
+ * with its own stack. Whenever the transport of CMPclient_setup_transport()
+ * would block, it calls CMPclient_engine_wait(), which arms the poller for
+ * the socket and switches back to the engine loop. The loop resumes a job
+ * as soon as its socket is ready or its deadline has passed.
+ *
+ * The poller uses io_uring (IORING_OP_POLL_ADD, via raw system calls such that
+ * no liburing is needed) if the kernel provides it including IORING_FEAT_EXT_ARG
+ * (Linux 5.11), else epoll. Each engine is driven by the thread calling
+ * CMPclient_engine_run(); for using several threads, use an engine per thread.
+ *
+ * Still blocking within a job are name resolution on DNS cache misses and
+ * CONNECT via a proxy. OpenSSL's own ASYNC jobs are not used since their
+ * stack size is fixed to 32 KiB before OpenSSL 3.2, too little for CMP.
+ * Job stacks are mapped with an inaccessible guard page below them, such that
+ * an overflow faults rather than silently corrupting the heap.
+ */
+
+/* saving and restoring the error queue, see genericCMPClient_local.h */
+
+static void entry_free(CMPCLIENT_ERR_ENTRY *entry)
+{
+    OPENSSL_free(entry->file);
+    OPENSSL_free(entry->func);
+    OPENSSL_free(entry->data);
+}
+
+void CMPclient_errs_save(CMPCLIENT_ERRS *errs)
+{
+    const char *file, *func, *data;
+    int line, flags;
+    unsigned long code;
+
+    while ((code = ERR_get_error_all(&file, &line, &func, &data, &flags)) != 0) {
+        CMPCLIENT_ERR_ENTRY *entry;
+
+        if (errs->num == errs->size) {
+            int size = errs->size == 0 ? 8 : 2 * errs->size;
+            CMPCLIENT_ERR_ENTRY *entries =
+                OPENSSL_realloc(errs->entries, (size_t)size * sizeof(*entries));
+
+            if (entries == NULL) { /* the remaining errors are lost */
+                ERR_clear_error();
+                return;
+            }
+            errs->entries = entries;
+            errs->size = size;
+        }
+        entry = &errs->entries[errs->num++];
+        entry->code = code;
+        entry->file = file != NULL ? OPENSSL_strdup(file) : NULL;
+        entry->line = line;
+        entry->func = func != NULL ? OPENSSL_strdup(func) : NULL;
+        entry->data = (flags & ERR_TXT_STRING) != 0 && *data != '\0'
+            ? OPENSSL_strdup(data) : NULL;
+    }
+}
+
+void CMPclient_errs_restore(CMPCLIENT_ERRS *errs)
+{
+    int i;
+
+    for (i = 0; i < errs->num; i++) {
+        CMPCLIENT_ERR_ENTRY *entry = &errs->entries[i];
+
+        ERR_new();
+        ERR_set_debug(entry->file, entry->line, entry->func);
+        if (entry->data != NULL)
+            ERR_set_error(ERR_GET_LIB(entry->code), ERR_GET_REASON(entry->code),
+                          "%s", entry->data);
+        else
+            ERR_set_error(ERR_GET_LIB(entry->code), ERR_GET_REASON(entry->code),
+                          NULL);
+        entry_free(entry);
+    }
+    errs->num = 0;
+}
+
+void CMPclient_errs_free(CMPCLIENT_ERRS *errs)
+{
+    int i;
+
+    for (i = 0; i < errs->num; i++)
+        entry_free(&errs->entries[i]);
+    OPENSSL_free(errs->entries);
+    memset(errs, 0, sizeof(*errs));
+}
+
+/* outside engine jobs, waiting is blocking */
+static int poll_wait(int fd, short events, int timeout_ms)
+{
+    struct pollfd pfd;
+    int rv;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    do {
+        rv = poll(&pfd, 1, timeout_ms > 0 ? timeout_ms : -1);
+    } while (rv < 0 && errno == EINTR);
+    return rv < 0 ? -1 : rv > 0;
+}
+
+#if defined(__linux__) && !defined(GENCMP_NO_ENGINE)
+
+# include <stdint.h>
+# include <sys/epoll.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <ucontext.h>
+# include <unistd.h>
+# if defined(__NR_io_uring_setup) && !defined(GENCMP_NO_IO_URING)
+#  include <linux/io_uring.h>
+#  ifdef IORING_FEAT_EXT_ARG
+#   define ENGINE_IO_URING
+#  endif
+# endif
+
+# define ENGINE_STACK_SIZE (256 * 1024)
+# define ENGINE_MAX_EVENTS 64
+# define ENGINE_SLOT_BITS 16 /* low bits of user data; the rest is a sequence */
+# define ENGINE_MAX_INFLIGHT (1 << ENGINE_SLOT_BITS)
+
+typedef struct engine_job_st {
+    CMPclient_engine_fn fn;
+    CMPclient_engine_done_fn done;
+    void *arg;
+    CMP_err err;
+    struct engine_job_st *next; /* in queue of jobs not yet started */
+} ENGINE_JOB;
+
+typedef struct engine_slot_st {
+    ENGINE_JOB *job; /* NULL if slot is free */
+    ucontext_t uc;
+    void *stack; /* above its guard page, see stack_new() */
+    uint64_t seq; /* incremented on each wait, for detecting stale events */
+    int fd; /* waited for, or -1 */
+    long deadline_ms; /* of the wait, 0 for none */
+    int result; /* of the wait: 1 ready, 0 timeout, -1 pending */
+    bool finished;
+    /* per-thread state of the job while it is switched out */
+    CMPCLIENT_ERRS errs;
+    int alloc_phase;
+} ENGINE_SLOT;
+
+struct cmpclient_engine_st {
+    int max_inflight;
+    int active; /* number of slots in use */
+    ENGINE_SLOT *slots;
+    ENGINE_SLOT *current; /* slot whose job is running, or NULL */
+    ucontext_t loop_uc;
+    CMPCLIENT_ERRS loop_errs; /* of the loop while a job is running */
+    ENGINE_JOB *queue, *queue_tail;
+    unsigned long jobs_done;
+    int epfd; /* epoll backend, or -1 */
+# ifdef ENGINE_IO_URING
+    int ring_fd; /* io_uring backend, or -1 */
+    struct {
+        unsigned *head, *tail, *mask, *array;
+        struct io_uring_sqe *sqes;
+        void *ring;
+        size_t ring_size, sqes_size;
+        unsigned entries;
+    } sq;
+    struct {
+        unsigned *head, *tail, *mask;
+        struct io_uring_cqe *cqes;
+        void *ring;
+        size_t ring_size;
+    } cq;
+    unsigned to_submit;
+# endif
+};
+
+static __thread CMPCLIENT_ENGINE *thread_engine = NULL; /* while running */
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t slot_data(const CMPCLIENT_ENGINE *e, const ENGINE_SLOT *s)
+{
+    return (s->seq << ENGINE_SLOT_BITS) | (uint64_t)(s - e->slots);
+}
+
+/* returns the slot still waiting for the event with given user data, or NULL */
+static ENGINE_SLOT *data_slot(CMPCLIENT_ENGINE *e, uint64_t data)
+{
+    uint64_t i = data & (ENGINE_MAX_INFLIGHT - 1);
+    ENGINE_SLOT *s;
+
+    if (i >= (uint64_t)e->max_inflight)
+        return NULL;
+    s = &e->slots[i];
+    return s->job != NULL && s->result < 0 && slot_data(e, s) == data ? s : NULL;
+}
+
+/* io_uring backend */
+
+# ifdef ENGINE_IO_URING
+static bool uring_init(CMPCLIENT_ENGINE *e, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    e->ring_fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (e->ring_fd < 0)
+        return false;
+    if ((p.features & IORING_FEAT_EXT_ARG) == 0)
+        goto err;
+    e->sq.ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    e->cq.ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    e->sq.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    e->sq.ring = mmap(NULL, e->sq.ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_SQ_RING);
+    e->cq.ring = mmap(NULL, e->cq.ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_CQ_RING);
+    e->sq.sqes = mmap(NULL, e->sq.sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_SQES);
+    if (e->sq.ring == MAP_FAILED || e->cq.ring == MAP_FAILED
+        || e->sq.sqes == MAP_FAILED)
+        goto err;
+    e->sq.head = (unsigned *)((char *)e->sq.ring + p.sq_off.head);
+    e->sq.tail = (unsigned *)((char *)e->sq.ring + p.sq_off.tail);
+    e->sq.mask = (unsigned *)((char *)e->sq.ring + p.sq_off.ring_mask);
+    e->sq.array = (unsigned *)((char *)e->sq.ring + p.sq_off.array);
+    e->sq.entries = p.sq_entries;
+    e->cq.head = (unsigned *)((char *)e->cq.ring + p.cq_off.head);
+    e->cq.tail = (unsigned *)((char *)e->cq.ring + p.cq_off.tail);
+    e->cq.mask = (unsigned *)((char *)e->cq.ring + p.cq_off.ring_mask);
+    e->cq.cqes = (struct io_uring_cqe *)((char *)e->cq.ring + p.cq_off.cqes);
+    return true;
+
+ err:
+    if (e->sq.ring != NULL && e->sq.ring != MAP_FAILED)
+        (void)munmap(e->sq.ring, e->sq.ring_size);
+    if (e->cq.ring != NULL && e->cq.ring != MAP_FAILED)
+        (void)munmap(e->cq.ring, e->cq.ring_size);
+    if (e->sq.sqes != NULL && e->sq.sqes != MAP_FAILED)
+        (void)munmap(e->sq.sqes, e->sq.sqes_size);
+    memset(&e->sq, 0, sizeof(e->sq));
+    memset(&e->cq, 0, sizeof(e->cq));
+    (void)close(e->ring_fd);
+    e->ring_fd = -1;
+    return false;
+}
+
+static void uring_free(CMPCLIENT_ENGINE *e)
+{
+    if (e->ring_fd < 0)
+        return;
+    (void)munmap(e->sq.ring, e->sq.ring_size);
+    (void)munmap(e->cq.ring, e->cq.ring_size);
+    (void)munmap(e->sq.sqes, e->sq.sqes_size);
+    (void)close(e->ring_fd);
+}
+
+static int uring_enter(CMPCLIENT_ENGINE *e, unsigned min_complete,
+                       long timeout_ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int rv;
+
+    memset(&arg, 0, sizeof(arg));
+    if (min_complete > 0 && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    rv = (int)syscall(__NR_io_uring_enter, e->ring_fd, e->to_submit,
+                      min_complete, flags | IORING_ENTER_EXT_ARG,
+                      &arg, sizeof(arg));
+    if (rv >= 0)
+        e->to_submit -= (unsigned)rv < e->to_submit ? (unsigned)rv
+            : e->to_submit;
+    return rv;
+}
+
+static struct io_uring_sqe *uring_sqe(CMPCLIENT_ENGINE *e)
+{
+    unsigned tail = *e->sq.tail, i;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(e->sq.head, __ATOMIC_ACQUIRE) >= e->sq.entries
+        && uring_enter(e, 0, -1) < 0)
+        return NULL;
+    if (tail - __atomic_load_n(e->sq.head, __ATOMIC_ACQUIRE) >= e->sq.entries)
+        return NULL;
+    i = tail & *e->sq.mask;
+    sqe = &e->sq.sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    e->sq.array[i] = i;
+    __atomic_store_n(e->sq.tail, tail + 1, __ATOMIC_RELEASE);
+    e->to_submit++;
+    return sqe;
+}
+
+static bool uring_arm(CMPCLIENT_ENGINE *e, ENGINE_SLOT *s, short events)
+{
+    struct io_uring_sqe *sqe = uring_sqe(e);
+
+    if (sqe == NULL)
+        return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = s->fd;
+    sqe->poll32_events = (uint32_t)events;
+    sqe->user_data = slot_data(e, s);
+    return true;
+}
+
+/* the poll request holds a reference to the socket, so remove it */
+static void uring_disarm(CMPCLIENT_ENGINE *e, ENGINE_SLOT *s)
+{
+    struct io_uring_sqe *sqe = uring_sqe(e);
+
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = slot_data(e, s);
+    sqe->user_data = 0; /* never matches a slot since sequences start at 1 */
+}
+
+static int uring_wait(CMPCLIENT_ENGINE *e, long timeout_ms)
+{
+    unsigned head, tail;
+    int n = 0;
+
+    if (uring_enter(e, 1, timeout_ms) < 0 && errno != ETIME && errno != EINTR)
+        return -1;
+    head = *e->cq.head;
+    tail = __atomic_load_n(e->cq.tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        ENGINE_SLOT *s = data_slot(e, e->cq.cqes[head & *e->cq.mask].user_data);
+
+        if (s != NULL) {
+            s->result = 1; /* also on error, which the job will see */
+            n++;
+        }
+    }
+    __atomic_store_n(e->cq.head, head, __ATOMIC_RELEASE);
+    return n;
+}
+# endif /* ENGINE_IO_URING */
+
+/* epoll backend */
+
+static bool epoll_arm(CMPCLIENT_ENGINE *e, ENGINE_SLOT *s, short events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLONESHOT | ((events & POLLIN) != 0 ? EPOLLIN : 0)
+        | ((events & POLLOUT) != 0 ? EPOLLOUT : 0);
+    ev.data.u64 = slot_data(e, s);
+    /* one-shot registrations stay, disarmed, until the socket is closed */
+    return epoll_ctl(e->epfd, EPOLL_CTL_MOD, s->fd, &ev) == 0
+        || (errno == ENOENT && epoll_ctl(e->epfd, EPOLL_CTL_ADD, s->fd, &ev) == 0);
+}
+
+static int epoll_wait_slots(CMPCLIENT_ENGINE *e, long timeout_ms)
+{
+    struct epoll_event evs[ENGINE_MAX_EVENTS];
+    int i, n = 0, num;
+
+    num = epoll_wait(e->epfd, evs, ENGINE_MAX_EVENTS,
+                     timeout_ms > INT32_MAX ? -1 : (int)timeout_ms);
+    if (num < 0)
+        return errno == EINTR ? 0 : -1;
+    for (i = 0; i < num; i++) {
+        ENGINE_SLOT *s = data_slot(e, evs[i].data.u64);
+
+        if (s != NULL) {
+            s->result = 1;
+            n++;
+        }
+    }
+    return n;
+}
+
+/* jobs */
+
+static void job_main(void)
+{
+    CMPCLIENT_ENGINE *e = thread_engine;
+    ENGINE_SLOT *s = e->current;
+
+    s->job->err = (*s->job->fn)(s->job->arg);
+    s->finished = true;
+    /* returning continues with uc_link, i.e., the engine loop */
+}
+
+/*
+ * switches to the job in slot s until it waits or has finished.
+ * The OpenSSL error queue and the allocation phase are per thread, so they
+ * are swapped such that each job, as well as the loop, keeps its own ones.
+ */
+static void job_resume(CMPCLIENT_ENGINE *e, ENGINE_SLOT *s)
+{
+    int loop_phase;
+
+    CMPclient_errs_save(&e->loop_errs);
+    CMPclient_errs_restore(&s->errs);
+    loop_phase = CMPclient_alloc_set_phase(s->alloc_phase);
+    e->current = s;
+    (void)swapcontext(&e->loop_uc, &s->uc);
+    e->current = NULL;
+    s->alloc_phase = CMPclient_alloc_set_phase(loop_phase);
+    if (!s->finished) {
+        CMPclient_errs_save(&s->errs);
+        CMPclient_errs_restore(&e->loop_errs);
+        return;
+    }
+
+    /* the errors of the job are visible to its done callback only */
+    if (s->job->done != NULL)
+        (*s->job->done)(s->job->arg, s->job->err);
+    ERR_clear_error();
+    CMPclient_errs_restore(&e->loop_errs);
+    OPENSSL_free(s->job);
+    s->job = NULL;
+    e->active--;
+    e->jobs_done++;
+}
+
+static size_t stack_guard_size(void)
+{
+    long page = sysconf(_SC_PAGESIZE);
+
+    return page > 0 ? (size_t)page : 4096;
+}
+
+/* returns the usable part of a job stack, with a guard page below it */
+static void *stack_new(void)
+{
+    size_t guard = stack_guard_size();
+    char *base = mmap(NULL, guard + ENGINE_STACK_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+
+    if (base == MAP_FAILED) {
+        LOG(FL_ERR, "cannot map job stack: %s", strerror(errno));
+        return NULL;
+    }
+    if (mprotect(base, guard, PROT_NONE) != 0) {
+        LOG(FL_ERR, "cannot protect job stack guard: %s", strerror(errno));
+        (void)munmap(base, guard + ENGINE_STACK_SIZE);
+        return NULL;
+    }
+    return base + guard;
+}
+
+static void stack_free(void *stack)
+{
+    size_t guard = stack_guard_size();
+
+    if (stack != NULL)
+        (void)munmap((char *)stack - guard, guard + ENGINE_STACK_SIZE);
+}
+
+static bool job_start(CMPCLIENT_ENGINE *e, ENGINE_SLOT *s, ENGINE_JOB *job)
+{
+    if (s->stack == NULL && (s->stack = stack_new()) == NULL)
+        return false;
+    if (getcontext(&s->uc) != 0)
+        return false;
+    s->uc.uc_stack.ss_sp = s->stack;
+    s->uc.uc_stack.ss_size = ENGINE_STACK_SIZE;
+    s->uc.uc_link = &e->loop_uc;
+    makecontext(&s->uc, job_main, 0);
+    s->job = job;
+    s->fd = -1;
+    s->result = 0;
+    s->finished = false;
+    s->alloc_phase = CMPclient_alloc_set_phase(-1 /* that of the loop */);
+    e->active++;
+    job_resume(e, s);
+    return true;
+}
+
+CMPCLIENT_ENGINE *CMPclient_engine_new(int max_inflight, int flags)
+{
+    CMPCLIENT_ENGINE *e;
+
+    if (max_inflight <= 0 || max_inflight > ENGINE_MAX_INFLIGHT) {
+        LOG(FL_ERR, "max_inflight must be in range 1..%d", ENGINE_MAX_INFLIGHT);
+        return NULL;
+    }
+    if ((e = OPENSSL_zalloc(sizeof(*e))) == NULL
+        || (e->slots = OPENSSL_zalloc((size_t)max_inflight
+                                      * sizeof(*e->slots))) == NULL) {
+        OPENSSL_free(e);
+        LOG_err("Out of memory");
+        return NULL;
+    }
+    e->max_inflight = max_inflight;
+    e->epfd = -1;
+# ifdef ENGINE_IO_URING
+    e->ring_fd = -1;
+    /* each waiting job has at most a poll and a poll removal in flight */
+    if ((flags & CMPCLIENT_ENGINE_EPOLL) == 0
+        && uring_init(e, (unsigned)max_inflight * 2))
+        return e;
+# endif
+    (void)flags;
+    if ((e->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        LOG(FL_ERR, "cannot create epoll instance: %s", strerror(errno));
+        CMPclient_engine_free(e);
+        return NULL;
+    }
+    return e;
+}
+
+const char *CMPclient_engine_backend(const CMPCLIENT_ENGINE *e)
+{
+    if (e == NULL)
+        return "none";
+# ifdef ENGINE_IO_URING
+    if (e->ring_fd >= 0)
+        return "io_uring";
+# endif
+    return "epoll";
+}
+
+CMP_err CMPclient_engine_submit(CMPCLIENT_ENGINE *e, CMPclient_engine_fn fn,
+                                OPTIONAL void *arg,
+                                OPTIONAL CMPclient_engine_done_fn done)
+{
+    ENGINE_JOB *job;
+
+    if (e == NULL || fn == NULL)
+        return CMP_R_INVALID_PARAMETERS;
+    if ((job = OPENSSL_zalloc(sizeof(*job))) == NULL)
+        return ERR_R_MALLOC_FAILURE;
+    job->fn = fn;
+    job->arg = arg;
+    job->done = done;
+    if (e->queue_tail != NULL)
+        e->queue_tail->next = job;
+    else
+        e->queue = job;
+    e->queue_tail = job;
+    return CMP_OK;
+}
+
+/*
+ * reports failure to the given job and all jobs queued so far.
+ * Jobs submitted meanwhile by their done callbacks stay queued.
+ */
+static void fail_jobs(CMPCLIENT_ENGINE *e, ENGINE_JOB *job, CMP_err err)
+{
+    ENGINE_JOB *next;
+
+    job->next = e->queue;
+    e->queue = e->queue_tail = NULL;
+    for (; job != NULL; job = next) {
+        next = job->next;
+        if (job->done != NULL)
+            (*job->done)(job->arg, err);
+        OPENSSL_free(job);
+    }
+}
+
+CMP_err CMPclient_engine_run(CMPCLIENT_ENGINE *e)
+{
+    CMP_err err = CMP_OK;
+    int i;
+
+    if (e == NULL)
+        return CMP_R_INVALID_PARAMETERS;
+    if (thread_engine != NULL) {
+        LOG(FL_ERR, "engine is already running in this thread");
+        return CMP_R_INVALID_CONTEXT;
+    }
+    thread_engine = e;
+    while (e->queue != NULL || e->active > 0) {
+        long timeout = -1, now;
+        int n;
+
+        /* start queued jobs as long as slots are free */
+        for (i = 0; i < e->max_inflight && e->queue != NULL; i++) {
+            ENGINE_JOB *job = e->queue;
+
+            if (e->slots[i].job != NULL)
+                continue;
+            e->queue = job->next;
+            if (e->queue == NULL)
+                e->queue_tail = NULL;
+            if (!job_start(e, &e->slots[i], job)) {
+                LOG(FL_ERR, "cannot start engine job");
+                err = ERR_R_MALLOC_FAILURE;
+                fail_jobs(e, job, err);
+                /* the jobs already running are continued */
+            }
+        }
+        if (e->active == 0)
+            continue;
+
+        now = now_ms();
+        for (i = 0; i < e->max_inflight; i++) {
+            const ENGINE_SLOT *s = &e->slots[i];
+
+            if (s->job != NULL && s->result < 0 && s->deadline_ms != 0
+                && (timeout < 0 || s->deadline_ms - now < timeout))
+                timeout = s->deadline_ms > now ? s->deadline_ms - now : 0;
+        }
+# ifdef ENGINE_IO_URING
+        if (e->ring_fd >= 0)
+            n = uring_wait(e, timeout);
+        else
+# endif
+            n = epoll_wait_slots(e, timeout);
+        if (n < 0) {
+            LOG(FL_ERR, "waiting for events failed: %s", strerror(errno));
+            err = CMP_R_OTHER_LIB_ERR;
+            if (e->queue != NULL) {
+                ENGINE_JOB *job = e->queue;
+
+                e->queue = job->next;
+                fail_jobs(e, job, err);
+            }
+            goto end;
+        }
+
+        now = now_ms();
+        for (i = 0; i < e->max_inflight; i++) {
+            ENGINE_SLOT *s = &e->slots[i];
+
+            if (s->job == NULL)
+                continue;
+            if (s->result < 0 && s->deadline_ms != 0 && now >= s->deadline_ms) {
+                s->result = 0;
+# ifdef ENGINE_IO_URING
+                if (e->ring_fd >= 0 && s->fd >= 0)
+                    uring_disarm(e, s);
+# endif
+            }
+            if (s->result >= 0)
+                job_resume(e, s);
+        }
+    }
+
+ end:
+    thread_engine = NULL;
+    return err;
+}
+
+unsigned long CMPclient_engine_jobs_done(const CMPCLIENT_ENGINE *e)
+{
+    return e == NULL ? 0 : e->jobs_done;
+}
+
+void CMPclient_engine_free(OPTIONAL CMPCLIENT_ENGINE *e)
+{
+    ENGINE_JOB *job, *next;
+    int i;
+
+    if (e == NULL)
+        return;
+    for (job = e->queue; job != NULL; job = next) {
+        next = job->next;
+        OPENSSL_free(job);
+    }
+    for (i = 0; i < e->max_inflight; i++) {
+        /* jobs interrupted by an error of CMPclient_engine_run() are lost */
+        OPENSSL_free(e->slots[i].job);
+        stack_free(e->slots[i].stack);
+        CMPclient_errs_free(&e->slots[i].errs);
+    }
+    CMPclient_errs_free(&e->loop_errs);
+    OPENSSL_free(e->slots);
+# ifdef ENGINE_IO_URING
+    uring_free(e);
+# endif
+    if (e->epfd >= 0)
+        (void)close(e->epfd);
+    OPENSSL_free(e);
+}
+
+bool CMPclient_engine_active(void)
+{
+    return thread_engine != NULL && thread_engine->current != NULL;
+}
+
+int CMPclient_engine_wait(int fd, short events, int timeout_ms)
+{
+    CMPCLIENT_ENGINE *e = thread_engine;
+    ENGINE_SLOT *s;
+    bool armed;
+
+    if (!CMPclient_engine_active())
+        return poll_wait(fd, events, timeout_ms);
+
+    s = e->current;
+    s->seq++;
+    s->fd = fd;
+    s->result = -1;
+    s->deadline_ms = timeout_ms > 0 ? now_ms() + timeout_ms : 0;
+    if (fd < 0) /* just sleeping */
+        armed = s->deadline_ms != 0;
+# ifdef ENGINE_IO_URING
+    else if (e->ring_fd >= 0)
+        armed = uring_arm(e, s, events);
+# endif
+    else
+        armed = epoll_arm(e, s, events);
+    if (!armed) {
+        s->result = 0;
+        return -1;
+    }
+    (void)swapcontext(&s->uc, &e->loop_uc); /* back when ready or timed out */
+    s->fd = -1;
+    return s->result;
+}
+
+#else /* !__linux__ || GENCMP_NO_ENGINE */
+
+CMPCLIENT_ENGINE *CMPclient_engine_new(int max_inflight, int flags)
+{
+    (void)max_inflight;
+    (void)flags;
+    LOG(FL_ERR, "the transport engine is not supported by this build");
+    return NULL;
+}
+
+const char *CMPclient_engine_backend(const CMPCLIENT_ENGINE *e)
+{
+    (void)e;
+    return "none";
+}
+
+CMP_err CMPclient_engine_submit(CMPCLIENT_ENGINE *e, CMPclient_engine_fn fn,
+                                OPTIONAL void *arg,
+                                OPTIONAL CMPclient_engine_done_fn done)
+{
+    (void)e;
+    (void)fn;
+    (void)arg;
+    (void)done;
+    return CMP_R_INVALID_PARAMETERS;
+}
+
+CMP_err CMPclient_engine_run(CMPCLIENT_ENGINE *e)
+{
+    (void)e;
+    return CMP_R_INVALID_PARAMETERS;
+}
+
+unsigned long CMPclient_engine_jobs_done(const CMPCLIENT_ENGINE *e)
+{
+    (void)e;
+    return 0;
+}
+
+void CMPclient_engine_free(OPTIONAL CMPCLIENT_ENGINE *e)
+{
+    (void)e;
+}
+
+bool CMPclient_engine_active(void)
+{
+    return false;
+}
+
+int CMPclient_engine_wait(int fd, short events, int timeout_ms)
+{
+    return poll_wait(fd, events, timeout_ms);
+}
+
+#endif
@@ -0,0 +1,1319 @@
+/*-
+ * @file   genericCMPClient_http.c
+ * @brief  HTTP(S) transport with connection handling done by the library
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "genericCMPClient_local.h"
+
+#include <openssl/http.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef LOCAL_DEFS
+# include "genericCMPClient_use.h"
+#else
+# ifndef SECUTILS_NO_TLS
+#  include <secutils/connections/tls.h>
+# endif
+#endif
+
+#ifndef GENCMP_NO_HTTP
+
+/*
+ * OpenSSL resolves the server name and connects within OSSL_HTTP_transfer(),
+ * trying the addresses one after the other. Here the library establishes
+ * the connection itself and hands it to OSSL_HTTP_transfer():
+ *
+ * - Name resolution results are cached process-wide per host and port,
+ *   for dns_ttl seconds, and failures for dns_negative_ttl seconds.
+ *   Addresses set via CMPclient_dns_cache_set() are pinned instead.
+ * - Connecting follows the Happy Eyeballs approach (RFC 8305): address
+ *   families are interleaved, and if an attempt did not succeed within
+ *   CONNECT_ATTEMPT_DELAY_MS, the next one is started in parallel.
+ *   The first connection established wins, all others are closed.
+ * - Resolve and connect times are recorded per endpoint.
+ *
+ * Plain HTTP via a proxy needs the proxy support of OSSL_HTTP_transfer(),
+ * which is not available for given connections, so then OpenSSL connects.
+ *
+ * A co-located server may also be reached via a Unix domain socket,
+ * which saves the TCP/IP stack and name resolution on each connect.
+ *
+ * Socket options given via CMPCLIENT_TRANSPORT_OPTS are applied before
+ * connecting. For each exchange, the times until connected, until the first
+ * byte of the response arrived, and until the response was complete
+ * are taken, where the first byte is detected by a callback on the BIO.
+ *
+ * Within jobs of the engine (see genericCMPClient_engine.c), the exchange
+ * is driven by OSSL_HTTP_REQ_CTX_nbio() and CMPclient_engine_wait(), such that
+ * other jobs run while waiting. Connection attempts are not raced then
+ * but made one after the other.
+ *
+ * Before each exchange, admission control per server (see DNS_ENTRY) takes
+ * a token from a bucket refilled at the configured rate and checks the cap on
+ * concurrent exchanges, waiting within the message timeout if needed, where
+ * engine jobs yield. After a 503 or 429 HTTP response, all exchanges with the
+ * server pause for its Retry-After time, at most ADMIT_BACKOFF_MAX_MS and the
+ * message timeout, else for a backoff time doubling from
+ * ADMIT_BACKOFF_MIN_MS up to ADMIT_BACKOFF_MAX_MS, with some jitter such that
+ * clients do not return in lockstep. Other 5xx responses and timeouts lead to
+ * the same backoff. Requests answered with 503 or 429, which the server has
+ * not processed, are retried after the pause if the message timeout permits.
+ * The status and Retry-After header are taken from the first bytes read
+ * after sending the request.
+ */
+
+#define DNS_DEFAULT_TTL 60 /* seconds */
+#define DNS_DEFAULT_NEGATIVE_TTL 5 /* seconds */
+#define DNS_MAX_ADDRS 16
+#define CONNECT_ATTEMPT_DELAY_MS 250
+#define CMP_CONTENT_TYPE "application/pkixcmp"
+#define ADMIT_POLL_MS 10 /* while waiting for the number of exchanges to drop */
+#define ADMIT_BACKOFF_MIN_MS 1000
+#define ADMIT_BACKOFF_MAX_MS 60000
+#define ADMIT_MAX_RETRIES 5 /* of requests not processed due to overload */
+
+typedef struct dns_addr_st {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    int family;
+} DNS_ADDR;
+
+typedef struct dns_entry_st {
+    char *host;
+    char *port;
+    DNS_ADDR addrs[DNS_MAX_ADDRS];
+    int num; /* 0 for negative entry */
+    time_t expires;
+    bool pinned; /* addrs set by CMPclient_dns_cache_set(), not expiring */
+    CMPCLIENT_ENDPOINT_STATS stats;
+    CMPCLIENT_RATE_LIMIT limit; /* admission control for this server */
+    double tokens; /* in the bucket */
+    long refilled_ms; /* when tokens were last updated */
+    int inflight; /* exchanges admitted and not yet finished */
+    long backoff_until_ms; /* no exchanges admitted before */
+    int backoff_ms; /* of the last backoff not followed by a success */
+    struct dns_entry_st *next;
+} DNS_ENTRY;
+
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static DNS_ENTRY *dns_cache = NULL;
+static int dns_ttl = DNS_DEFAULT_TTL;
+static int dns_negative_ttl = DNS_DEFAULT_NEGATIVE_TTL;
+
+struct cmpclient_transport_st {
+    char *host;
+    char *port;
+    char *path;
+    char *proxy; /* HTTP(S) proxy to use, or NULL */
+    char *unix_path; /* Unix domain socket to use instead of TCP, or NULL */
+    SSL_CTX *ssl_ctx; /* NULL if TLS is not used */
+    OSSL_HTTP_REQ_CTX *rctx; /* while connection is kept alive */
+    BIO *bio; /* connection given to rctx, owned by us */
+    CMPCLIENT_TRANSPORT_OPTS opts;
+    CMPCLIENT_EXCHANGE_TIMES times; /* of the last exchange */
+    struct timespec start; /* of the current exchange */
+    bool request_sent; /* in the current exchange */
+    int http_status; /* of the current exchange, 0 if unknown */
+    int retry_after; /* in seconds, from the response, 0 if none */
+    bool admitted; /* counted as in flight for its server */
+};
+
+static time_t now_s(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned long elapsed_us(const struct timespec *start)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)((ts.tv_sec - start->tv_sec) * 1000000L
+                           + (ts.tv_nsec - start->tv_nsec) / 1000);
+}
+
+void CMPclient_dns_cache_set_ttl(int ttl, int negative_ttl)
+{
+    (void)pthread_mutex_lock(&dns_lock);
+    dns_ttl = ttl < 0 ? DNS_DEFAULT_TTL : ttl;
+    dns_negative_ttl = negative_ttl < 0 ? DNS_DEFAULT_NEGATIVE_TTL
+        : negative_ttl;
+    (void)pthread_mutex_unlock(&dns_lock);
+}
+
+/*
+ * Entries of servers with exchanges in flight are kept, as these are released
+ * on them; they are just reset and freed by a later clear once idle.
+ */
+void CMPclient_dns_cache_clear(void)
+{
+    DNS_ENTRY *e, *next, **pe = &dns_cache;
+
+    (void)pthread_mutex_lock(&dns_lock);
+    for (e = dns_cache; e != NULL; e = next) {
+        next = e->next;
+        if (e->inflight > 0) {
+            e->num = 0;
+            e->expires = 0;
+            e->pinned = false;
+            memset(&e->stats, 0, sizeof(e->stats));
+            memset(&e->limit, 0, sizeof(e->limit));
+            e->tokens = 0;
+            e->refilled_ms = 0;
+            e->backoff_until_ms = 0;
+            e->backoff_ms = 0;
+            pe = &e->next;
+            continue;
+        }
+        *pe = next;
+        OPENSSL_free(e->host);
+        OPENSSL_free(e->port);
+        OPENSSL_free(e);
+    }
+    (void)pthread_mutex_unlock(&dns_lock);
+}
+
+/* must be called with dns_lock held */
+static DNS_ENTRY *dns_entry(const char *host, const char *port, bool create)
+{
+    DNS_ENTRY *e;
+
+    for (e = dns_cache; e != NULL; e = e->next)
+        if (strcmp(e->host, host) == 0 && strcmp(e->port, port) == 0)
+            return e;
+    if (!create)
+        return NULL;
+    if ((e = OPENSSL_zalloc(sizeof(*e))) == NULL
+        || (e->host = OPENSSL_strdup(host)) == NULL
+        || (e->port = OPENSSL_strdup(port)) == NULL) {
+        if (e != NULL)
+            OPENSSL_free(e->host);
+        OPENSSL_free(e);
+        return NULL;
+    }
+    e->next = dns_cache;
+    dns_cache = e;
+    return e;
+}
+
+static void dns_addr_set(DNS_ADDR *addr, const struct addrinfo *ai)
+{
+    memcpy(&addr->addr, ai->ai_addr, ai->ai_addrlen);
+    addr->len = ai->ai_addrlen;
+    addr->family = ai->ai_family;
+}
+
+/* interleave address families, starting with the one preferred by getaddrinfo() */
+static int dns_collect(const struct addrinfo *res, DNS_ADDR *addrs)
+{
+    const struct addrinfo *first = res, *other = res;
+    int n = 0;
+
+    while (n < DNS_MAX_ADDRS) {
+        while (first != NULL && (first->ai_family != res->ai_family
+                                 || first->ai_addrlen > sizeof(addrs->addr)))
+            first = first->ai_next;
+        while (other != NULL && (other->ai_family == res->ai_family
+                                 || other->ai_addrlen > sizeof(addrs->addr)))
+            other = other->ai_next;
+        if (first == NULL && other == NULL)
+            break;
+        if (first != NULL) {
+            dns_addr_set(&addrs[n++], first);
+            first = first->ai_next;
+        }
+        if (other != NULL && n < DNS_MAX_ADDRS) {
+            dns_addr_set(&addrs[n++], other);
+            other = other->ai_next;
+        }
+    }
+    return n;
+}
+
+bool CMPclient_dns_cache_set(const char *host, const char *port,
+                             OPTIONAL const char *addrs)
+{
+    DNS_ADDR list[DNS_MAX_ADDRS];
+    struct addrinfo hints, *res;
+    char *copy = NULL, *addr, *save = NULL;
+    DNS_ENTRY *e;
+    int n = 0;
+
+    if (host == NULL || port == NULL)
+        return false;
+    if (addrs != NULL && (copy = OPENSSL_strdup(addrs)) == NULL)
+        return false;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    for (addr = copy != NULL ? strtok_r(copy, ",", &save) : NULL; addr != NULL;
+         addr = strtok_r(NULL, ",", &save)) {
+        if (n == DNS_MAX_ADDRS || getaddrinfo(addr, port, &hints, &res) != 0) {
+            LOG(FL_ERR, "invalid or too many addresses for %s:%s: %s",
+                host, port, addrs);
+            OPENSSL_free(copy);
+            return false;
+        }
+        dns_addr_set(&list[n++], res);
+        freeaddrinfo(res);
+    }
+    OPENSSL_free(copy);
+    if (addrs != NULL && n == 0) {
+        LOG(FL_ERR, "no addresses given for %s:%s", host, port);
+        return false;
+    }
+
+    (void)pthread_mutex_lock(&dns_lock);
+    if ((e = dns_entry(host, port, true)) != NULL) {
+        e->pinned = addrs != NULL;
+        e->num = n;
+        memcpy(e->addrs, list, (size_t)n * sizeof(*list));
+        e->expires = 0; /* when unpinned, resolve on next use */
+    }
+    (void)pthread_mutex_unlock(&dns_lock);
+    return e != NULL;
+}
+
+/* copies the addresses for host and port to addrs, returns their number */
+static int dns_resolve(const char *host, const char *port, DNS_ADDR *addrs)
+{
+    struct addrinfo hints, *res = NULL;
+    struct timespec start;
+    DNS_ENTRY *e;
+    unsigned long us;
+    int n = 0, rv;
+
+    (void)pthread_mutex_lock(&dns_lock);
+    if ((e = dns_entry(host, port, false)) != NULL
+        && (e->pinned || e->expires > now_s())) {
+        e->stats.cache_hits++;
+        n = e->num;
+        memcpy(addrs, e->addrs, (size_t)n * sizeof(*addrs));
+        (void)pthread_mutex_unlock(&dns_lock);
+        if (n == 0)
+            LOG(FL_ERR, "cannot resolve '%s' (cached)", host);
+        return n;
+    }
+    (void)pthread_mutex_unlock(&dns_lock);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    rv = getaddrinfo(host, port, &hints, &res);
+    us = elapsed_us(&start);
+    if (rv == 0) {
+        n = dns_collect(res, addrs);
+        freeaddrinfo(res);
+    } else {
+        LOG(FL_ERR, "cannot resolve '%s': %s", host, gai_strerror(rv));
+    }
+
+    (void)pthread_mutex_lock(&dns_lock);
+    if ((e = dns_entry(host, port, true)) != NULL) {
+        e->stats.resolves++;
+        e->stats.resolve_us += us;
+        if (n == 0)
+            e->stats.resolve_failures++;
+        e->num = n;
+        memcpy(e->addrs, addrs, (size_t)n * sizeof(*addrs));
+        e->expires = now_s() + (n > 0 ? dns_ttl : dns_negative_ttl);
+    }
+    (void)pthread_mutex_unlock(&dns_lock);
+    return n;
+}
+
+static void endpoint_stats_connect(const char *host, const char *port,
+                                   unsigned long us, int family)
+{
+    DNS_ENTRY *e;
+
+    (void)pthread_mutex_lock(&dns_lock);
+    if ((e = dns_entry(host, port, true)) != NULL) {
+        if (family != 0) {
+            e->stats.connects++;
+            e->stats.connect_us += us;
+            e->stats.last_family = family;
+        } else {
+            e->stats.connect_failures++;
+        }
+    }
+    (void)pthread_mutex_unlock(&dns_lock);
+}
+
+bool CMPclient_endpoint_stats_get(const char *host, const char *port,
+                                  CMPCLIENT_ENDPOINT_STATS *stats)
+{
+    DNS_ENTRY *e;
+
+    if (host == NULL || port == NULL || stats == NULL)
+        return false;
+    (void)pthread_mutex_lock(&dns_lock);
+    if ((e = dns_entry(host, port, false)) != NULL)
+        *stats = e->stats;
+    (void)pthread_mutex_unlock(&dns_lock);
+    return e != NULL;
+}
+
+void CMPclient_endpoint_stats_log(severity level)
+{
+    DNS_ENTRY *e;
+
+    (void)pthread_mutex_lock(&dns_lock);
+    for (e = dns_cache; e != NULL; e = e->next) {
+        const CMPCLIENT_ENDPOINT_STATS *st = &e->stats;
+
+        LOG(LOG_FUNC_FILE_LINE, level, "endpoint %s%s%s: %lu resolves (%lu failed, avg %lu us), "
+            "%lu cache hits, %lu connects (%lu failed, avg %lu us, last via %s), "
+            "%lu throttled (avg %lu us), %lu backoffs",
+            e->port[0] == '\0' ? "unix:" : "", e->host,
+            e->port[0] == '\0' ? "" : ":", e->port,
+            st->resolves, st->resolve_failures,
+            st->resolves == 0 ? 0 : st->resolve_us / st->resolves,
+            st->cache_hits, st->connects, st->connect_failures,
+            st->connects == 0 ? 0 : st->connect_us / st->connects,
+            st->last_family == AF_INET6 ? "IPv6"
+            : st->last_family == AF_INET ? "IPv4"
+            : st->last_family == AF_UNIX ? "local socket" : "none",
+            st->throttled,
+            st->throttled == 0 ? 0 : st->throttle_us / st->throttled,
+            st->backoffs);
+    }
+    (void)pthread_mutex_unlock(&dns_lock);
+}
+
+bool CMPclient_rate_limit_set(const char *host, const char *port,
+                              OPTIONAL const CMPCLIENT_RATE_LIMIT *limit)
+{
+    DNS_ENTRY *e;
+
+    if (host == NULL || port == NULL
+        || (limit != NULL && (limit->rate < 0 || limit->max_inflight < 0)))
+        return false;
+    (void)pthread_mutex_lock(&dns_lock);
+    if ((e = dns_entry(host, port, true)) != NULL) {
+        if (limit != NULL)
+            e->limit = *limit;
+        else
+            memset(&e->limit, 0, sizeof(e->limit));
+        if (e->limit.burst < 1)
+            e->limit.burst = 1;
+        e->tokens = e->limit.burst;
+        e->refilled_ms = now_ms();
+    }
+    (void)pthread_mutex_unlock(&dns_lock);
+    return e != NULL;
+}
+
+/* admission control is keyed by the server, also when using a proxy */
+static void transport_key(const CMPCLIENT_TRANSPORT *t,
+                          const char **host, const char **port)
+{
+    *host = t->unix_path != NULL ? t->unix_path : t->host;
+    *port = t->unix_path != NULL ? "" : t->port;
+}
+
+/* returns the time to wait in ms, or 0 after admitting, called locked */
+static long admit_try(DNS_ENTRY *e, long now)
+{
+    const CMPCLIENT_RATE_LIMIT *lim = &e->limit;
+
+    if (e->backoff_until_ms > now)
+        return e->backoff_until_ms - now;
+    if (lim->max_inflight > 0 && e->inflight >= lim->max_inflight)
+        return ADMIT_POLL_MS;
+    if (lim->rate > 0) {
+        e->tokens += (double)(now - e->refilled_ms) * lim->rate / 1000;
+        if (e->tokens > lim->burst)
+            e->tokens = lim->burst;
+        e->refilled_ms = now;
+        if (e->tokens < 1)
+            return 1 + (long)((1 - e->tokens) * 1000 / lim->rate);
+        e->tokens -= 1;
+    }
+    e->inflight++;
+    return 0;
+}
+
+/* waits until the exchange may start, deadline_ms 0 means none */
+static bool transport_admit(CMPCLIENT_TRANSPORT *t, long deadline_ms)
+{
+    const char *host, *port;
+    long start = now_ms(), now = start, wait;
+    DNS_ENTRY *e;
+
+    transport_key(t, &host, &port);
+    for (;;) {
+        (void)pthread_mutex_lock(&dns_lock);
+        if ((e = dns_entry(host, port, true)) == NULL) {
+            (void)pthread_mutex_unlock(&dns_lock);
+            return true; /* out of memory, so no admission control */
+        }
+        if ((wait = admit_try(e, now)) == 0) {
+            t->admitted = true;
+            if (now > start) {
+                e->stats.throttled++;
+                e->stats.throttle_us += (unsigned long)(now - start) * 1000;
+            }
+        }
+        (void)pthread_mutex_unlock(&dns_lock);
+        if (wait == 0)
+            return true;
+        if (deadline_ms != 0 && now + wait > deadline_ms) {
+            LOG(FL_ERR, "no admission to %s%s%s within message timeout",
+                host, port[0] == '\0' ? "" : ":", port);
+            return false;
+        }
+        (void)CMPclient_engine_wait(-1, 0, (int)wait);
+        now = now_ms();
+    }
+}
+
+/*
+ * returns true if the request was not processed and may be retried.
+ * timeout is the message timeout in seconds, 0 for none, which also bounds
+ * the pause requested by the server.
+ */
+static bool transport_release(CMPCLIENT_TRANSPORT *t, bool ok, bool timed_out,
+                              int timeout)
+{
+    const char *host, *port;
+    bool overload = t->http_status == 503 || t->http_status == 429;
+    DNS_ENTRY *e;
+    long pause = 0;
+
+    transport_key(t, &host, &port);
+    (void)pthread_mutex_lock(&dns_lock);
+    if ((e = dns_entry(host, port, false)) != NULL) {
+        if (t->admitted && e->inflight > 0)
+            e->inflight--;
+        if (ok) {
+            e->backoff_ms = 0;
+        } else if (overload || t->http_status >= 500 || timed_out) {
+            if (overload && t->retry_after > 0) {
+                long max_ms = timeout > 0
+                    && timeout < ADMIT_BACKOFF_MAX_MS / 1000
+                    ? 1000L * timeout : ADMIT_BACKOFF_MAX_MS;
+
+                /* compared before multiplying, which could overflow */
+                pause = t->retry_after >= max_ms / 1000 ? max_ms
+                    : 1000L * t->retry_after;
+            } else {
+                unsigned char r = 0;
+
+                e->backoff_ms = e->backoff_ms == 0 ? ADMIT_BACKOFF_MIN_MS
+                    : e->backoff_ms >= ADMIT_BACKOFF_MAX_MS / 2
+                    ? ADMIT_BACKOFF_MAX_MS : 2 * e->backoff_ms;
+                (void)RAND_bytes(&r, 1);
+                /* between 75% and 125% */
+                pause = e->backoff_ms * (384L + r) / 512;
+            }
+            if (now_ms() + pause > e->backoff_until_ms) {
+                e->backoff_until_ms = now_ms() + pause;
+                e->stats.backoffs++;
+            }
+        }
+    }
+    (void)pthread_mutex_unlock(&dns_lock);
+    t->admitted = false;
+    if (pause > 0)
+        LOG(FL_WARN, "%s from %s%s%s, pausing exchanges with it for %ld ms",
+            overload ? "server busy" : "failure", host,
+            port[0] == '\0' ? "" : ":", port, pause);
+    return overload;
+}
+
+/* to be called before connect() */
+static void set_sockopts(int fd, int family, const CMPCLIENT_TRANSPORT_OPTS *opts)
+{
+    int on = 1;
+
+    if (opts->sndbuf > 0)
+        (void)setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+                         &opts->sndbuf, sizeof(opts->sndbuf));
+    if (opts->rcvbuf > 0)
+        (void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+                         &opts->rcvbuf, sizeof(opts->rcvbuf));
+    if (family == AF_UNIX)
+        return;
+    /*
+     * HTTP headers and body are written separately; on a kept-alive connection
+     * Nagle's algorithm would hold back the body until the delayed ACK.
+     */
+    if (!opts->nagle)
+        (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (opts->fast_open) {
+#ifdef TCP_FASTOPEN_CONNECT
+        /* the SYN carries the request if the server gave us a cookie before */
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                       &on, sizeof(on)) != 0 && LOG_ENABLED(LOG_DEBUG))
+            LOG(FL_DEBUG, "TCP Fast Open not available: %s", strerror(errno));
+#else
+        LOG(FL_DEBUG, "TCP Fast Open not supported on this platform");
+#endif
+    }
+}
+
+static int start_connect(const DNS_ADDR *addr,
+                         const CMPCLIENT_TRANSPORT_OPTS *opts)
+{
+    int fd = socket(addr->family, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        return -1;
+    set_sockopts(fd, addr->family, opts);
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0
+        || (connect(fd, (const struct sockaddr *)&addr->addr, addr->len) != 0
+            && errno != EINPROGRESS)) {
+        (void)close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* returns connected non-blocking socket or -1; timeout_ms <= 0 means none */
+static int connect_racing(const DNS_ADDR *addrs, int n, int timeout_ms,
+                          const CMPCLIENT_TRANSPORT_OPTS *opts, int *family)
+{
+    struct pollfd pfds[DNS_MAX_ADDRS];
+    int which[DNS_MAX_ADDRS]; /* address index per pending attempt */
+    int pending = 0, next = 0, fd = -1, i;
+    struct timespec start, last_start;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    last_start = start;
+    while (fd < 0 && (pending > 0 || next < n)) {
+        long since_start = (long)(elapsed_us(&start) / 1000);
+        long since_last = (long)(elapsed_us(&last_start) / 1000);
+        int wait_ms;
+
+        if (timeout_ms > 0 && since_start >= timeout_ms)
+            break;
+        if (next < n && (pending == 0 || since_last >= CONNECT_ATTEMPT_DELAY_MS)) {
+            int sock = start_connect(&addrs[next], opts);
+
+            if (sock >= 0) {
+                pfds[pending].fd = sock;
+                pfds[pending].events = POLLOUT;
+                which[pending++] = next;
+                (void)clock_gettime(CLOCK_MONOTONIC, &last_start);
+            }
+            next++;
+            continue;
+        }
+
+        wait_ms = next < n ? CONNECT_ATTEMPT_DELAY_MS - (int)since_last : -1;
+        if (timeout_ms > 0
+            && (wait_ms < 0 || wait_ms > timeout_ms - (int)since_start))
+            wait_ms = timeout_ms - (int)since_start;
+        if (poll(pfds, (nfds_t)pending, wait_ms) < 0 && errno != EINTR)
+            break;
+        for (i = 0; i < pending; i++) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+
+            if (pfds[i].revents == 0)
+                continue;
+            if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0
+                && err == 0) {
+                fd = pfds[i].fd;
+                *family = addrs[which[i]].family;
+                pfds[i].fd = -1;
+                break;
+            }
+            /* failed attempt: drop it, such that the next one starts now */
+            (void)close(pfds[i].fd);
+            pfds[i] = pfds[pending - 1];
+            which[i] = which[pending - 1];
+            pending--;
+            i--;
+            last_start.tv_sec = 0;
+        }
+    }
+    for (i = 0; i < pending; i++)
+        if (pfds[i].fd >= 0)
+            (void)close(pfds[i].fd);
+    return fd;
+}
+
+CMPCLIENT_TRANSPORT *CMPclient_transport_new(const char *host,
+                                             const char *port,
+                                             OPTIONAL const char *path,
+                                             OPTIONAL SSL_CTX *tls,
+                                             OPTIONAL const char *proxy,
+                                             OPTIONAL const char *no_proxy)
+{
+    CMPCLIENT_TRANSPORT *t;
+    const char *proxy_url;
+
+    if (host == NULL || port == NULL) {
+        LOG(FL_ERR, "missing host or port");
+        return NULL;
+    }
+    if ((t = OPENSSL_zalloc(sizeof(*t))) == NULL)
+        goto oom;
+    proxy_url = OSSL_HTTP_adapt_proxy(proxy, no_proxy, host, tls != NULL);
+    if ((t->host = OPENSSL_strdup(host)) == NULL
+        || (t->port = OPENSSL_strdup(port)) == NULL
+        || (t->path = OPENSSL_strdup(path != NULL ? path : "/")) == NULL
+        || (proxy_url != NULL
+            && (t->proxy = OPENSSL_strdup(proxy_url)) == NULL))
+        goto oom;
+    if (tls != NULL) {
+        if (!SSL_CTX_up_ref(tls))
+            goto oom;
+        t->ssl_ctx = tls;
+    }
+    return t;
+
+ oom:
+    LOG_err("Out of memory");
+    CMPclient_transport_free(t);
+    return NULL;
+}
+
+CMPCLIENT_TRANSPORT *CMPclient_transport_new_unix(const char *socket_path,
+                                                  OPTIONAL const char *path)
+{
+    CMPCLIENT_TRANSPORT *t;
+
+    if (socket_path == NULL) {
+        LOG(FL_ERR, "missing socket path");
+        return NULL;
+    }
+    if (strlen(socket_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        LOG(FL_ERR, "socket path too long: %s", socket_path);
+        return NULL;
+    }
+    if ((t = OPENSSL_zalloc(sizeof(*t))) == NULL
+        || (t->host = OPENSSL_strdup("localhost")) == NULL /* for Host: */
+        || (t->port = OPENSSL_strdup("")) == NULL
+        || (t->path = OPENSSL_strdup(path != NULL ? path : "/")) == NULL
+        || (t->unix_path = OPENSSL_strdup(socket_path)) == NULL) {
+        LOG_err("Out of memory");
+        CMPclient_transport_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+#ifndef SECUTILS_NO_TLS
+static void set_tls_bio(CMPCLIENT_TRANSPORT *t, BIO *bio)
+{
+    X509_STORE *ts = SSL_CTX_get_cert_store(t->ssl_ctx);
+
+    /* indicate to cert status checking if a TLS connection is active */
+    if (ts != NULL)
+        (void)STORE_set0_tls_bio(ts, bio);
+}
+#endif
+
+void CMPclient_transport_close(OPTIONAL CMPCLIENT_TRANSPORT *t)
+{
+    if (t == NULL)
+        return;
+    if (t->rctx != NULL)
+        (void)OSSL_HTTP_close(t->rctx, 1);
+    t->rctx = NULL;
+#ifndef SECUTILS_NO_TLS
+    if (t->bio != NULL && t->ssl_ctx != NULL) {
+        set_tls_bio(t, NULL);
+        (void)ERR_set_mark();
+        (void)BIO_ssl_shutdown(t->bio);
+        (void)ERR_pop_to_mark(); /* hide any errors on closing */
+    }
+#endif
+    BIO_free_all(t->bio);
+    t->bio = NULL;
+}
+
+void CMPclient_transport_free(OPTIONAL CMPCLIENT_TRANSPORT *t)
+{
+    if (t == NULL)
+        return;
+    CMPclient_transport_close(t);
+    SSL_CTX_free(t->ssl_ctx);
+    OPENSSL_free(t->host);
+    OPENSSL_free(t->port);
+    OPENSSL_free(t->path);
+    OPENSSL_free(t->proxy);
+    OPENSSL_free(t->unix_path);
+    OPENSSL_free(t);
+}
+
+void CMPclient_transport_set_opts(CMPCLIENT_TRANSPORT *t,
+                                  OPTIONAL const CMPCLIENT_TRANSPORT_OPTS *opts)
+{
+    if (t == NULL)
+        return;
+    if (opts != NULL)
+        t->opts = *opts;
+    else
+        memset(&t->opts, 0, sizeof(t->opts));
+}
+
+bool CMPclient_transport_set_rate_limit(const CMPCLIENT_TRANSPORT *t,
+                                        OPTIONAL const CMPCLIENT_RATE_LIMIT *limit)
+{
+    const char *host, *port;
+
+    if (t == NULL)
+        return false;
+    transport_key(t, &host, &port);
+    return CMPclient_rate_limit_set(host, port, limit);
+}
+
+bool CMPclient_transport_times_get(const CMPCLIENT_TRANSPORT *t,
+                                   CMPCLIENT_EXCHANGE_TIMES *times)
+{
+    if (t == NULL || times == NULL)
+        return false;
+    *times = t->times;
+    return true;
+}
+
+/* within engine jobs; returns connected non-blocking socket or -1 */
+static int connect_sequential(const DNS_ADDR *addrs, int n, int timeout_ms,
+                              const CMPCLIENT_TRANSPORT_OPTS *opts,
+                              int *family)
+{
+    struct timespec start;
+    int i;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++) {
+        int remaining = timeout_ms - (int)(elapsed_us(&start) / 1000);
+        int fd, err = 0;
+        socklen_t len = sizeof(err);
+
+        if (timeout_ms > 0 && remaining <= 0)
+            break;
+        if ((fd = start_connect(&addrs[i], opts)) < 0)
+            continue;
+        if (CMPclient_engine_wait(fd, POLLOUT,
+                                  timeout_ms > 0 ? remaining : 0) == 1
+            && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0
+            && err == 0) {
+            *family = addrs[i].family;
+            return fd;
+        }
+        (void)close(fd);
+    }
+    return -1;
+}
+
+/* connect to |host|:|port| of the server or proxy; returns socket BIO */
+static BIO *transport_connect(const char *host, const char *port,
+                              int timeout_ms,
+                              const CMPCLIENT_TRANSPORT_OPTS *opts)
+{
+    DNS_ADDR addrs[DNS_MAX_ADDRS];
+    CMPCLIENT_TRANSPORT_OPTS conn_opts = *opts;
+    struct timespec start;
+    int n, fd, family = 0;
+    BIO *bio;
+
+    if ((n = dns_resolve(host, port, addrs)) == 0)
+        return NULL;
+    /*
+     * With TCP_FASTOPEN_CONNECT, connect() succeeds before any SYN/ACK, so
+     * the first address tried would always win and an unreachable one would
+     * not be noticed before writing. TFO is therefore used for single
+     * addresses only.
+     */
+    if (n > 1)
+        conn_opts.fast_open = false;
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    fd = CMPclient_engine_active()
+        ? connect_sequential(addrs, n, timeout_ms, &conn_opts, &family)
+        : connect_racing(addrs, n, timeout_ms, &conn_opts, &family);
+    endpoint_stats_connect(host, port, elapsed_us(&start), fd < 0 ? 0 : family);
+    if (fd < 0) {
+        LOG(FL_ERR, "cannot connect to %s:%s", host, port);
+        return NULL;
+    }
+    if ((bio = BIO_new_socket(fd, BIO_CLOSE)) == NULL) {
+        (void)close(fd);
+        return NULL;
+    }
+    return bio;
+}
+
+/* connection to a local server; blocks at most while its backlog is full */
+static BIO *transport_connect_unix(const char *path,
+                                   const CMPCLIENT_TRANSPORT_OPTS *opts)
+{
+    struct sockaddr_un addr;
+    struct timespec start;
+    int fd;
+    BIO *bio;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path); /* length checked in transport_new_unix() */
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0)
+        set_sockopts(fd, AF_UNIX, opts);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        LOG(FL_ERR, "cannot connect to unix:%s: %s", path, strerror(errno));
+        if (fd >= 0)
+            (void)close(fd);
+        fd = -1;
+    }
+    endpoint_stats_connect(path, "", elapsed_us(&start), fd < 0 ? 0 : AF_UNIX);
+    if (fd < 0)
+        return NULL;
+    /* like TCP connections, such that engine jobs need not block on it */
+    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if ((bio = BIO_new_socket(fd, BIO_CLOSE)) == NULL) {
+        (void)close(fd);
+        return NULL;
+    }
+    return bio;
+}
+
+/* finds header of given name with delta-seconds value, -1 if none */
+static int header_seconds(const char *buf, size_t len, const char *name)
+{
+    size_t i, n = strlen(name);
+    int val = -1;
+
+    for (i = 0; i + 2 + n < len && !(buf[i] == '\r' && buf[i + 2] == '\r'); i++)
+        if (buf[i] == '\n' && strncasecmp(buf + i + 1, name, n) == 0
+            && buf[i + 1 + n] == ':') {
+            for (i += 2 + n; i < len && buf[i] == ' '; i++)
+                ;
+            for (val = 0; i < len && buf[i] >= '0' && buf[i] <= '9'
+                     && val < INT_MAX / 10; i++)
+                val = val * 10 + (buf[i] - '0');
+            break;
+        }
+    return val;
+}
+
+/* takes status code and Retry-After from the start of an HTTP/1.x response */
+static void parse_status(CMPCLIENT_TRANSPORT *t, const char *buf, size_t len)
+{
+    if (len < 12 || strncmp(buf, "HTTP/1.", 7) != 0 || buf[8] != ' ')
+        return;
+    t->http_status = atoi(buf + 9);
+    if (t->http_status != 200)
+        t->retry_after = header_seconds(buf, len, "Retry-After");
+    if (t->retry_after < 0)
+        t->retry_after = 0;
+}
+
+/*
+ * detects the first byte of the response, see CMPclient_transport_cb(),
+ * and takes the HTTP status from it
+ */
+static long timing_cb(BIO *bio, int oper, const char *argp, size_t len,
+                      int argi, long argl, int ret, size_t *processed)
+{
+    CMPCLIENT_TRANSPORT *t = (CMPCLIENT_TRANSPORT *)BIO_get_callback_arg(bio);
+
+    (void)len;
+    (void)argi;
+    (void)argl;
+    if (ret <= 0 || processed == NULL || *processed == 0)
+        return ret;
+    if (oper == (BIO_CB_WRITE | BIO_CB_RETURN)) {
+        t->request_sent = true;
+    } else if ((oper == (BIO_CB_READ | BIO_CB_RETURN)
+                || oper == (BIO_CB_GETS | BIO_CB_RETURN))
+               && t->request_sent && t->times.first_byte_us == 0) {
+        t->times.first_byte_us = elapsed_us(&t->start);
+        parse_status(t, argp, *processed);
+    }
+    return ret;
+}
+
+static bool transport_open(CMPCLIENT_TRANSPORT *t, int timeout)
+{
+    char *proxy_host = NULL, *proxy_port = NULL;
+    int connect_timeout_ms = t->opts.connect_timeout_ms > 0
+        ? t->opts.connect_timeout_ms : timeout * 1000;
+    bool ok = false;
+
+    if (t->unix_path != NULL) {
+        t->bio = transport_connect_unix(t->unix_path, &t->opts);
+        goto timing;
+    }
+    if (t->proxy != NULL
+        && !OSSL_HTTP_parse_url(t->proxy, NULL, NULL, &proxy_host, &proxy_port,
+                                NULL, NULL, NULL, NULL))
+        return false;
+    t->bio = transport_connect(proxy_host != NULL ? proxy_host : t->host,
+                               proxy_port != NULL ? proxy_port : t->port,
+                               connect_timeout_ms, &t->opts);
+    if (t->bio == NULL)
+        goto end;
+
+#ifndef SECUTILS_NO_TLS
+    if (t->ssl_ctx != NULL) {
+        BIO *sbio = NULL;
+        SSL *ssl;
+
+        if ((t->proxy != NULL
+             && !OSSL_HTTP_proxy_connect(t->bio, t->host, t->port,
+                                         NULL, NULL, /* no proxy credentials */
+                                         timeout, NULL, "CMP client"))
+            || (sbio = BIO_new(BIO_f_ssl())) == NULL)
+            goto end;
+        if ((ssl = SSL_new(t->ssl_ctx)) == NULL) {
+            BIO_free(sbio);
+            goto end;
+        }
+        SSL_set_tlsext_host_name(ssl, t->host); /* not critical to do */
+        if (!CMPclient_trust_apply_TLS(ssl)) {
+            SSL_free(ssl);
+            BIO_free(sbio);
+            goto end;
+        }
+        SSL_set_connect_state(ssl);
+        BIO_set_ssl(sbio, ssl, BIO_CLOSE);
+        t->bio = BIO_push(sbio, t->bio);
+        set_tls_bio(t, t->bio);
+    }
+#endif
+
+ timing:
+    if (t->bio != NULL) {
+        BIO_set_callback_ex(t->bio, timing_cb);
+        BIO_set_callback_arg(t->bio, (char *)t);
+        ok = true;
+    }
+
+ end:
+    if (!ok)
+        CMPclient_transport_close(t);
+    OPENSSL_free(proxy_host);
+    OPENSSL_free(proxy_port);
+    return ok;
+}
+
+/*
+ * Without timeout, OpenSSL does not wait for a non-blocking socket to become
+ * ready but retries at once, such that blocking exchanges would spin.
+ */
+static void transport_set_blocking(CMPCLIENT_TRANSPORT *t, bool blocking)
+{
+    int fd = -1, flags;
+
+    if (BIO_get_fd(t->bio, &fd) < 0 || (flags = fcntl(fd, F_GETFL, 0)) < 0)
+        return;
+    if (blocking != ((flags & O_NONBLOCK) == 0))
+        (void)fcntl(fd, F_SETFL, blocking ? flags & ~O_NONBLOCK
+                    : flags | O_NONBLOCK);
+}
+
+/* like OSSL_HTTP_transfer() but yielding to other engine jobs while waiting */
+static OSSL_CMP_MSG *transport_exchange_nbio(CMPCLIENT_TRANSPORT *t,
+                                             BIO *req_mem, int timeout,
+                                             int keep_alive)
+{
+    OSSL_CMP_MSG *res = NULL;
+    int fd = -1, rv = 0;
+
+    if (t->rctx == NULL
+        && (t->rctx = OSSL_HTTP_open(t->host, t->port, NULL, NULL, 0,
+                                     t->bio, t->bio, NULL, NULL,
+                                     0 /* buf_size */, timeout)) == NULL)
+        return NULL;
+    if (OSSL_HTTP_set1_request(t->rctx, t->path, NULL /* headers */,
+                               CMP_CONTENT_TYPE, req_mem,
+                               CMP_CONTENT_TYPE, 1 /* expect_asn1 */,
+                               OSSL_HTTP_DEFAULT_MAX_RESP_LEN,
+                               timeout, keep_alive)
+        && BIO_get_fd(t->bio, &fd) >= 0) {
+        while ((rv = OSSL_HTTP_REQ_CTX_nbio(t->rctx)) == -1) {
+            int remaining = timeout * 1000
+                - (int)(elapsed_us(&t->start) / 1000);
+
+            if (timeout > 0 && remaining <= 0) {
+                LOG(FL_ERR, "timeout on HTTP exchange with %s", t->host);
+                break;
+            }
+            if (CMPclient_engine_wait(fd, BIO_should_write(t->bio)
+                                      ? POLLOUT : POLLIN,
+                                      timeout > 0 ? remaining : 0) != 1)
+                break;
+        }
+    }
+    if (rv == 1) /* the memory BIO stays owned by rctx */
+        res = (OSSL_CMP_MSG *)
+            ASN1_item_d2i_bio(ASN1_ITEM_rptr(OSSL_CMP_MSG),
+                              OSSL_HTTP_REQ_CTX_get0_mem_bio(t->rctx), NULL);
+    if (res == NULL || !OSSL_HTTP_is_alive(t->rctx)) {
+        (void)OSSL_HTTP_close(t->rctx, res != NULL);
+        t->rctx = NULL;
+    }
+    return res;
+}
+
+static OSSL_CMP_MSG *transport_exchange(CMPCLIENT_TRANSPORT *t,
+                                        const OSSL_CMP_MSG *req,
+                                        int timeout, int keep_alive)
+{
+    bool own_connect;
+    BIO *req_mem, *rsp = NULL;
+    OSSL_CMP_MSG *res = NULL;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &t->start);
+    memset(&t->times, 0, sizeof(t->times));
+    t->request_sent = false;
+    t->http_status = 0;
+    t->retry_after = 0;
+    /* plain HTTP via proxy is left to OpenSSL, see above */
+    own_connect = t->proxy == NULL || t->ssl_ctx != NULL;
+    t->times.reused = t->rctx != NULL;
+    if (own_connect && t->rctx == NULL) {
+        if (!transport_open(t, timeout))
+            return NULL;
+        t->times.connect_us = elapsed_us(&t->start);
+    }
+
+    if ((req_mem = ASN1_item_i2d_mem_bio(ASN1_ITEM_rptr(OSSL_CMP_MSG),
+                                         (const ASN1_VALUE *)req)) == NULL)
+        return NULL;
+    if (own_connect)
+        transport_set_blocking(t, timeout == 0 && !CMPclient_engine_active());
+    if (own_connect && CMPclient_engine_active())
+        res = transport_exchange_nbio(t, req_mem, timeout, keep_alive);
+    else
+        rsp = OSSL_HTTP_transfer(&t->rctx, t->host, t->port, t->path,
+                             0 /* TLS, if any, is already set up */,
+                             own_connect ? NULL : t->proxy, NULL /* no_proxy */,
+                             /* giving also rbio avoids BIO_do_connect() */
+                             own_connect ? t->bio : NULL,
+                             own_connect ? t->bio : NULL,
+                             NULL /* bio_update_fn */, NULL /* arg */,
+                             0 /* buf_size */, NULL /* headers */,
+                             CMP_CONTENT_TYPE, req_mem,
+                             CMP_CONTENT_TYPE, 1 /* expect_asn1 */,
+                             OSSL_HTTP_DEFAULT_MAX_RESP_LEN,
+                             timeout, keep_alive);
+    BIO_free(req_mem);
+    if (rsp != NULL)
+        res = (OSSL_CMP_MSG *)ASN1_item_d2i_bio(ASN1_ITEM_rptr(OSSL_CMP_MSG),
+                                                rsp, NULL);
+    BIO_free(rsp);
+    if (t->rctx == NULL) /* not kept alive, or failed */
+        CMPclient_transport_close(t);
+
+    t->times.total_us = elapsed_us(&t->start);
+    if (res != NULL && LOG_ENABLED(LOG_INFO))
+        LOG(FL_INFO, "exchange with %s%s%s: connect %lu us%s, "
+            "first byte %lu us, total %lu us",
+            t->unix_path != NULL ? "unix:" : t->host,
+            t->unix_path != NULL ? t->unix_path : ":",
+            t->unix_path != NULL ? "" : t->port,
+            t->times.connect_us, t->times.reused ? " (kept alive)" : "",
+            t->times.first_byte_us, t->times.total_us);
+    return res;
+}
+
+OSSL_CMP_MSG *CMPclient_transport_cb(OSSL_CMP_CTX *ctx,
+                                     const OSSL_CMP_MSG *req)
+{
+    CMPCLIENT_TRANSPORT *t = OSSL_CMP_CTX_get_transfer_cb_arg(ctx);
+    int timeout = OSSL_CMP_CTX_get_option(ctx, OSSL_CMP_OPT_MSG_TIMEOUT);
+    int keep_alive = OSSL_CMP_CTX_get_option(ctx, OSSL_CMP_OPT_KEEP_ALIVE);
+    long deadline_ms, left_ms = 0;
+    OSSL_CMP_MSG *res = NULL;
+    CMPCLIENT_ERRS kept = { NULL, 0, 0 };
+    int attempt;
+
+    if (t == NULL || req == NULL) {
+        LOG(FL_ERR, "missing transport or request");
+        return NULL;
+    }
+    if (timeout < 0)
+        timeout = 0;
+    deadline_ms = timeout > 0 ? now_ms() + 1000L * timeout : 0;
+    for (attempt = 0; res == NULL && attempt <= ADMIT_MAX_RETRIES; attempt++) {
+        bool retry;
+
+        if (!transport_admit(t, deadline_ms))
+            break;
+        /* the message timeout covers waiting for admission and any retries */
+        if (deadline_ms != 0 && (left_ms = deadline_ms - now_ms()) < 1000) {
+            t->http_status = 0; /* not to be counted as a further failure */
+            (void)transport_release(t, false, false, timeout);
+            LOG(FL_ERR, "message timeout exceeded before exchange");
+            break;
+        }
+        /*
+         * Not using an ERR mark here since the exchange may yield to other
+         * engine jobs, across which the error queue does not keep marks.
+         */
+        CMPclient_errs_save(&kept);
+        res = transport_exchange(t, req, (int)(left_ms / 1000), keep_alive);
+        retry = transport_release(t, res != NULL, res == NULL && deadline_ms != 0
+                                  && now_ms() >= deadline_ms - 1000, timeout);
+        if (res == NULL && retry && attempt < ADMIT_MAX_RETRIES) {
+            /* errors of an attempt to be retried do not matter */
+            ERR_clear_error();
+            CMPclient_errs_restore(&kept);
+            continue;
+        }
+        CMPclient_errs_save(&kept); /* appending those of the attempt */
+        CMPclient_errs_restore(&kept);
+        if (res == NULL)
+            break;
+    }
+    CMPclient_errs_free(&kept);
+    return res;
+}
+
+#else /* GENCMP_NO_HTTP */
+
+void CMPclient_dns_cache_set_ttl(int ttl, int negative_ttl)
+{
+    (void)ttl;
+    (void)negative_ttl;
+}
+
+void CMPclient_dns_cache_clear(void)
+{
+}
+
+bool CMPclient_dns_cache_set(const char *host, const char *port,
+                             OPTIONAL const char *addrs)
+{
+    (void)host;
+    (void)port;
+    (void)addrs;
+    return false;
+}
+
+bool CMPclient_endpoint_stats_get(const char *host, const char *port,
+                                  CMPCLIENT_ENDPOINT_STATS *stats)
+{
+    (void)host;
+    (void)port;
+    (void)stats;
+    return false;
+}
+
+void CMPclient_endpoint_stats_log(severity level)
+{
+    (void)level;
+}
+
+bool CMPclient_rate_limit_set(const char *host, const char *port,
+                              OPTIONAL const CMPCLIENT_RATE_LIMIT *limit)
+{
+    (void)host;
+    (void)port;
+    (void)limit;
+    return false;
+}
+
+CMPCLIENT_TRANSPORT *CMPclient_transport_new(const char *host,
+                                             const char *port,
+                                             OPTIONAL const char *path,
+                                             OPTIONAL SSL_CTX *tls,
+                                             OPTIONAL const char *proxy,
+                                             OPTIONAL const char *no_proxy)
+{
+    (void)host;
+    (void)port;
+    (void)path;
+    (void)tls;
+    (void)proxy;
+    (void)no_proxy;
+    LOG(FL_ERR, "Persistent transports are not supported by this build");
+    return NULL;
+}
+
+CMPCLIENT_TRANSPORT *CMPclient_transport_new_unix(const char *socket_path,
+                                                  OPTIONAL const char *path)
+{
+    (void)socket_path;
+    (void)path;
+    LOG(FL_ERR, "Persistent transports are not supported by this build");
+    return NULL;
+}
+
+void CMPclient_transport_close(OPTIONAL CMPCLIENT_TRANSPORT *t)
+{
+    (void)t;
+}
+
+void CMPclient_transport_free(OPTIONAL CMPCLIENT_TRANSPORT *t)
+{
+    (void)t;
+}
+
+void CMPclient_transport_set_opts(CMPCLIENT_TRANSPORT *t,
+                                  OPTIONAL const CMPCLIENT_TRANSPORT_OPTS *opts)
+{
+    (void)t;
+    (void)opts;
+}
+
+bool CMPclient_transport_set_rate_limit(const CMPCLIENT_TRANSPORT *t,
+                                        OPTIONAL const CMPCLIENT_RATE_LIMIT *limit)
+{
+    (void)t;
+    (void)limit;
+    return false;
+}
+
+bool CMPclient_transport_times_get(const CMPCLIENT_TRANSPORT *t,
+                                   CMPCLIENT_EXCHANGE_TIMES *times)
+{
+    (void)t;
+    (void)times;
+    return false;
+}
+
+OSSL_CMP_MSG *CMPclient_transport_cb(OSSL_CMP_CTX *ctx,
+                                     const OSSL_CMP_MSG *req)
+{
+    (void)ctx;
+    (void)req;
+    return NULL;
+}
+
+#endif /* GENCMP_NO_HTTP */
@@ -0,0 +1,93 @@
+/*-
+ * @file   genericCMPClient_local.h
+ * @brief  declarations shared among the library sources, not part of the API
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef GENERIC_CMP_CLIENT_LOCAL_H
+# define GENERIC_CMP_CLIENT_LOCAL_H
+
+# include "genericCMPClient.h"
+
+/*
+ * guard for frequent LOG() calls, e.g., if (LOG_ENABLED(LOG_DEBUG)) LOG(...),
+ * such that their arguments are not evaluated and formatted in vain
+ */
+# define LOG_ENABLED(level) CMPclient_log_enabled(level)
+
+/*
+ * nanoseconds of the modification and status change times of a struct stat,
+ * where the platform offers them; the seconds are in st_mtime and st_ctime
+ */
+# if defined(_WIN32)
+#  define STAT_MTIME_NS(st) 0L
+#  define STAT_CTIME_NS(st) 0L
+# elif defined(__APPLE__)
+#  define STAT_MTIME_NS(st) ((long)(st).st_mtimespec.tv_nsec)
+#  define STAT_CTIME_NS(st) ((long)(st).st_ctimespec.tv_nsec)
+# else /* POSIX.1-2008 */
+#  define STAT_MTIME_NS(st) ((long)(st).st_mtim.tv_nsec)
+#  define STAT_CTIME_NS(st) ((long)(st).st_ctim.tv_nsec)
+# endif
+
+/* allocation accounting */
+/* releases the arena chunk of the calling thread; called by CMPclient_reinit() */
+void CMPclient_alloc_transaction_end(void);
+# ifndef GENCMP_NO_ALLOC
+void CMPclient_alloc_phase_restore(const int *phase);
+/*
+ * To be placed among the declarations of API functions that set an allocation
+ * phase, such that the phase of the caller is restored whenever they return.
+ */
+#  define ALLOC_PHASE_SCOPE \
+    int alloc_caller_phase \
+        __attribute__((cleanup(CMPclient_alloc_phase_restore))) = \
+        CMPclient_alloc_set_phase(-1 /* just get the current one */)
+# else /* there are no phases to restore */
+#  define ALLOC_PHASE_SCOPE int alloc_caller_phase __attribute__((unused))
+# endif
+
+/*
+ * yields a new reference to store, or to a later snapshot of the same trust
+ * handle, ready for verifying newly enrolled certs, ignoring any verification
+ * time set. Snapshots already published are not modified.
+ */
+X509_STORE *CMPclient_trust_get1_new_cert_store(X509_STORE *store);
+# ifndef SECUTILS_NO_TLS
+/* sets the current snapshot of any trust store attached to the SSL_CTX of ssl */
+bool CMPclient_trust_apply_TLS(SSL *ssl);
+# endif
+
+/*
+ * OpenSSL error queue entries moved out of the thread's queue, such that
+ * engine jobs sharing a thread each see their own errors only.
+ * ERR marks are not preserved, so they must not be held across a yield.
+ */
+typedef struct cmpclient_err_entry_st {
+    unsigned long code;
+    char *file; /* the strings are copies, or NULL */
+    int line;
+    char *func;
+    char *data; /* additional text */
+} CMPCLIENT_ERR_ENTRY;
+
+typedef struct cmpclient_errs_st {
+    CMPCLIENT_ERR_ENTRY *entries;
+    int num, size;
+} CMPCLIENT_ERRS;
+
+/* appends the entries of the thread's error queue, which gets emptied */
+void CMPclient_errs_save(CMPCLIENT_ERRS *errs);
+/* pushes the saved entries onto the thread's error queue, emptying errs */
+void CMPclient_errs_restore(CMPCLIENT_ERRS *errs);
+void CMPclient_errs_free(CMPCLIENT_ERRS *errs);
+
+#endif /* GENERIC_CMP_CLIENT_LOCAL_H */
@@ -0,0 +1,329 @@
+/*-
+ * @file   genericCMPClient_log.c
+ * @brief  asynchronous, level-gated logging backend of the generic CMP client
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "genericCMPClient.h"
+
+#include <pthread.h>
+#include <string.h>
+
+static int log_verbosity = LOG_INFO;
+
+void CMPclient_log_set_verbosity(severity level)
+{
+    __atomic_store_n(&log_verbosity, (int)level, __ATOMIC_RELAXED);
+    LOG_set_verbosity(level);
+}
+
+bool CMPclient_log_enabled(severity level)
+{
+    return (int)level <= __atomic_load_n(&log_verbosity, __ATOMIC_RELAXED);
+}
+
+#ifndef GENCMP_NO_LOG
+
+/*
+ * Log messages are handed over from any number of producer threads to a
+ * single background thread via a bounded lock-free ring buffer following
+ * D. Vyukov's MPMC queue design: each slot carries a sequence number that
+ * tells whether it is free for the producer holding the matching ticket
+ * or filled for the consumer. Producers never block; if the buffer is full,
+ * the message is dropped and counted.
+ * Producers are counted while they may access the buffer, such that stopping
+ * can wait for them before picking up their last messages and freeing it.
+ * When idle, the drain thread blocks on a condition variable; producers take
+ * the lock to signal it only when they find it waiting, i.e., when the queue
+ * has just become non-empty.
+ */
+
+#define LOG_ASYNC_DEFAULT_CAPACITY 1024
+#define LOG_ASYNC_MAX_CAPACITY (1 << 20)
+#define LOG_ASYNC_FUNC_LEN 64
+#define LOG_ASYNC_FILE_LEN 128
+#define LOG_ASYNC_MSG_LEN 1024
+
+typedef struct log_slot_st {
+    size_t seq;
+    severity level;
+    int lineno;
+    bool has_func;
+    bool has_file;
+    char func[LOG_ASYNC_FUNC_LEN];
+    char file[LOG_ASYNC_FILE_LEN];
+    char msg[LOG_ASYNC_MSG_LEN];
+} LOG_SLOT;
+
+static LOG_SLOT *log_slots = NULL;
+static size_t log_mask = 0;
+static size_t log_enqueue_pos = 0; /* updated atomically by producers */
+static size_t log_dequeue_pos = 0; /* updated by the drain thread only */
+static unsigned long log_dropped = 0;
+static int log_running = 0;
+static int log_stopping = 0;
+static int log_producers = 0; /* number of threads possibly enqueuing */
+static int log_idle = 0; /* drain thread is waiting, set under log_lock */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_nonempty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_quiescent = PTHREAD_COND_INITIALIZER; /* no producers */
+static LOG_cb_t log_sink = NULL;
+static pthread_t log_thread;
+
+static size_t copy_truncated(char *dst, size_t dst_len, const char *src)
+{
+    size_t len = strlen(src);
+
+    if (len >= dst_len)
+        len = dst_len - 1;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+    return len;
+}
+
+static bool log_enqueue(OPTIONAL const char *func, OPTIONAL const char *file,
+                        int lineno, severity level, const char *msg)
+{
+    size_t pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+    LOG_SLOT *slot;
+
+    for (;;) {
+        size_t seq;
+        long diff;
+
+        slot = &log_slots[pos & log_mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_enqueue_pos, &pos, pos + 1,
+                                            true /* weak */, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+            /* else pos has been reloaded by the failed CAS */
+        } else if (diff < 0) {
+            return false; /* full */
+        } else {
+            pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->level = level;
+    slot->lineno = lineno;
+    slot->has_func = func != NULL;
+    slot->has_file = file != NULL;
+    if (func != NULL)
+        (void)copy_truncated(slot->func, sizeof(slot->func), func);
+    if (file != NULL)
+        (void)copy_truncated(slot->file, sizeof(slot->file), file);
+    (void)copy_truncated(slot->msg, sizeof(slot->msg), msg);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    /* pairs with the fence in log_drain() setting log_idle */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_idle, __ATOMIC_RELAXED)) {
+        (void)pthread_mutex_lock(&log_lock);
+        (void)pthread_cond_signal(&log_nonempty);
+        (void)pthread_mutex_unlock(&log_lock);
+    }
+    return true;
+}
+
+static bool log_slot_ready(void)
+{
+    return __atomic_load_n(&log_slots[log_dequeue_pos & log_mask].seq,
+                           __ATOMIC_ACQUIRE) == log_dequeue_pos + 1;
+}
+
+/* called by the drain thread only */
+static bool log_dequeue_one(void)
+{
+    size_t pos = log_dequeue_pos;
+    LOG_SLOT *slot = &log_slots[pos & log_mask];
+
+    if (!log_slot_ready())
+        return false; /* empty or producer still copying */
+    (void)(*log_sink)(slot->has_func ? slot->func : NULL,
+                      slot->has_file ? slot->file : NULL,
+                      slot->lineno, slot->level, slot->msg);
+    log_dequeue_pos = pos + 1;
+    __atomic_store_n(&slot->seq, pos + log_mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool log_queue_empty(void)
+{
+    return __atomic_load_n(&log_enqueue_pos, __ATOMIC_ACQUIRE)
+        == log_dequeue_pos;
+}
+
+static bool log_drained(void)
+{
+    return __atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE) && log_queue_empty();
+}
+
+static void *log_drain(ossl_unused void *arg)
+{
+    for (;;) {
+        if (log_dequeue_one())
+            continue;
+        if (log_drained())
+            break;
+
+        (void)pthread_mutex_lock(&log_lock);
+        __atomic_store_n(&log_idle, 1, __ATOMIC_RELAXED);
+        /* pairs with the fence in log_enqueue() after publishing a slot */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (!log_slot_ready() && !log_drained())
+            (void)pthread_cond_wait(&log_nonempty, &log_lock);
+        __atomic_store_n(&log_idle, 0, __ATOMIC_RELAXED);
+        (void)pthread_mutex_unlock(&log_lock);
+    }
+    return NULL;
+}
+
+/* to be called by producers when done, after incrementing log_producers */
+static void log_producer_done(void)
+{
+    if (__atomic_sub_fetch(&log_producers, 1, __ATOMIC_SEQ_CST) == 0
+        && __atomic_load_n(&log_stopping, __ATOMIC_SEQ_CST)) {
+        (void)pthread_mutex_lock(&log_lock);
+        (void)pthread_cond_broadcast(&log_quiescent);
+        (void)pthread_mutex_unlock(&log_lock);
+    }
+}
+
+CMP_err CMPclient_log_async_start(OPTIONAL LOG_cb_t sink, size_t capacity)
+{
+    size_t size = 1, i;
+
+    if (log_running) {
+        LOG(FL_ERR, "Asynchronous logging has already been started");
+        return CMP_R_INVALID_ARGS;
+    }
+    if (capacity == 0)
+        capacity = LOG_ASYNC_DEFAULT_CAPACITY;
+    if (capacity > LOG_ASYNC_MAX_CAPACITY) {
+        LOG(FL_ERR, "Asynchronous log buffer capacity %lu exceeds maximum %d",
+            (unsigned long)capacity, LOG_ASYNC_MAX_CAPACITY);
+        return CMP_R_INVALID_ARGS;
+    }
+    while (size < capacity)
+        size <<= 1;
+
+    if ((log_slots = OPENSSL_malloc(size * sizeof(*log_slots))) == NULL)
+        return ERR_R_MALLOC_FAILURE;
+    for (i = 0; i < size; i++)
+        log_slots[i].seq = i;
+    log_mask = size - 1;
+    log_enqueue_pos = log_dequeue_pos = 0;
+    log_dropped = 0;
+    log_stopping = 0;
+    log_sink = sink != NULL ? sink : (LOG_cb_t)LOG_console;
+
+    if (pthread_create(&log_thread, NULL, log_drain, NULL) != 0) {
+        OPENSSL_free(log_slots);
+        log_slots = NULL;
+        LOG(FL_ERR, "Cannot start asynchronous logging thread");
+        return ERR_R_INIT_FAIL;
+    }
+    __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+    return CMP_OK;
+}
+
+bool CMPclient_log_async(OPTIONAL const char *func, OPTIONAL const char *file,
+                         int lineno, severity level, const char *msg)
+{
+    bool queued;
+
+    if (!CMPclient_log_enabled(level))
+        return true; /* nothing to do, which is not an error */
+    /* register before checking for stop, which waits for registered ones */
+    (void)__atomic_fetch_add(&log_producers, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&log_running, __ATOMIC_SEQ_CST)
+        || __atomic_load_n(&log_stopping, __ATOMIC_SEQ_CST)) {
+        log_producer_done();
+        return (*(log_sink != NULL ? log_sink : (LOG_cb_t)LOG_console))
+            (func, file, lineno, level, msg);
+    }
+    queued = log_enqueue(func, file, lineno, level, msg);
+    log_producer_done();
+    if (queued)
+        return true;
+    (void)__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+unsigned long CMPclient_log_async_dropped(void)
+{
+    return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
+
+void CMPclient_log_async_stop(void)
+{
+    unsigned long dropped;
+    char buf[80];
+
+    if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+        return;
+    __atomic_store_n(&log_stopping, 1, __ATOMIC_SEQ_CST);
+    (void)pthread_mutex_lock(&log_lock);
+    (void)pthread_cond_signal(&log_nonempty); /* wake the drain thread */
+    (void)pthread_mutex_unlock(&log_lock);
+    (void)pthread_join(log_thread, NULL); /* drains all pending messages */
+
+    /* new producers now log synchronously; wait for those still enqueuing */
+    (void)pthread_mutex_lock(&log_lock);
+    while (__atomic_load_n(&log_producers, __ATOMIC_SEQ_CST) != 0)
+        (void)pthread_cond_wait(&log_quiescent, &log_lock);
+    (void)pthread_mutex_unlock(&log_lock);
+    /* pick up any messages enqueued while the thread was terminating */
+    while (log_dequeue_one())
+        ;
+    __atomic_store_n(&log_running, 0, __ATOMIC_SEQ_CST);
+    OPENSSL_free(log_slots);
+    log_slots = NULL;
+    LOG_init(log_sink); /* replaces CMPclient_log_async if installed */
+
+    if ((dropped = CMPclient_log_async_dropped()) != 0) {
+        snprintf(buf, sizeof(buf),
+                 "dropped %lu log messages due to full buffer", dropped);
+        (void)(*log_sink)(LOG_FUNC_FILE_LINE, LOG_WARNING, buf);
+    }
+}
+
+#else /* GENCMP_NO_LOG */
+
+CMP_err CMPclient_log_async_start(OPTIONAL LOG_cb_t sink, size_t capacity)
+{
+    (void)sink;
+    (void)capacity;
+    LOG(FL_ERR, "Asynchronous logging is not supported by this build");
+    return CMP_R_INVALID_PARAMETERS;
+}
+
+bool CMPclient_log_async(OPTIONAL const char *func, OPTIONAL const char *file,
+                         int lineno, severity level, const char *msg)
+{
+    return !CMPclient_log_enabled(level)
+        || LOG_console(func, file, lineno, level, msg);
+}
+
+unsigned long CMPclient_log_async_dropped(void)
+{
+    return 0;
+}
+
+void CMPclient_log_async_stop(void)
+{
+}
+
+#endif
@@ -0,0 +1,599 @@
+/*-
+ * @file   genericCMPClient_ocsp.c
+ * @brief  OCSP-based status checking of whole chains with grouped requests
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "genericCMPClient.h"
+
+#ifndef GENCMP_NO_CERTSTATUS
+
+# include <pthread.h>
+# include <string.h>
+# include <time.h>
+
+# if !defined(OPENSSL_NO_OCSP) && OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/http.h>
+#  include <openssl/ocsp.h>
+
+/*
+ * When checking the status of all certs of a chain, the usual callback
+ * installed by STORE_set_parameters() sends an OCSP request per cert.
+ * Yet a chain is typically served by few responders, and an OCSPRequest
+ * may hold any number of CertIDs. So this check_revocation callback first
+ * groups the CertIDs of the chain certs by responder URL and issuer and sends
+ * a single request per group, distributing the SingleResponses to the certs.
+ * A response is authorized only for CertIDs of the CA that signed it or that
+ * delegated OCSP signing to the responder (RFC 6960 section 4.2.2.2), so
+ * CertIDs of different issuers are merged into a request only if the store
+ * holds a trust anchor explicitly trusted for OCSP signing.
+ * Only if the status of any cert remains undetermined it falls back to the
+ * callback previously set, which then checks the chain as before.
+ * Optionally, the status obtained is cached per CertID until the nextUpdate
+ * of the response, such that verifying many certs issued by the same CAs
+ * does not ask for the status of these CAs again and again.
+ */
+
+#  define OCSP_DEFAULT_TIMEOUT 10 /* seconds, as for the CLI -ocsp_timeout */
+#  define OCSP_MAX_SKEW 300 /* seconds of clock skew allowed for validity */
+#  define OCSP_CACHE_BUCKETS 256
+
+typedef struct ocsp_cached_st {
+    unsigned char *id; /* DER encoding of the CertID */
+    int id_len;
+    int status;
+    time_t expires; /* nextUpdate of the response */
+    struct ocsp_cached_st *next;
+} OCSP_CACHED;
+
+typedef struct ocsp_cache_st {
+    pthread_mutex_t lock;
+    OCSP_CACHED *buckets[OCSP_CACHE_BUCKETS];
+    int num, max;
+} OCSP_CACHE;
+
+typedef struct ocsp_multi_st {
+    bool use_aia;
+    char *responder; /* fallback URL, or NULL */
+    int timeout;
+    int max_ids;
+    bool merge_issuers; /* a trusted responder has been configured */
+    int (*fallback)(X509_STORE_CTX *ctx);
+    OCSP_CACHE *cache; /* shared by all threads using the store, or NULL */
+} OCSP_MULTI;
+
+typedef struct ocsp_group_st {
+    char *url;
+    OCSP_REQUEST *req;
+    const OCSP_CERTID *issuer; /* first CertID added to req */
+    int num; /* of CertIDs added to req */
+} OCSP_GROUP;
+
+static int ocsp_index = -1;
+static pthread_once_t ocsp_once = PTHREAD_ONCE_INIT;
+/* the responder's own chain is verified via the same store, see below */
+static __thread int ocsp_depth = 0;
+
+static void ocsp_cache_free(OCSP_CACHE *cache)
+{
+    OCSP_CACHED *e;
+    int i;
+
+    if (cache == NULL)
+        return;
+    for (i = 0; i < OCSP_CACHE_BUCKETS; i++)
+        while ((e = cache->buckets[i]) != NULL) {
+            cache->buckets[i] = e->next;
+            OPENSSL_free(e->id);
+            OPENSSL_free(e);
+        }
+    (void)pthread_mutex_destroy(&cache->lock);
+    OPENSSL_free(cache);
+}
+
+static OCSP_CACHED **cache_bucket(OCSP_CACHE *cache,
+                                  const unsigned char *id, int len)
+{
+    unsigned long h = 5381;
+
+    while (len-- > 0)
+        h = h * 33 + *id++;
+    return &cache->buckets[h % OCSP_CACHE_BUCKETS];
+}
+
+/* returns the cached status for the given CertID, or -1 if none is valid */
+static int ocsp_cache_get(OCSP_CACHE *cache, const OCSP_CERTID *cid)
+{
+    unsigned char *id = NULL;
+    int len = i2d_OCSP_CERTID(cid, &id), status = -1;
+    OCSP_CACHED *e;
+
+    if (len <= 0)
+        return -1;
+    (void)pthread_mutex_lock(&cache->lock);
+    for (e = *cache_bucket(cache, id, len); e != NULL; e = e->next)
+        if (e->id_len == len && memcmp(e->id, id, (size_t)len) == 0) {
+            if (e->expires > time(NULL))
+                status = e->status;
+            break;
+        }
+    (void)pthread_mutex_unlock(&cache->lock);
+    OPENSSL_free(id);
+    return status;
+}
+
+/* with the lock held */
+static void cache_purge_expired(OCSP_CACHE *cache, time_t now)
+{
+    OCSP_CACHED **p, *e;
+    int i;
+
+    for (i = 0; i < OCSP_CACHE_BUCKETS; i++)
+        for (p = &cache->buckets[i]; (e = *p) != NULL;) {
+            if (e->expires > now) {
+                p = &e->next;
+                continue;
+            }
+            *p = e->next;
+            OPENSSL_free(e->id);
+            OPENSSL_free(e);
+            cache->num--;
+        }
+}
+
+/* responses without nextUpdate are not cached since newer ones may exist */
+static void ocsp_cache_put(OCSP_CACHE *cache, const OCSP_CERTID *cid,
+                           int status, const ASN1_GENERALIZEDTIME *nextupd)
+{
+    unsigned char *id = NULL;
+    OCSP_CACHED **bucket, *e;
+    time_t now = time(NULL), expires;
+    int len, days, secs;
+
+    if (nextupd == NULL || !ASN1_TIME_diff(&days, &secs, NULL, nextupd)
+        || (expires = now + (time_t)days * 86400 + secs) <= now
+        || (len = i2d_OCSP_CERTID(cid, &id)) <= 0)
+        return;
+    (void)pthread_mutex_lock(&cache->lock);
+    bucket = cache_bucket(cache, id, len);
+    for (e = *bucket; e != NULL; e = e->next)
+        if (e->id_len == len && memcmp(e->id, id, (size_t)len) == 0)
+            break;
+    if (e == NULL && cache->num >= cache->max)
+        cache_purge_expired(cache, now);
+    if (e == NULL && cache->num < cache->max
+        && (e = OPENSSL_zalloc(sizeof(*e))) != NULL) {
+        e->id = id;
+        e->id_len = len;
+        e->next = *bucket;
+        *bucket = e;
+        cache->num++;
+        id = NULL;
+    }
+    if (e != NULL) {
+        e->status = status;
+        e->expires = expires;
+    }
+    (void)pthread_mutex_unlock(&cache->lock);
+    OPENSSL_free(id);
+}
+
+static void ocsp_multi_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                            int idx, long argl, void *argp)
+{
+    OCSP_MULTI *om = ptr;
+
+    (void)parent;
+    (void)ad;
+    (void)idx;
+    (void)argl;
+    (void)argp;
+    if (om != NULL) {
+        ocsp_cache_free(om->cache);
+        OPENSSL_free(om->responder);
+        OPENSSL_free(om);
+    }
+}
+
+static void ocsp_init(void)
+{
+    ocsp_index = X509_STORE_get_ex_new_index(0, NULL, NULL, NULL,
+                                             ocsp_multi_free);
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long)(now.tv_sec - start->tv_sec) * 1000
+        + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* returns a copy of the OCSP responder URL to use for cert, or NULL */
+static char *responder_url(const OCSP_MULTI *om, X509 *cert)
+{
+    char *url = NULL;
+
+    if (om->use_aia) {
+        STACK_OF(OPENSSL_STRING) *aia = X509_get1_ocsp(cert);
+
+        if (sk_OPENSSL_STRING_num(aia) > 0)
+            url = OPENSSL_strdup(sk_OPENSSL_STRING_value(aia, 0));
+        X509_email_free(aia);
+    }
+    if (url == NULL && om->responder != NULL)
+        url = OPENSSL_strdup(om->responder);
+    return url;
+}
+
+static OCSP_GROUP *find_group(OCSP_GROUP *groups, int *num, char *url,
+                              const OCSP_CERTID *id, const OCSP_MULTI *om)
+{
+    int i;
+
+    for (i = 0; i < *num; i++)
+        if (strcmp(groups[i].url, url) == 0
+            && (om->merge_issuers
+                || OCSP_id_issuer_cmp(groups[i].issuer, id) == 0)
+            && (om->max_ids <= 0 || groups[i].num < om->max_ids)) {
+            OPENSSL_free(url);
+            return &groups[i];
+        }
+    if ((groups[i].req = OCSP_REQUEST_new()) == NULL
+        || !OCSP_request_add1_nonce(groups[i].req, NULL, -1)) {
+        OCSP_REQUEST_free(groups[i].req);
+        OPENSSL_free(url);
+        return NULL;
+    }
+    groups[i].url = url;
+    groups[i].issuer = id;
+    groups[i].num = 0;
+    (*num)++;
+    return &groups[i];
+}
+
+static OCSP_RESPONSE *ocsp_transfer(const char *url, const OCSP_REQUEST *req,
+                                    int timeout)
+{
+    char *host = NULL, *port = NULL, *path = NULL;
+    BIO *req_mem = NULL, *rsp_mem = NULL;
+    OCSP_RESPONSE *rsp = NULL;
+    int use_ssl;
+
+    if (!OSSL_HTTP_parse_url(url, &use_ssl, NULL, &host, &port, NULL, &path,
+                             NULL, NULL))
+        goto end;
+    if (use_ssl) {
+        LOG(FL_WARN, "HTTPS not supported for OCSP responder %s", url);
+        goto end;
+    }
+    req_mem = ASN1_item_i2d_mem_bio(ASN1_ITEM_rptr(OCSP_REQUEST),
+                                    (const ASN1_VALUE *)req);
+    if (req_mem == NULL)
+        goto end;
+    rsp_mem = OSSL_HTTP_transfer(NULL, host, port, path, 0 /* use_ssl */,
+                                 NULL /* proxy from env */, NULL, NULL, NULL,
+                                 NULL, NULL, 0 /* buf_size */, NULL /* hdrs */,
+                                 "application/ocsp-request", req_mem,
+                                 "application/ocsp-response", 1 /* ASN.1 */,
+                                 0 /* default max_resp_len */, timeout,
+                                 0 /* no keep_alive */);
+    if (rsp_mem != NULL)
+        rsp = (OCSP_RESPONSE *)ASN1_item_d2i_bio(ASN1_ITEM_rptr(OCSP_RESPONSE),
+                                                 rsp_mem, NULL);
+
+ end:
+    if (rsp == NULL)
+        LOG(FL_WARN, "Cannot get OCSP response from %s", url);
+    BIO_free(req_mem);
+    BIO_free(rsp_mem);
+    OPENSSL_free(host);
+    OPENSSL_free(port);
+    OPENSSL_free(path);
+    return rsp;
+}
+
+/*
+ * sets status[i] for each cert i of the chain in group gi for which
+ * a verified response gives a definite status
+ */
+static void ocsp_process(X509_STORE_CTX *ctx, const OCSP_GROUP *group, int gi,
+                         const int *grp, OCSP_CERTID *const *ids, int *status,
+                         int num, const OCSP_MULTI *om, int timeout)
+{
+    X509_STORE *store = X509_STORE_CTX_get0_store(ctx);
+    STACK_OF(X509) *chain = X509_STORE_CTX_get0_chain(ctx);
+    OCSP_RESPONSE *rsp = ocsp_transfer(group->url, group->req, timeout);
+    OCSP_BASICRESP *bs = NULL;
+    ASN1_GENERALIZEDTIME *thisupd, *nextupd;
+    int i, st, reason;
+
+    if (rsp == NULL)
+        return;
+    if (OCSP_response_status(rsp) != OCSP_RESPONSE_STATUS_SUCCESSFUL
+        || (bs = OCSP_response_get1_basic(rsp)) == NULL) {
+        LOG(FL_WARN, "OCSP responder %s did not answer successfully",
+            group->url);
+        goto end;
+    }
+    if (OCSP_check_nonce(group->req, bs) == 0) {
+        LOG(FL_WARN, "Nonce mismatch in OCSP response from %s", group->url);
+        goto end;
+    }
+    if (OCSP_basic_verify(bs, chain, store, 0) <= 0) {
+        LOG(FL_WARN, "Cannot verify OCSP response from %s", group->url);
+        goto end;
+    }
+    for (i = 0; i < num; i++) {
+        if (grp[i] != gi)
+            continue;
+        if (OCSP_resp_find_status(bs, ids[i], &st, &reason, NULL,
+                                  &thisupd, &nextupd)
+            && st != V_OCSP_CERTSTATUS_UNKNOWN
+            && OCSP_check_validity(thisupd, nextupd, OCSP_MAX_SKEW, -1)) {
+            status[i] = st;
+            if (om->cache != NULL)
+                ocsp_cache_put(om->cache, ids[i], st, nextupd);
+        }
+    }
+
+ end:
+    OCSP_BASICRESP_free(bs);
+    OCSP_RESPONSE_free(rsp);
+    ERR_clear_error(); /* any failures are handled by the fallback */
+}
+
+/*
+ * Checks the chain certs except the trust anchor, using the OCSP_MULTI
+ * settings of the store. Returns 1 if all are good, 0 if verification
+ * shall fail, and -1 if the status of any of them remains undetermined.
+ */
+static int ocsp_check_chain(X509_STORE_CTX *ctx, const OCSP_MULTI *om)
+{
+    STACK_OF(X509) *chain = X509_STORE_CTX_get0_chain(ctx);
+    X509_STORE_CTX_verify_cb verify_cb = X509_STORE_CTX_get_verify_cb(ctx);
+    int num = sk_X509_num(chain) - 1; /* certs having an issuer in chain */
+    int timeout = om->timeout < 0 ? OCSP_DEFAULT_TIMEOUT : om->timeout;
+    OCSP_GROUP *groups = NULL;
+    OCSP_CERTID **ids = NULL;
+    int *grp = NULL, *status = NULL;
+    int ngroups = 0, cached = 0, i, ret = -1;
+    struct timespec start;
+
+    if (num <= 0)
+        return 1;
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    groups = OPENSSL_zalloc((size_t)num * sizeof(*groups));
+    ids = OPENSSL_zalloc((size_t)num * sizeof(*ids));
+    grp = OPENSSL_malloc((size_t)num * sizeof(*grp));
+    status = OPENSSL_malloc((size_t)num * sizeof(*status));
+    if (groups == NULL || ids == NULL || grp == NULL || status == NULL)
+        goto end;
+
+    for (i = 0; i < num; i++) {
+        X509 *cert = sk_X509_value(chain, i);
+        OCSP_GROUP *group;
+        char *url;
+
+        status[i] = -1;
+        grp[i] = -1;
+        if ((ids[i] = OCSP_cert_to_id(NULL, cert,
+                                      sk_X509_value(chain, i + 1))) == NULL)
+            goto end;
+        if (om->cache != NULL
+            && (status[i] = ocsp_cache_get(om->cache, ids[i])) >= 0) {
+            cached++;
+            url = NULL;
+        } else {
+            url = responder_url(om, cert);
+        }
+        if (url == NULL) {
+            OCSP_CERTID_free(ids[i]);
+            ids[i] = NULL;
+            continue;
+        }
+        if ((group = find_group(groups, &ngroups, url, ids[i], om)) == NULL
+            || OCSP_request_add0_id(group->req, ids[i]) == NULL) {
+            OCSP_CERTID_free(ids[i]);
+            ids[i] = NULL;
+            goto end;
+        }
+        /* ids[i] is now owned by group->req */
+        grp[i] = (int)(group - groups);
+        group->num++;
+    }
+    for (i = 0; i < ngroups; i++)
+        ocsp_process(ctx, &groups[i], i, grp, ids, status, num, om, timeout);
+
+    ret = 1;
+    for (i = 0; i < num; i++) {
+        if (status[i] == V_OCSP_CERTSTATUS_REVOKED) {
+            X509_STORE_CTX_set_error_depth(ctx, i);
+            X509_STORE_CTX_set_current_cert(ctx, sk_X509_value(chain, i));
+            X509_STORE_CTX_set_error(ctx, X509_V_ERR_CERT_REVOKED);
+            if (verify_cb == NULL || !verify_cb(0, ctx)) {
+                ret = 0;
+                break;
+            }
+        } else if (status[i] != V_OCSP_CERTSTATUS_GOOD) {
+            ret = -1;
+        }
+    }
+    LOG(FL_DEBUG, "OCSP status of %d chain certs checked with %d request%s and %d cached in %ld ms%s",
+        num, ngroups, ngroups == 1 ? "" : "s", cached, elapsed_ms(&start),
+        ret < 0 ? ", some undetermined" : "");
+
+ end:
+    for (i = 0; i < ngroups; i++) {
+        OCSP_REQUEST_free(groups[i].req);
+        OPENSSL_free(groups[i].url);
+    }
+    OPENSSL_free(groups);
+    OPENSSL_free(ids);
+    OPENSSL_free(grp);
+    OPENSSL_free(status);
+    return ret;
+}
+
+static int ocsp_check_revocation(X509_STORE_CTX *ctx)
+{
+    const OCSP_MULTI *om =
+        X509_STORE_get_ex_data(X509_STORE_CTX_get0_store(ctx), ocsp_index);
+    int ret = -1;
+
+    if (om == NULL) {
+        X509_STORE_CTX_set_error(ctx, X509_V_ERR_UNSPECIFIED);
+        return 0;
+    }
+    /*
+     * When verifying the chain of an OCSP responder, as done by
+     * OCSP_basic_verify(), just apply the previous callback, if any.
+     */
+    if (ocsp_depth == 0) {
+        ocsp_depth++;
+        ret = ocsp_check_chain(ctx, om);
+        ocsp_depth--;
+    }
+    if (ret >= 0)
+        return ret;
+    if (om->fallback != NULL)
+        return (*om->fallback)(ctx);
+    if (ocsp_depth > 0)
+        return 1;
+    X509_STORE_CTX_set_error(ctx, X509_V_ERR_OCSP_CERT_UNKNOWN);
+    return X509_STORE_CTX_get_verify_cb(ctx)(0, ctx);
+}
+
+/* whether any trust anchor in store is explicitly trusted for OCSP signing */
+static bool has_trusted_responder(X509_STORE *store)
+{
+    STACK_OF(X509_OBJECT) *objs;
+    X509 *cert;
+    int i;
+    bool found = false;
+
+    if (!X509_STORE_lock(store))
+        return false;
+    objs = X509_STORE_get0_objects(store);
+    for (i = 0; !found && i < sk_X509_OBJECT_num(objs); i++)
+        found = (cert = X509_OBJECT_get0_X509(sk_X509_OBJECT_value(objs, i)))
+            != NULL
+            && X509_check_trust(cert, NID_OCSP_sign, 0) == X509_TRUST_TRUSTED;
+    (void)X509_STORE_unlock(store);
+    return found;
+}
+
+bool CMPclient_ocsp_multi(X509_STORE *store, bool use_aia,
+                          OPTIONAL const char *responders, int timeout,
+                          int max_ids)
+{
+    OCSP_MULTI *om, *old;
+    size_t len;
+
+    if (store == NULL) {
+        LOG(FL_ERR, "No store parameter given");
+        return false;
+    }
+    if (!use_aia && responders == NULL) {
+        LOG(FL_ERR, "Neither use_aia nor responders given");
+        return false;
+    }
+    if (pthread_once(&ocsp_once, ocsp_init) != 0 || ocsp_index < 0)
+        return false;
+    if ((om = OPENSSL_zalloc(sizeof(*om))) == NULL)
+        return false;
+    om->use_aia = use_aia;
+    om->timeout = timeout;
+    om->max_ids = max_ids;
+    om->merge_issuers = has_trusted_responder(store);
+    if (responders != NULL) {
+        /* only the first one of a list of URLs is used */
+        len = strcspn(responders, ", \t\n");
+        if ((om->responder = OPENSSL_strndup(responders, len)) == NULL) {
+            OPENSSL_free(om);
+            return false;
+        }
+    }
+    old = X509_STORE_get_ex_data(store, ocsp_index);
+    om->fallback = old != NULL ? old->fallback
+        : X509_STORE_get_check_revocation(store);
+    if (!X509_STORE_set_ex_data(store, ocsp_index, om)) {
+        ocsp_multi_free(store, om, NULL, ocsp_index, 0, NULL);
+        return false;
+    }
+    if (old != NULL) {
+        om->cache = old->cache; /* any cache is kept */
+        old->cache = NULL;
+    }
+    ocsp_multi_free(store, old, NULL, ocsp_index, 0, NULL);
+    X509_STORE_set_check_revocation(store, ocsp_check_revocation);
+    return true;
+}
+
+bool CMPclient_ocsp_cache(X509_STORE *store, int max_entries)
+{
+    OCSP_MULTI *om;
+    OCSP_CACHE *cache;
+
+    if (store == NULL) {
+        LOG(FL_ERR, "No store parameter given");
+        return false;
+    }
+    om = ocsp_index < 0 ? NULL : X509_STORE_get_ex_data(store, ocsp_index);
+    if (om == NULL) {
+        LOG(FL_ERR, "CMPclient_ocsp_multi() has not been called on the store");
+        return false;
+    }
+    if (max_entries <= 0) {
+        ocsp_cache_free(om->cache);
+        om->cache = NULL;
+        return true;
+    }
+    if ((cache = om->cache) == NULL) {
+        if ((cache = OPENSSL_zalloc(sizeof(*cache))) == NULL)
+            return false;
+        if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+            OPENSSL_free(cache);
+            return false;
+        }
+        om->cache = cache;
+    }
+    cache->max = max_entries;
+    return true;
+}
+
+# else /* OPENSSL_NO_OCSP or OpenSSL < 3.0 */
+
+bool CMPclient_ocsp_multi(X509_STORE *store, bool use_aia,
+                          OPTIONAL const char *responders, int timeout,
+                          int max_ids)
+{
+    (void)store;
+    (void)use_aia;
+    (void)responders;
+    (void)timeout;
+    (void)max_ids;
+    LOG(FL_ERR, "Grouped OCSP requests are not supported by this build");
+    return false;
+}
+
+bool CMPclient_ocsp_cache(X509_STORE *store, int max_entries)
+{
+    (void)store;
+    (void)max_entries;
+    LOG(FL_ERR, "Grouped OCSP requests are not supported by this build");
+    return false;
+}
+
+# endif
+#endif /* !defined GENCMP_NO_CERTSTATUS */
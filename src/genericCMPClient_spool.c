@@ -0,0 +1,394 @@
+/*-
+ * @file   genericCMPClient_spool.c
+ * @brief  store-and-forward spool transport for offline bulk processing
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "genericCMPClient_local.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef GENCMP_NO_SPOOL
+
+/*
+ * A spool directory has two subdirectories: out/ for requests and in/ for
+ * responses, each holding one DER-encoded CMP message per file, named
+ * <transactionID in hex>.<sequence number>.der. Files are written under a
+ * temporary name starting with '.' and then renamed, such that readers never
+ * see partial messages.
+ *
+ * The transfer callback CMPclient_spool_cb() of transactions set up with
+ * CMPclient_setup_spool() queues the request to out/ and waits until a
+ * response with the same transactionID shows up in in/. Since in a transaction
+ * only one request is outstanding at a time, the transactionID suffices for
+ * matching; the recipNonce is checked by OpenSSL as usual. Any number of
+ * transactions, also of different processes, may wait on the same spool.
+ * Responses for transactions not waiting in the current process are left.
+ * All waiters of a process share a single scan of in/ per poll interval.
+ * Within jobs of the engine, waiting yields to other jobs.
+ *
+ * CMPclient_spool_forward(), e.g., run whenever the uplink is available,
+ * ships all queued requests over a single connection kept alive and drops
+ * the responses into in/. The directories may as well be moved by other
+ * means, for instance on a removable medium, to where the forwarder runs.
+ */
+
+#define SPOOL_OUT "out"
+#define SPOOL_IN "in"
+#define SPOOL_DER_SUFFIX ".der"
+#define SPOOL_MAX_TXID_LEN 64 /* in bytes, RFC 4210 recommends 128 bits */
+#define SPOOL_DEFAULT_POLL_MS 100
+
+typedef struct spool_waiter_st {
+    char txid[2 * SPOOL_MAX_TXID_LEN + 1]; /* in hex */
+    OSSL_CMP_MSG *rsp;
+    struct spool_waiter_st *next;
+} SPOOL_WAITER;
+
+struct cmpclient_spool_st {
+    char *dir;
+    int poll_ms;
+    pthread_mutex_t lock;
+    unsigned long seq;
+    long last_scan_ms;
+    SPOOL_WAITER *waiting;
+};
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool make_dir(const char *dir, const char *sub)
+{
+    char path[PATH_MAX];
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, sub) >= (int)sizeof(path))
+        return false;
+    if (mkdir(path, 0700) == 0 || errno == EEXIST)
+        return true;
+    LOG(FL_ERR, "cannot create spool directory %s: %s", path, strerror(errno));
+    return false;
+}
+
+static bool txid_hex(const OSSL_CMP_MSG *msg, char *buf)
+{
+    static const char hex[] = "0123456789abcdef";
+    const ASN1_OCTET_STRING *txid =
+        OSSL_CMP_HDR_get0_transactionID(OSSL_CMP_MSG_get0_header(msg));
+    const unsigned char *data;
+    int i, len;
+
+    if (txid == NULL
+        || (len = ASN1_STRING_length(txid)) <= 0 || len > SPOOL_MAX_TXID_LEN)
+        return false;
+    data = ASN1_STRING_get0_data(txid);
+    for (i = 0; i < len; i++) {
+        buf[2 * i] = hex[data[i] >> 4];
+        buf[2 * i + 1] = hex[data[i] & 0x0f];
+    }
+    buf[2 * len] = '\0';
+    return true;
+}
+
+/* writes to a temporary file first such that readers do not see partial data */
+static bool write_msg(const char *dir, const char *sub, const char *name,
+                      const OSSL_CMP_MSG *msg)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+
+    if (snprintf(path, sizeof(path), "%s/%s/%s", dir, sub, name)
+        >= (int)sizeof(path)
+        || snprintf(tmp, sizeof(tmp), "%s/%s/.%s.tmp", dir, sub, name)
+        >= (int)sizeof(tmp))
+        return false;
+    if (OSSL_CMP_MSG_write(tmp, msg) <= 0) {
+        LOG(FL_ERR, "cannot write CMP message to %s", tmp);
+        return false;
+    }
+    if (rename(tmp, path) != 0) {
+        LOG(FL_ERR, "cannot rename %s: %s", tmp, strerror(errno));
+        (void)unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+static bool is_msg_file(const char *name)
+{
+    size_t len = strlen(name);
+
+    return name[0] != '.' && len > strlen(SPOOL_DER_SUFFIX)
+        && strcmp(name + len - strlen(SPOOL_DER_SUFFIX), SPOOL_DER_SUFFIX) == 0;
+}
+
+CMPCLIENT_SPOOL *CMPclient_spool_new(const char *dir, int poll_ms)
+{
+    CMPCLIENT_SPOOL *spool;
+
+    if (dir == NULL) {
+        LOG(FL_ERR, "No dir parameter given");
+        return NULL;
+    }
+    if (!make_dir(dir, "") || !make_dir(dir, SPOOL_OUT)
+        || !make_dir(dir, SPOOL_IN))
+        return NULL;
+    if ((spool = OPENSSL_zalloc(sizeof(*spool))) == NULL
+        || (spool->dir = OPENSSL_strdup(dir)) == NULL) {
+        OPENSSL_free(spool);
+        LOG_err("Out of memory");
+        return NULL;
+    }
+    spool->poll_ms = poll_ms > 0 ? poll_ms : SPOOL_DEFAULT_POLL_MS;
+    if (pthread_mutex_init(&spool->lock, NULL) != 0) {
+        OPENSSL_free(spool->dir);
+        OPENSSL_free(spool);
+        return NULL;
+    }
+    return spool;
+}
+
+void CMPclient_spool_free(OPTIONAL CMPCLIENT_SPOOL *spool)
+{
+    if (spool == NULL)
+        return;
+    if (spool->waiting != NULL)
+        LOG(FL_WARN, "freeing spool while transactions are waiting on it");
+    (void)pthread_mutex_destroy(&spool->lock);
+    OPENSSL_free(spool->dir);
+    OPENSSL_free(spool);
+}
+
+/* hands any responses in in/ to the waiters they belong to, called locked */
+static void scan_responses(CMPCLIENT_SPOOL *spool)
+{
+    char path[PATH_MAX], txid[2 * SPOOL_MAX_TXID_LEN + 1];
+    struct dirent *entry;
+    DIR *dir;
+
+    if (snprintf(path, sizeof(path), "%s/%s", spool->dir, SPOOL_IN)
+        >= (int)sizeof(path) || (dir = opendir(path)) == NULL) {
+        LOG(FL_WARN, "cannot open spool directory %s/%s",
+            spool->dir, SPOOL_IN);
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strcspn(entry->d_name, ".");
+        SPOOL_WAITER *w;
+        OSSL_CMP_MSG *rsp;
+
+        if (!is_msg_file(entry->d_name))
+            continue;
+        for (w = spool->waiting; w != NULL; w = w->next)
+            if (w->rsp == NULL && strlen(w->txid) == len
+                && strncmp(w->txid, entry->d_name, len) == 0)
+                break;
+        if (w == NULL)
+            continue; /* may be for another process */
+        if (snprintf(path, sizeof(path), "%s/%s/%s", spool->dir, SPOOL_IN,
+                     entry->d_name) >= (int)sizeof(path))
+            continue;
+        rsp = OSSL_CMP_MSG_read(path, NULL, NULL);
+        if (rsp == NULL || !txid_hex(rsp, txid) || strcmp(txid, w->txid) != 0) {
+            char bad[PATH_MAX];
+
+            LOG(FL_WARN, "ignoring invalid or mismatching response in %s", path);
+            OSSL_CMP_MSG_free(rsp);
+            if (snprintf(bad, sizeof(bad), "%s.bad", path) < (int)sizeof(bad))
+                (void)rename(path, bad);
+            continue;
+        }
+        (void)unlink(path);
+        w->rsp = rsp;
+    }
+    (void)closedir(dir);
+}
+
+OSSL_CMP_MSG *CMPclient_spool_cb(OSSL_CMP_CTX *ctx, const OSSL_CMP_MSG *req)
+{
+    CMPCLIENT_SPOOL *spool = OSSL_CMP_CTX_get_transfer_cb_arg(ctx);
+    int timeout = OSSL_CMP_CTX_get_option(ctx, OSSL_CMP_OPT_MSG_TIMEOUT);
+    long deadline = timeout > 0 ? now_ms() + 1000L * timeout : 0;
+    char name[sizeof(((SPOOL_WAITER *)NULL)->txid) + 32], path[PATH_MAX];
+    SPOOL_WAITER w, **pw;
+    OSSL_CMP_MSG *rsp = NULL;
+
+    if (spool == NULL || req == NULL)
+        return NULL;
+    memset(&w, 0, sizeof(w));
+    if (!txid_hex(req, w.txid)) {
+        LOG(FL_ERR, "cannot spool request lacking suitable transactionID");
+        return NULL;
+    }
+    (void)pthread_mutex_lock(&spool->lock);
+    (void)snprintf(name, sizeof(name), "%s.%lu%s",
+                   w.txid, ++spool->seq, SPOOL_DER_SUFFIX);
+    w.next = spool->waiting;
+    spool->waiting = &w;
+    (void)pthread_mutex_unlock(&spool->lock);
+    if (!write_msg(spool->dir, SPOOL_OUT, name, req))
+        goto end;
+    if (LOG_ENABLED(LOG_DEBUG))
+        LOG(FL_DEBUG, "queued request %s/%s/%s", spool->dir, SPOOL_OUT, name);
+
+    for (;;) {
+        long now = now_ms();
+
+        (void)pthread_mutex_lock(&spool->lock);
+        if (w.rsp == NULL && now - spool->last_scan_ms >= spool->poll_ms) {
+            spool->last_scan_ms = now;
+            scan_responses(spool);
+        }
+        rsp = w.rsp;
+        (void)pthread_mutex_unlock(&spool->lock);
+        if (rsp != NULL)
+            break;
+        if (deadline != 0 && now >= deadline) {
+            LOG(FL_ERR, "no response to spooled request %s within %d seconds",
+                name, timeout);
+            /* if not forwarded yet, withdraw the request */
+            if (snprintf(path, sizeof(path), "%s/%s/%s", spool->dir,
+                         SPOOL_OUT, name) < (int)sizeof(path))
+                (void)unlink(path);
+            break;
+        }
+        (void)CMPclient_engine_wait(-1, 0, spool->poll_ms);
+    }
+
+ end:
+    (void)pthread_mutex_lock(&spool->lock);
+    for (pw = &spool->waiting; *pw != NULL; pw = &(*pw)->next)
+        if (*pw == &w) {
+            *pw = w.next;
+            break;
+        }
+    (void)pthread_mutex_unlock(&spool->lock);
+    return rsp;
+}
+
+CMP_err CMPclient_spool_forward(CMP_CTX *ctx, const char *dir,
+                                OPTIONAL int *num)
+{
+    OSSL_CMP_transfer_cb_t transfer_cb;
+    void *arg;
+    char out[PATH_MAX], path[PATH_MAX];
+    struct dirent *entry;
+    CMP_err err = CMP_OK;
+    DIR *d;
+    int n = 0;
+
+    if (num != NULL)
+        *num = 0;
+    if (ctx == NULL) {
+        LOG(FL_ERR, "No ctx parameter given");
+        return CMP_R_INVALID_CONTEXT;
+    }
+    if (dir == NULL) {
+        LOG(FL_ERR, "No dir parameter given");
+        return CMP_R_INVALID_PARAMETERS;
+    }
+    if (!make_dir(dir, SPOOL_IN)
+        || snprintf(out, sizeof(out), "%s/%s", dir, SPOOL_OUT)
+        >= (int)sizeof(out))
+        return CMP_R_INVALID_PARAMETERS;
+    if ((d = opendir(out)) == NULL) {
+        LOG(FL_ERR, "cannot open spool directory %s: %s", out, strerror(errno));
+        return CMP_R_INVALID_PARAMETERS;
+    }
+    /* as set up by CMPclient_setup_transport() or CMPclient_setup_HTTP() */
+    arg = OSSL_CMP_CTX_get_transfer_cb_arg(ctx);
+    transfer_cb = arg != NULL && arg == OSSL_CMP_CTX_get_http_cb_arg(ctx)
+        ? CMPclient_transport_cb : OSSL_CMP_MSG_http_perform;
+
+    while ((entry = readdir(d)) != NULL) {
+        OSSL_CMP_MSG *req, *rsp;
+
+        if (!is_msg_file(entry->d_name)
+            || snprintf(path, sizeof(path), "%s/%s", out, entry->d_name)
+            >= (int)sizeof(path))
+            continue;
+        if ((req = OSSL_CMP_MSG_read(path, NULL, NULL)) == NULL) {
+            /* may have been withdrawn meanwhile */
+            if (access(path, F_OK) == 0)
+                LOG(FL_WARN, "skipping unreadable request %s", path);
+            continue;
+        }
+        rsp = (*transfer_cb)(ctx, req);
+        OSSL_CMP_MSG_free(req);
+        if (rsp == NULL) {
+            LOG(FL_ERR, "forwarding %s failed; stopping", path);
+            err = CMP_R_TRANSFER_ERROR;
+            break;
+        }
+        if (!write_msg(dir, SPOOL_IN, entry->d_name, rsp)) {
+            OSSL_CMP_MSG_free(rsp);
+            err = CMP_R_INVALID_PARAMETERS;
+            break;
+        }
+        OSSL_CMP_MSG_free(rsp);
+        (void)unlink(path);
+        n++;
+    }
+    (void)closedir(d);
+    if (OSSL_CMP_CTX_get_option(ctx, OSSL_CMP_OPT_KEEP_ALIVE) != 0)
+        (void)CMPclient_reinit(ctx); /* closes the connection */
+    LOG(FL_INFO, "forwarded %d spooled request(s) from %s", n, out);
+    if (num != NULL)
+        *num = n;
+    return err;
+}
+
+#else /* GENCMP_NO_SPOOL */
+
+CMPCLIENT_SPOOL *CMPclient_spool_new(const char *dir, int poll_ms)
+{
+    (void)dir;
+    (void)poll_ms;
+    LOG(FL_ERR, "Spooled transfer is not supported by this build");
+    return NULL;
+}
+
+void CMPclient_spool_free(OPTIONAL CMPCLIENT_SPOOL *spool)
+{
+    (void)spool;
+}
+
+OSSL_CMP_MSG *CMPclient_spool_cb(OSSL_CMP_CTX *ctx, const OSSL_CMP_MSG *req)
+{
+    (void)ctx;
+    (void)req;
+    return NULL;
+}
+
+CMP_err CMPclient_spool_forward(CMP_CTX *ctx, const char *dir,
+                                OPTIONAL int *num)
+{
+    (void)ctx;
+    (void)dir;
+    if (num != NULL)
+        *num = 0;
+    LOG(FL_ERR, "Spooled transfer is not supported by this build");
+    return CMP_R_INVALID_PARAMETERS;
+}
+
+#endif
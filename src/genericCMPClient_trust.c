@@ -0,0 +1,565 @@
+/*-
+ * @file   genericCMPClient_trust.c
+ * @brief  trust stores reloaded on change of their source files
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "genericCMPClient_local.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifndef GENCMP_NO_TRUST
+
+/*
+ * A reloadable trust store is a sequence of immutable X509_STORE snapshots,
+ * each loaded from the same source files. The current snapshot is published
+ * via a single pointer, which readers load and take a reference to while
+ * holding the lock of the handle, such that they never wait for a rebuild.
+ * A new snapshot is built completely off to the side, by the watcher thread
+ * polling the sources for changes of their inode, size, or mtime, or on
+ * CMPclient_trust_reload(), and then replaces the pointer atomically.
+ * If loading fails, e.g., because a file is being rewritten, the previous
+ * snapshot stays in use, and the next change of the sources is retried.
+ *
+ * Each snapshot carries a counted reference to its handle as ex_data, such that
+ * a context holding a snapshot as its trusted store or new cert trust store
+ * (the certConf_cb_arg) picks up the current one with CMPclient_trust_refresh(),
+ * which the CMPclient functions do at the start of each transaction.
+ * Thus transactions in progress keep verifying against the snapshot they
+ * started with, which their context holds a reference to.
+ * The handle is freed when CMPclient_trust_free() has been called and
+ * the last snapshot is gone.
+ *
+ * An attached SSL_CTX is not modified after CMPclient_trust_attach_TLS(),
+ * which only records a counted reference to the handle as its ex_data, since
+ * OpenSSL does not synchronize changes of an SSL_CTX with SSL_new() and
+ * handshakes using it. Instead, each SSL object gets the current snapshot
+ * as its verify cert store right after its creation, such that handshakes
+ * in progress keep theirs.
+ *
+ * Likewise, published snapshots are not adapted for use as new cert trust
+ * store, which ignores any verification time set. Instead, the handle is
+ * marked as being used that way, and each snapshot loaded from then on gets
+ * the verification time cleared right after setup_fn, before publishing it.
+ */
+
+#define TRUST_DEFAULT_INTERVAL 5 /* in seconds */
+#define TRUST_MAX_SOURCES 16
+
+typedef struct trust_source_st {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_ns;
+    int err; /* errno of stat(), 0 if the file is present */
+} TRUST_SOURCE;
+
+struct cmpclient_trust_st {
+    char *files;
+    char *desc;
+    CMPclient_trust_setup_cb_t setup_fn;
+    void *setup_arg;
+    bool new_cert_use; /* as new cert trust store, accessed atomically */
+    int refs; /* by the user and by each snapshot, accessed atomically */
+    pthread_mutex_t lock; /* for current */
+    X509_STORE *current; /* published snapshot, NULL after trust_free() */
+    unsigned long generation;
+    pthread_mutex_t reload_lock; /* serializes rebuilds */
+    TRUST_SOURCE sources[TRUST_MAX_SOURCES];
+    int num_sources;
+    int interval;
+    bool watching;
+    bool stopping;
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop_cond;
+    pthread_t watcher;
+};
+
+static pthread_once_t trust_once = PTHREAD_ONCE_INIT;
+static int trust_index = -1;
+#ifndef SECUTILS_NO_TLS
+static int trust_tls_index = -1;
+#endif
+
+static void trust_unref(CMPCLIENT_TRUST *trust)
+{
+    if (__atomic_sub_fetch(&trust->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    (void)pthread_cond_destroy(&trust->stop_cond);
+    (void)pthread_mutex_destroy(&trust->stop_lock);
+    (void)pthread_mutex_destroy(&trust->lock);
+    (void)pthread_mutex_destroy(&trust->reload_lock);
+    OPENSSL_free(trust->desc);
+    OPENSSL_free(trust->files);
+    OPENSSL_free(trust);
+}
+
+/* called when a snapshot or an attached SSL_CTX is freed */
+static void trust_ex_free(ossl_unused void *parent, void *ptr,
+                          ossl_unused CRYPTO_EX_DATA *ad,
+                          ossl_unused int idx, ossl_unused long argl,
+                          ossl_unused void *argp)
+{
+    if (ptr != NULL)
+        trust_unref(ptr);
+}
+
+static void trust_init(void)
+{
+    trust_index = X509_STORE_get_ex_new_index(0, NULL, NULL, NULL,
+                                              trust_ex_free);
+#ifndef SECUTILS_NO_TLS
+    trust_tls_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+                                               trust_ex_free);
+#endif
+}
+
+/* the handle the given store is a snapshot of, or NULL */
+static CMPCLIENT_TRUST *trust_of(OPTIONAL X509_STORE *store)
+{
+    if (store == NULL)
+        return NULL;
+    (void)pthread_once(&trust_once, trust_init);
+    return trust_index < 0 ? NULL : X509_STORE_get_ex_data(store, trust_index);
+}
+
+/* yields the number of sources, or -1 if there are too many */
+static int stat_sources(const char *files, TRUST_SOURCE *sources)
+{
+    char *list = OPENSSL_strdup(files), *file = list, *next;
+    struct stat st;
+    int n = 0;
+
+    if (list == NULL)
+        return -1;
+    for (; file != NULL && *file != '\0'; file = next) {
+        next = UTIL_next_item(file);
+        if (n == TRUST_MAX_SOURCES) {
+            n = -1;
+            break;
+        }
+        memset(&sources[n], 0, sizeof(sources[n]));
+        if (stat(file, &st) != 0) {
+            sources[n].err = errno; /* e.g., not a file but a URI */
+        } else {
+            sources[n].dev = st.st_dev;
+            sources[n].ino = st.st_ino;
+            sources[n].size = st.st_size;
+            sources[n].mtime = st.st_mtime;
+            sources[n].mtime_ns = STAT_MTIME_NS(st);
+        }
+        n++;
+    }
+    OPENSSL_free(list);
+    return n;
+}
+
+/* yields a new reference to the current snapshot, or NULL */
+static X509_STORE *get1_current(CMPCLIENT_TRUST *trust)
+{
+    X509_STORE *store;
+
+    (void)pthread_mutex_lock(&trust->lock);
+    store = trust->current;
+    if (store != NULL && !X509_STORE_up_ref(store))
+        store = NULL;
+    (void)pthread_mutex_unlock(&trust->lock);
+    return store;
+}
+
+/* publishes store, consuming it */
+static void publish(CMPCLIENT_TRUST *trust, X509_STORE *store)
+{
+    X509_STORE *old;
+
+    (void)pthread_mutex_lock(&trust->lock);
+    old = trust->current;
+    trust->current = store;
+    (void)__atomic_add_fetch(&trust->generation, 1, __ATOMIC_RELEASE);
+    (void)pthread_mutex_unlock(&trust->lock);
+    X509_STORE_free(old); /* contexts and SSL objects may still hold it */
+}
+
+int CMPclient_trust_reload(CMPCLIENT_TRUST *trust, bool force)
+{
+    TRUST_SOURCE sources[TRUST_MAX_SOURCES];
+    X509_STORE *store;
+    int n, res = -1;
+
+    if (trust == NULL) {
+        LOG(FL_ERR, "No trust parameter given");
+        return -1;
+    }
+    (void)pthread_mutex_lock(&trust->reload_lock);
+    if ((n = stat_sources(trust->files, sources)) < 0) {
+        LOG(FL_ERR, "More than %d sources of %s", TRUST_MAX_SOURCES,
+            trust->desc);
+        goto end;
+    }
+    if (!force && trust->current != NULL && n == trust->num_sources
+        && memcmp(sources, trust->sources, (size_t)n * sizeof(*sources)) == 0) {
+        res = 0;
+        goto end;
+    }
+    /* the next change is worth a try also if this one cannot be loaded */
+    memcpy(trust->sources, sources, (size_t)n * sizeof(*sources));
+    trust->num_sources = n;
+
+    if ((store = STORE_load(trust->files, trust->desc, NULL)) == NULL)
+        goto fail;
+    /* most likely a file truncated while being rewritten */
+    if (sk_X509_OBJECT_num(X509_STORE_get0_objects(store)) <= 0) {
+        LOG(FL_ERR, "No certs in %s", trust->desc);
+        X509_STORE_free(store);
+        goto fail;
+    }
+    (void)__atomic_add_fetch(&trust->refs, 1, __ATOMIC_RELAXED);
+    if (!X509_STORE_set_ex_data(store, trust_index, trust)) {
+        trust_unref(trust); /* not the last reference */
+        X509_STORE_free(store);
+        goto fail;
+    }
+    if (trust->setup_fn != NULL
+        && !(*trust->setup_fn)(store, trust->setup_arg)) {
+        X509_STORE_free(store);
+        goto fail;
+    }
+    if (__atomic_load_n(&trust->new_cert_use, __ATOMIC_ACQUIRE))
+        X509_VERIFY_PARAM_clear_flags(X509_STORE_get0_param(store),
+                                      X509_V_FLAG_USE_CHECK_TIME);
+    publish(trust, store);
+    LOG(FL_INFO, "Loaded %s, generation %lu", trust->desc,
+        CMPclient_trust_generation(trust));
+    res = 1;
+    goto end;
+
+ fail:
+    if (trust->current != NULL)
+        LOG(FL_WARN, "Cannot reload %s, keeping previous contents",
+            trust->desc);
+ end:
+    (void)pthread_mutex_unlock(&trust->reload_lock);
+    return res;
+}
+
+static void *watch(void *arg)
+{
+    CMPCLIENT_TRUST *trust = arg;
+    struct timespec ts;
+
+    (void)pthread_mutex_lock(&trust->stop_lock);
+    while (!trust->stopping) {
+        (void)clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += trust->interval;
+        if (pthread_cond_timedwait(&trust->stop_cond, &trust->stop_lock,
+                                   &ts) != ETIMEDOUT)
+            continue;
+        (void)pthread_mutex_unlock(&trust->stop_lock);
+        (void)CMPclient_trust_reload(trust, false);
+        (void)pthread_mutex_lock(&trust->stop_lock);
+    }
+    (void)pthread_mutex_unlock(&trust->stop_lock);
+    return NULL;
+}
+
+CMPCLIENT_TRUST *CMPclient_trust_new(const char *files,
+                                     OPTIONAL const char *desc,
+                                     OPTIONAL CMPclient_trust_setup_cb_t setup_fn,
+                                     OPTIONAL void *setup_arg,
+                                     int interval)
+{
+    CMPCLIENT_TRUST *trust;
+
+    if (files == NULL) {
+        LOG(FL_ERR, "No files parameter given");
+        return NULL;
+    }
+    (void)pthread_once(&trust_once, trust_init);
+    if (trust_index < 0
+        || (trust = OPENSSL_zalloc(sizeof(*trust))) == NULL)
+        return NULL;
+    if ((trust->files = OPENSSL_strdup(files)) == NULL
+        || (trust->desc = OPENSSL_strdup(desc != NULL ? desc
+                                         : "trusted certs")) == NULL) {
+        OPENSSL_free(trust->files);
+        OPENSSL_free(trust);
+        return NULL;
+    }
+    trust->refs = 1;
+    trust->setup_fn = setup_fn;
+    trust->setup_arg = setup_arg;
+    trust->interval = interval < 0 ? TRUST_DEFAULT_INTERVAL : interval;
+    (void)pthread_mutex_init(&trust->reload_lock, NULL);
+    (void)pthread_mutex_init(&trust->lock, NULL);
+    (void)pthread_mutex_init(&trust->stop_lock, NULL);
+    (void)pthread_cond_init(&trust->stop_cond, NULL);
+
+    if (CMPclient_trust_reload(trust, true) != 1)
+        goto err;
+    if (trust->interval > 0) {
+        if (pthread_create(&trust->watcher, NULL, watch, trust) != 0) {
+            LOG(FL_ERR, "Cannot start thread watching %s", trust->desc);
+            goto err;
+        }
+        trust->watching = true;
+    }
+    return trust;
+
+ err:
+    CMPclient_trust_free(trust);
+    return NULL;
+}
+
+void CMPclient_trust_free(OPTIONAL CMPCLIENT_TRUST *trust)
+{
+    X509_STORE *store;
+
+    if (trust == NULL)
+        return;
+    if (trust->watching) {
+        (void)pthread_mutex_lock(&trust->stop_lock);
+        trust->stopping = true;
+        (void)pthread_cond_signal(&trust->stop_cond);
+        (void)pthread_mutex_unlock(&trust->stop_lock);
+        (void)pthread_join(trust->watcher, NULL);
+    }
+
+    /* snapshots held elsewhere stay valid, yet are no more refreshed */
+    (void)pthread_mutex_lock(&trust->lock);
+    store = trust->current;
+    trust->current = NULL;
+    (void)pthread_mutex_unlock(&trust->lock);
+    X509_STORE_free(store);
+    trust_unref(trust);
+}
+
+X509_STORE *CMPclient_trust_get1(CMPCLIENT_TRUST *trust)
+{
+    X509_STORE *store;
+
+    if (trust == NULL) {
+        LOG(FL_ERR, "No trust parameter given");
+        return NULL;
+    }
+    if ((store = get1_current(trust)) == NULL)
+        LOG(FL_ERR, "No current snapshot of %s", trust->desc);
+    return store;
+}
+
+unsigned long CMPclient_trust_generation(const CMPCLIENT_TRUST *trust)
+{
+    return trust == NULL ? 0
+        : __atomic_load_n(&trust->generation, __ATOMIC_ACQUIRE);
+}
+
+#ifndef SECUTILS_NO_TLS
+CMP_err CMPclient_trust_attach_TLS(CMPCLIENT_TRUST *trust, SSL_CTX *tls)
+{
+    CMPCLIENT_TRUST *old;
+
+    if (trust == NULL || tls == NULL) {
+        LOG(FL_ERR, "No trust or tls parameter given");
+        return CMP_R_NULL_ARGUMENT;
+    }
+    if (trust_tls_index < 0)
+        return CMP_R_OTHER_LIB_ERR;
+    old = SSL_CTX_get_ex_data(tls, trust_tls_index);
+    (void)__atomic_add_fetch(&trust->refs, 1, __ATOMIC_RELAXED);
+    if (!SSL_CTX_set_ex_data(tls, trust_tls_index, trust)) {
+        trust_unref(trust); /* not the last reference */
+        return CMP_R_OTHER_LIB_ERR;
+    }
+    if (old != NULL)
+        trust_unref(old);
+    return CMP_OK;
+}
+
+bool CMPclient_trust_apply_TLS(SSL *ssl)
+{
+    CMPCLIENT_TRUST *trust;
+    X509_STORE *store;
+    bool ok;
+
+    if (trust_tls_index < 0
+        || (trust = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl),
+                                        trust_tls_index)) == NULL)
+        return true; /* no trust store attached */
+    if ((store = get1_current(trust)) == NULL) {
+        LOG(FL_ERR, "%s attached to TLS has been freed", trust->desc);
+        return false;
+    }
+    ok = SSL_set1_verify_cert_store(ssl, store) != 0;
+    X509_STORE_free(store);
+    return ok;
+}
+#endif
+
+static bool check_time_set(X509_STORE *store)
+{
+    return (X509_VERIFY_PARAM_get_flags(X509_STORE_get0_param(store))
+            & X509_V_FLAG_USE_CHECK_TIME) != 0;
+}
+
+X509_STORE *CMPclient_trust_get1_new_cert_store(X509_STORE *store)
+{
+    CMPCLIENT_TRUST *trust = trust_of(store);
+    X509_STORE *current;
+
+    if (trust == NULL) {
+        X509_VERIFY_PARAM_clear_flags(X509_STORE_get0_param(store),
+                                      X509_V_FLAG_USE_CHECK_TIME);
+        return X509_STORE_up_ref(store) ? store : NULL;
+    }
+    /* from now on, reloads publish snapshots without verification time */
+    __atomic_store_n(&trust->new_cert_use, true, __ATOMIC_RELEASE);
+    if (!check_time_set(store))
+        return X509_STORE_up_ref(store) ? store : NULL;
+
+    if ((current = get1_current(trust)) != NULL && check_time_set(current)) {
+        X509_STORE_free(current);
+        current = CMPclient_trust_reload(trust, true) == 1
+            ? get1_current(trust) : NULL;
+    }
+    if (current == NULL)
+        LOG(FL_ERR, "Cannot get %s without verification time", trust->desc);
+    return current;
+}
+
+/*
+ * yields in *current a new reference to the snapshot store is outdated by.
+ * The handle is kept alive by the reference that store holds to it.
+ */
+static bool refresh(X509_STORE *store, X509_STORE **current)
+{
+    CMPCLIENT_TRUST *trust = trust_of(store);
+    bool ok = true;
+
+    *current = NULL;
+    if (trust == NULL)
+        return true;
+    (void)pthread_mutex_lock(&trust->lock);
+    if (trust->current != NULL && trust->current != store) {
+        if (X509_STORE_up_ref(trust->current))
+            *current = trust->current;
+        else
+            ok = false;
+    }
+    (void)pthread_mutex_unlock(&trust->lock);
+    return ok;
+}
+
+bool CMPclient_trust_refresh(CMP_CTX *ctx)
+{
+    X509_STORE *store, *current;
+
+    if (ctx == NULL) {
+        LOG(FL_ERR, "No ctx parameter given");
+        return false;
+    }
+    store = OSSL_CMP_CTX_get0_trustedStore(ctx);
+    if (!refresh(store, &current))
+        return false;
+    if (current != NULL && !OSSL_CMP_CTX_set0_trustedStore(ctx, current)) {
+        X509_STORE_free(current);
+        return false;
+    }
+
+    store = OSSL_CMP_CTX_get_certConf_cb_arg(ctx);
+    if (!refresh(store, &current))
+        return false;
+    if (current != NULL) {
+        if (!OSSL_CMP_CTX_set_certConf_cb_arg(ctx, current)) {
+            X509_STORE_free(current);
+            return false;
+        }
+        X509_STORE_free(store);
+    }
+    return true;
+}
+
+#else /* GENCMP_NO_TRUST */
+
+CMPCLIENT_TRUST *CMPclient_trust_new(const char *files,
+                                     OPTIONAL const char *desc,
+                                     OPTIONAL CMPclient_trust_setup_cb_t setup_fn,
+                                     OPTIONAL void *setup_arg,
+                                     int interval)
+{
+    (void)files;
+    (void)desc;
+    (void)setup_fn;
+    (void)setup_arg;
+    (void)interval;
+    LOG(FL_ERR, "Reloadable trust stores are not supported by this build");
+    return NULL;
+}
+
+void CMPclient_trust_free(OPTIONAL CMPCLIENT_TRUST *trust)
+{
+    (void)trust;
+}
+
+X509_STORE *CMPclient_trust_get1(CMPCLIENT_TRUST *trust)
+{
+    (void)trust;
+    return NULL;
+}
+
+unsigned long CMPclient_trust_generation(const CMPCLIENT_TRUST *trust)
+{
+    (void)trust;
+    return 0;
+}
+
+int CMPclient_trust_reload(CMPCLIENT_TRUST *trust, bool force)
+{
+    (void)trust;
+    (void)force;
+    return -1;
+}
+
+X509_STORE *CMPclient_trust_get1_new_cert_store(X509_STORE *store)
+{
+    X509_VERIFY_PARAM_clear_flags(X509_STORE_get0_param(store),
+                                  X509_V_FLAG_USE_CHECK_TIME);
+    return X509_STORE_up_ref(store) ? store : NULL;
+}
+
+#ifndef SECUTILS_NO_TLS
+CMP_err CMPclient_trust_attach_TLS(CMPCLIENT_TRUST *trust, SSL_CTX *tls)
+{
+    (void)trust;
+    (void)tls;
+    LOG(FL_ERR, "Reloadable trust stores are not supported by this build");
+    return CMP_R_INVALID_PARAMETERS;
+}
+
+bool CMPclient_trust_apply_TLS(SSL *ssl)
+{
+    (void)ssl;
+    return true;
+}
+#endif
+
+/* without reloadable trust stores, there is nothing to pick up */
+bool CMPclient_trust_refresh(CMP_CTX *ctx)
+{
+    (void)ctx;
+    return true;
+}
+
+#endif
@@ -0,0 +1,477 @@
+/*-
+ * @file   mockCA.c
+ * @brief  minimal CMP mock CA based on OSSL_CMP_SRV_CTX, for tests and benchmarks
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "mockCA.h"
+
+#include <openssl/cmperr.h>
+#include <openssl/err.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * An OSSL_CMP_SRV_CTX keeps the state of one transaction at a time,
+ * so all messages of a transaction must be handled by the same one.
+ * For serving transactions in parallel, a number of slots is kept,
+ * each with its own OSSL_CMP_SRV_CTX bound to the transactionID in progress.
+ */
+/* not exported by OpenSSL */
+#define MOCK_PKIBODY_RP      12 /* OSSL_CMP_PKIBODY_RP */
+#define MOCK_PKIBODY_PKICONF 19 /* OSSL_CMP_PKIBODY_PKICONF */
+#define MOCK_PKIBODY_GENP    22 /* OSSL_CMP_PKIBODY_GENP */
+#define MOCK_PKIBODY_ERROR   23 /* OSSL_CMP_PKIBODY_ERROR */
+
+typedef struct mock_slot_st {
+    MOCK_CA *ca;
+    OSSL_CMP_SRV_CTX *srv_ctx;
+    ASN1_OCTET_STRING *tid; /* transaction in progress, or NULL */
+    bool busy;
+    unsigned long last_used;
+    OSSL_CMP_MSG *certReq; /* saved while polling */
+    int curr_pollCount;
+} MOCK_SLOT;
+
+struct mock_ca_st {
+    MOCK_CA_OPTS opts;
+    OSSL_CMP_PKISI *status; /* to be returned on success */
+    int num_slots;
+    MOCK_SLOT *slots;
+    unsigned long use_count;
+    OSSL_CRMF_CERTTEMPLATE *last_tmpl; /* of the most recent CRMF request */
+    pthread_mutex_t lock;
+    pthread_cond_t slot_free;
+};
+
+static OSSL_CMP_PKISI *process_cert_request(OSSL_CMP_SRV_CTX *srv_ctx,
+                                            const OSSL_CMP_MSG *cert_req,
+                                            ossl_unused int certReqId,
+                                            const OSSL_CRMF_MSG *crm,
+                                            ossl_unused const X509_REQ *p10cr,
+                                            X509 **certOut,
+                                            STACK_OF(X509) **chainOut,
+                                            STACK_OF(X509) **caPubs)
+{
+    MOCK_SLOT *slot = OSSL_CMP_SRV_CTX_get0_custom_ctx(srv_ctx);
+    const MOCK_CA_OPTS *opts = &slot->ca->opts;
+
+    *certOut = NULL;
+    *chainOut = NULL;
+    *caPubs = NULL;
+
+    if (opts->poll_count > 0 && slot->curr_pollCount == 0) {
+        /* start polling */
+        if (slot->certReq != NULL) {
+            ERR_raise(ERR_LIB_CMP, CMP_R_UNEXPECTED_PKIBODY);
+            return NULL;
+        }
+        if ((slot->certReq = OSSL_CMP_MSG_dup(cert_req)) == NULL)
+            return NULL;
+        return OSSL_CMP_STATUSINFO_new(OSSL_CMP_PKISTATUS_waiting, 0, NULL);
+    }
+    if (slot->curr_pollCount >= opts->poll_count)
+        slot->curr_pollCount = 0; /* give final response after polling */
+
+    if (crm != NULL) {
+        OSSL_CRMF_CERTTEMPLATE *tmpl =
+            ASN1_item_dup(ASN1_ITEM_rptr(OSSL_CRMF_CERTTEMPLATE),
+                          OSSL_CRMF_MSG_get0_tmpl(crm));
+
+        if (tmpl == NULL)
+            return NULL;
+        (void)pthread_mutex_lock(&slot->ca->lock);
+        OSSL_CRMF_CERTTEMPLATE_free(slot->ca->last_tmpl);
+        slot->ca->last_tmpl = tmpl;
+        (void)pthread_mutex_unlock(&slot->ca->lock);
+    }
+
+    if (OSSL_CMP_MSG_get_bodytype(cert_req) == OSSL_CMP_KUR
+        && crm != NULL && opts->ref_cert != NULL) {
+        const OSSL_CRMF_CERTID *cid = OSSL_CRMF_MSG_get0_regCtrl_oldCertID(crm);
+
+        if (cid == NULL) {
+            ERR_raise(ERR_LIB_CMP, CMP_R_MISSING_CERTID);
+            return NULL;
+        }
+        if (X509_NAME_cmp(OSSL_CRMF_CERTID_get0_issuer(cid),
+                          X509_get_issuer_name(opts->ref_cert)) != 0
+            || ASN1_INTEGER_cmp(OSSL_CRMF_CERTID_get0_serialNumber(cid),
+                                X509_get0_serialNumber(opts->ref_cert)) != 0) {
+            ERR_raise(ERR_LIB_CMP, CMP_R_WRONG_CERTID);
+            return NULL;
+        }
+    }
+
+    if (opts->rsp_cert != NULL && (*certOut = X509_dup(opts->rsp_cert)) == NULL)
+        goto err;
+    if (opts->rsp_extracerts != NULL
+        && (*chainOut = X509_chain_up_ref(opts->rsp_extracerts)) == NULL)
+        goto err;
+    if (opts->rsp_capubs != NULL
+        && (*caPubs = X509_chain_up_ref(opts->rsp_capubs)) == NULL)
+        goto err;
+    return OSSL_CMP_PKISI_dup(slot->ca->status);
+
+ err:
+    X509_free(*certOut);
+    *certOut = NULL;
+    sk_X509_pop_free(*chainOut, X509_free);
+    *chainOut = NULL;
+    sk_X509_pop_free(*caPubs, X509_free);
+    *caPubs = NULL;
+    return NULL;
+}
+
+static OSSL_CMP_PKISI *process_rr(OSSL_CMP_SRV_CTX *srv_ctx,
+                                  ossl_unused const OSSL_CMP_MSG *rr,
+                                  const X509_NAME *issuer,
+                                  const ASN1_INTEGER *serial)
+{
+    MOCK_SLOT *slot = OSSL_CMP_SRV_CTX_get0_custom_ctx(srv_ctx);
+    const X509 *ref_cert = slot->ca->opts.ref_cert;
+
+    if (ref_cert == NULL) {
+        ERR_raise(ERR_LIB_CMP, CMP_R_NULL_ARGUMENT);
+        return NULL;
+    }
+    /* accept any rr derived from CSR, which may lack issuer and serial */
+    if (issuer != NULL && serial != NULL
+        && (X509_NAME_cmp(issuer, X509_get_issuer_name(ref_cert)) != 0
+            || ASN1_INTEGER_cmp(serial, X509_get0_serialNumber(ref_cert)) != 0)) {
+        ERR_raise(ERR_LIB_CMP, CMP_R_REQUEST_NOT_ACCEPTED);
+        return NULL;
+    }
+    return OSSL_CMP_PKISI_dup(slot->ca->status);
+}
+
+static int process_genm(OSSL_CMP_SRV_CTX *srv_ctx,
+                        ossl_unused const OSSL_CMP_MSG *genm,
+                        const STACK_OF(OSSL_CMP_ITAV) *in,
+                        STACK_OF(OSSL_CMP_ITAV) **out)
+{
+#if OPENSSL_VERSION_NUMBER > 0x30200000L || defined USE_LIBCMP
+    MOCK_SLOT *slot = OSSL_CMP_SRV_CTX_get0_custom_ctx(srv_ctx);
+
+    if (sk_OSSL_CMP_ITAV_num(in) == 1
+        && OBJ_obj2nid(OSSL_CMP_ITAV_get0_type(sk_OSSL_CMP_ITAV_value(in, 0)))
+        == NID_id_it_caCerts) {
+        OSSL_CMP_ITAV *rsp = OSSL_CMP_ITAV_new_caCerts(slot->ca->opts.rsp_capubs);
+
+        if (rsp == NULL || (*out = sk_OSSL_CMP_ITAV_new_reserve(NULL, 1)) == NULL) {
+            OSSL_CMP_ITAV_free(rsp);
+            return 0;
+        }
+        (void)sk_OSSL_CMP_ITAV_push(*out, rsp);
+        return 1;
+    }
+#else
+    (void)srv_ctx;
+#endif
+    *out = sk_OSSL_CMP_ITAV_deep_copy(in, OSSL_CMP_ITAV_dup, OSSL_CMP_ITAV_free);
+    return *out != NULL;
+}
+
+static void process_error(ossl_unused OSSL_CMP_SRV_CTX *srv_ctx,
+                          ossl_unused const OSSL_CMP_MSG *error,
+                          const OSSL_CMP_PKISI *statusInfo,
+                          ossl_unused const ASN1_INTEGER *errorCode,
+                          ossl_unused const OSSL_CMP_PKIFREETEXT *errorDetails)
+{
+    LOG(FL_INFO, "mock CA got error message with %s status",
+        statusInfo != NULL ? "some" : "no");
+}
+
+static int process_certConf(OSSL_CMP_SRV_CTX *srv_ctx,
+                            ossl_unused const OSSL_CMP_MSG *certConf,
+                            ossl_unused int certReqId,
+                            const ASN1_OCTET_STRING *certHash,
+                            ossl_unused const OSSL_CMP_PKISI *si)
+{
+    MOCK_SLOT *slot = OSSL_CMP_SRV_CTX_get0_custom_ctx(srv_ctx);
+    ASN1_OCTET_STRING *digest;
+    int ok;
+
+    if (slot->ca->opts.rsp_cert == NULL) {
+        ERR_raise(ERR_LIB_CMP, CMP_R_NULL_ARGUMENT);
+        return 0;
+    }
+    if ((digest = X509_digest_sig(slot->ca->opts.rsp_cert, NULL, NULL)) == NULL)
+        return 0;
+    ok = ASN1_OCTET_STRING_cmp(certHash, digest) == 0;
+    ASN1_OCTET_STRING_free(digest);
+    if (!ok)
+        ERR_raise(ERR_LIB_CMP, CMP_R_CERTHASH_UNMATCHED);
+    return ok;
+}
+
+static int process_pollReq(OSSL_CMP_SRV_CTX *srv_ctx,
+                           ossl_unused const OSSL_CMP_MSG *pollReq,
+                           ossl_unused int certReqId,
+                           OSSL_CMP_MSG **certReq, int64_t *check_after)
+{
+    MOCK_SLOT *slot = OSSL_CMP_SRV_CTX_get0_custom_ctx(srv_ctx);
+
+    if (slot->certReq == NULL) { /* not currently in polling mode */
+        *certReq = NULL;
+        ERR_raise(ERR_LIB_CMP, CMP_R_UNEXPECTED_PKIBODY);
+        return 0;
+    }
+    if (++slot->curr_pollCount >= slot->ca->opts.poll_count) {
+        *certReq = slot->certReq; /* end polling */
+        slot->certReq = NULL;
+        *check_after = 0;
+    } else {
+        *certReq = NULL;
+        *check_after = slot->ca->opts.check_after;
+    }
+    return 1;
+}
+
+static bool setup_slot(MOCK_SLOT *slot, MOCK_CA *ca,
+                       OSSL_LIB_CTX *libctx, const char *propq)
+{
+    const MOCK_CA_OPTS *opts = &ca->opts;
+    OSSL_CMP_CTX *ctx;
+
+    slot->ca = ca;
+    if ((slot->srv_ctx = OSSL_CMP_SRV_CTX_new(libctx, propq)) == NULL
+        || !OSSL_CMP_SRV_CTX_init(slot->srv_ctx, slot, process_cert_request,
+                                  process_rr, process_genm, process_error,
+                                  process_certConf, process_pollReq))
+        return false;
+    ctx = OSSL_CMP_SRV_CTX_get0_cmp_ctx(slot->srv_ctx);
+    if (!OSSL_CMP_CTX_set_log_cb(ctx, opts->log_cb != NULL
+                                 ? (OSSL_CMP_log_cb_t)opts->log_cb
+                                 : (OSSL_CMP_log_cb_t)LOG_console)
+        || !OSSL_CMP_CTX_set_log_verbosity(ctx, opts->verbosity))
+        return false;
+
+    if (opts->srv_secret != NULL
+        && !OSSL_CMP_CTX_set1_secretValue(ctx,
+                                          (const unsigned char *)opts->srv_secret,
+                                          (int)strlen(opts->srv_secret)))
+        return false;
+    if (opts->digest != NULL
+        && !OSSL_CMP_CTX_set_option(ctx, OSSL_CMP_OPT_DIGEST_ALGNID,
+                                    OBJ_ln2nid(opts->digest)))
+        return false;
+    if (opts->mac != NULL
+        && !OSSL_CMP_CTX_set_option(ctx, OSSL_CMP_OPT_MAC_ALGNID,
+                                    OBJ_ln2nid(opts->mac)))
+        return false;
+    if (opts->srv_cert != NULL && !OSSL_CMP_CTX_set1_cert(ctx, opts->srv_cert))
+        return false;
+    if (opts->srv_key != NULL && !OSSL_CMP_CTX_set1_pkey(ctx, opts->srv_key))
+        return false;
+    if (opts->srv_trusted != NULL
+        && (!X509_STORE_up_ref(opts->srv_trusted)
+            || !OSSL_CMP_CTX_set0_trustedStore(ctx, opts->srv_trusted)))
+        return false;
+    if (opts->srv_untrusted != NULL
+        && !OSSL_CMP_CTX_set1_untrusted(ctx, opts->srv_untrusted))
+        return false;
+#ifdef OSSL_CMP_OPT_NO_CACHE_EXTRACERTS
+    if (!OSSL_CMP_CTX_set_option(ctx, OSSL_CMP_OPT_NO_CACHE_EXTRACERTS,
+                                 opts->no_cache_extracerts))
+        return false;
+#endif
+
+    return OSSL_CMP_SRV_CTX_set_send_unprotected_errors(slot->srv_ctx,
+                                                        opts->send_unprotected_errors)
+        && OSSL_CMP_SRV_CTX_set_accept_unprotected(slot->srv_ctx,
+                                                   opts->accept_unprotected)
+        && OSSL_CMP_SRV_CTX_set_accept_raverified(slot->srv_ctx,
+                                                  opts->accept_raverified)
+        && OSSL_CMP_SRV_CTX_set_grant_implicit_confirm(slot->srv_ctx,
+                                                       opts->grant_implicit_confirm);
+}
+
+MOCK_CA *MOCK_CA_new(OPTIONAL OSSL_LIB_CTX *libctx, OPTIONAL const char *propq,
+                     const MOCK_CA_OPTS *opts, int slots)
+{
+    MOCK_CA *ca;
+    int i;
+
+    if (opts == NULL)
+        return NULL;
+    if (slots <= 0)
+        slots = 1;
+    if ((ca = OPENSSL_zalloc(sizeof(*ca))) == NULL)
+        return NULL;
+    ca->opts = *opts;
+    if (opts->no_check_time && opts->srv_trusted != NULL)
+        X509_VERIFY_PARAM_set_flags(X509_STORE_get0_param(opts->srv_trusted),
+                                    X509_V_FLAG_NO_CHECK_TIME);
+    (void)pthread_mutex_init(&ca->lock, NULL);
+    (void)pthread_cond_init(&ca->slot_free, NULL);
+    if ((ca->status = OSSL_CMP_STATUSINFO_new(OSSL_CMP_PKISTATUS_accepted,
+                                              0, NULL)) == NULL
+        || (ca->slots = OPENSSL_zalloc((size_t)slots * sizeof(*ca->slots))) == NULL)
+        goto err;
+    ca->num_slots = slots;
+    for (i = 0; i < slots; i++)
+        if (!setup_slot(&ca->slots[i], ca, libctx, propq))
+            goto err;
+    return ca;
+
+ err:
+    LOG(FL_ERR, "cannot set up mock CA");
+    MOCK_CA_free(ca);
+    return NULL;
+}
+
+void MOCK_CA_free(OPTIONAL MOCK_CA *ca)
+{
+    int i;
+
+    if (ca == NULL)
+        return;
+    for (i = 0; ca->slots != NULL && i < ca->num_slots; i++) {
+        OSSL_CMP_SRV_CTX_free(ca->slots[i].srv_ctx);
+        ASN1_OCTET_STRING_free(ca->slots[i].tid);
+        OSSL_CMP_MSG_free(ca->slots[i].certReq);
+    }
+    OPENSSL_free(ca->slots);
+    OSSL_CMP_PKISI_free(ca->status);
+    OSSL_CRMF_CERTTEMPLATE_free(ca->last_tmpl);
+    (void)pthread_cond_destroy(&ca->slot_free);
+    (void)pthread_mutex_destroy(&ca->lock);
+    OPENSSL_free(ca);
+}
+
+OSSL_CRMF_CERTTEMPLATE *MOCK_CA_get1_last_template(MOCK_CA *ca)
+{
+    OSSL_CRMF_CERTTEMPLATE *tmpl = NULL;
+
+    (void)pthread_mutex_lock(&ca->lock);
+    if (ca->last_tmpl != NULL)
+        tmpl = ASN1_item_dup(ASN1_ITEM_rptr(OSSL_CRMF_CERTTEMPLATE),
+                             ca->last_tmpl);
+    (void)pthread_mutex_unlock(&ca->lock);
+    return tmpl;
+}
+
+/* called with ca->lock held */
+static MOCK_SLOT *find_slot(MOCK_CA *ca, const ASN1_OCTET_STRING *tid)
+{
+    MOCK_SLOT *lru = NULL;
+    int i;
+
+    for (i = 0; i < ca->num_slots; i++) {
+        MOCK_SLOT *slot = &ca->slots[i];
+
+        if (tid != NULL && slot->tid != NULL
+            && ASN1_OCTET_STRING_cmp(tid, slot->tid) == 0)
+            return slot->busy ? NULL : slot;
+        if (!slot->busy && (lru == NULL
+                            || (slot->tid == NULL && lru->tid != NULL)
+                            || ((slot->tid == NULL) == (lru->tid == NULL)
+                                && slot->last_used < lru->last_used)))
+            lru = slot;
+    }
+    if (lru != NULL && lru->tid != NULL) { /* take over stale transaction */
+        ASN1_OCTET_STRING_free(lru->tid);
+        lru->tid = NULL;
+        OSSL_CMP_MSG_free(lru->certReq);
+        lru->certReq = NULL;
+        lru->curr_pollCount = 0;
+    }
+    return lru;
+}
+
+static bool is_final_rsp(const OSSL_CMP_MSG *rsp)
+{
+    switch (OSSL_CMP_MSG_get_bodytype(rsp)) {
+    case MOCK_PKIBODY_PKICONF:
+    case MOCK_PKIBODY_RP:
+    case MOCK_PKIBODY_GENP:
+    case MOCK_PKIBODY_ERROR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+OSSL_CMP_MSG *MOCK_CA_process(MOCK_CA *ca, const OSSL_CMP_MSG *req)
+{
+    const ASN1_OCTET_STRING *tid;
+    MOCK_SLOT *slot;
+    OSSL_CMP_MSG *rsp;
+
+    if (ca == NULL || req == NULL) {
+        ERR_raise(ERR_LIB_CMP, CMP_R_NULL_ARGUMENT);
+        return NULL;
+    }
+    tid = OSSL_CMP_HDR_get0_transactionID(OSSL_CMP_MSG_get0_header(req));
+
+    (void)pthread_mutex_lock(&ca->lock);
+    while ((slot = find_slot(ca, tid)) == NULL)
+        (void)pthread_cond_wait(&ca->slot_free, &ca->lock);
+    slot->busy = true;
+    if (slot->tid == NULL && tid != NULL)
+        slot->tid = ASN1_OCTET_STRING_dup(tid);
+    (void)pthread_mutex_unlock(&ca->lock);
+
+    rsp = OSSL_CMP_SRV_process_request(slot->srv_ctx, req);
+
+    (void)pthread_mutex_lock(&ca->lock);
+    slot->busy = false;
+    slot->last_used = ++ca->use_count;
+    if (rsp == NULL || is_final_rsp(rsp)) {
+        ASN1_OCTET_STRING_free(slot->tid);
+        slot->tid = NULL;
+    }
+    (void)pthread_cond_broadcast(&ca->slot_free);
+    (void)pthread_mutex_unlock(&ca->lock);
+
+    if (ca->opts.delay_ms > 0) {
+        struct timespec ts;
+
+        ts.tv_sec = ca->opts.delay_ms / 1000;
+        ts.tv_nsec = (ca->opts.delay_ms % 1000) * 1000000L;
+        (void)nanosleep(&ts, NULL);
+    }
+    return rsp;
+}
+
+OSSL_CMP_MSG *MOCK_CA_transfer_cb(OSSL_CMP_CTX *ctx, const OSSL_CMP_MSG *req)
+{
+    MOCK_CA *ca = OSSL_CMP_CTX_get_transfer_cb_arg(ctx);
+    unsigned char *der = NULL;
+    const unsigned char *p;
+    OSSL_CMP_MSG *srv_req, *srv_rsp, *rsp = NULL;
+    int len;
+
+    if ((len = i2d_OSSL_CMP_MSG(req, &der)) <= 0)
+        return NULL;
+    p = der;
+    srv_req = d2i_OSSL_CMP_MSG(NULL, &p, len);
+    OPENSSL_free(der);
+    if (srv_req == NULL)
+        return NULL;
+
+    srv_rsp = MOCK_CA_process(ca, srv_req);
+    OSSL_CMP_MSG_free(srv_req);
+    if (srv_rsp == NULL)
+        return NULL;
+
+    der = NULL;
+    if ((len = i2d_OSSL_CMP_MSG(srv_rsp, &der)) > 0) {
+        p = der;
+        rsp = d2i_OSSL_CMP_MSG(NULL, &p, len);
+    }
+    OPENSSL_free(der);
+    OSSL_CMP_MSG_free(srv_rsp);
+    return rsp;
+}
@@ -0,0 +1,75 @@
+/*-
+ * @file   mockCA.h
+ * @brief  minimal CMP mock CA based on OSSL_CMP_SRV_CTX, for tests and benchmarks
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef MOCK_CA_H
+# define MOCK_CA_H
+
+# include "genericCMPClient.h"
+
+/*
+ * The behavior mimics the mock server of the OpenSSL 'cmp' app:
+ * certificate requests are answered with a fixed certificate |rsp_cert|,
+ * kur and rr requests are checked against the reference cert |ref_cert|,
+ * and genm requests are answered by echoing the ITAVs, except for caCerts.
+ * All certs and keys given in the options are shared, not copied.
+ */
+typedef struct mock_ca_opts_st {
+    X509 *srv_cert; /* for signature-based protection of responses */
+    EVP_PKEY *srv_key;
+    const char *srv_secret; /* for PBM-based protection, takes precedence */
+    const char *digest; /* for protecting responses; NULL for default */
+    const char *mac; /* for PBM-based protection; NULL for default */
+    X509_STORE *srv_trusted; /* for verifying signature-based requests */
+    STACK_OF(X509) *srv_untrusted;
+    X509 *ref_cert;
+    X509 *rsp_cert;
+    STACK_OF(X509) *rsp_extracerts;
+    STACK_OF(X509) *rsp_capubs;
+    int poll_count; /* number of waiting responses before the final one */
+    int check_after; /* checkAfter value to send while polling */
+    int delay_ms; /* delay before each response is returned */
+    bool accept_unprotected;
+    bool accept_raverified;
+    bool grant_implicit_confirm;
+    bool send_unprotected_errors;
+    bool no_check_time;
+    bool no_cache_extracerts;
+    int verbosity;
+    LOG_cb_t log_cb; /* defaults to LOG_console */
+} MOCK_CA_OPTS;
+
+typedef struct mock_ca_st MOCK_CA;
+
+/* |slots| is the max number of transactions handled in parallel, default 1 */
+MOCK_CA *MOCK_CA_new(OPTIONAL OSSL_LIB_CTX *libctx, OPTIONAL const char *propq,
+                     const MOCK_CA_OPTS *opts, int slots);
+void MOCK_CA_free(OPTIONAL MOCK_CA *ca);
+
+/*
+ * returns a copy of the certTemplate of the most recent CRMF-based request,
+ * or NULL if there was none, for checking what a client actually requested
+ */
+OSSL_CRMF_CERTTEMPLATE *MOCK_CA_get1_last_template(MOCK_CA *ca);
+
+/* thread-safe; the result must be freed by the caller */
+OSSL_CMP_MSG *MOCK_CA_process(MOCK_CA *ca, const OSSL_CMP_MSG *req);
+
+/*
+ * transfer callback for in-process use by a CMP client, which expects the
+ * MOCK_CA as transfer_cb_arg. Messages are DER-encoded and decoded in order
+ * to exercise the same code paths as over the wire.
+ */
+OSSL_CMP_MSG *MOCK_CA_transfer_cb(OSSL_CMP_CTX *ctx, const OSSL_CMP_MSG *req);
+
+#endif /* MOCK_CA_H */
@@ -0,0 +1,310 @@
+/*-
+ * @file   mockOCSP.c
+ * @brief  in-process HTTP server and OCSP responder, for tests and benchmarks
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "mockOCSP.h"
+
+#include <openssl/x509v3.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MOCK_HTTP_BUF_SIZE 16384
+
+/* handles a single request per connection */
+static void http_serve(MOCK_HTTP *http, int fd)
+{
+    char buf[MOCK_HTTP_BUF_SIZE], hdr[128];
+    char *body = NULL, *clen;
+    long len = -1, have = 0, n;
+    unsigned char *der;
+    int hdr_len, der_len;
+
+    while (body == NULL || have < (body - buf) + len) {
+        if (have == (long)sizeof(buf) - 1
+            || (n = recv(fd, buf + have, sizeof(buf) - 1 - (size_t)have, 0))
+            <= 0)
+            return;
+        have += n;
+        buf[have] = '\0';
+        if (body == NULL && (body = strstr(buf, "\r\n\r\n")) != NULL) {
+            body += 4;
+            if ((clen = strstr(buf, "Content-Length:")) == NULL
+                || (len = strtol(clen + 15, NULL, 10)) <= 0)
+                return;
+        }
+    }
+    der = (*http->respond)(http->arg, (unsigned char *)body, len, &der_len);
+    if (der == NULL)
+        return;
+    hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+                       "Content-Type: %s\r\n"
+                       "Content-Length: %d\r\n\r\n", http->content_type,
+                       der_len);
+    if (send(fd, hdr, (size_t)hdr_len, 0) == hdr_len)
+        (void)send(fd, der, (size_t)der_len, 0);
+    OPENSSL_free(der);
+}
+
+static void *http_server(void *arg)
+{
+    MOCK_HTTP *http = arg;
+    int fd;
+
+    while ((fd = accept(http->fd, NULL, NULL)) >= 0) {
+        http_serve(http, fd);
+        (void)close(fd);
+    }
+    return NULL;
+}
+
+void MOCK_HTTP_stop(MOCK_HTTP *http)
+{
+    if (http->fd >= 0) {
+        (void)shutdown(http->fd, SHUT_RDWR); /* makes accept() return */
+        if (http->started)
+            (void)pthread_join(http->thread, NULL);
+        (void)close(http->fd);
+    }
+    http->fd = -1;
+    http->started = false;
+}
+
+bool MOCK_HTTP_start(MOCK_HTTP *http, MOCK_HTTP_respond_t respond, void *arg,
+                     const char *content_type)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    memset(http, 0, sizeof(*http));
+    http->respond = respond;
+    http->arg = arg;
+    http->content_type = content_type;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((http->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0
+        || bind(http->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(http->fd, 16) != 0
+        || getsockname(http->fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        MOCK_HTTP_stop(http);
+        return false;
+    }
+    http->port = ntohs(addr.sin_port);
+    http->started = pthread_create(&http->thread, NULL, http_server, http) == 0;
+    if (!http->started)
+        MOCK_HTTP_stop(http);
+    return http->started;
+}
+
+#if !defined(GENCMP_NO_CERTSTATUS) && !defined(OPENSSL_NO_OCSP)
+
+# define MOCK_OCSP_NAME_LEN 64
+
+static bool add_ext(X509 *cert, X509 *issuer, int nid, const char *value)
+{
+    X509V3_CTX v3ctx;
+    X509_EXTENSION *ext;
+    bool ok;
+
+    X509V3_set_ctx(&v3ctx, issuer, cert, NULL, NULL, 0);
+    if ((ext = X509V3_EXT_conf_nid(NULL, &v3ctx, nid, value)) == NULL)
+        return false;
+    ok = X509_add_ext(cert, ext, -1) != 0;
+    X509_EXTENSION_free(ext);
+    return ok;
+}
+
+/* issuer NULL means self-signed; ocsp_url NULL means OCSP signer */
+static X509 *new_cert(const char *name, const char *role, EVP_PKEY *key,
+                      X509 *issuer, EVP_PKEY *issuer_key, bool ca,
+                      const char *ocsp_url)
+{
+    static long serial = 0;
+    X509 *cert = X509_new();
+    X509_NAME *subject = X509_NAME_new();
+    char cn[MOCK_OCSP_NAME_LEN], aia[MOCK_OCSP_NAME_LEN];
+
+    snprintf(cn, sizeof(cn), "%s %s", name, role);
+    if (ocsp_url != NULL)
+        snprintf(aia, sizeof(aia), "OCSP;URI:%s", ocsp_url);
+    if (cert == NULL || subject == NULL
+        || !X509_set_version(cert, 2)
+        || !ASN1_INTEGER_set(X509_get_serialNumber(cert),
+                             __atomic_add_fetch(&serial, 1, __ATOMIC_RELAXED))
+        || !X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_ASC,
+                                       (const unsigned char *)cn, -1, -1, 0)
+        || !X509_set_subject_name(cert, subject)
+        || !X509_set_issuer_name(cert, issuer != NULL
+                                 ? X509_get_subject_name(issuer) : subject)
+        || X509_gmtime_adj(X509_getm_notBefore(cert), -3600) == NULL
+        || X509_gmtime_adj(X509_getm_notAfter(cert), 86400) == NULL
+        || !X509_set_pubkey(cert, key)
+        || !add_ext(cert, issuer != NULL ? issuer : cert,
+                    NID_basic_constraints, ca ? "critical,CA:TRUE" : "CA:FALSE")
+        || (ocsp_url != NULL && issuer != NULL
+            && !add_ext(cert, issuer, NID_info_access, aia))
+        || (ocsp_url == NULL
+            && !add_ext(cert, issuer, NID_ext_key_usage, "OCSPSigning"))
+        || X509_sign(cert, issuer_key != NULL ? issuer_key : key,
+                     EVP_sha256()) <= 0) {
+        X509_free(cert);
+        cert = NULL;
+    }
+    X509_NAME_free(subject);
+    return cert;
+}
+
+static unsigned char *ocsp_respond(void *arg, const unsigned char *der,
+                                   long len, int *rsp_len)
+{
+    MOCK_OCSP *mo = arg;
+    OCSP_REQUEST *req = d2i_OCSP_REQUEST(NULL, &der, len);
+    OCSP_BASICRESP *bs = OCSP_BASICRESP_new();
+    OCSP_RESPONSE *rsp = NULL;
+    unsigned char *rsp_der = NULL;
+    ASN1_TIME *thisupd = X509_gmtime_adj(NULL, 0);
+    ASN1_TIME *nextupd = X509_gmtime_adj(NULL, 86400);
+    bool no_next = __atomic_load_n(&mo->no_next_update, __ATOMIC_ACQUIRE);
+    X509 *signer = mo->rsp_cert;
+    EVP_PKEY *signer_key = mo->rsp_key;
+    int i, n;
+
+    if (req == NULL || bs == NULL || thisupd == NULL || nextupd == NULL)
+        goto end;
+    n = OCSP_request_onereq_count(req);
+    /* without a trusted responder, the issuer of the first CertID signs */
+    for (i = 1; signer == NULL && n > 0 && i < MOCK_OCSP_CHAIN_LEN; i++) {
+        OCSP_CERTID *id = OCSP_cert_to_id(NULL, mo->chain[i - 1], mo->chain[i]);
+        OCSP_ONEREQ *one = OCSP_request_onereq_get0(req, 0);
+
+        if (id != NULL
+            && OCSP_id_issuer_cmp(id, OCSP_onereq_get0_id(one)) == 0) {
+            signer = mo->chain[i];
+            signer_key = mo->keys[i];
+        }
+        OCSP_CERTID_free(id);
+    }
+    if (signer == NULL)
+        goto end;
+    for (i = 0; i < n; i++) {
+        OCSP_CERTID *id = OCSP_onereq_get0_id(OCSP_request_onereq_get0(req, i));
+        bool revoked = mo->revoked != NULL && OCSP_id_cmp(id, mo->revoked) == 0;
+
+        if (OCSP_basic_add1_status(bs, id, revoked ? V_OCSP_CERTSTATUS_REVOKED
+                                   : V_OCSP_CERTSTATUS_GOOD,
+                                   revoked ? OCSP_REVOKED_STATUS_KEYCOMPROMISE
+                                   : 0, revoked ? thisupd : NULL,
+                                   thisupd, no_next ? NULL : nextupd) == NULL)
+            goto end;
+    }
+    __atomic_store_n(&mo->last_ids, n, __ATOMIC_RELEASE);
+    if (OCSP_copy_nonce(bs, req) > 0
+        && OCSP_basic_sign(bs, signer, signer_key, EVP_sha256(), NULL, 0))
+        rsp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, bs);
+    if (rsp != NULL && (*rsp_len = i2d_OCSP_RESPONSE(rsp, &rsp_der)) > 0)
+        (void)__atomic_add_fetch(&mo->requests, 1, __ATOMIC_RELEASE);
+
+ end:
+    ASN1_TIME_free(thisupd);
+    ASN1_TIME_free(nextupd);
+    OCSP_BASICRESP_free(bs);
+    OCSP_REQUEST_free(req);
+    OCSP_RESPONSE_free(rsp);
+    return rsp_der;
+}
+
+void MOCK_OCSP_free(OPTIONAL MOCK_OCSP *mo)
+{
+    int i;
+
+    if (mo == NULL)
+        return;
+    MOCK_HTTP_stop(&mo->http);
+    for (i = 0; i < MOCK_OCSP_CHAIN_LEN; i++) {
+        X509_free(mo->chain[i]);
+        EVP_PKEY_free(mo->keys[i]);
+    }
+    X509_free(mo->rsp_cert);
+    EVP_PKEY_free(mo->rsp_key);
+    X509_STORE_free(mo->store);
+    sk_X509_free(mo->untrusted);
+    OCSP_CERTID_free(mo->revoked);
+    OPENSSL_free(mo);
+}
+
+MOCK_OCSP *MOCK_OCSP_new(const char *name, int max_ids, int revoked,
+                         bool trusted_rsp)
+{
+    static const char *const roles[MOCK_OCSP_CHAIN_LEN] =
+        { "leaf", "sub CA", "CA", "root" };
+    const int root = MOCK_OCSP_CHAIN_LEN - 1;
+    MOCK_OCSP *mo;
+    EVP_PKEY **keys;
+    char url[64];
+    int i;
+
+    if ((mo = OPENSSL_zalloc(sizeof(*mo))) == NULL)
+        return NULL;
+    keys = mo->keys;
+    mo->http.fd = -1;
+    if (!MOCK_HTTP_start(&mo->http, ocsp_respond, mo,
+                         "application/ocsp-response"))
+        goto err;
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/ocsp", mo->http.port);
+
+    for (i = 0; i <= root; i++)
+        if ((keys[i] = EVP_EC_gen("P-256")) == NULL)
+            goto err;
+    for (i = root; i >= 0; i--)
+        if ((mo->chain[i] =
+             new_cert(name, roles[i], keys[i],
+                      i == root ? NULL : mo->chain[i + 1],
+                      i == root ? NULL : keys[i + 1], i > 0, url)) == NULL)
+            goto err;
+    if (revoked >= 0
+        && (mo->revoked = OCSP_cert_to_id(NULL, mo->chain[revoked],
+                                          mo->chain[revoked + 1])) == NULL)
+        goto err;
+    if (trusted_rsp
+        && ((mo->rsp_key = EVP_EC_gen("P-256")) == NULL
+            || (mo->rsp_cert = new_cert(name, "responder", mo->rsp_key,
+                                        mo->chain[root], keys[root],
+                                        false, NULL)) == NULL
+            || !X509_add1_trust_object(mo->chain[root],
+                                       OBJ_nid2obj(NID_anyExtendedKeyUsage))
+            || !X509_add1_trust_object(mo->chain[root],
+                                       OBJ_nid2obj(NID_OCSP_sign))))
+        goto err;
+    if ((mo->store = X509_STORE_new()) == NULL
+        || !X509_STORE_add_cert(mo->store, mo->chain[root])
+        || !CMPclient_ocsp_multi(mo->store, true /* use_aia */, NULL,
+                                 -1 /* default timeout */, max_ids)
+        || (mo->untrusted = sk_X509_new_null()) == NULL)
+        goto err;
+    for (i = 1; i < root; i++)
+        if (!sk_X509_push(mo->untrusted, mo->chain[i]))
+            goto err;
+    return mo;
+
+ err:
+    MOCK_OCSP_free(mo);
+    return NULL;
+}
+
+#endif /* !defined(GENCMP_NO_CERTSTATUS) && !defined(OPENSSL_NO_OCSP) */
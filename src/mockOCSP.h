@@ -0,0 +1,84 @@
+/*-
+ * @file   mockOCSP.h
+ * @brief  in-process HTTP server and OCSP responder, for tests and benchmarks
+ *
+ * @author David von Oheimb, Siemens AG, David.von.Oheimb@siemens.com
+ *
+ *  Copyright (c) 2023 Siemens AG
+ *  Licensed under the Apache License 2.0 (the "License").
+ *  You may not use this file except in compliance with the License.
+ *  You can obtain a copy in the file LICENSE in the source distribution
+ *  or at https://www.openssl.org/source/license.html
+ *  SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef MOCK_OCSP_H
+# define MOCK_OCSP_H
+
+# include "genericCMPClient.h"
+
+# include <pthread.h>
+
+/* returns the DER-encoded response, to be freed with OPENSSL_free() */
+typedef unsigned char *(*MOCK_HTTP_respond_t)(void *arg,
+                                              const unsigned char *der,
+                                              long len, int *rsp_len);
+
+/*
+ * HTTP/1.0 server on loopback, run by a thread of its own, answering a single
+ * POST request per connection via |respond|. The port is chosen by the system.
+ */
+typedef struct mock_http_st {
+    MOCK_HTTP_respond_t respond;
+    void *arg;
+    const char *content_type; /* of the responses */
+    int port;
+    int fd;
+    pthread_t thread;
+    bool started;
+} MOCK_HTTP;
+
+bool MOCK_HTTP_start(MOCK_HTTP *http, MOCK_HTTP_respond_t respond, void *arg,
+                     const char *content_type);
+/* also fine after a failed MOCK_HTTP_start() or if only fd is set to -1 */
+void MOCK_HTTP_stop(MOCK_HTTP *http);
+
+# if !defined(GENCMP_NO_CERTSTATUS) && !defined(OPENSSL_NO_OCSP)
+#  include <openssl/ocsp.h>
+
+#  define MOCK_OCSP_CHAIN_LEN 4 /* including the root */
+
+/*
+ * A chain root -> 2 intermediate CAs -> leaf of fresh EC certs, whose AIA
+ * points to an OCSP responder served via MOCK_HTTP. |store| holds the root and
+ * is set up for CMPclient_ocsp_multi(), and |untrusted| holds the CA certs.
+ * The responder signs either with |rsp_cert| issued by the root, which is then
+ * explicitly trusted for OCSP signing, or with the key of the CA that issued
+ * the certs concerned, as usual in a PKI without a trusted responder.
+ */
+typedef struct mock_ocsp_st {
+    X509 *chain[MOCK_OCSP_CHAIN_LEN]; /* leaf first */
+    EVP_PKEY *keys[MOCK_OCSP_CHAIN_LEN];
+    X509 *rsp_cert; /* NULL if the issuing CA signs the response */
+    EVP_PKEY *rsp_key;
+    X509_STORE *store;
+    STACK_OF(X509) *untrusted;
+    OCSP_CERTID *revoked; /* to be reported as revoked, or NULL */
+    int no_next_update; /* accessed atomically, as the counters below */
+    int requests; /* answered so far */
+    int last_ids; /* number of CertIDs in the last request */
+    MOCK_HTTP http;
+} MOCK_OCSP;
+
+/*
+ * |name| prefixes the subjects of the certs, |max_ids| is passed on to
+ * CMPclient_ocsp_multi(), and |revoked| gives the index of a chain cert to
+ * report as revoked, or -1. |trusted_rsp| means using a responder trusted via
+ * the root for OCSP signing.
+ */
+MOCK_OCSP *MOCK_OCSP_new(const char *name, int max_ids, int revoked,
+                         bool trusted_rsp);
+void MOCK_OCSP_free(OPTIONAL MOCK_OCSP *mo);
+# endif /* !defined(GENCMP_NO_CERTSTATUS) && !defined(OPENSSL_NO_OCSP) */
+
+#endif /* MOCK_OCSP_H */
@@ -13,6 +13,10 @@ use strict;
 use warnings;
 
 use POSIX;
+use File::Copy;
+use File::Path qw(rmtree);
+use Storable qw(store retrieve);
+use Time::HiRes qw(time);
 sub data_dir { return "../test/recipes/80-test_cmp_http_data" }
 sub result_dir { return "." }
 use OpenSSL::Test qw/:DEFAULT cmdstr data_file bldtop_dir/;
@@ -96,7 +100,7 @@ sub subst_env {
 sub load_config {
     my $server_name = shift;
     my $section = shift;
-    my $test_config = $ENV{OPENSSL_CMP_CONFIG} // "$server_name/test.cnf";
+    my $test_config = $ENV{OPENSSL_CMP_CONFIG} // data_subdir($server_name)."/test.cnf";
     open (CH, $test_config) or die "Cannot open $test_config: $!";
     my $active = 0;
     while (<CH>) {
@@ -136,34 +140,56 @@ sub load_config {
 }
 
 my @server_configurations = ("Mock");
-# ("Mock", "EJBCA", "Insta", "Simple");
+# ("Mock", "MockSrv", "EJBCA", "Insta", "Simple");
 @server_configurations = split /\s+/, $ENV{OPENSSL_CMP_SERVER} if $ENV{OPENSSL_CMP_SERVER};
 # set env variable, e.g., OPENSSL_CMP_SERVER="Mock Insta" to include further CMP servers
+# MockSrv is our cmpMockServer, which shares the credentials of the Mock server
+
+sub is_mock { # whether the server is run locally using the Mock credentials
+    my $server_name = shift;
+    return $server_name =~ m/^Mock(Srv)?$/;
+}
+
+sub data_subdir {
+    my $server_name = shift;
+    return is_mock($server_name) ? "Mock" : $server_name;
+}
 
 my @all_aspects = ("connection", "verification", "credentials", "commands", "enrollment");
 push (@all_aspects, "certstatus");
 @all_aspects = split /\s+/, $ENV{OPENSSL_CMP_ASPECTS} if $ENV{OPENSSL_CMP_ASPECTS};
 # set env variable, e.g., OPENSSL_CMP_ASPECTS="commands enrollment" to select specific aspects
 
+my $parallel = $ENV{OPENSSL_CMP_JOBS} // 1;
+# set env variable, e.g., OPENSSL_CMP_JOBS=8 to run up to 8 test shards in parallel
+my $slow = $ENV{OPENSSL_CMP_SLOW} // 2;
+# test cases taking more seconds than this are reported also in non-verbose mode
+
 my $faillog;
 my $file = $ENV{HARNESS_FAILLOG}; # pathname relative to result_dir
 if ($file) {
     open($faillog, ">", $file) or die "Cannot open '$file' for writing: $!";
 }
+my $timelog;
+$file = $ENV{HARNESS_TIMELOG}; # pathname relative to result_dir
+if ($file) {
+    open($timelog, ">", $file) or die "Cannot open '$file' for writing: $!";
+    print $timelog "server\taspect\tcase\ttitle\texpected\tactual\tseconds\n";
+}
 
-sub test_cmp_http {
+# runs a single test case, returning its outcome and duration for later report
+sub run_cmp_http {
     my $server_name = shift;
-    my $aspect = shift;
-    my $n = shift;
-    my $i = shift;
     my $title = shift;
     my $params = shift;
     my $expected_result = shift;
     $params = [ '-server', "127.0.0.1:$server_port", @$params ]
-        if ($server_name eq "Mock" && !(grep { $_ eq '-server' } @$params));
-    my $cmd = app([@app, @$params]);
+        if (is_mock($server_name) && !(grep { $_ eq '-server' } @$params));
+    # -batch is supported only with the 'validate' use case, given first
+    my @use_case = (grep { $_ eq '-batch' } @$params) ? ("validate") : ();
+    my $cmd = app([@app, @use_case, @$params]);
 
-    $expected_result = 1 if $server_name eq "Mock" && $title =~ m/- ok for Mock/;
+    $expected_result = 1 if is_mock($server_name) && $title =~ m/- ok for Mock/;
     sleep($sleep) if $server_name eq "Insta";
     sleep($sleep) if $server_name eq "Insta"
         && $title eq "path with additional '/'s fine according to RFC 3986"
@@ -206,34 +232,161 @@ sub test_cmp_http {
         || $title eq "extracerts wrong chain (some root CA)"
         || $title eq "reuse last srvcert";
 
-    unless (is(my $actual_result = run($cmd), $expected_result, $title)) {
+    my $start = time();
+    my $actual_result = run($cmd);
+    my $seconds = time() - $start;
+    if ($actual_result != $expected_result) {
+        sleep($sleep) if $expected_result == 1;
+        sleep($sleep) if $server_name eq "Insta" && $expected_result == 1;
+    }
+    return { title => $title, expected => $expected_result,
+             actual => $actual_result, seconds => $seconds,
+             invocation => cmdstr($cmd, display => 1) };
+}
+
+sub report_cmp_http {
+    my $server_name = shift;
+    my $aspect = shift;
+    my $n = shift;
+    my $i = shift;
+    my $result = shift;
+    my $title = $$result{title};
+    my $expected_result = $$result{expected};
+    my $actual_result = $$result{actual};
+    my $seconds = sprintf("%.3f", $$result{seconds});
+
+    note("$seconds s for \"$title\"");
+    diag("slow: $server_name $aspect \"$title\" ($i/$n) took $seconds s")
+        if $seconds > $slow;
+    print $timelog "$server_name\t$aspect\t$i\t$title\t".
+        "$expected_result\t$actual_result\t$seconds\n" if $timelog;
+    unless (is($actual_result, $expected_result, $title)) {
         if ($faillog) {
-            my $quote_spc_empty = sub { $_ eq "" ? '""' : $_ =~ m/ / ? '"'.$_.'"' : $_ };
-            my $invocation = cmdstr($cmd, display => 1);
             print $faillog "$server_name $aspect \"$title\" ($i/$n)".
                 " expected=$expected_result (".
                 ($expected_result ? "success" : "failure").")".
-                " actual=$actual_result\n";
-            print $faillog "$invocation\n\n";
+                " actual=$actual_result time=${seconds}s\n";
+            print $faillog "$$result{invocation}\n\n";
         }
-        sleep($sleep) if $expected_result == 1;
-        sleep($sleep) if $server_name eq "Insta" && $expected_result == 1;
     }
 }
 
-sub test_cmp_http_aspect {
+sub report_cmp_http_aspect {
     my $server_name = shift;
     my $aspect = shift;
-    my $tests = shift;
+    my $results = shift;
     subtest "CMP app CLI $server_name $aspect\n" => sub {
-        my $n = scalar @$tests;
+        my $n = scalar @$results;
         plan tests => $n;
         my $i = 1;
-        foreach (@$tests) {
-            test_cmp_http($server_name, $aspect, $n, $i++, $$_[0], $$_[1], $$_[2]);
+        foreach (@$results) {
+            report_cmp_http($server_name, $aspect, $n, $i++, $_);
         }
     };
-    # not unlinking test.cert.pem, test.cacerts.pem, and test.extracerts.pem
+}
+
+# Each shard, i.e., the test cases of one aspect for one server, is run in its
+# own scratch copy of the server-specific input files, such that output files
+# like test.cert.pem are not shared with other shards that may run in parallel.
+# The scratch directory is at the same depth as the original one such that
+# relative references like ../test.cnf keep working. It is kept on failure.
+# A local mock server is started for each shard, on a port chosen by the OS.
+# Returns undef if the server cannot be started.
+sub run_shard {
+    my $server_name = shift;
+    my $aspect = shift;
+    my $src_dir = data_subdir($server_name);
+    my $scratch = "_run_${server_name}_$aspect";
+    rmtree($scratch);
+    mkdir($scratch) or die "Cannot create '$scratch': $!";
+    opendir(my $dh, $src_dir) or die "Cannot open '$src_dir': $!";
+    foreach (readdir($dh)) {
+        copy("$src_dir/$_", "$scratch/$_") or die "Cannot copy '$src_dir/$_': $!"
+            if -f "$src_dir/$_";
+    }
+    closedir($dh);
+
+    load_config($server_name, $server_name);
+    my $pid;
+    if (is_mock($server_name)) {
+        indir $scratch => sub {
+            $pid = start_server($server_name, "-port 0");
+        };
+        return undef unless $pid;
+    }
+    if (not($server_name =~ m/Insta/)) { # do not update aspect-specific settings for Insta
+    load_config($server_name, $aspect); # update with any aspect-specific settings
+    }
+    my @results;
+    indir $scratch => sub {
+        my $tests = load_tests($server_name, $aspect);
+        @results = map { run_cmp_http($server_name, @$_) } @$tests;
+    };
+    stop_server($server_name, $pid) if $pid;
+    rmtree($scratch) unless grep { $$_{actual} != $$_{expected} } @results;
+    return \@results;
+}
+
+# Runs the given jobs, each consisting of shards to be run sequentially,
+# with up to $parallel jobs in forked processes at a time, while reporting
+# the results strictly in the order of the shards. Any shard entry with
+# undefined aspect just marks the end of the shards for the given server.
+sub run_jobs {
+    my $shards = shift;
+    my $jobs = shift;
+    my %results; # by shard index
+    my %running; # jobs by PID
+    my $next = 0; # index of the next shard to report
+
+    my $report = sub {
+        while ($next < @$shards && (!defined $$shards[$next][1]
+                                    || exists $results{$next})) {
+            my ($server_name, $aspect) = @{$$shards[$next]};
+            if (!defined $aspect) {
+                ok(1, "$server_name server has terminated");
+            } elsif (defined $results{$next}) {
+                report_cmp_http_aspect($server_name, $aspect, $results{$next});
+            } else {
+                fail("CMP app CLI $server_name $aspect: no results, e.g., server did not start");
+            }
+            $next++;
+        }
+    };
+    my $result_file = sub { return "_run_".(shift).".res"; };
+    my $collect = sub {
+        my $pid = waitpid(-1, 0);
+        my $job = delete $running{$pid} or return;
+        foreach my $i (@$job) {
+            my $file = $result_file->($i);
+            $results{$i} = -e $file ? ${retrieve($file)} : undef;
+            unlink $file;
+        }
+        $report->();
+    };
+
+    foreach my $job (@$jobs) {
+        if ($parallel <= 1) {
+            foreach my $i (@$job) { # not using $_, which is clobbered by start_server
+                $results{$i} = run_shard(@{$$shards[$i]});
+                $report->();
+            }
+            next;
+        }
+        $collect->() while keys %running >= $parallel;
+        STDOUT->flush();
+        STDERR->flush();
+        my $pid = fork();
+        die "Cannot fork: $!" unless defined $pid;
+        if ($pid == 0) {
+            foreach my $i (@$job) {
+                store(\run_shard(@{$$shards[$i]}), $result_file->($i));
+            }
+            POSIX::_exit(0); # do not let Test::More finish in the child process
+        }
+        $running{$pid} = $job;
+    }
+    $collect->() while %running;
+    $report->();
 }
 
 # The input files for the tests done here dynamically depend on the test server
@@ -246,56 +399,50 @@ sub test_cmp_http_aspect {
 # from $BLDTOP/test-runs/test_cmp_http and prepending the input files by SRCTOP.
 
 indir data_dir() => sub {
-    plan tests => 1 + @server_configurations * @all_aspects
-        + 2
-        - (grep(/^Mock$/, @server_configurations)
-           && grep(/^certstatus$/, @all_aspects));
+    plan tests => 2 + @server_configurations * (@all_aspects + 1)
+        - (grep(is_mock($_), @server_configurations)
+           * grep(/^certstatus$/, @all_aspects));
 
     indir "Mock" => sub {
-        test_cmp_http_aspect("basic", "options", \@cmp_basic_tests);
+        report_cmp_http_aspect("basic", "options",
+                               [ map { run_cmp_http("basic", @$_) } @cmp_basic_tests ]);
         use_server_internally();
     };
 
     # TODO: complete and thoroughly review _all_ of the around 500 test cases
+    my @shards; # server name and aspect, in the order of reporting
+    my @jobs; # lists of shard indices, where each list is run sequentially
     foreach my $server_name (@server_configurations) {
         $server_name = chop_dblquot($server_name);
-        load_config($server_name, $server_name);
-        {
-          SKIP: {
-            my $pid;
-            if ($server_name eq "Mock") {
-                indir "Mock" => sub {
-                    $pid = start_server($server_name, "");
-                    next unless $pid;
-                }
+        my @job;
+        foreach my $aspect (@all_aspects) {
+            $aspect = chop_dblquot($aspect);
+            if (is_mock($server_name) && $aspect eq "certstatus") {
+                print "Skipping certstatus check as not supported by $server_name server\n";
+                next;
+            }
+            push @shards, [$server_name, $aspect];
+            # each shard gets its own mock server, while the shards
+            # for a remote server are run sequentially to limit its load
+            if (is_mock($server_name)) {
+                push @jobs, [$#shards];
+            } else {
+                push @job, $#shards;
             }
-            foreach my $aspect (@all_aspects) {
-                $aspect = chop_dblquot($aspect);
-                if ($server_name eq "Mock" && $aspect eq "certstatus") {
-                    print "Skipping certstatus check as not supported by $server_name server\n";
-                    next;
-                }
-                if (not($server_name =~ m/Insta/)) { # do not update aspect-specific settings for Insta
-                load_config($server_name, $aspect); # update with any aspect-specific settings
-                }
-                indir $server_name => sub {
-                    my $tests = load_tests($server_name, $aspect);
-                    test_cmp_http_aspect($server_name, $aspect, $tests);
-                };
-            };
-            stop_server($server_name, $pid) if $pid;
-            ok(1, "$server_name server has terminated");
-          }
         }
-    };
+        push @jobs, \@job if @job;
+        push @shards, [$server_name, undef];
+    }
+    run_jobs(\@shards, \@jobs);
 };
 
 close($faillog) if $faillog;
+close($timelog) if $timelog;
 
 sub load_tests {
     my $server_name = shift;
     my $aspect = shift;
-    my $test_config = $ENV{OPENSSL_CMP_CONFIG} // "$server_name/test.cnf";
+    my $test_config = $ENV{OPENSSL_CMP_CONFIG} // data_subdir($server_name)."/test.cnf";
     my $file = data_file("test_$aspect.csv");
     my $result_dir = result_dir();
     my @result;
@@ -341,7 +488,7 @@ sub load_tests {
         s/^\"(\".*?\")\"$/$1/ for (@fields); # remove escaping from quotation marks from elements
         my $expected_result = $fields[$column];
         my $description = 1;
-        $description += 3;
+        $description += 4;
         my $title = $fields[$description];
         next LOOP if (!defined($expected_result)
                       || ($expected_result ne 0 && $expected_result ne 1));
@@ -355,7 +502,9 @@ sub load_tests {
 sub start_server {
     my $server_name = shift;
     my $args = shift; # optional further CLI arguments
-    my $cmd = "$ENV{OPENSSL} cmp -config server.cnf $args";
+    my $cmd = $server_name eq "MockSrv"
+        ? ($ENV{CMPMOCKSERVER} // "../../../../cmpMockServer")." -config server.cnf $args"
+        : "$ENV{OPENSSL} cmp -config server.cnf $args";
     print "Current directory is ".getcwd()."\n";
     print "Launching $server_name server: $cmd\n";
     my $pid = open($server_fh, "$cmd|");
@@ -393,4 +542,5 @@ sub stop_server {
     print "Killing $server_name server with PID=$pid\n";
     kill('KILL', $pid);
     waitpid($pid, 0);
+    close($server_fh); # else reopening it for the next server would warn
 }
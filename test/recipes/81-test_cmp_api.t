@@ -0,0 +1,31 @@
+#! /usr/bin/env perl
+# Copyright Siemens AG 2023
+#
+# Licensed under the Apache License 2.0 (the "License").  You may not use
+# this file except in compliance with the License.  You can obtain a copy
+# in the file LICENSE in the source distribution or at
+# https://www.openssl.org/source/license.html
+
+use lib "util/perl"; # needed in genCMPClient project
+use strict;
+use warnings;
+
+sub data_dir { return "../test/recipes/80-test_cmp_http_data/Mock" }
+use OpenSSL::Test qw/:DEFAULT cmdstr/;
+
+BEGIN {
+    setup("test_cmp_api");
+}
+
+# each test case of cmpApiTest is run in a process of its own
+my @tests = map { chomp; $_ } run(app(["cmpApiTest", "-list"]), capture => 1);
+
+# test cases exchanging messages with cmpMockServer are skipped without it
+my @mock_server = $ENV{CMPMOCKSERVER} ? ("-mock_server", $ENV{CMPMOCKSERVER}) : ();
+
+plan tests => scalar @tests;
+
+foreach my $test (@tests) {
+    ok(run(app(["cmpApiTest", "-datadir", data_dir(), @mock_server, $test])),
+       $test);
+}
@@ -0,0 +1,111 @@
+#! /usr/bin/env perl
+# Copyright (c) 2023 Siemens AG
+#
+# Licensed under the Apache License 2.0 (the "License").
+# You may not use this file except in compliance with the License.
+# You can obtain a copy in the file LICENSE in the source distribution
+# or at https://www.openssl.org/source/license.html
+# SPDX-License-Identifier: Apache-2.0
+#
+# Convert certificate files (PEM, possibly containing several certs, or DER)
+# into DER byte arrays to be compiled into a binary, such that trust anchors
+# and pinned server certs can be used without file I/O and base64 decoding.
+#
+# Usage: embed_certs.pl <out> -n <name> [<file>...] [-n <name> [<file>...]]...
+#
+# Writes <out>.c and <out>.h declaring for each <name>
+#     extern const CMPCLIENT_DER_CERT *const embedded_<name>;
+#     extern const size_t embedded_<name>_num;
+# for use with CERT_load_der(), CERTS_load_der(), and STORE_load_der().
+# A <name> without any files yields a NULL pointer and zero count.
+
+use strict;
+use warnings;
+
+use File::Basename;
+use MIME::Base64;
+
+my $out = shift @ARGV;
+die "Usage: $0 <out> -n <name> [<file>...] [-n <name> [<file>...]]...\n"
+    unless defined $out && @ARGV >= 2 && $ARGV[0] eq "-n";
+
+my @groups; # list of [name, [[file, der]...]]
+while (@ARGV) {
+    my $arg = shift @ARGV;
+    if ($arg eq "-n") {
+        my $name = shift @ARGV;
+        die "$0: invalid name '".($name // "")."'\n"
+            unless defined $name && $name =~ /^[A-Za-z_][A-Za-z0-9_]*$/;
+        push @groups, [$name, []];
+        next;
+    }
+    push @{$groups[-1]->[1]}, map { [$arg, $_] } read_certs($arg);
+}
+
+sub read_certs {
+    my $file = shift;
+    open(my $fh, "<:raw", $file) or die "$0: cannot open '$file': $!\n";
+    my $data = do { local $/; <$fh> };
+    close($fh);
+
+    if ($data =~ /-----BEGIN /) {
+        my @ders;
+        my $type = qr/(?:X509 )?CERTIFICATE/;
+        while ($data =~ /-----BEGIN $type-----\r?\n(.*?)-----END $type-----/gs) {
+            push @ders, decode_base64($1);
+        }
+        die "$0: no certificate found in '$file'\n" unless @ders;
+        return @ders;
+    }
+    # DER: must be a single ASN.1 SEQUENCE
+    die "$0: '$file' is neither PEM nor DER\n"
+        unless length($data) > 2 && ord($data) == 0x30;
+    return ($data);
+}
+
+sub c_bytes {
+    my @bytes = map { sprintf("0x%02x", $_) } unpack("C*", shift);
+    my $res = "";
+    while (my @line = splice(@bytes, 0, 12)) {
+        $res .= "    ".join(", ", @line).",\n";
+    }
+    return $res;
+}
+
+my $base = basename($out);
+my $guard = uc($base) =~ s/[^A-Z0-9]/_/gr."_H";
+my $notice = "/* generated by util/embed_certs.pl - do not edit */\n";
+
+open(my $h, ">", "$out.h") or die "$0: cannot write '$out.h': $!\n";
+print $h $notice, "\n#ifndef $guard\n# define $guard\n\n",
+    "# include <genericCMPClient.h>\n\n";
+foreach my $group (@groups) {
+    my $name = $group->[0];
+    print $h "extern const CMPCLIENT_DER_CERT *const embedded_$name;\n",
+        "extern const size_t embedded_${name}_num;\n";
+}
+print $h "\n#endif /* $guard */\n";
+close($h) or die "$0: cannot write '$out.h': $!\n";
+
+open(my $c, ">", "$out.c") or die "$0: cannot write '$out.c': $!\n";
+print $c $notice, "\n#include \"$base.h\"\n";
+foreach my $group (@groups) {
+    my ($name, $certs) = @$group;
+    my $i = 0;
+    foreach my $cert (@$certs) {
+        print $c "\n/* $cert->[0] */\n",
+            "static const unsigned char ${name}_$i\[] = {\n",
+            c_bytes($cert->[1]), "};\n";
+        $i++;
+    }
+    if ($i == 0) {
+        print $c "\nconst CMPCLIENT_DER_CERT *const embedded_$name = NULL;\n";
+    } else {
+        print $c "\nstatic const CMPCLIENT_DER_CERT ${name}_certs[] = {\n";
+        print $c "    { ${name}_$_, sizeof(${name}_$_) },\n" for 0 .. $i - 1;
+        print $c "};\n",
+            "const CMPCLIENT_DER_CERT *const embedded_$name = ${name}_certs;\n";
+    }
+    print $c "const size_t embedded_${name}_num = $i;\n";
+}
+close($c) or die "$0: cannot write '$out.c': $!\n";